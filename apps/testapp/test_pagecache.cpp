@@ -0,0 +1,124 @@
+// 
+// Copyright 1998-2012 Jeff Bush
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// 
+
+#include <types.h>
+#include <syscall.h>
+#include <stdio.h>
+
+//
+// Page cache contention benchmark.  Each thread maps a different file and
+// touches all of its pages, unmapping and mapping it again for every pass.
+// The files are read once beforehand, so every page is in the cache and the
+// time is spent in the fault path.  A fault also maps the resident pages
+// around it, so not every page touched faults, and the result is reported per
+// page touched.  This is timed with the files touched one after another by a
+// single thread, and then with a thread per file running at the same time.  On
+// a multiprocessor, the second should be faster if faults on different caches
+// don't wait for each other.
+//
+
+const int kPasses = 50;
+const int kMaxFiles = 4;
+const unsigned int kMapBase = 0x40000000;
+const unsigned int kMapSpacing = 0x4000000;
+
+static const char *kFiles[kMaxFiles] = {
+	"/boot/testapp",
+	"/boot/shell",
+	"/boot/leaky",
+	"/boot/net_server"
+};
+
+struct FaultJob {
+	const char *path;
+	unsigned int va;
+	unsigned int size;
+	int doneSem;
+};
+
+static FaultJob jobs[kMaxFiles];
+
+static void fault_file(const FaultJob &job, int passes)
+{
+	for (int pass = 0; pass < passes; pass++) {
+		int area = map_file(job.path, job.va, 0, job.size, EXACT_ADDRESS);
+		if (area < 0) {
+			printf("error mapping %s\n", job.path);
+			return;
+		}
+
+		int sum = 0;
+		for (unsigned int offset = 0; offset < job.size; offset += PAGE_SIZE)
+			sum += *(volatile char*) (job.va + offset);
+
+		delete_area(area);
+	}
+}
+
+static int fault_thread(void *_job)
+{
+	FaultJob *job = (FaultJob*) _job;
+	fault_file(*job, kPasses);
+	release_sem(job->doneSem, 1);
+	return 0;
+}
+
+void time_cache_contention()
+{
+	int doneSem = create_sem("cache_bench_done", 0);
+	int fileCount = 0;
+	unsigned int totalPages = 0;
+	for (int i = 0; i < kMaxFiles; i++) {
+		struct stat st;
+		if (stat(kFiles[i], &st) < 0 || st.size < PAGE_SIZE)
+			continue;
+
+		jobs[fileCount].path = kFiles[i];
+		jobs[fileCount].va = kMapBase + fileCount * kMapSpacing;
+		jobs[fileCount].size = st.size & ~(PAGE_SIZE - 1);
+		jobs[fileCount].doneSem = doneSem;
+		totalPages += jobs[fileCount].size / PAGE_SIZE;
+		fault_file(jobs[fileCount], 1);	// Load the file into the cache
+		fileCount++;
+	}
+
+	if (fileCount == 0) {
+		printf("no files to map\n");
+		close_handle(doneSem);
+		return;
+	}
+
+	bigtime_t start = system_time();
+	for (int i = 0; i < fileCount; i++)
+		fault_file(jobs[i], kPasses);
+
+	bigtime_t serial = system_time() - start;
+
+	start = system_time();
+	for (int i = 0; i < fileCount; i++)
+		spawn_thread(fault_thread, "cache_bench", &jobs[i], 16);
+
+	for (int i = 0; i < fileCount; i++)
+		acquire_sem(doneSem, INFINITE_TIMEOUT);
+
+	bigtime_t parallel = system_time() - start;
+	close_handle(doneSem);
+
+	int pagesTouched = totalPages * kPasses;
+	printf("%d files, %d pages touched.  one thread %Ld us (%Ld ns per page), "
+		"%d threads %Ld us (%Ld ns per page)\n", fileCount, pagesTouched, serial,
+		serial * 1000 / pagesTouched, fileCount, parallel, parallel * 1000 / pagesTouched);
+}
@@ -0,0 +1,124 @@
+// 
+// Copyright 1998-2012 Jeff Bush
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// 
+
+
+#include <types.h>
+#include <syscall.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+//
+// Scheduler benchmark.  Pairs of threads wake each other up with semaphores.
+// The waking thread stores a timestamp before releasing its partner, which
+// measures how long the partner took to start running.  Running with more pairs
+// than processors shows how wakeup latency and total throughput scale as
+// processors are added.
+//
+
+const int kMaxPairs = 8;
+const int kRounds = 2000;
+
+struct PingPongPair {
+	int pingSem;
+	int pongSem;
+	int doneSem;
+	volatile bigtime_t wakeTime;
+	bigtime_t totalLatency;
+	bigtime_t maxLatency;
+};
+
+static void record_latency(PingPongPair *pair)
+{
+	bigtime_t latency = system_time() - pair->wakeTime;
+	pair->totalLatency += latency;
+	if (latency > pair->maxLatency)
+		pair->maxLatency = latency;
+}
+
+static int ping_thread(void *_pair)
+{
+	PingPongPair *pair = (PingPongPair*) _pair;
+	for (int round = 0; round < kRounds; round++) {
+		pair->wakeTime = system_time();
+		release_sem(pair->pongSem, 1);
+		acquire_sem(pair->pingSem, INFINITE_TIMEOUT);
+		record_latency(pair);
+	}
+
+	release_sem(pair->doneSem, 1);
+	return 0;
+}
+
+static int pong_thread(void *_pair)
+{
+	PingPongPair *pair = (PingPongPair*) _pair;
+	for (int round = 0; round < kRounds; round++) {
+		acquire_sem(pair->pongSem, INFINITE_TIMEOUT);
+		record_latency(pair);
+		pair->wakeTime = system_time();
+		release_sem(pair->pingSem, 1);
+	}
+
+	release_sem(pair->doneSem, 1);
+	return 0;
+}
+
+static void run_pairs(int pairCount)
+{
+	PingPongPair pairs[kMaxPairs];
+	int doneSem = create_sem("sched_bench_done", 0);
+	for (int i = 0; i < pairCount; i++) {
+		pairs[i].pingSem = create_sem("ping", 0);
+		pairs[i].pongSem = create_sem("pong", 0);
+		pairs[i].doneSem = doneSem;
+		pairs[i].totalLatency = 0;
+		pairs[i].maxLatency = 0;
+	}
+
+	bigtime_t start = system_time();
+	for (int i = 0; i < pairCount; i++) {
+		spawn_thread(pong_thread, "pong", &pairs[i], 16);
+		spawn_thread(ping_thread, "ping", &pairs[i], 16);
+	}
+
+	for (int i = 0; i < pairCount * 2; i++)
+		acquire_sem(doneSem, INFINITE_TIMEOUT);
+
+	bigtime_t elapsed = system_time() - start;
+	bigtime_t totalLatency = 0;
+	bigtime_t maxLatency = 0;
+	for (int i = 0; i < pairCount; i++) {
+		totalLatency += pairs[i].totalLatency;
+		if (pairs[i].maxLatency > maxLatency)
+			maxLatency = pairs[i].maxLatency;
+
+		close_handle(pairs[i].pingSem);
+		close_handle(pairs[i].pongSem);
+	}
+
+	close_handle(doneSem);
+	int wakeups = pairCount * kRounds * 2;
+	printf("%5d %10Ld %8Ld %8Ld %12Ld\n", pairCount, elapsed, totalLatency / wakeups,
+		maxLatency, (bigtime_t) wakeups * 1000000 / (elapsed ? elapsed : 1));
+}
+
+void time_scheduler()
+{
+	printf("pairs   total us  avg lat  max lat  wakeups/sec\n");
+	for (int pairCount = 1; pairCount <= kMaxPairs; pairCount *= 2)
+		run_pairs(pairCount);
+}
@@ -0,0 +1,55 @@
+// 
+// Copyright 1998-2012 Jeff Bush
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// 
+
+#include <types.h>
+#include <syscall.h>
+#include <stdio.h>
+
+//
+// Thread creation benchmark.  Threads are created one at a time, as short lived
+// worker threads would be, and each one exits right away.  The first thread
+// usually has to get new stacks.  Later ones can reuse the stacks of the thread
+// that exited before them, if the kernel caches them.
+//
+
+const int kThreads = 1000;
+
+static int exit_thread(void *_doneSem)
+{
+	release_sem(*(int*) _doneSem, 1);
+	return 0;
+}
+
+static bigtime_t spawn_and_wait(int doneSem)
+{
+	bigtime_t start = system_time();
+	spawn_thread(exit_thread, "spawn_bench", &doneSem, 16);
+	acquire_sem(doneSem, INFINITE_TIMEOUT);
+	return system_time() - start;
+}
+
+void time_spawn()
+{
+	int doneSem = create_sem("spawn_bench_done", 0);
+	bigtime_t first = spawn_and_wait(doneSem);
+	bigtime_t total = 0;
+	for (int i = 1; i < kThreads; i++)
+		total += spawn_and_wait(doneSem);
+
+	close_handle(doneSem);
+	printf("first thread %Ld us, then %Ld us per thread (%d threads)\n", first,
+		total / (kThreads - 1), kThreads);
+}
@@ -34,6 +34,9 @@ void time_faults();
 void time_syscall();
 void test_ide();
 void test_heap();
+void time_scheduler();
+void time_spawn();
+void time_cache_contention();
 
 int main()
 {
@@ -53,6 +56,9 @@ int main()
 		printf("c. Time system call\n");
 		printf("d. IDE drive\n");
 		printf("e. Heap\n");
+		printf("f. Time scheduler\n");
+		printf("g. Time thread spawn\n");
+		printf("h. Time page cache contention\n");
 		printf("z. Quit\n");
 		printf("> ");
 		switch (getc()) {
@@ -99,6 +105,15 @@ int main()
 			case 'e':
 				test_heap();
 				break;
+			case 'f':
+				time_scheduler();
+				break;
+			case 'g':
+				time_spawn();
+				break;
+			case 'h':
+				time_cache_contention();
+				break;
 			case 'z':
 				return 0;
 				
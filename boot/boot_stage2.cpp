@@ -44,6 +44,7 @@ void LoadElfImage(void *data, unsigned *outStartAddress);
 void ClearScreen();
 void PrintMessage(const char *msg);
 void memzero(void *ptr, int count);
+unsigned CountHighMemoryPages();
 int strcmp(const char *str1, const char *str2);
 
 static unsigned nextFreePage = 0;
@@ -91,6 +92,7 @@ extern "C" void _start(unsigned int mem, char*)
 	// Set up boot parameters
 	BootParams *params = (BootParams*)(0xc0104000 - sizeof(BootParams));
 	params->memsize = mem;
+	params->highPageCount = CountHighMemoryPages();
 
 	// Set up in-use ranges for the kernel.
 	params->SetAllocated((unsigned) pagedir, (unsigned) pagedir + PAGE_SIZE - 1); // page dir
@@ -109,6 +111,21 @@ extern "C" void _start(unsigned int mem, char*)
 		: : "m" (kernelEntry), "m" (params), "r" (temp));
 }
 
+// The memory size passed by the first stage stops below 4GB.  QEMU and Bochs
+// report the memory above that in CMOS registers 0x5b-0x5d, in 64k units.
+unsigned CountHighMemoryPages()
+{
+	unsigned count = 0;
+	for (int reg = 0x5d; reg >= 0x5b; reg--) {
+		unsigned char value;
+		asm volatile("outb %%al, $0x70" : : "a" (reg));
+		asm volatile("inb $0x71, %%al" : "=a" (value));
+		count = (count << 8) | value;
+	}
+
+	return count * (0x10000 / kPageSize);
+}
+
 void LoadElfImage(void *data, unsigned *outStartAddress)
 {
 	Elf32_Ehdr *imageHeader = (Elf32_Ehdr*) data;
@@ -14,8 +14,7 @@
 // limitations under the License.
 // 
 
-#include "AddressSpace.h"
-#include "Area.h"
+#include "Alloc.h"
 #include "cpu_asm.h"
 #include "Device.h"
 #include "InterruptHandler.h"
@@ -81,7 +80,7 @@ private:
 	void SendCommand(uchar data[], int size);
 	void ReadResult(uchar data[], int size);
 	void RecalibrateDrive();
-	int ReadSector(int lba, unsigned pa);
+	int ReadSector(int lba);
 	virtual InterruptStatus HandleInterrupt();
 	void WriteRegister(RegisterOffset, int);
 	int ReadRegister(RegisterOffset);
@@ -96,6 +95,8 @@ private:
 	int fBaseAddress;
 	int fDrive;
 	Semaphore fCommandComplete;
+	void *fDmaBuffer;	// Sectors are transferred through this
+	unsigned int fDmaAddress;
 };
 
 FloppyCommand::FloppyCommand()
@@ -141,13 +142,15 @@ Floppy::Floppy(int chain, int drive)
 	else
 		fBaseAddress = 0x370;
 
+	// The ISA DMA controller can only address the first 16MB, and a transfer
+	// can't cross a 64k boundary.  A single page buffer in the DMA zone meets
+	// both.
+	fDmaBuffer = AllocDmaBuffer(kSectorSize, kPageZoneDma, &fDmaAddress);
+	if (fDmaBuffer == 0)
+		panic("Floppy: couldn't allocate DMA buffer");
+
 	ObserveInterrupt(6);
 #if 0
-	Area *area = AddressSpace::GetKernelAddressSpace()->CreateArea("floppy hack", PAGE_SIZE,
-		AREA_WIRED, SYSTEM_READ | SYSTEM_WRITE, new PageCache, 0);
-	unsigned pa = AddressSpace::GetKernelAddressSpace()->HackGetPhysicalMap()->GetPhysicalAddress(
-		area->GetBaseAddress());
-
 	printf("Status = %02x\n", ReadRegister(kMainStatus));
 
 	// Set up geometry.
@@ -171,14 +174,14 @@ Floppy::Floppy(int chain, int drive)
 #if 0
 	printf("Read sector\n");
 	for (int retry = 0; retry < 5; retry++) {
-		if (ReadSector(60, pa) < 0) {
+		if (ReadSector(60) < 0) {
 			printf("An error occured\n");
 			sleep(50000);
 			CheckStatus();
 			RecalibrateDrive();
 		} else {
 			printf("Read from floppy sector 0:\n");
-			bindump((uchar*) area->GetBaseAddress(), kSectorSize);
+			bindump((uchar*) fDmaBuffer, kSectorSize);
 			break;
 		}
 	}
@@ -192,6 +195,7 @@ Floppy::~Floppy()
 {
 	IgnoreInterrupts();
 	CancelTimeout();
+	FreeDmaBuffer(fDmaBuffer);
 }
 
 int Floppy::Read(off_t, void*, size_t)
@@ -271,7 +275,7 @@ void Floppy::RecalibrateDrive()
 	printf("Everything is back on track (so to speak)\n");
 }
 
-int Floppy::ReadSector(int lba, unsigned physaddr)
+int Floppy::ReadSector(int lba)
 {
 	enum {
 		kDmaAddress = 4,
@@ -283,9 +287,7 @@ int Floppy::ReadSector(int lba, unsigned physaddr)
 		kDmaPage = 0x81,
 	};
 
-	if ((physaddr >> 24) != 0)
-		panic("DMA address is out of range (must be < 24M)");
-
+	unsigned int physaddr = fDmaAddress;
 
 	// Set up the DMA controller to transfer data from the floppy
 	// controller.
@@ -368,7 +370,7 @@ InterruptStatus Floppy::HandleInterrupt()
 	}
 
 	fCommandComplete.Release(1, false);
-	return kReschedule;
+	return kHandledInterrupt;
 }
 
 void Floppy::WriteRegister(RegisterOffset offset, int value)
@@ -17,6 +17,7 @@
 #include "cpu_asm.h"
 #include "KernelDebug.h"
 #include "Device.h"
+#include "DPC.h"
 #include "InterruptHandler.h"
 #include "Semaphore.h"
 #include "stdio.h"
@@ -26,7 +27,7 @@
 const unsigned int kStatusError = 1;
 const int kBlockSize = 512;
 
-class Ide : public Device, public InterruptHandler {
+class Ide : public Device, public InterruptHandler, public DPC {
 public:
 	Ide();
 	virtual ~Ide();
@@ -38,6 +39,7 @@ private:
 		int sector, bool wait = true);
 	int SendCommand(unsigned int op);
 	virtual InterruptStatus HandleInterrupt();
+	virtual void HandleDPC();
 	void WaitForController() const;
 	void ResetController();	
 	int BlockIo(unsigned int lba, void *, bool read);
@@ -133,11 +135,18 @@ int Ide::SendCommand(unsigned int op)
 	return 0;
 }
 
+// Reading the status register acknowledges the interrupt.  Waking the thread
+// that issued the command is deferred.
 InterruptStatus Ide::HandleInterrupt()
 {
 	fStatus = read_io_8(fBasePort + 7);
+	DPC::Enqueue();
+	return kHandledInterrupt;
+}
+
+void Ide::HandleDPC()
+{
 	fCompletionSem.Release(1, false);
-	return kReschedule;
 }
 
 int Ide::BlockIo(unsigned int lba, void *data, bool read)
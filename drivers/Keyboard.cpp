@@ -20,6 +20,7 @@
 #include "Device.h"
 #include "InterruptHandler.h"
 #include "Semaphore.h"
+#include "Spinlock.h"
 #include "stdio.h"
 
 enum Locks {
@@ -48,6 +49,7 @@ private:
 	static void WaitOutput();
 
 	Semaphore fKeyEventsQueued;	
+	Spinlock fBufferLock;
 	CircularBuffer<char, 1024> fBuffer;
 	bool fShift;
 	unsigned fLocks;
@@ -127,6 +129,7 @@ InterruptStatus Keyboard::HandleInterrupt()
 
 			if (ascii != 0) {
 				// Wake reader if this is first char
+				cpu_flags fl = fBufferLock.Lock();
 				if (fBuffer.IsEmpty()) {
 					fKeyEventsQueued.Release(1, false);
 					result = kReschedule;
@@ -134,6 +137,8 @@ InterruptStatus Keyboard::HandleInterrupt()
 				
 				if (!fBuffer.IsFull())
 					fBuffer.Insert(ascii);
+
+				fBufferLock.Unlock(fl);
 			}
 		}
 	}
@@ -151,16 +156,17 @@ void Keyboard::SetLeds()
 
 int Keyboard::Read(off_t, void *buffer, size_t size)
 {
-	cpu_flags fl = DisableInterrupts();
+	cpu_flags fl = fBufferLock.Lock();
 	while (fBuffer.IsEmpty()) {
-		if (fKeyEventsQueued.Wait() == E_INTERRUPTED) {
-			RestoreInterrupts(fl);
+		fBufferLock.Unlock(fl);
+		if (fKeyEventsQueued.Wait() == E_INTERRUPTED)
 			return E_INTERRUPTED;
-		}
+
+		fl = fBufferLock.Lock();
 	}
 
 	int sizeRead = fBuffer.Remove(reinterpret_cast<char*>(buffer), size);
-	RestoreInterrupts(fl);
+	fBufferLock.Unlock(fl);
 	
 	return sizeRead;
 }
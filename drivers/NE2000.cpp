@@ -16,7 +16,9 @@
 
 #include "cpu_asm.h"
 #include "Device.h"
+#include "DPC.h"
 #include "Semaphore.h"
+#include "Spinlock.h"
 #include "stdio.h"
 #include "string.h"
 #include "syscall.h"
@@ -72,7 +74,7 @@ enum Ne2kRegister {
 const int kRingPageSize = 256;
 const size_t kMtu = 1550;
 
-class Ne2000 : public Device, public InterruptHandler {
+class Ne2000 : public Device, public InterruptHandler, public DPC {
 public:
 	Ne2000(int base, int irq);
 	virtual ~Ne2000();
@@ -82,6 +84,7 @@ public:
 
 private:
 	virtual InterruptStatus HandleInterrupt();
+	virtual void HandleDPC();
 	void Reset();
 	void Initialize();
 	inline void WriteRegister(int value, Ne2kRegister);
@@ -95,6 +98,8 @@ private:
 	int fWordLength;
 	Semaphore fTransmitReady;
 	Semaphore fReceiveReady;
+	Spinlock fRegisterLock;	// Register accesses use multiple steps
+	int fPendingEvents;		// Acknowledged, but not handled by the DPC yet
 	int fReceiveRingStart;
 	int fReceiveRingEnd;
 	int fTransmitRingStart;
@@ -106,7 +111,8 @@ Ne2000::Ne2000(int base, int irq)
 		fNextReceivePacket(0),
 		fWordLength(1),
 		fTransmitReady("transmit_ready"),
-		fReceiveReady("packets_queued", 0)
+		fReceiveReady("packets_queued", 0),
+		fPendingEvents(0)
 {
 	ObserveInterrupt(irq);
 	Initialize();
@@ -129,12 +135,13 @@ inline int Ne2000::ReadRegister(Ne2kRegister reg)
 
 int Ne2000::Read(off_t, void *buffer, size_t count)
 {
-	cpu_flags fl = DisableInterrupts();
-
 	// Wait for packets.
 	fReceiveReady.Wait();
+
+	cpu_flags fl = fRegisterLock.Lock();
 	if (ReadRegister(kInterruptStatusRegister) & kOverwriteWarning) {
 		HandleRingOverflow();
+		fRegisterLock.Unlock(fl);
 		return -1;
 	}
 
@@ -156,7 +163,7 @@ int Ne2000::Read(off_t, void *buffer, size_t count)
 	fNextReceivePacket = header.nextPacket;
 	WriteRegister(fNextReceivePacket == fReceiveRingStart ? fReceiveRingEnd
 		: fNextReceivePacket - 1, kBoundaryRegister);
-	RestoreInterrupts(fl);
+	fRegisterLock.Unlock(fl);
 
 	return header.receiveCount - sizeof(header);
 }
@@ -175,14 +182,14 @@ int Ne2000::Write(off_t, const void *buffer, size_t size)
 		return -1;
 	}
 
-	cpu_flags fl = DisableInterrupts();
 	fTransmitReady.Wait();
+	cpu_flags fl = fRegisterLock.Lock();
 	WriteCardMemory(fTransmitRingStart * kRingPageSize, buffer, size);
 	WriteRegister(fTransmitRingStart, kTransmitPageRegister);
 	WriteRegister(size >> 8, kTransmitByteCount0);
 	WriteRegister(size & 0xff, kTransmitByteCount1);
 	WriteRegister(kCommandTransmit | kCommandDmaDisable, kCommandRegister);
-	RestoreInterrupts(fl);
+	fRegisterLock.Unlock(fl);
 
 	return size;
 }
@@ -203,10 +210,27 @@ int Ne2000::Control(int op, void *data)
 
 InterruptStatus Ne2000::HandleInterrupt()
 {
+	cpu_flags fl = fRegisterLock.Lock();
 	int events = ReadRegister(kInterruptStatusRegister);
-	if (events == 0)
+	if (events == 0) {
+		fRegisterLock.Unlock(fl);
 		return kUnhandledInterrupt;
-		
+	}
+
+	WriteRegister(events, kInterruptStatusRegister);
+	fPendingEvents |= events;
+	fRegisterLock.Unlock(fl);
+	DPC::Enqueue();
+	return kHandledInterrupt;
+}
+
+void Ne2000::HandleDPC()
+{
+	cpu_flags fl = fRegisterLock.Lock();
+	int events = fPendingEvents;
+	fPendingEvents = 0;
+	fRegisterLock.Unlock(fl);
+
 	if (events & kPacketReceived)
 		fReceiveReady.Release(1, false);
 
@@ -215,9 +239,6 @@ InterruptStatus Ne2000::HandleInterrupt()
 
 	if (events & kTransmitError)
 		printf("transmit error\n");
-
-	WriteRegister(events, kInterruptStatusRegister);
-	return kReschedule;
 }
 
 void Ne2000::Reset()
@@ -19,6 +19,7 @@
 #include "Area.h"
 #include "cpu_asm.h"
 #include "Device.h"
+#include "Spinlock.h"
 #include "types.h"
 
 class Area;
@@ -42,6 +43,7 @@ private:
 	unsigned short fCurrentAttribute;
 	unsigned fOffset;
  	Area *fTextBufferArea;
+	Spinlock fLock;
 };
 
 VgaText::VgaText()
@@ -74,7 +76,7 @@ inline void VgaText::ScrollUp()
 
 int VgaText::Write(off_t, const void *buf, size_t size)
 {
-	cpu_flags fl = DisableInterrupts();
+	cpu_flags fl = fLock.Lock();
 	char *s = (char*) buf;
 	while (size-- > 0) {
 		char c = *s++;
@@ -104,19 +106,19 @@ int VgaText::Write(off_t, const void *buf, size_t size)
 	}
 
 	UpdateHardwareCursor();
-	RestoreInterrupts(fl);
+	fLock.Unlock(fl);
 	return E_NO_ERROR;
 }
 
 void VgaText::Clear()
 {
-	cpu_flags fl = DisableInterrupts();
+	cpu_flags fl = fLock.Lock();
 	for (int i = 0; i < kScreenWidth * kScreenHeight; i++)
 		fTextBuffer[i] = fCurrentAttribute | ' ';
 
 	fOffset = 0;
 	UpdateHardwareCursor();
-	RestoreInterrupts(fl);
+	fLock.Unlock(fl);
 }
 
 Device* VgaTextInstantiate()
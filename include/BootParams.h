@@ -27,7 +27,8 @@ struct BootParams {
 	inline BootParams();
 	inline void SetAllocated(unsigned begin, unsigned end);
 
-	unsigned memsize;
+	unsigned memsize;		///< Bytes of memory below 4GB
+	unsigned highPageCount;	///< Pages of memory starting at 4GB
 	int rangeCount;
 	struct Range {
 		unsigned begin;
@@ -35,12 +35,14 @@ int close_handle(int);
 /* Threads */
 int sleep(bigtime_t time);
 bigtime_t system_time();
+status_t _get_system_time(bigtime_t *outTime);
 int spawn_thread(thread_start_t, const char *name, void *data, int priority);
-void thread_exit();
+void thread_exit() NORETURN;
 status_t exec(const char *path);
 status_t wait_for_multiple_objects(int handleCount, const object_id *handles, bigtime_t timeout,
 	WaitFlags flags);
 status_t kill_thread(int thread_id);
+status_t set_scheduling_class(int schedulingClass);
 
 /* Semaphores */
 int create_sem(const char *name, int count);
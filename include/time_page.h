@@ -0,0 +1,47 @@
+// 
+// Copyright 1998-2012 Jeff Bush
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// 
+
+/// @file time_page.h
+#ifndef _TIME_PAGE_H
+#define _TIME_PAGE_H
+
+#include "types.h"
+
+/// The kernel maps a read-only page with this layout at the same address in
+/// every team, so user code can compute the system time without a system call.
+#define TIME_PAGE_ADDRESS 0xbffff000
+
+/// Scale and offset for converting the time stamp counter to system time.  The
+/// kernel makes sequence odd while it changes the other fields, so a reader that
+/// sees it change must read them again.
+typedef struct TimePage {
+	volatile int sequence;
+	int tscValid;			// If zero, read the time with _get_system_time instead
+	uint tscMultiplier;		// Microseconds per tick, as a 0.32 fixed point fraction
+	int64 tscBase;
+	bigtime_t timeBase;		// System time when the counter was at tscBase
+} TimePage;
+
+/// @returns the system time, in microseconds, when the time stamp counter had
+///   the value tsc.
+static inline bigtime_t tsc_to_system_time(const TimePage *page, int64 tsc)
+{
+	uint64 delta = tsc - page->tscBase;
+	return page->timeBase + (delta >> 32) * page->tscMultiplier
+		+ (((delta & 0xffffffff) * page->tscMultiplier) >> 32);
+}
+
+#endif
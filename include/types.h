@@ -41,6 +41,7 @@ typedef unsigned int size_t;
 typedef long ssize_t;
 typedef int object_id;
 typedef int64 off_t;
+typedef uint64 paddr_t;
 typedef unsigned long mode_t;
 
 #define OS_NAME_LENGTH 20
@@ -103,6 +104,17 @@ typedef enum WaitFlags {
 	WAIT_FOR_ALL = 1
 } WaitFlags;
 
+// Scheduling classes, for set_scheduling_class().  The real-time classes
+// (round robin and FIFO) can only be used by threads with a priority of
+// MAX_REAL_TIME_PRIORITY or lower.
+typedef enum SchedulingClassType {
+	SCHED_INTERACTIVE,		// Priority boosted after blocking (default)
+	SCHED_ROUND_ROBIN,		// Fixed priority, time sliced
+	SCHED_FIFO				// Fixed priority, runs until it blocks
+} SchedulingClassType;
+
+#define MAX_REAL_TIME_PRIORITY 24
+
 // Create file flags
 #define CREATE_FILE 1
 
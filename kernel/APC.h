@@ -23,6 +23,9 @@
 /// Asynchrnous Procedure Call
 /// A function will be called in kernel mode on behalf of a thread that is just about to exit the kernel.
 struct APC : public QueueNode {
+	/// APCs are allocated from a slab cache
+	void* operator new(size_t);
+
 	/// Function to invoke when this APC expires
 	/// This function may be in user or kernel space
 	void (*fCallback)(void *data);
@@ -17,15 +17,18 @@
 #include "AddressSpace.h"
 #include "Area.h"
 #include "cpu_asm.h"
+#include "KernelDebug.h"
 #include "memory_layout.h"
 #include "Page.h"
 #include "PageCache.h"
 #include "PhysicalMap.h"
+#include "Slab.h"
 #include "stdio.h"
 #include "string.h"
 #include "syscall.h"
 #include "Team.h"
 #include "Thread.h"
+#include "WorkQueue.h"
 
 const int kDefaultWorkingSet = 0x40000;
 const int kDefaultMinWorkingSet = 0x10000;
@@ -36,8 +39,24 @@ const int kMaxFaultsPerSecond = 100;
 const int kMinFreePages = 40;
 const int kWorkingSetIncrement = PAGE_SIZE * 10;
 const bigtime_t kTrimInterval = 500000;
+const int kDefaultFaultAroundPages = 16;
+
+class PageDaemon : public DelayedWorkItem {
+public:
+	virtual void Run();
+};
 
 AddressSpace* AddressSpace::fKernelAddressSpace = 0;
+int AddressSpace::fFaultAroundPages = kDefaultFaultAroundPages;
+int AddressSpace::fFaultAroundMapped = 0;
+static PageDaemon pageDaemon;
+static WorkQueue pageDaemonQueue("page daemon", kWorkPriorityNormal);
+static SlabCache areaCache("area", sizeof(Area));
+
+void* Area::operator new(size_t size)
+{
+	return areaCache.AllocInstance(size);
+}
 
 AddressSpace::AddressSpace()
 	:	fPhysicalMap(new PhysicalMap),
@@ -58,6 +77,9 @@ AddressSpace::AddressSpace()
 
 AddressSpace::~AddressSpace()
 {
+	// The physical map is deleted first so the pages it maps are released
+	// before the caches that own them.
+	delete fPhysicalMap;
 	for (;;) {
 		// This is a very clunky way to step through the area tree while
 		// removing items from it.  The iterator must be re-created because
@@ -73,8 +95,6 @@ AddressSpace::~AddressSpace()
 		fAreas.Remove(area);
 		area->ReleaseRef();
 	}
-
-	delete fPhysicalMap;
 }
 
 Area* AddressSpace::CreateArea(const char name[], unsigned int size, AreaWiring wiring,
@@ -112,11 +132,17 @@ Area* AddressSpace::CreateArea(const char name[], unsigned int size, AreaWiring
 	return area;
 }
 
-Area* AddressSpace::MapPhysicalMemory(const char name[], unsigned int pa,
+Area* AddressSpace::MapPhysicalMemory(const char name[], paddr_t pa,
 	unsigned int size, PageProtection protection)
 {
+	// Large enough ranges are aligned so they can be mapped with large pages.
+	unsigned int alignment = PAGE_SIZE;
+	unsigned int largePageSize = PhysicalMap::GetLargePageSize();
+	if (PhysicalMap::HasLargePages() && size >= largePageSize && pa % largePageSize == 0)
+		alignment = largePageSize;
+
 	fAreaLock.LockWrite();
-	unsigned int va = FindFreeRange(size);
+	unsigned int va = FindFreeRange(size, 0, alignment);
 	if (va == INVALID_PAGE) {
 		fAreaLock.UnlockWrite();
 		return 0;
@@ -124,9 +150,7 @@ Area* AddressSpace::MapPhysicalMemory(const char name[], unsigned int pa,
 
 	Area *area = new Area(name, protection, 0, 0, AREA_WIRED);
 	fAreas.Add(area, va, va + size - 1);
-	for (unsigned int aroffs = 0; aroffs < size; aroffs += PAGE_SIZE)
-		fPhysicalMap->Map(va + aroffs, pa + aroffs, protection);
-
+	fPhysicalMap->MapContiguous(va, pa, size, protection);
 	fChangeCount++;
 	fAreaLock.UnlockWrite();
 	return area;
@@ -184,6 +208,14 @@ void AddressSpace::DeleteArea(Area *area)
 	fAreaLock.UnlockWrite();
 }
 
+Area* AddressSpace::FindArea(unsigned int va)
+{
+	fAreaLock.LockRead();
+	Area *area = static_cast<Area*>(fAreas.Find(va));
+	fAreaLock.UnlockRead();
+	return area;
+}
+
 status_t AddressSpace::HandleFault(unsigned int va, bool write, bool user)
 {
 	va &= ~(PAGE_SIZE - 1); // Round down to a page boundry.
@@ -212,9 +244,10 @@ status_t AddressSpace::HandleFault(unsigned int va, bool write, bool user)
 	}
 
 	bool copy = cache->IsCopy();
+	off_t cacheOffset = area->GetCacheOffset();
 	cache->AcquireRef();
 	fAreaLock.UnlockRead();
-	off_t offset = va - area->GetBaseAddress() + area->GetCacheOffset();
+	off_t offset = va - area->GetBaseAddress() + cacheOffset;
 	Page *page = cache->GetPage(offset, write && cache->IsCopy());
 	cache->ReleaseRef();
 	if (page == 0)
@@ -226,22 +259,56 @@ status_t AddressSpace::HandleFault(unsigned int va, bool write, bool user)
 		// the area hasn't changed underneath the fault handler.
 		Area *newArea = static_cast<Area*>(fAreas.Find(va));
 		if (newArea != area || newArea->GetPageCache() != cache ||
-			newArea->GetCacheOffset() != offset)
+			newArea->GetCacheOffset() != cacheOffset) {
 			fAreaLock.UnlockRead();
 			return E_BAD_ADDRESS;
+		}
 	}
 
 	// If this is a read from copy-on-write page, it is shared with the
 	// original cache.  Mark it read only.
-	if (copy && !write)
-		protection &= ~(USER_WRITE | SYSTEM_WRITE);
+	PageProtection readOnly = protection & ~(USER_WRITE | SYSTEM_WRITE);
+	fPhysicalMap->Map(va, page->GetPhysicalAddress(), copy && !write ? readOnly
+		: protection);
+
+	// Neighbouring pages in a copy may be shared with the source, and writes
+	// to them must fault so they are copied first.
+	if (fFaultAroundPages > 1)
+		FaultAround(area, va, copy ? readOnly : protection);
 
-	fPhysicalMap->Map(va, page->GetPhysicalAddress(), protection);
 	fAreaLock.UnlockRead();
 	AtomicAdd(&fFaultCount, 1);
 	return E_NO_ERROR;
 }
 
+// Map resident pages in an aligned window around a faulting address, so a
+// sequential scan through a file doesn't fault on every page.  Pages that are
+// busy or not in memory are left to fault normally.  Called with the area
+// lock held for reading.
+void AddressSpace::FaultAround(const Area *area, unsigned int va, PageProtection protection)
+{
+	// The end is inclusive so a window at the top of the address space
+	// doesn't wrap.
+	unsigned int windowSize = fFaultAroundPages * PAGE_SIZE;
+	unsigned int start = MAX(va & ~(windowSize - 1), area->GetBaseAddress());
+	unsigned int end = MIN(va | (windowSize - 1), area->GetHighKey());
+	int count = (end - start) / PAGE_SIZE + 1;
+	if (count <= 1)
+		return;
+
+	Page *pages[kMaxFaultAroundPages];
+	if (area->GetPageCache()->GetResidentPages(start - area->GetBaseAddress()
+		+ area->GetCacheOffset(), pages, count) <= 1)
+		return;	// Only the faulting page is resident.
+
+	paddr_t pa[kMaxFaultAroundPages];
+	for (int i = 0; i < count; i++)
+		pa[i] = pages[i] ? pages[i]->GetPhysicalAddress() : INVALID_PAGE;
+
+	// The faulting page was mapped already and is skipped.
+	AtomicAdd(&fFaultAroundMapped, fPhysicalMap->MapUnmapped(start, pa, count, protection));
+}
+
 void AddressSpace::TrimWorkingSet()
 {
 	int mappedMemory = fPhysicalMap->CountMappedPages() * PAGE_SIZE;
@@ -258,9 +325,9 @@ void AddressSpace::TrimWorkingSet()
 			fWorkingSetSize = MIN(fWorkingSetSize + kWorkingSetIncrement, fMaxWorkingSet);
 		} else if (faultsPerSecond < kMinFaultsPerSecond
 			&& mappedMemory <= fWorkingSetSize
-			&& fWorkingSetSize > fMaxWorkingSet
+			&& fWorkingSetSize > fMinWorkingSet
 			&& Page::CountFreePages() < kMinFreePages) {
-			fWorkingSetSize = MAX(fWorkingSetSize - kWorkingSetIncrement, fMaxWorkingSet);
+			fWorkingSetSize = MAX(fWorkingSetSize - kWorkingSetIncrement, fMinWorkingSet);
 		}
 
 		fLastWorkingSetAdjust = now;
@@ -268,12 +335,55 @@ void AddressSpace::TrimWorkingSet()
 		RestoreInterrupts(fl);
 	}
 
-	// Trim some pages if needed
-	while (mappedMemory > fWorkingSetSize) {
+	int excessPages = (mappedMemory - fWorkingSetSize) / PAGE_SIZE;
+	if (excessPages <= 0)
+		return;
+
+	// This is a clock algorithm.  The first time the scan passes a page, its
+	// accessed bit is cleared.  If the bit is still clear the next time around,
+	// the page hasn't been used in the meantime and is unmapped.  The scan picks
+	// up where the last one left off.  Since it starts in the middle of the
+	// address space, it takes three laps to pass every page twice.
+	fAreaLock.LockRead();
+	unsigned int va = fNextTrimAddress;
+	for (int lap = 0; lap < 3 && excessPages > 0; lap++) {
+		for (AVLTreeIterator iterator(fAreas, true); iterator.GetCurrent() && excessPages > 0;
+			iterator.GoToNext()) {
+			Area *area = static_cast<Area*>(iterator.GetCurrent());
+			if (area->GetHighKey() < va || area->GetWiring() == AREA_WIRED
+				|| area->GetPageCache() == 0)
+				continue;
+
+			if (va < area->GetBaseAddress())
+				va = area->GetBaseAddress();
 
-        break;
+			excessPages -= TrimArea(area, &va, excessPages);
+		}
 
+		if (excessPages > 0)
+			va = 0;
 	}
+
+	fNextTrimAddress = va;
+	fAreaLock.UnlockRead();
+}
+
+// Scan an area from va, unmapping pages that haven't been accessed since the
+// last scan until maxPages have been unmapped or the end of the area is reached.
+// va is updated to where the scan stopped.  The area lock must be held.
+int AddressSpace::TrimArea(Area *area, unsigned int *va, int maxPages)
+{
+	int trimmed = 0;
+	while (*va < area->GetHighKey() && trimmed < maxPages) {
+		paddr_t pa;
+		int state = fPhysicalMap->AgeMapping(*va, &pa);
+		if ((state & (kMappingPresent | kMappingAccessed)) == kMappingPresent)
+			trimmed++;
+
+		*va += PAGE_SIZE;
+	}
+
+	return trimmed;
 }
 
 const PhysicalMap* AddressSpace::GetPhysicalMap() const
@@ -294,6 +404,33 @@ AddressSpace* AddressSpace::GetKernelAddressSpace()
 void AddressSpace::Bootstrap()
 {
 	fKernelAddressSpace = new AddressSpace(PhysicalMap::GetKernelPhysicalMap());
+	AddDebugCommand("faultaround", "Show or set the number of pages mapped around faults",
+		FaultAroundCommand);
+}
+
+status_t AddressSpace::SetFaultAroundPages(int pages)
+{
+	if (pages < 1 || pages > kMaxFaultAroundPages || (pages & (pages - 1)) != 0)
+		return E_INVALID_OPERATION;
+
+	fFaultAroundPages = pages;
+	return E_NO_ERROR;
+}
+
+void AddressSpace::FaultAroundCommand(int argc, const char *argv[])
+{
+	if (argc > 2) {
+		printf("usage: %s [pages]\n", argv[0]);
+		return;
+	}
+
+	if (argc == 2 && SetFaultAroundPages(atoi(argv[1])) != E_NO_ERROR) {
+		printf("pages must be a power of two from 1 to %d\n", kMaxFaultAroundPages);
+		return;
+	}
+
+	printf("Fault-around window: %d pages\n", fFaultAroundPages);
+	printf("Pages mapped by fault-around: %d\n", fFaultAroundMapped);
 }
 
 void AddressSpace::Print() const
@@ -336,13 +473,17 @@ AddressSpace::AddressSpace(PhysicalMap *map)
 	fAreas.Add(new Area("Kernel Text", SYSTEM_READ | SYSTEM_EXEC), kKernelBase, kKernelDataBase - 1);
 	fAreas.Add(new Area("Kernel Data", SYSTEM_READ | SYSTEM_WRITE), kKernelDataBase, kKernelDataTop);
 	fAreas.Add(new Area("Kernel Heap", SYSTEM_READ | SYSTEM_WRITE), kHeapBase, kHeapTop);
+	fAreas.Add(new Area("Direct Map", SYSTEM_READ | SYSTEM_WRITE), kDirectMapBase, kDirectMapTop);
+	fAreas.Add(new Area("Page Frames", SYSTEM_READ | SYSTEM_WRITE), kPageArrayBase,
+		kPageArrayTop);
 	fAreas.Add(new Area("Hyperspace", SYSTEM_READ | SYSTEM_WRITE), kIOAreaBase, kIOAreaTop);
 	Area *kstack = new Area("Init Stack", SYSTEM_READ | SYSTEM_WRITE);
 	fAreas.Add(kstack, kBootStackBase, kBootStackTop);
 	Thread::GetRunningThread()->SetKernelStack(kstack);
 }
 
-unsigned int AddressSpace::FindFreeRange(unsigned int size, int flags) const
+unsigned int AddressSpace::FindFreeRange(unsigned int size, int flags,
+	unsigned int alignment) const
 {
 	unsigned int base = INVALID_PAGE;
 	if (flags & SEARCH_FROM_BOTTOM) {
@@ -350,8 +491,10 @@ unsigned int AddressSpace::FindFreeRange(unsigned int size, int flags) const
 		for (AVLTreeIterator iterator(fAreas, true); iterator.GetCurrent();
 			iterator.GoToNext()) {
 			const Area *area = static_cast<const Area*>(iterator.GetCurrent());
-			if (area->GetBaseAddress() - low >= size) {
-				base = low;
+			unsigned int start = (low + alignment - 1) & ~(alignment - 1);
+			if (start >= low && area->GetBaseAddress() >= start
+				&& area->GetBaseAddress() - start >= size) {
+				base = start;
 				break;
 			}
 
@@ -362,8 +505,9 @@ unsigned int AddressSpace::FindFreeRange(unsigned int size, int flags) const
 		for (AVLTreeIterator iterator(fAreas, false); iterator.GetCurrent();
 			iterator.GoToNext()) {
 			const Area *area = static_cast<const Area*>(iterator.GetCurrent());
-			if (high - area->GetHighKey() >= size) {
-				base = high + 1 - size;
+			if (high - area->GetHighKey() >= size
+				&& ((high + 1 - size) & ~(alignment - 1)) > area->GetHighKey()) {
+				base = (high + 1 - size) & ~(alignment - 1);
 				break;
 			}
 
@@ -374,12 +518,15 @@ unsigned int AddressSpace::FindFreeRange(unsigned int size, int flags) const
 	return base;
 }
 
-void AddressSpace::PageDaemonLoop()
+void AddressSpace::StartPageDaemon()
 {
-	for (;;) {
-		sleep(kTrimInterval);
-		Team::DoForEach(TrimTeamWorkingSet, 0);
-	}
+	pageDaemon.Schedule(&pageDaemonQueue, kTrimInterval);
+}
+
+void PageDaemon::Run()
+{
+	Team::DoForEach(AddressSpace::TrimTeamWorkingSet, 0);
+	Schedule(&pageDaemonQueue, kTrimInterval);
 }
 
 void AddressSpace::TrimTeamWorkingSet(void *, Team *team)
@@ -58,7 +58,7 @@ public:
 	/// @returns
 	///   - Pointer to new Area object on success
 	///   - NULL if it failed to create an area for some reason
-	Area* MapPhysicalMemory(const char name[], unsigned int pa, unsigned int size,
+	Area* MapPhysicalMemory(const char name[], paddr_t pa, unsigned int size,
 		PageProtection protection);
 
 	/// Change the size of an existing area, potentially allocating or freeing backing store associated with it
@@ -73,6 +73,9 @@ public:
 	/// Remove an area from this address space and unmap all of its pages
 	void DeleteArea(Area*);
 
+	/// @returns The area that contains a virtual address, or 0 if there isn't one
+	Area* FindArea(unsigned int va);
+
 	/// Called when a thread attempts to access an area of memory that doesn't have a physical
 	/// page mapped to it.  This will attempt to map the appropriate page to that address.
 	/// @param va Virtual address that user attempted to access
@@ -87,7 +90,9 @@ public:
 	///   - E_NO_ERROR if a page was sucessfully mapped to the address
 	status_t HandleFault(unsigned int va, bool write, bool user);
 
-	/// Try to unmap least frequently accessed pages from this address space
+	/// Unmap pages that have not been accessed recently until the amount of
+	/// mapped memory is within the working set size.  Unmapped pages remain in
+	/// their caches.
 	/// @bug Shouldn't this be private?
 	void TrimWorkingSet();
 
@@ -104,18 +109,33 @@ public:
 	/// Called at boot time to initialize structures
 	static void Bootstrap();
 
-	/// This thread just attempts to remove least frequently pages from address spaces
-	/// @bug Shouldn't this be private?
-	/// @bug Shouldn't this be NORETURN?
-	static void PageDaemonLoop();
+	/// Start periodically removing the least frequently used pages from address
+	/// spaces.  This runs on a work queue.
+	static void StartPageDaemon();
 
 	/// Print debug information about this address space to the debug log
 	void Print() const;
 
+	/// Largest number of pages that SetFaultAroundPages accepts
+	static const int kMaxFaultAroundPages = 64;
+
+	/// Set how many pages are considered when a page fault maps the resident
+	/// neighbours of the faulting page.  The window is aligned to its size and
+	/// clipped to the area.
+	/// @param pages A power of two up to kMaxFaultAroundPages.  1 disables fault-around.
+	/// @returns E_INVALID_OPERATION if the number of pages is not valid
+	static status_t SetFaultAroundPages(int pages);
+
 private:
 	AddressSpace(PhysicalMap*);
-	unsigned int FindFreeRange(unsigned int size, int flags = 0) const;
+	unsigned int FindFreeRange(unsigned int size, int flags = 0,
+		unsigned int alignment = PAGE_SIZE) const;
 	static void TrimTeamWorkingSet(void*, Team*);
+	int TrimArea(Area*, unsigned int *va, int maxPages);
+	void FaultAround(const Area*, unsigned int va, PageProtection);
+	static void FaultAroundCommand(int, const char**);
+
+	friend class PageDaemon;
 
 	RWLock fAreaLock;
 	AVLTree fAreas;
@@ -128,6 +148,8 @@ private:
 	bigtime_t fLastWorkingSetAdjust;
 	unsigned int fNextTrimAddress;
 	static AddressSpace *fKernelAddressSpace;
+	static int fFaultAroundPages;
+	static int fFaultAroundMapped;
 };
 
 #endif
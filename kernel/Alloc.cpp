@@ -14,59 +14,255 @@
 // limitations under the License.
 // 
 
+#include "AddressSpace.h"
+#include "Alloc.h"
+#include "Area.h"
 #include "cpu_asm.h"
+#include "KernelDebug.h"
 #include "Lock.h"
 #include "memory_layout.h"
+#include "Page.h"
+#include "PageCache.h"
+#include "PhysicalMap.h"
+#include "Processor.h"
+#include "Semaphore.h"
+#include "Slab.h"
+#include "Spinlock.h"
 #include "stdio.h"
 #include "stdlib.h"
+#include "string.h"
+#include "Thread.h"
+#include "WorkQueue.h"
 
+/// Elements that are not cached by any processor.  Magazines are refilled from
+/// here and flushed back here.
 struct HeapBin {
-	Mutex lock;
 	size_t elementSize;
 	int growSize;
-	int allocCount;
 	void *freeList;
 	int freeCount;
 	char *rawList;
 	int rawCount;
+	Spinlock lock;
+};
+
+const int kMagazineSize = 16;
+
+// A magazine holds at most this many bytes, so processors don't keep a lot of
+// memory in the large bins to themselves.
+const size_t kMagazineBytes = 0x4000;
+
+/// Free elements of one bin cached by one processor.  Most allocations and frees
+/// only touch the magazine of the processor they run on.  It is only accessed
+/// with interrupts disabled on that processor, so it needs no lock, and malloc
+/// and free can be called from interrupt handlers.
+struct HeapMagazine {
+	int count;
+	int allocCount;	// Allocations on this processor minus frees
+	void *elements[kMagazineSize];
 };
 
 struct HeapPage {
 	unsigned short binIndex : 5;
 	unsigned short freeCount : 9;
-	unsigned short cleaning : 1;
 	unsigned short inUse : 1;
 } PACKED;
 
-static char* RawAlloc(int size, int binindex);
+/// A range of the heap.  The first one is mapped by the boot loader.  The rest
+/// are wired kernel areas that are created as the heap grows, and deleted once
+/// nothing in them is allocated.
+struct HeapSegment {
+	unsigned int base;
+	unsigned int top;	// Exclusive.  0 if this slot is unused.
+	unsigned int brk;	// Pages below this have been handed out
+	HeapPage *descriptors;	// One for each page, starting at base
+	void *freePages;	// Free slab pages, linked through the first word
+	int pagesInUse;
+	Area *area;	// 0 for the boot heap
+};
+
+/// Grows the heap in the background before it runs out, and deletes segments
+/// that have become empty.
+class HeapMaintenance : public WorkItem {
+public:
+	virtual void Run();
+};
+
+// Bin index in the page descriptors of pages that hold slabs
+const int kSlabBinIndex = 31;
+
+const unsigned int kHeapSegmentSize = 0x100000;
+const int kMaxHeapSegments = 128;
+
+// When less than this is left in the current segment, a new one is created in
+// the background.  This is also enough for the allocations made while creating
+// a segment.
+const unsigned int kHeapLowWater = 0x20000;
+
+// The heap may use at most this fraction of memory
+const int kHeapMemoryFraction = 2;
+
+/// Runs malloc/free pairs on several threads at once to measure the fast path
+/// under contention.  It is started from the debugger and reports when done.
+class HeapBenchmark : public WorkItem {
+public:
+	HeapBenchmark();
+	void Start(int threadCount, size_t size, int iterations);
+	virtual void Run();
 
-static volatile unsigned int brk = kHeapBase;
-static HeapPage pageDescriptors[(kHeapTop - kHeapBase) / PAGE_SIZE];
+private:
+	static int BenchmarkThread(void*);
+
+	volatile bool fBusy;
+	int fThreadCount;
+	size_t fSize;
+	int fIterations;
+	volatile int fTotalTime;	// Microseconds, summed over all threads
+	Semaphore *fStart;
+	Semaphore *fDone;
+};
+
+const int kMaxBenchmarkThreads = 16;
+
+static char* RawAlloc(int size, int binindex, bool canGrow);
+static bool GrowHeap(unsigned int minSize);
+static void ReleaseEmptySegments();
+
+static HeapPage bootPageDescriptors[(kHeapTop - kHeapBase + 1) / PAGE_SIZE];
+static HeapSegment segments[kMaxHeapSegments] = {
+	{kHeapBase, kHeapTop + 1, kHeapBase, bootPageDescriptors, 0, 0, 0}
+};
+
+static int segmentCount = 1;
+static int currentSegment = 0;
+static unsigned int heapSize = kHeapTop + 1 - kHeapBase;
+static Spinlock heapLock;	// Protects segments
+static Mutex growLock;	// Serializes adding and deleting segments
+static Thread *growingThread = 0;
+static HeapMaintenance heapMaintenance;
+static WorkQueue heapQueue("kernel heap", kWorkPriorityHigh);
+static HeapBenchmark heapBenchmark;
+static WorkQueue benchmarkQueue("heap benchmark", kWorkPriorityNormal);
 static HeapBin bins[] = {
-	{0, 16, PAGE_SIZE, 0, 0, 0, 0, 0},
-	{0, 32, PAGE_SIZE, 0, 0, 0, 0, 0},
-	{0, 44, PAGE_SIZE, 0, 0, 0, 0, 0},
-	{0, 64, PAGE_SIZE, 0, 0, 0, 0, 0},
-	{0, 89, PAGE_SIZE, 0, 0, 0, 0, 0},
-	{0, 128, PAGE_SIZE, 0, 0, 0, 0, 0},
-	{0, 256, PAGE_SIZE, 0, 0, 0, 0, 0},
-	{0, 315, PAGE_SIZE, 0, 0, 0, 0, 0},
-	{0, 512, PAGE_SIZE, 0, 0, 0, 0, 0},
-	{0, 1024, PAGE_SIZE, 0, 0, 0, 0, 0},
-	{0, 2048, PAGE_SIZE, 0, 0, 0, 0, 0},
-	{0, 0x1000, 0x1000, 0, 0, 0, 0, 0},
-	{0, 0x2000, 0x2000, 0, 0, 0, 0, 0},
-	{0, 0x3000, 0x3000, 0, 0, 0, 0, 0},
-	{0, 0x4000, 0x4000, 0, 0, 0, 0, 0},
-	{0, 0x5000, 0x5000, 0, 0, 0, 0, 0},
-	{0, 0x6000, 0x6000, 0, 0, 0, 0, 0},
-	{0, 0x7000, 0x7000, 0, 0, 0, 0, 0},
-	{0, 0x8000, 0x8000, 0, 0, 0, 0, 0},
-	{0, 0x9000, 0x9000, 0, 0, 0, 0, 0},
-	{0, 0xa000, 0xa000, 0, 0, 0, 0, 0}
+	{16, PAGE_SIZE, 0, 0, 0, 0, Spinlock()},
+	{32, PAGE_SIZE, 0, 0, 0, 0, Spinlock()},
+	{44, PAGE_SIZE, 0, 0, 0, 0, Spinlock()},
+	{64, PAGE_SIZE, 0, 0, 0, 0, Spinlock()},
+	{89, PAGE_SIZE, 0, 0, 0, 0, Spinlock()},
+	{128, PAGE_SIZE, 0, 0, 0, 0, Spinlock()},
+	{256, PAGE_SIZE, 0, 0, 0, 0, Spinlock()},
+	{315, PAGE_SIZE, 0, 0, 0, 0, Spinlock()},
+	{512, PAGE_SIZE, 0, 0, 0, 0, Spinlock()},
+	{1024, PAGE_SIZE, 0, 0, 0, 0, Spinlock()},
+	{2048, PAGE_SIZE, 0, 0, 0, 0, Spinlock()},
+	{0x1000, 0x1000, 0, 0, 0, 0, Spinlock()},
+	{0x2000, 0x2000, 0, 0, 0, 0, Spinlock()},
+	{0x3000, 0x3000, 0, 0, 0, 0, Spinlock()},
+	{0x4000, 0x4000, 0, 0, 0, 0, Spinlock()},
+	{0x5000, 0x5000, 0, 0, 0, 0, Spinlock()},
+	{0x6000, 0x6000, 0, 0, 0, 0, Spinlock()},
+	{0x7000, 0x7000, 0, 0, 0, 0, Spinlock()},
+	{0x8000, 0x8000, 0, 0, 0, 0, Spinlock()},
+	{0x9000, 0x9000, 0, 0, 0, 0, Spinlock()},
+	{0xa000, 0xa000, 0, 0, 0, 0, Spinlock()}
 };
 
 const int kBinCount = sizeof(bins) / sizeof(HeapBin);
+static HeapMagazine magazines[kMaxProcessors][kBinCount];
+
+// Segments are only deleted once nothing in them is allocated, so the segment
+// that holds an allocated address can be found without the lock.
+static HeapSegment* FindSegment(unsigned int address)
+{
+	for (int i = 0; i < segmentCount; i++) {
+		if (address >= segments[i].base && address < segments[i].top)
+			return &segments[i];
+	}
+
+	return 0;
+}
+
+static inline HeapPage* GetPageDescriptor(const HeapSegment *segment, unsigned int address)
+{
+	return &segment->descriptors[(address - segment->base) / PAGE_SIZE];
+}
+
+static inline int GetMagazineCapacity(const HeapBin &bin)
+{
+	return MAX(MIN(static_cast<size_t>(kMagazineSize), kMagazineBytes / bin.elementSize), 1);
+}
+
+// Move half a magazine worth of elements from the bin into an empty magazine.
+// Interrupts must be disabled.
+// @returns false if the bin is empty
+static bool FillMagazine(HeapBin &bin, HeapMagazine &magazine)
+{
+	int count = MAX(GetMagazineCapacity(bin) / 2, 1);
+	cpu_flags fl = bin.lock.Lock();
+	while (magazine.count < count) {
+		void *element;
+		if (bin.freeList) {
+			element = bin.freeList;
+			bin.freeList = *reinterpret_cast<void**>(element);
+			bin.freeCount--;
+		} else if (bin.rawCount > 0) {
+			element = bin.rawList;
+			bin.rawList += bin.elementSize;
+			bin.rawCount--;
+		} else
+			break;
+
+		magazine.elements[magazine.count++] = element;
+	}
+
+	bin.lock.Unlock(fl);
+	return magazine.count > 0;
+}
+
+// Return elements from a magazine to the bin until it holds keepCount.
+// Interrupts must be disabled.
+static void FlushMagazine(HeapBin &bin, HeapMagazine &magazine, int keepCount)
+{
+	cpu_flags fl = bin.lock.Lock();
+	while (magazine.count > keepCount) {
+		void *element = magazine.elements[--magazine.count];
+		*reinterpret_cast<void**>(element) = bin.freeList;
+		bin.freeList = element;
+		bin.freeCount++;
+	}
+
+	bin.lock.Unlock(fl);
+}
+
+// Get more space for an empty bin.  The bin lock isn't held while doing this,
+// since growing the heap may allocate from this bin.  Adding segments is
+// serialized by growLock.
+// @returns false if the heap is out of space, or couldn't grow without blocking
+static bool RefillBin(int binIndex, bool canGrow)
+{
+	HeapBin &bin = bins[binIndex];
+	char *raw = RawAlloc(bin.growSize, binIndex, canGrow);
+	if (raw == 0)
+		return false;
+
+	cpu_flags fl = bin.lock.Lock();
+	if (bin.rawCount == 0) {
+		bin.rawList = raw;
+		bin.rawCount = bin.growSize / bin.elementSize;
+	} else {
+		// Another thread added space in the meantime.  Put this on
+		// the free list.
+		for (int i = 0; i < bin.growSize / static_cast<int>(bin.elementSize); i++) {
+			void *element = raw + i * bin.elementSize;
+			*reinterpret_cast<void**>(element) = bin.freeList;
+			bin.freeList = element;
+			bin.freeCount++;
+		}
+	}
+
+	bin.lock.Unlock(fl);
+	return true;
+}
 
 void* malloc(size_t size)
 {
@@ -76,32 +272,41 @@ void* malloc(size_t size)
 		if (size <= bins[binIndex].elementSize)
 			break;
 
-	if (binIndex == kBinCount)
-		address = RawAlloc(size, binIndex);
-	else {
+	if (binIndex == kBinCount) {
+		// Large allocations get an area of their own, once there is an address
+		// space to create it in.  Until then, they come from the boot heap.
+		if (AddressSpace::GetKernelAddressSpace())
+			address = vmalloc(size);
+		else
+			address = RawAlloc(size, binIndex, true);
+	} else {
 		HeapBin &bin = bins[binIndex];
-		bin.lock.Lock();
-		if (bin.freeList) {
-			address = bin.freeList;
-			bin.freeList = *reinterpret_cast<void**>(bin.freeList);
-			bin.freeCount--;
-		} else {
-			if (bin.rawCount == 0) {
-				bin.rawList = RawAlloc(bin.growSize, binIndex);
-				bin.rawCount = bin.growSize / bin.elementSize;
+		for (;;) {
+			cpu_flags fl = DisableInterrupts();
+			HeapMagazine &magazine
+				= magazines[Processor::GetCurrentProcessorIndex()][binIndex];
+			if (magazine.count > 0 || FillMagazine(bin, magazine)) {
+				address = magazine.elements[--magazine.count];
+				magazine.allocCount++;
+				RestoreInterrupts(fl);
+				break;
 			}
 
-			bin.rawCount--;
-			address = bin.rawList;
-			bin.rawList += bin.elementSize;
+			RestoreInterrupts(fl);
+
+			// Growing the heap may block, which isn't possible in an interrupt
+			// handler or while holding a spinlock.  The maintenance work item
+			// normally grows it before it runs out.
+			if (!RefillBin(binIndex, InterruptsEnabled(fl)))
+				return 0;
 		}
-		
-		bin.allocCount++;
-		HeapPage *pages = &pageDescriptors[(reinterpret_cast<unsigned int>(address) - kHeapBase) / PAGE_SIZE];
+
+		// Each page of a multi-page element belongs to that element alone, so
+		// this doesn't need a lock.
+		HeapPage *pages = GetPageDescriptor(FindSegment(reinterpret_cast<unsigned int>(address)),
+			reinterpret_cast<unsigned int>(address));
 		for (unsigned int index = 0; index < bin.elementSize / PAGE_SIZE; index++)
 			pages[index].freeCount--;
-
-		bin.lock.Unlock();
 	}
 
 	return address;
@@ -112,77 +317,429 @@ void free(void *address)
 	if (address == 0)
 		return;
 
-	HeapPage *pages = &pageDescriptors[((unsigned int) address - kHeapBase) / PAGE_SIZE];
-	HeapBin &bin = bins[pages[0].binIndex];
-	bin.lock.Lock();
+	HeapSegment *segment = FindSegment(reinterpret_cast<unsigned int>(address));
+	if (segment == 0) {
+		// Large allocations are areas of their own.
+		vfree(address);
+		return;
+	}
+
+	HeapPage *pages = GetPageDescriptor(segment, reinterpret_cast<unsigned int>(address));
+	if (pages[0].binIndex == kSlabBinIndex) {
+		SlabCache::FreeObject(address);
+		return;
+	}
+
+	// Large allocations from the boot heap aren't in a bin, so there is
+	// nowhere to return them.  They are leaked.
+	int binIndex = pages[0].binIndex;
+	if (binIndex == kBinCount)
+		return;
+
+	HeapBin &bin = bins[binIndex];
 	for (unsigned int index = 0; index < bin.elementSize / PAGE_SIZE; index++)
 		pages[index].freeCount++;
 
-	*reinterpret_cast<void**>(address) = bin.freeList;
-	bin.freeList = address;
-	bin.allocCount--;
-	bin.freeCount++;
-	bin.lock.Unlock();
+	cpu_flags fl = DisableInterrupts();
+	HeapMagazine &magazine = magazines[Processor::GetCurrentProcessorIndex()][binIndex];
+	int capacity = GetMagazineCapacity(bin);
+	if (magazine.count == capacity)
+		FlushMagazine(bin, magazine, capacity / 2);
+
+	magazine.elements[magazine.count++] = address;
+	magazine.allocCount--;
+	RestoreInterrupts(fl);
+}
+
+void* vmalloc(size_t size)
+{
+	PageCache *cache = new PageCache;
+	Area *area = AddressSpace::GetKernelAddressSpace()->CreateArea("vmalloc",
+		(size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1), AREA_WIRED, SYSTEM_READ | SYSTEM_WRITE,
+		cache, 0);
+	if (area == 0) {
+		delete cache;
+		return 0;
+	}
+
+	return reinterpret_cast<void*>(area->GetBaseAddress());
+}
+
+void vfree(void *address)
+{
+	AddressSpace *space = AddressSpace::GetKernelAddressSpace();
+	Area *area = space->FindArea(reinterpret_cast<unsigned int>(address));
+	if (area == 0 || area->GetBaseAddress() != reinterpret_cast<unsigned int>(address))
+		panic("vfree: %p was not allocated with vmalloc", address);
+
+	space->DeleteArea(area);
+}
+
+void* AllocDmaBuffer(size_t size, PageZone zone, unsigned int *outPhysicalAddress)
+{
+	int order = 0;
+	while (order <= kMaxPageOrder && static_cast<size_t>(PAGE_SIZE << order) < size)
+		order++;
+
+	if (order > kMaxPageOrder)
+		return 0;
+
+	paddr_t pa = Page::AllocContiguous(order, zone);
+	if (pa == INVALID_PAGE)
+		return 0;
+
+	Area *area = AddressSpace::GetKernelAddressSpace()->MapPhysicalMemory("DMA buffer", pa,
+		PAGE_SIZE << order, SYSTEM_READ | SYSTEM_WRITE);
+	if (area == 0) {
+		Page::FreeContiguous(pa, order);
+		return 0;
+	}
+
+	// Both DMA zones are below 4GB.
+	*outPhysicalAddress = static_cast<unsigned int>(pa);
+	return reinterpret_cast<void*>(area->GetBaseAddress());
+}
+
+void FreeDmaBuffer(void *buffer)
+{
+	AddressSpace *space = AddressSpace::GetKernelAddressSpace();
+	unsigned int va = reinterpret_cast<unsigned int>(buffer);
+	Area *area = space->FindArea(va);
+	if (area == 0 || area->GetBaseAddress() != va || area->GetPageCache() != 0)
+		panic("FreeDmaBuffer: %p was not allocated with AllocDmaBuffer", buffer);
+
+	paddr_t pa = PhysicalMap::GetKernelPhysicalMap()->GetPhysicalAddress(va);
+	int order = 0;
+	while (static_cast<unsigned int>(PAGE_SIZE << order) < area->GetSize())
+		order++;
+
+	space->DeleteArea(area);
+	Page::FreeContiguous(pa, order);
 }
 
-void PrintHeapBins(int, const char*[])
+void* AllocSlabPage()
 {
-	printf("    Size   In Use     Free      Raw\n");
-	for (int binIndex = 0; binIndex < kBinCount; binIndex++)
-		printf("%8lu %8d %8d %8d\n", bins[binIndex].elementSize, bins[binIndex].allocCount,
-			bins[binIndex].freeCount, bins[binIndex].rawCount);
+	for (bool reclaimed = false; ; reclaimed = true) {
+		// Free pages in the boot heap and lower slots are used first, so
+		// other segments have a chance to empty out and be deleted.
+		cpu_flags fl = heapLock.Lock();
+		for (int i = 0; i < segmentCount; i++) {
+			HeapSegment &segment = segments[i];
+			void *page = segment.freePages;
+			if (page) {
+				segment.freePages = *static_cast<void**>(page);
+				segment.pagesInUse++;
+				GetPageDescriptor(&segment, reinterpret_cast<unsigned int>(page))->inUse = true;
+				heapLock.Unlock(fl);
+				return page;
+			}
+		}
+
+		// Growing the heap may block, so with interrupts disabled this only
+		// takes space the current segment already has.
+		heapLock.Unlock(fl);
+		void *page = RawAlloc(PAGE_SIZE, kSlabBinIndex, InterruptsEnabled(fl));
+		if (page)
+			return page;
+
+		if (reclaimed || SlabCache::ReclaimAll() == 0)
+			return 0;
+	}
 }
 
-void PrintHeapPages(int, const char*[])
+void FreeSlabPage(void *page)
+{
+	HeapSegment *segment = FindSegment(reinterpret_cast<unsigned int>(page));
+	cpu_flags fl = heapLock.Lock();
+	GetPageDescriptor(segment, reinterpret_cast<unsigned int>(page))->inUse = false;
+	*static_cast<void**>(page) = segment->freePages;
+	segment->freePages = page;
+	bool empty = --segment->pagesInUse == 0 && segment->area != 0
+		&& segment != &segments[currentSegment];
+	heapLock.Unlock(fl);
+	if (empty)
+		heapQueue.Enqueue(&heapMaintenance);
+}
+
+static void PrintHeapBins(int, const char*[])
+{
+	printf("    Size   In Use     Free   Cached      Raw\n");
+	for (int binIndex = 0; binIndex < kBinCount; binIndex++) {
+		int allocCount = 0;
+		int cachedCount = 0;
+		for (int processor = 0; processor < kMaxProcessors; processor++) {
+			allocCount += magazines[processor][binIndex].allocCount;
+			cachedCount += magazines[processor][binIndex].count;
+		}
+
+		printf("%8lu %8d %8d %8d %8d\n", bins[binIndex].elementSize, allocCount,
+			bins[binIndex].freeCount, cachedCount, bins[binIndex].rawCount);
+	}
+}
+
+static void PrintHeapPages(int, const char*[])
 {
 	printf("Address       Element Size   Free\n");      
-	for (unsigned int i = 0; i < (kHeapTop - kHeapBase) / PAGE_SIZE; i++) {
-		if (!pageDescriptors[i].inUse)
+	for (int segmentIndex = 0; segmentIndex < segmentCount; segmentIndex++) {
+		const HeapSegment &segment = segments[segmentIndex];
+		for (unsigned int i = 0; i < (segment.brk - segment.base) / PAGE_SIZE; i++) {
+			if (!segment.descriptors[i].inUse)
+				continue;
+
+			if (segment.descriptors[i].binIndex < kBinCount)
+				printf("%08x         %5d      %5d\n", i * PAGE_SIZE + segment.base,
+					static_cast<int>(bins[segment.descriptors[i].binIndex].elementSize),
+					segment.descriptors[i].freeCount);
+			else
+				printf("%08x            xx         xx\n", i * PAGE_SIZE + segment.base);
+		}
+	}
+}
+
+// Allocate pages from the current segment, growing the heap if they don't fit
+// and canGrow is set.
+// @returns 0 if the heap can't grow
+char* RawAlloc(int size, int binIndex, bool canGrow)
+{
+	size = (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+	for (;;) {
+		cpu_flags fl = heapLock.Lock();
+		HeapSegment &segment = segments[currentSegment];
+		if (segment.brk + size <= segment.top) {
+			unsigned int val = segment.brk;
+			segment.brk += size;
+			segment.pagesInUse += size / PAGE_SIZE;
+			bool low = segment.top - segment.brk < kHeapLowWater;
+			for (unsigned int addr = val; addr < val + size; addr += PAGE_SIZE) {
+				HeapPage &page = *GetPageDescriptor(&segment, addr);
+				page.inUse = true;
+				page.binIndex = binIndex;
+				if (binIndex < kBinCount && bins[binIndex].elementSize < PAGE_SIZE)
+					page.freeCount = PAGE_SIZE / bins[binIndex].elementSize;
+				else
+					page.freeCount = 1;
+			}
+
+			heapLock.Unlock(fl);
+			if (low)
+				heapQueue.Enqueue(&heapMaintenance);
+
+			return reinterpret_cast<char*>(val);
+		}
+
+		heapLock.Unlock(fl);
+		if (!canGrow) {
+			heapQueue.Enqueue(&heapMaintenance);
+			return 0;
+		}
+
+		if (!GrowHeap(size))
+			return 0;
+	}
+}
+
+// Add a segment that has room for at least minSize bytes, unless the current
+// one already has room and is above the low water mark.
+// @returns false if the heap couldn't grow
+bool GrowHeap(unsigned int minSize)
+{
+	// Early in boot, there is no kernel address space to create areas in.  If
+	// this thread is already creating a segment, the reserve has run out.
+	if (AddressSpace::GetKernelAddressSpace() == 0
+		|| growingThread == Thread::GetRunningThread())
+		return false;
+
+	growLock.Lock();
+	cpu_flags fl = heapLock.Lock();
+	const HeapSegment &current = segments[currentSegment];
+	bool hasRoom = current.top - current.brk >= minSize + kHeapLowWater;
+	heapLock.Unlock(fl);
+	if (hasRoom) {
+		growLock.Unlock();
+		return true;
+	}
+
+	// The page descriptors are at the start of the segment.
+	unsigned int pageCount = (minSize + kHeapSegmentSize) / PAGE_SIZE;
+	unsigned int descriptorSize = (pageCount * sizeof(HeapPage) + PAGE_SIZE - 1)
+		& ~(PAGE_SIZE - 1);
+	unsigned int size = pageCount * PAGE_SIZE + descriptorSize;
+	if (heapSize + size > Page::GetMemSize() / kHeapMemoryFraction) {
+		growLock.Unlock();
+		return false;
+	}
+
+	int slot = 0;
+	while (slot < kMaxHeapSegments && segments[slot].top != 0)
+		slot++;
+
+	if (slot == kMaxHeapSegments) {
+		growLock.Unlock();
+		return false;
+	}
+
+	// The pages of the area are cleared, so the descriptors start out unused.
+	growingThread = Thread::GetRunningThread();
+	PageCache *cache = new PageCache;
+	Area *area = AddressSpace::GetKernelAddressSpace()->CreateArea("Kernel Heap", size,
+		AREA_WIRED, SYSTEM_READ | SYSTEM_WRITE, cache, 0);
+	growingThread = 0;
+	if (area == 0) {
+		delete cache;
+		growLock.Unlock();
+		return false;
+	}
+
+	fl = heapLock.Lock();
+	HeapSegment &segment = segments[slot];
+	segment.descriptors = reinterpret_cast<HeapPage*>(area->GetBaseAddress());
+	segment.base = area->GetBaseAddress() + descriptorSize;
+	segment.brk = segment.base;
+	segment.freePages = 0;
+	segment.pagesInUse = 0;
+	segment.area = area;
+	segment.top = segment.base + pageCount * PAGE_SIZE;
+	if (slot == segmentCount)
+		segmentCount++;
+
+	currentSegment = slot;
+	heapSize += size;
+	heapLock.Unlock(fl);
+	growLock.Unlock();
+	return true;
+}
+
+// Delete segments that have no allocated pages
+void ReleaseEmptySegments()
+{
+	growLock.Lock();
+	for (int slot = 0; slot < segmentCount; slot++) {
+		cpu_flags fl = heapLock.Lock();
+		HeapSegment &segment = segments[slot];
+		if (segment.area == 0 || segment.pagesInUse > 0 || slot == currentSegment) {
+			heapLock.Unlock(fl);
 			continue;
+		}
 
-		if (pageDescriptors[i].binIndex < kBinCount)
-			printf("%08x         %5d      %5d\n", i * PAGE_SIZE + kHeapBase,
-				static_cast<int>(bins[pageDescriptors[i].binIndex].elementSize),
-				pageDescriptors[i].freeCount);
-		else
-			printf("%08x            xx         xx\n", i * PAGE_SIZE + kHeapBase);
+		Area *area = segment.area;
+		segment.top = 0;
+		segment.base = 0;
+		segment.brk = 0;
+		segment.freePages = 0;
+		segment.area = 0;
+		heapSize -= area->GetSize();
+		heapLock.Unlock(fl);
+		AddressSpace::GetKernelAddressSpace()->DeleteArea(area);
 	}
+
+	growLock.Unlock();
 }
 
-char* RawAlloc(int size, int binIndex)
+void HeapMaintenance::Run()
 {
-	unsigned int val = static_cast<unsigned int>(AtomicAdd(reinterpret_cast<volatile int*>(&brk), (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1)));
-	if (val > kHeapTop)
-		panic("Out of heap space");
+	GrowHeap(0);
+	ReleaseEmptySegments();
+}
 
-	for (unsigned int addr = val; addr < val + size; addr += PAGE_SIZE) {
-		HeapPage &page = pageDescriptors[(addr - kHeapBase) / PAGE_SIZE];
-		page.inUse = true;
-		page.cleaning = false;
-		page.binIndex = binIndex;
-		if (binIndex < kBinCount && bins[binIndex].elementSize < PAGE_SIZE)
-			page.freeCount = PAGE_SIZE / bins[binIndex].elementSize;
-		else
-			page.freeCount = 1;
+HeapBenchmark::HeapBenchmark()
+	:	fBusy(false),
+		fThreadCount(0),
+		fSize(0),
+		fIterations(0),
+		fTotalTime(0),
+		fStart(0),
+		fDone(0)
+{
+}
+
+// This is called from the debugger, which can't wait for threads, so it only
+// queues the benchmark.
+void HeapBenchmark::Start(int threadCount, size_t size, int iterations)
+{
+	if (fBusy) {
+		printf("The benchmark is already running\n");
+		return;
 	}
-			
-	return reinterpret_cast<char*>(val);
+
+	fBusy = true;
+	fThreadCount = threadCount;
+	fSize = size;
+	fIterations = iterations;
+	benchmarkQueue.Enqueue(this);
+	printf("Results will be printed when the benchmark finishes\n");
 }
 
-void GarbageCollectBin(HeapBin &bin)
+void HeapBenchmark::Run()
 {
-	for (void **link = &bin.freeList; *link != 0;) {
-		HeapPage &page = pageDescriptors[(reinterpret_cast<unsigned int>(*link) - kHeapBase)
-			/ PAGE_SIZE];
-		if (page.cleaning) {
-			*link = **reinterpret_cast<void***>(link);
-			if (--page.freeCount == 0) {
-				// Free this page...
-			}
-		} else if (page.freeCount == PAGE_SIZE / bin.elementSize) {
-			*link = **reinterpret_cast<void***>(link);
-			page.cleaning = true;
-		} else
-			link = *reinterpret_cast<void***>(link);
+	if (fStart == 0) {
+		fStart = new Semaphore("heap benchmark start", 0);
+		fDone = new Semaphore("heap benchmark done", 0);
+	}
+
+	fTotalTime = 0;
+	Team *team = Thread::GetRunningThread()->GetTeam();
+	for (int i = 0; i < fThreadCount; i++)
+		new Thread("heap benchmark", team, BenchmarkThread, this);
+
+	// Let all of the threads go at once, so they contend with each other.
+	bigtime_t startTime = SystemTime();
+	fStart->Release(fThreadCount);
+	for (int i = 0; i < fThreadCount; i++)
+		fDone->Wait();
+
+	int elapsed = static_cast<int>(SystemTime() - startTime);
+	int pairs = fThreadCount * fIterations;
+	printf("heapbench: %d threads, %d malloc/free pairs of %u bytes in %d us, %d ns per pair\n",
+		fThreadCount, pairs, static_cast<unsigned int>(fSize), elapsed,
+		static_cast<int>(static_cast<int64>(fTotalTime) * 1000 / pairs));
+	fBusy = false;
+}
+
+int HeapBenchmark::BenchmarkThread(void *param)
+{
+	HeapBenchmark *benchmark = static_cast<HeapBenchmark*>(param);
+	benchmark->fStart->Wait();
+	bigtime_t startTime = SystemTime();
+	for (int i = 0; i < benchmark->fIterations; i++)
+		free(malloc(benchmark->fSize));
+
+	AtomicAdd(&benchmark->fTotalTime, static_cast<int>(SystemTime() - startTime));
+	benchmark->fDone->Release();
+	Thread::GetRunningThread()->Exit();
+}
+
+static void HeapBenchmarkCommand(int argc, const char *argv[])
+{
+	if (argc > 4) {
+		printf("usage: %s [threads] [size] [iterations]\n", argv[0]);
+		return;
+	}
+
+	int threadCount = argc > 1 ? atoi(argv[1]) : Processor::GetProcessorCount() * 2;
+	int size = argc > 2 ? atoi(argv[2]) : 32;
+	int iterations = argc > 3 ? atoi(argv[3]) : 100000;
+	if (threadCount < 1 || threadCount > kMaxBenchmarkThreads) {
+		printf("thread count must be 1-%d\n", kMaxBenchmarkThreads);
+		return;
+	}
+
+	if (size < 1 || size > static_cast<int>(bins[kBinCount - 1].elementSize)) {
+		printf("size must be 1-%u\n", static_cast<unsigned int>(bins[kBinCount - 1].elementSize));
+		return;
 	}
+
+	if (iterations < 1) {
+		printf("iteration count must be positive\n");
+		return;
+	}
+
+	heapBenchmark.Start(threadCount, size, iterations);
+}
+
+void HeapBootstrap()
+{
+	AddDebugCommand("heap", "Show kernel heap bins", PrintHeapBins);
+	AddDebugCommand("heappages", "Show kernel heap pages", PrintHeapPages);
+	AddDebugCommand("heapbench", "Time kernel malloc/free pairs on several threads",
+		HeapBenchmarkCommand);
 }
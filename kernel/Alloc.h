@@ -0,0 +1,61 @@
+// 
+// Copyright 1998-2012 Jeff Bush
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// 
+
+/// @file Alloc.h
+///	Kernel heap interfaces beyond malloc and free
+
+#ifndef _ALLOC_H
+#define _ALLOC_H
+
+#include "Page.h"
+#include "types.h"
+
+/// Allocate a page from the kernel heap to hold a slab.  Pages freed with
+/// FreeSlabPage are reused before the heap grows.  When the heap is full, empty
+/// slabs are reclaimed from all caches.  free() passes pointers into these pages
+/// to SlabCache::FreeObject.  With interrupts disabled, this doesn't grow the
+/// heap, since that may block.
+/// @returns The page, or 0 if the heap is out of space
+void* AllocSlabPage();
+
+/// Return a page allocated with AllocSlabPage
+void FreeSlabPage(void*);
+
+/// Allocate a large buffer that is virtually contiguous.  It is a wired kernel
+/// area of its own, so it doesn't use up the heap.  malloc calls this for
+/// allocations that are too large for its bins.  This may block.
+/// @returns The buffer, or 0 if it couldn't be allocated
+void* vmalloc(size_t size);
+
+/// Free a buffer allocated with vmalloc
+void vfree(void*);
+
+/// Allocate a wired buffer that is physically contiguous, for devices that
+/// transfer data with DMA.  The size is rounded up to a power of two pages and
+/// the buffer is aligned to that size physically.  This doesn't block.
+/// @param zone Devices that can't address all memory pass the zone they can
+/// @param outPhysicalAddress Set to the physical address of the buffer, to
+///   program into the device
+/// @returns The buffer, or 0 if there is no free contiguous memory that large
+void* AllocDmaBuffer(size_t size, PageZone zone, unsigned int *outPhysicalAddress);
+
+/// Free a buffer allocated with AllocDmaBuffer
+void FreeDmaBuffer(void*);
+
+/// Register the heap debugger commands
+void HeapBootstrap();
+
+#endif
@@ -31,6 +31,9 @@ public:
 		AreaWiring lock = AREA_WIRED);
 	virtual ~Area();
 
+	/// Areas are allocated from a slab cache
+	void* operator new(size_t);
+
 	/// Return the lowest virtual address of this area
 	inline unsigned int GetBaseAddress() const;
 
@@ -21,6 +21,22 @@
 
 #include "types.h"
 
+/// History of how a backing store has been read.  The page cache uses it to
+/// detect sequential access and decide how far to read ahead.  It is protected
+/// by the lock of the page cache.
+struct ReadAheadState {
+	inline ReadAheadState();
+
+	/// Page index that was looked up most recently
+	unsigned int fLastIndex;
+
+	/// First page of the window that was read ahead most recently
+	unsigned int fWindowStart;
+
+	/// Number of pages in that window, or 0 if access is not sequential
+	int fWindowSize;
+};
+
 /// A backing store is a place where data is stored that is not physical memory.
 /// It provides IO operations on this space.  It can represent data from a file
 /// or an anonymous chunk of swap space.
@@ -50,10 +66,27 @@ public:
 	/// Guarantee that a certain amount of data will be able to be written to the backing store
 	/// @returns Number of bytes actually available.
 	virtual off_t Commit(off_t size) = 0;
+
+	/// Backing stores that are usually read sequentially, like files, keep
+	/// state that lets the page cache read pages before they are needed.
+	/// @returns The read ahead state, or 0 if pages should only be read on demand
+	virtual ReadAheadState* GetReadAheadState();
 };
 
+inline ReadAheadState::ReadAheadState()
+	:	fLastIndex(0),
+		fWindowStart(0),
+		fWindowSize(0)
+{
+}
+
 inline BackingStore::~BackingStore()
 {
 }
 
+inline ReadAheadState* BackingStore::GetReadAheadState()
+{
+	return 0;
+}
+
 #endif
@@ -0,0 +1,85 @@
+// 
+// Copyright 1998-2012 Jeff Bush
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// 
+
+#include "cpu_asm.h"
+#include "DPC.h"
+#include "Processor.h"
+#include "Spinlock.h"
+
+// Each processor has its own queue, which is only changed by that processor,
+// but the lock keeps a DPC from being queued on two processors at once.
+static Spinlock dpcLock;
+static Queue dpcQueue[kMaxProcessors];
+static bool dpcsRunning[kMaxProcessors];
+static bool reschedulePending[kMaxProcessors];
+
+DPC::DPC()
+	:	fQueued(false)
+{
+}
+
+void DPC::Enqueue()
+{
+	cpu_flags fl = dpcLock.Lock();
+	if (!fQueued) {
+		fQueued = true;
+		dpcQueue[Processor::GetCurrentProcessorIndex()].Enqueue(this);
+	}
+
+	dpcLock.Unlock(fl);
+}
+
+InterruptStatus DPC::RunQueued()
+{
+	int processorIndex = Processor::GetCurrentProcessorIndex();
+	if (dpcsRunning[processorIndex])
+		return kHandledInterrupt;
+
+	dpcsRunning[processorIndex] = true;
+	for (;;) {
+		cpu_flags fl = dpcLock.Lock();
+		DPC *dpc = static_cast<DPC*>(dpcQueue[processorIndex].Dequeue());
+		if (dpc)
+			dpc->fQueued = false;
+
+		dpcLock.Unlock(fl);
+		if (dpc == 0)
+			break;
+
+		EnableInterrupts();
+		dpc->HandleDPC();
+		DisableInterrupts();
+	}
+
+	dpcsRunning[processorIndex] = false;
+	if (reschedulePending[processorIndex]) {
+		reschedulePending[processorIndex] = false;
+		return kReschedule;
+	}
+
+	return kHandledInterrupt;
+}
+
+bool DPC::CanReschedule()
+{
+	int processorIndex = Processor::GetCurrentProcessorIndex();
+	if (dpcsRunning[processorIndex]) {
+		reschedulePending[processorIndex] = true;
+		return false;
+	}
+
+	return true;
+}
@@ -0,0 +1,62 @@
+// 
+// Copyright 1998-2012 Jeff Bush
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// 
+
+/// @file DPC.h
+#ifndef _DPC_H
+#define _DPC_H
+
+#include "InterruptHandler.h"
+#include "Queue.h"
+
+/// Deferred Procedure Call
+/// An interrupt handler should only do what must be done with interrupts
+/// disabled, which is usually acknowledging the device, and queue a DPC for the
+/// rest (such as waking the threads waiting for the device).  Queued DPCs are run
+/// by the processor that queued them, with interrupts enabled, after the interrupt
+/// has been acknowledged and before the trap handler returns to the interrupted
+/// thread.
+class DPC : private QueueNode {
+public:
+	DPC();
+
+	/// Queue this to run on the current processor.  If it is already queued,
+	/// it only runs once.  This may be called from an interrupt handler.
+	void Enqueue();
+
+	/// Run the DPCs queued on this processor.  This is called by the trap handler
+	/// with interrupts disabled, and they are disabled again when this returns.
+	/// If another interrupt arrives while the DPCs are running, the DPCs it queues
+	/// are run by this call.
+	/// @returns kReschedule if that interrupt asked for a reschedule, which has
+	///   to wait until the DPCs are finished.
+	static InterruptStatus RunQueued();
+
+	/// The trap handler calls this before it reschedules.  The thread can't be
+	/// switched while DPCs are running on its stack.
+	/// @returns false if DPCs are running on this processor, in which case the
+	///   reschedule happens when they finish.
+	static bool CanReschedule();
+
+protected:
+	/// Derived classes override this to do the deferred work.  It is called
+	/// with interrupts enabled, but it may not block.
+	virtual void HandleDPC() = 0;
+
+private:
+	bool fQueued;
+};
+
+#endif
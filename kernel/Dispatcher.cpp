@@ -18,11 +18,14 @@
 #include "Dispatcher.h"
 #include "Queue.h"
 #include "Scheduler.h"
+#include "string.h"
 #include "Thread.h"
 #include "Timer.h"
 
 class ThreadWaitEvent;
 
+RecursiveSpinlock gDispatcherLock;
+
 /// A WaitTag associates a dispatcher to a wait event.
 /// The wait tag is a node that exists in two linked lists:
 /// Each dispatcher has a list of WaitTags that represent
@@ -56,6 +59,7 @@ ThreadWaitEvent::ThreadWaitEvent(Thread *thread, WaitFlags flags)
 {
 }
 
+// This is called from the timer interrupt with the dispatcher lock held.
 InterruptStatus ThreadWaitEvent::HandleTimeout()
 {
 	// Remove this event from the wait queues of all the dispatchers.
@@ -80,7 +84,7 @@ Dispatcher::~Dispatcher()
 
 status_t Dispatcher::Wait(bigtime_t timeout)
 {
-	cpu_flags fl = DisableInterrupts();
+	cpu_flags fl = gDispatcherLock.Lock();
 	status_t result = E_NO_ERROR;
 	if (fSignalled)
 		ThreadWoken();
@@ -90,7 +94,7 @@ status_t Dispatcher::Wait(bigtime_t timeout)
 		result = WaitInternal(1, &list, WAIT_FOR_ONE, timeout, &tag);
 	}
 
-	RestoreInterrupts(fl);
+	gDispatcherLock.Unlock(fl);
 	return result;
 }
 
@@ -99,7 +103,7 @@ status_t Dispatcher::WaitForMultipleDispatchers(int dispatcherCount, Dispatcher
 {
 	status_t result = E_NO_ERROR;
 
-	cpu_flags fl = DisableInterrupts();
+	cpu_flags fl = gDispatcherLock.Lock();
 	bool satisfied;
 	if (flags & WAIT_FOR_ALL) {
 		satisfied = true;
@@ -122,7 +126,7 @@ status_t Dispatcher::WaitForMultipleDispatchers(int dispatcherCount, Dispatcher
 		for (int dispatcherIndex = 0; dispatcherIndex < dispatcherCount; dispatcherIndex++)
 			dispatchers[dispatcherIndex]->ThreadWoken();
 
-		RestoreInterrupts(fl);
+		gDispatcherLock.Unlock(fl);
 		return E_NO_ERROR;
 	}
 
@@ -136,14 +140,13 @@ status_t Dispatcher::WaitForMultipleDispatchers(int dispatcherCount, Dispatcher
 		delete [] tags;
 	}
 
-	RestoreInterrupts(fl);
+	gDispatcherLock.Unlock(fl);
 	return result;
 }
 
 void Dispatcher::Signal(bool reschedule)
 {
-	cpu_flags fl = DisableInterrupts();
-	ASSERT(!_get_interrupt_state());
+	cpu_flags fl = gDispatcherLock.Lock();
 	fSignalled = true;
 	bool threadsWoken = false;
 	for (WaitTag *nextDispatcherBlock = static_cast<WaitTag*>(fTags.GetHead());
@@ -180,7 +183,7 @@ void Dispatcher::Signal(bool reschedule)
 		}
 	}
 
-	RestoreInterrupts(fl);
+	gDispatcherLock.Unlock(fl);
 	if (reschedule && threadsWoken)
 		gScheduler.Reschedule();
 }
@@ -194,6 +197,16 @@ void Dispatcher::ThreadWoken()
 {
 }
 
+int Dispatcher::GetHighestWaiterPriority() const
+{
+	int priority = 0;
+	for (const WaitTag *tag = static_cast<const WaitTag*>(fTags.GetHead()); tag;
+		tag = static_cast<const WaitTag*>(fTags.GetNext(tag)))
+		priority = MAX(priority, tag->fEvent->fThread->GetCurrentPriority());
+
+	return priority;
+}
+
 status_t Dispatcher::WaitInternal(int dispatcherCount, Dispatcher *dispatchers[], WaitFlags flags,
 	bigtime_t timeout, WaitTag tags[])
 {
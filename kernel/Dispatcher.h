@@ -20,6 +20,7 @@
 #define _DISPATCHER_H
 
 #include "Queue.h"
+#include "Spinlock.h"
 #include "Timer.h"
 #include "types.h"
 
@@ -71,6 +72,10 @@ protected:
 	/// to seletively Unsignal the Dispatcher depending on their semantics.
 	virtual void ThreadWoken();
 
+	/// @returns the highest current priority of the threads waiting on this
+	///   dispatcher, or 0 if none are.  Must be called with the dispatcher lock held.
+	int GetHighestWaiterPriority() const;
+
 private:
 	static status_t WaitInternal(int dispatcherCount, Dispatcher *dispatchers[],
 		WaitFlags flags, bigtime_t timeout, class WaitTag[]);
@@ -78,4 +83,9 @@ private:
 	Queue fTags;
 };
 
+/// The dispatcher lock protects the state of all dispatchers, the scheduler's ready
+/// queues, and the timer queue.  It is held across context switches: the thread that
+/// is switched to releases it.
+extern RecursiveSpinlock gDispatcherLock;
+
 #endif
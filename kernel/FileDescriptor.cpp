@@ -15,8 +15,19 @@
 // 
 
 #include "FileDescriptor.h"
+#include "Slab.h"
 #include "VNode.h"
 
+// Big enough for the descriptors of the file systems
+const size_t kFileDescriptorSlabSize = 128;
+
+static SlabCache fileDescriptorCache("file descriptor", kFileDescriptorSlabSize);
+
+void* FileDescriptor::operator new(size_t size)
+{
+	return fileDescriptorCache.AllocInstance(size);
+}
+
 FileDescriptor::FileDescriptor(VNode *node)
 	:	Resource(OBJ_FD, ""),
 		fNode(node),
@@ -25,6 +25,10 @@ class FileDescriptor : public Resource {
 public:
 	FileDescriptor(VNode*);
 	virtual ~FileDescriptor();
+
+	/// File descriptors, including those of derived classes that fit, are
+	/// allocated from a slab cache
+	void* operator new(size_t);
 	VNode* GetNode() const;
 	off_t Seek(off_t, int whence);
 	virtual int ReadDir(char outName[], size_t size);
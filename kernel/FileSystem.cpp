@@ -17,6 +17,7 @@
 #include "cpu_asm.h"
 #include "FileSystem.h"
 #include "List.h"
+#include "Spinlock.h"
 #include "string.h"
 #include "syscall.h"
 #include "Thread.h"
@@ -35,6 +36,7 @@ extern FileSystem* FatFsInstantiate(int);
 
 FileSystem* FileSystem::fRootFileSystem = 0;
 List FileSystem::fFsTypeList;
+static Spinlock fsTypeLock;
 
 FileSystem::FileSystem()
 	:	fCovers(0)
@@ -65,21 +67,21 @@ void FileSystem::RegisterFsType(const char name[], FileSystem* (*Instantiate)(in
 	strncpy(type->name, name, OS_NAME_LENGTH);
 	type->Instantiate = Instantiate;
 
-	cpu_flags fl = DisableInterrupts();
+	cpu_flags fl = fsTypeLock.Lock();
 	fFsTypeList.AddToTail(type);
-	RestoreInterrupts(fl);
+	fsTypeLock.Unlock(fl);
 }
 
 status_t FileSystem::InstantiateFsType(const char type[], int devfd, FileSystem **space)
 {
-	cpu_flags fl = DisableInterrupts();
+	cpu_flags fl = fsTypeLock.Lock();
 	const FsType *fsType;
 	for (fsType = static_cast<const FsType*>(fFsTypeList.GetHead()); fsType;
 		fsType = static_cast<const FsType*>(fFsTypeList.GetNext(fsType)))
 		if (strcmp(type, fsType->name) == 0)
 			break;
 			
-	RestoreInterrupts(fl);
+	fsTypeLock.Unlock(fl);
 	if (fsType == 0)
 		return E_INVALID_OPERATION; // This filesystem type is not registered.
 
@@ -18,9 +18,14 @@
 #include "InterruptHandler.h"
 #include "interrupt.h"
 #include "KernelDebug.h"
+#include "Spinlock.h"
 
 InterruptHandler* InterruptHandler::fHandlers[kMaxInterrupts];
 
+// Protects changes to the handler lists.  Dispatch walks a list without it,
+// so a handler is always fully linked before it becomes visible.
+static Spinlock handlerLock;
+
 InterruptHandler::InterruptHandler()
 	:	fVector(-1),
 		fActive(false)
@@ -46,14 +51,14 @@ void InterruptHandler::ObserveInterrupt(int vector)
 	ASSERT(vector >= 0);
 	ASSERT(vector <= kMaxInterrupts);
 
-	cpu_flags st = DisableInterrupts();
+	cpu_flags st = handlerLock.Lock();
 	if (fHandlers[vector] == 0)
 		EnableIrq(vector);
 
 	fNext = fHandlers[vector];
 	fHandlers[vector] = this;
 	fVector = vector;
-	RestoreInterrupts(st);
+	handlerLock.Unlock(st);
 }
 
 void InterruptHandler::IgnoreInterrupts()
@@ -61,7 +66,7 @@ void InterruptHandler::IgnoreInterrupts()
 	if (fVector == -1)
 		panic("Attempt to unregister handler that isn't registered");
 
-	cpu_flags st = DisableInterrupts();
+	cpu_flags st = handlerLock.Lock();
 	if (fHandlers[fVector] == 0)
 		panic("Attempt to remove interrupt handler that is not installed");
 		
@@ -83,7 +88,7 @@ void InterruptHandler::IgnoreInterrupts()
 		DisableIrq(fVector);
 
 	fVector = -1;
-	RestoreInterrupts(st);
+	handlerLock.Unlock(st);
 }
 
 InterruptStatus InterruptHandler::Dispatch(int vector)
@@ -40,7 +40,10 @@ public:
 	///      interrupt handlers.
 	///   - kReschedule This driver has handled this interrupt and has also make one or more threads
 	///      runnable.  Reschedule after returning from interrupt handler because the threads have
-	///      tight latency requirements.
+	///      tight latency requirements.  This is rarely needed: the trap handler reschedules on
+	///      its own if a thread more important than the running one was made ready.
+	/// Work that doesn't need to be done with interrupts disabled, including waking threads,
+	/// should be deferred with a DPC.
 	virtual InterruptStatus HandleInterrupt();
 
 	/// Begin watching an interrupt with the given interrupt vector.  If other InterruptHandlers
@@ -19,6 +19,7 @@
 #include "interrupt.h"
 #include "KernelDebug.h"
 #include "List.h"
+#include "Spinlock.h"
 #include "stdio.h"
 #include "string.h"
 
@@ -56,6 +57,7 @@ static char tempBuffer[kBufferLength];
 static int commandSlot;
 static char commandHistory[kCommandHistorySize][kCommandBufferLength];
 static bigtime_t bootTime;
+static Spinlock consoleLock;	// Protects tempBuffer and keeps lines from interleaving
 static struct {
 	const char *name;
 	const char *description;
@@ -123,14 +125,14 @@ void panic(const char fmt[], ...)
 
 void printf(const char fmt[], ...)
 {
-	cpu_flags fl = DisableInterrupts();
+	cpu_flags fl = consoleLock.Lock();
 	va_list arglist;
 	VA_START(arglist, fmt);
 	vsnprintf(tempBuffer, kBufferLength, fmt, arglist);
 	for (const char *c = tempBuffer; *c; c++)
 		DebugConsoleWrite(*c);
 
-	RestoreInterrupts(fl);
+	consoleLock.Unlock(fl);
 }
 
 void AddDebugCommand(const char name[], const char description[], DebugHook hook)
@@ -16,22 +16,66 @@
 
 #include "cpu_asm.h"
 #include "Lock.h"
+#include "Scheduler.h"
+#include "string.h"
 #include "Thread.h"
 
 
 Mutex::Mutex(int)
+	:	fOwner(0),
+		fNextHeld(0)
 {
 	Signal(false);
 }
 
 status_t Mutex::Lock()
 {
-	return Wait();
+	// The dispatcher lock is held across the wait, so the holder can't release
+	// the mutex between inheriting this thread's priority and this thread
+	// being queued on it.  Mutexes are used before the first thread is set up,
+	// in which case there is nobody to track.
+	cpu_flags fl = gDispatcherLock.Lock();
+	Thread *thread = Thread::GetRunningThread();
+	if (thread && fOwner) {
+		thread->fBlockedOn = this;
+		InheritPriority(fOwner, thread->GetCurrentPriority());
+	}
+
+	status_t error = Wait();
+	if (thread) {
+		thread->fBlockedOn = 0;
+		if (error == E_NO_ERROR) {
+			fOwner = thread;
+			fNextHeld = thread->fHeldMutexes;
+			thread->fHeldMutexes = this;
+
+			// Threads that started waiting while the mutex was being handed
+			// over didn't have an owner to pass their priority to.
+			RestorePriority(thread);
+		} else if (fOwner)
+			RestorePriority(fOwner);
+	}
+
+	gDispatcherLock.Unlock(fl);
+	return error;
 }
 
 void Mutex::Unlock()
 {
+	cpu_flags fl = gDispatcherLock.Lock();
+	Thread *owner = fOwner;
+	if (owner) {
+		Mutex **link = &owner->fHeldMutexes;
+		while (*link != this)
+			link = &(*link)->fNextHeld;
+
+		*link = fNextHeld;
+		fOwner = 0;
+		RestorePriority(owner);
+	}
+
 	Signal(false);
+	gDispatcherLock.Unlock(fl);
 }
 
 void Mutex::ThreadWoken()
@@ -39,6 +83,46 @@ void Mutex::ThreadWoken()
 	Unsignal();
 }
 
+// Called with the dispatcher lock held.  This only raises priorities, so it stops
+// at the first thread in the chain that is already running at this priority,
+// which also keeps it from going around a deadlock forever.
+void Mutex::InheritPriority(Thread *holder, int priority)
+{
+	while (holder && holder->fInheritedPriority < priority) {
+		holder->fInheritedPriority = priority;
+		if (holder->GetCurrentPriority() < priority)
+			gScheduler.SetPriority(holder, priority);
+
+		holder = holder->fBlockedOn ? holder->fBlockedOn->fOwner : 0;
+	}
+}
+
+// Called with the dispatcher lock held when a thread releases a mutex or stops
+// waiting for one.  The thread inherits the priority of the most important
+// thread still waiting on any of the mutexes it holds, and goes back to its base
+// priority if there are none.
+void Mutex::RestorePriority(Thread *holder)
+{
+	while (holder) {
+		int inherited = 0;
+		for (Mutex *mutex = holder->fHeldMutexes; mutex; mutex = mutex->fNextHeld)
+			inherited = MAX(inherited, mutex->GetHighestWaiterPriority());
+
+		if (inherited == holder->fInheritedPriority)
+			break;
+
+		int priority;
+		if (inherited > holder->fInheritedPriority)
+			priority = MAX(holder->GetCurrentPriority(), inherited);
+		else
+			priority = MAX(holder->GetBasePriority(), inherited);
+
+		holder->fInheritedPriority = inherited;
+		gScheduler.SetPriority(holder, priority);
+		holder = holder->fBlockedOn ? holder->fBlockedOn->fOwner : 0;
+	}
+}
+
 const int kMaxReaders = 0x50000000;
 
 RWLock::RWLock()
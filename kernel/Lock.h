@@ -23,6 +23,13 @@
 #include "Dispatcher.h"
 #include "Semaphore.h"
 
+class Thread;
+
+/// A mutex records the thread that holds it.  While a more important thread is
+/// waiting for it, the holder runs at the waiter's priority, so it can't be kept
+/// from releasing the mutex by threads of intermediate priority.  If the holder
+/// is itself waiting on another mutex, the priority is passed along to that
+/// mutex's holder too.
 class Mutex : public Dispatcher {
 public:
 	Mutex(int = 0);
@@ -30,6 +37,11 @@ public:
 	void Unlock();
 private:
 	virtual void ThreadWoken();
+	static void InheritPriority(Thread *holder, int priority);
+	static void RestorePriority(Thread *holder);
+
+	Thread *fOwner;
+	Mutex *fNextHeld;
 };
 
 /// Reader/Writer lock
@@ -57,7 +69,7 @@ public:
 	bool IsLocked() const;
 private:
 	Mutex fMutex;
-	class Thread *fHolder;
+	Thread *fHolder;
 	int fRecursion;
 };
 
@@ -17,6 +17,7 @@
 #include "BootParams.h"
 #include "cpu_asm.h"
 #include "KernelDebug.h"
+#include "memory_layout.h"
 #include "Page.h"
 #include "PageCache.h"
 #include "PhysicalMap.h"
@@ -25,16 +26,74 @@
 #include "stdio.h"
 #include "string.h"
 #include "Thread.h"
+#include "WorkQueue.h"
+
+// The page-out daemon is started when the number of free pages drops below the
+// low watermark, and frees pages until it is above the high watermark.
+const int kFreePagesLowWatermark = 32;
+const int kFreePagesHighWatermark = 96;
+const bigtime_t kPageOutRetryInterval = 100000;
+
+// Interrupts are disabled while the page lock is held, so the page-out daemon
+// releases it after looking at this many pages.
+const int kPageOutScanBatch = 32;
+
+// Threads waiting for a busy page block on one of these, chosen by hashing the
+// page.  Pages that leave the busy state wake every thread waiting on their
+// channel, and each one checks its own page again.
+const int kPageWaitChannelCount = 64;
+
+// Pages below this are in the DMA zone.  It is aligned to the largest free
+// block, so blocks never span zones.
+const unsigned int kDmaZoneLimit = 0x1000000;
+
+// Memory above 4GB is in the high zone, and can only be used with PAE.  The
+// boot loader reports it separately, since there is a hole for devices below.
+const paddr_t kHighMemoryBase = 0x100000000ULL;
+
+// Construct an object at a specific address
+inline void* operator new(size_t, void *where)
+{
+	return where;
+}
+
+class PageEraser : public WorkItem {
+public:
+	virtual void Run();
+};
+
+class PageOutDaemon : public DelayedWorkItem {
+public:
+	virtual void Run();
+};
+
+class PageWaitChannel : public Dispatcher {
+public:
+	PageWaitChannel();
+	void WakeAll();
+
+	volatile int fWaiterCount;
+};
+
+static PageEraser pageEraser;
+static WorkQueue pageEraserQueue("page eraser", kWorkPriorityIdle);
+static PageOutDaemon pageOutDaemon;
+static WorkQueue pageOutQueue("page out", kWorkPriorityPageOut);
+static PageWaitChannel pageWaitChannels[kPageWaitChannelCount];
 
 Semaphore Page::fFreePagesAvailable("Free Pages Available", 0);
+Spinlock Page::fPageLock;
 Page* Page::fPages = 0;
-Queue Page::fFreeQueue;
+Queue Page::fFreeLists[kPageZoneCount][kMaxPageOrder + 1];
 Queue Page::fActiveQueue;
+Queue Page::fInactiveQueue;
 Queue Page::fClearQueue;
 int Page::fPageCount = 0;
+int Page::fReservedCount = 0;
 int Page::fFreeCount = 0;
 int Page::fTransitionCount = 0;
 int Page::fActiveCount = 0;
+int Page::fInactiveCount = 0;
 int Page::fWiredCount = 0;
 int Page::fClearCount = 0;
 
@@ -43,41 +102,76 @@ int64 Page::fPagesRequested = 0;
 int64 Page::fClearPagesRequested = 0;
 int64 Page::fClearPageHits = 0;
 int64 Page::fClearPagesUsedAsFree = 0;
-
-Page* Page::LockPage(unsigned int pa)
+int64 Page::fBusyPageWaits = 0;
+int64 Page::fPageOutRuns = 0;
+int64 Page::fPagesScanned = 0;
+int64 Page::fPagesDeactivated = 0;
+int64 Page::fPagesReclaimed = 0;
+int64 Page::fPagesWrittenBack = 0;
+static bigtime_t lastStatsTime = 0;
+static int64 lastPagesScanned = 0;
+static int64 lastPagesReclaimed = 0;
+
+static inline PageZone GetZone(int pageIndex)
 {
-	Page *page;
-	cpu_flags fl = DisableInterrupts();
-	for (;;) {
-		page = &fPages[pa / PAGE_SIZE];
-		if (page->fState != kPageTransition)
-			break;
+	if (static_cast<unsigned int>(pageIndex) < kDmaZoneLimit / PAGE_SIZE)
+		return kPageZoneDma;
 
-		RestoreInterrupts(fl);
-		sleep(20000);
-		fl = DisableInterrupts();
+	return static_cast<paddr_t>(pageIndex) < kHighMemoryBase / PAGE_SIZE ? kPageZoneNormal
+		: kPageZoneHigh;
+}
+
+Page* Page::LockPage(paddr_t pa)
+{
+	Page *page = &fPages[pa / PAGE_SIZE];
+	cpu_flags fl = fPageLock.Lock();
+	while (page->fState == kPageTransition) {
+		fPageLock.Unlock(fl);
+		page->WaitUntilNotBusy();
+		fl = fPageLock.Lock();
 	}
 
 	page->MoveToQueue(kPageTransition);
-	RestoreInterrupts(fl);
+	fPageLock.Unlock(fl);
 	return page;
 }
 
-unsigned int Page::GetPhysicalAddress() const
+paddr_t Page::GetPhysicalAddress() const
 {
-	return (this - fPages) * PAGE_SIZE;
+	return static_cast<paddr_t>(this - fPages) * PAGE_SIZE;
 }
 
 Page* Page::Alloc(bool clear)
 {
-	Page *page = 0;
+	// Start paging out before memory runs out, so allocations rarely have to
+	// wait for it.
+	if (fFreeCount + fClearCount <= kFreePagesLowWatermark)
+		pageOutQueue.Enqueue(&pageOutDaemon);
 
 	fFreePagesAvailable.Wait();
+	return TakeFreePage(clear);
+}
+
+Page* Page::TryAlloc()
+{
+	if (CountFreePages() <= kFreePagesLowWatermark
+		|| fFreePagesAvailable.Wait(0) != E_NO_ERROR)
+		return 0;
+
+	return TakeFreePage(false);
+}
+
+// Remove a page from the free or clear queue.  The caller has already acquired
+// fFreePagesAvailable, so one of the queues has a page.
+Page* Page::TakeFreePage(bool clear)
+{
+	Page *page = 0;
 
 	// Note that we grab pages from the tail of these queues.  This helps
 	// processor cache utilization, but also improves performance of the
 	// physical map page locking area.
-	cpu_flags fl = DisableInterrupts();
+	bool needsClear = false;
+	cpu_flags fl = fPageLock.Lock();
 	fPagesRequested++;
 	if (clear && fClearCount > 0) {
 		// There is already a pre-cleared page, use that.
@@ -87,16 +181,12 @@ Page* Page::Alloc(bool clear)
 	} else if (clear) {
 		// There aren't pre-cleared pages available, clear one now.
 		fClearPagesRequested++;
-		page = static_cast<Page*>(fFreeQueue.GetTail());
-		if (clear) {
-			char *va = PhysicalMap::LockPhysicalPage(page->GetPhysicalAddress());
-			ClearPage(va);
-			PhysicalMap::UnlockPhysicalPage(va);
-		}
+		page = FindFreeBlock(0, kPageZoneHigh);
+		needsClear = true;
 	} else if (fFreeCount > 0) {
 		// This page should not be cleared, so just grab it off the
 		// free queue.
-		page = static_cast<Page*>(fFreeQueue.GetTail());
+		page = FindFreeBlock(0, kPageZoneHigh);
 	} else {
 		// This page should not be cleared, but there aren't any free
 		// pages.  Use a cleared page instead.
@@ -105,54 +195,217 @@ Page* Page::Alloc(bool clear)
 	}
 	
 	page->MoveToQueue(kPageTransition);
-	RestoreInterrupts(fl);
+	fPageLock.Unlock(fl);
+
+	// The page is in the transition state, so nobody else will touch it
+	// while it is cleared.
+	if (needsClear) {
+		char *va = PhysicalMap::LockPhysicalPage(page->GetPhysicalAddress());
+		ClearPage(va);
+		PhysicalMap::UnlockPhysicalPage(va);
+	}
+
 	return page;
 }
 
+paddr_t Page::AllocContiguous(int order, PageZone zone)
+{
+	ASSERT(order >= 0 && order <= kMaxPageOrder);
+	int pageCount = 1 << order;
+
+	// Reserve the pages like Alloc does, but give up rather than waiting.
+	for (int i = 0; i < pageCount; i++) {
+		if (fFreePagesAvailable.Wait(0) != E_NO_ERROR) {
+			if (i > 0)
+				fFreePagesAvailable.Release(i, false);
+
+			return INVALID_PAGE;
+		}
+	}
+
+	cpu_flags fl = fPageLock.Lock();
+	Page *block = FindFreeBlock(order, zone);
+	if (block == 0) {
+		// Cleared pages aren't merged with their neighbours.  Give up the work
+		// of clearing them to get larger blocks.
+		ReleaseClearPages();
+		block = FindFreeBlock(order, zone);
+	}
+
+	if (block == 0) {
+		fPageLock.Unlock(fl);
+		fFreePagesAvailable.Release(pageCount, false);
+		return INVALID_PAGE;
+	}
+
+	// Each page is split off of the block as it is removed, leaving the rest
+	// of it on the free lists.
+	for (int i = 0; i < pageCount; i++)
+		block[i].MoveToQueue(kPageWired);
+
+	fPageLock.Unlock(fl);
+	if (CountFreePages() <= kFreePagesLowWatermark)
+		pageOutQueue.Enqueue(&pageOutDaemon);
+
+	return block->GetPhysicalAddress();
+}
+
+void Page::FreeContiguous(paddr_t pa, int order)
+{
+	Page *block = &fPages[pa / PAGE_SIZE];
+	cpu_flags fl = fPageLock.Lock();
+	for (int i = 0; i < (1 << order); i++) {
+		ASSERT(block[i].fState == kPageWired);
+		ASSERT(block[i].fCache == 0);
+		block[i].MoveToQueue(kPageFree);
+	}
+
+	fPageLock.Unlock(fl);
+}
+
 void Page::Free()
 {
 	ASSERT(fState != kPageFree);
 	ASSERT(fCache == 0);
+	cpu_flags fl = fPageLock.Lock();
 	MoveToQueue(kPageFree);
+	fPageLock.Unlock(fl);
 }
 
 void Page::SetBusy()
 {
+	cpu_flags fl = fPageLock.Lock();
 	MoveToQueue(kPageTransition);
+	fPageLock.Unlock(fl);
 }
 
 void Page::SetNotBusy()
 {
 	ASSERT(fCache != 0);
+	cpu_flags fl = fPageLock.Lock();
 	MoveToQueue(kPageActive);
+	fPageLock.Unlock(fl);
+}
+
+void Page::WaitUntilNotBusy()
+{
+	PageWaitChannel &channel = pageWaitChannels[(this - fPages) % kPageWaitChannelCount];
+
+	// The dispatcher lock is held from the check until this thread is waiting,
+	// so the wakeup can't be missed.  The count is updated atomically because
+	// MoveToQueue reads it without the lock.
+	cpu_flags fl = gDispatcherLock.Lock();
+	AtomicAdd(&channel.fWaiterCount, 1);
+	if (fState == kPageTransition) {
+		fBusyPageWaits++;
+		channel.Wait();
+	}
+
+	AtomicAdd(&channel.fWaiterCount, -1);
+	gDispatcherLock.Unlock(fl);
 }
 
 void Page::Wire()
 {
+	cpu_flags fl = fPageLock.Lock();
 	MoveToQueue(kPageWired);
+	fPageLock.Unlock(fl);
 }
 
 void Page::Unwire()
 {
 	ASSERT(fCache != 0);
+	cpu_flags fl = fPageLock.Lock();
 	MoveToQueue(kPageActive);
+	fPageLock.Unlock(fl);
+}
+
+void Page::Reference()
+{
+	fReferenced = true;
+	if (fState == kPageInactive) {
+		cpu_flags fl = fPageLock.Lock();
+		if (fState == kPageInactive)
+			MoveToQueue(kPageActive);
+
+		fPageLock.Unlock(fl);
+	}
+}
+
+void Page::AddMapping(paddr_t pa)
+{
+	if (pa / PAGE_SIZE < static_cast<paddr_t>(fPageCount))
+		AtomicAdd(&fPages[pa / PAGE_SIZE].fMapCount, 1);
+}
+
+void Page::RemoveMapping(paddr_t pa, bool modified)
+{
+	if (pa / PAGE_SIZE >= static_cast<paddr_t>(fPageCount))
+		return;
+
+	// The cache can't reclaim the page or go away while it is still mapped, so
+	// the count is decremented afterwards.
+	Page *page = &fPages[pa / PAGE_SIZE];
+	PageCache *cache = page->fCache;
+	if (modified && cache)
+		cache->MarkDirty(page);
+
+	AtomicAdd(&page->fMapCount, -1);
 }
 
 int Page::CountFreePages()
 {
-	return fFreeCount;
+	return fFreeCount + fClearCount;
 }
 
 void Page::Bootstrap()
 {
-	fPageCount = bootParams.memsize / PAGE_SIZE;
-	fPages = new Page[fPageCount];
-	fFreeCount = fPageCount;
-	fFreePagesAvailable.Release(fPageCount, false);
+	// With more than about 100MB of memory, the descriptors don't fit in the
+	// boot heap, so they get memory of their own.  Memory above 4GB needs PAE.
+	// Pages are indexed by physical address, so the hole below 4GB gets
+	// descriptors too, which are reserved.
+	const int kHighMemoryPage = kHighMemoryBase / PAGE_SIZE;
+	int lowPageCount = bootParams.memsize / PAGE_SIZE;
+	fPageCount = lowPageCount;
+	if (bootParams.highPageCount > 0) {
+		if (PhysicalMap::HasPae())
+			fPageCount = kHighMemoryPage + bootParams.highPageCount;
+		else {
+			printf("Memory above 4GB can't be used without PAE, ignoring %uMB\n",
+				bootParams.highPageCount / (0x100000 / PAGE_SIZE));
+		}
+	}
+
+	const int kMaxPageCount = (kPageArrayTop - kPageArrayBase + 1) / sizeof(Page);
+	if (fPageCount > kMaxPageCount) {
+		printf("Only using the first %uMB of memory\n", kMaxPageCount / (0x100000 / PAGE_SIZE));
+		fPageCount = kMaxPageCount;
+		lowPageCount = MIN(lowPageCount, kMaxPageCount);
+	}
+
+	if (fPageCount > kHighMemoryPage)
+		fReservedCount = kHighMemoryPage - lowPageCount;
+
+	unsigned int arraySize = (fPageCount * sizeof(Page) + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+	PhysicalMap::MapBootMemory(kPageArrayBase, arraySize);
+	fPages = reinterpret_cast<Page*>(kPageArrayBase);
+	fFreeCount = fPageCount - fReservedCount;
+	fFreePagesAvailable.Release(fFreeCount, false);
 	for (int pageIndex = 0; pageIndex < fPageCount; pageIndex++) {
+		new (&fPages[pageIndex]) Page;
 		fPages[pageIndex].fCache = 0;
-		fPages[pageIndex].fState = kPageFree;
-		fFreeQueue.Enqueue(&fPages[pageIndex]);
+		fPages[pageIndex].fDirty = false;
+		fPages[pageIndex].fReferenced = false;
+		fPages[pageIndex].fMapCount = 0;
+		fPages[pageIndex].fState = pageIndex >= lowPageCount && pageIndex < kHighMemoryPage
+			? kPageReserved : kPageFree;
+		fPages[pageIndex].fOrder = -1;
+	}
+
+	// All pages must be initialized before any are merged with their buddies.
+	for (int pageIndex = 0; pageIndex < fPageCount; pageIndex++) {
+		if (fPages[pageIndex].fState == kPageFree)
+			fPages[pageIndex].InsertFreePage();
 	}
 
 	AddDebugCommand("pgstat", "Page statistics", PrintStats);
@@ -160,15 +413,14 @@ void Page::Bootstrap()
 
 void Page::StartPageEraser()
 {
-	new Thread("Page Eraser", Thread::GetRunningThread()->GetTeam(), PageEraser,
-		0, 1);
+	pageEraserQueue.Enqueue(&pageEraser);
 }
 
 // This is a bit of a kludge to work around the chicken & egg problem
 // of allocating pages from the first stage loader for things like
 // the initial stack, the kernel image, and page management data structures.
 // It is called after Page::Bootstrap to specify which pages are already in use.
-void Page::MarkUsed(unsigned int pa)
+void Page::MarkUsed(paddr_t pa)
 {
 	Page *page = &fPages[pa / PAGE_SIZE];
 	if (page->fState == kPageFree) {
@@ -176,18 +428,20 @@ void Page::MarkUsed(unsigned int pa)
 		// are enough pages available at this stage of the bootstrap; it
 		// is just acquired to update the count.
 		fFreePagesAvailable.Wait();
+		cpu_flags fl = fPageLock.Lock();
 		page->MoveToQueue(kPageWired);
+		fPageLock.Unlock(fl);
 	} else
-		printf("Page %08x is in state %d\n", pa, page->fState);
+		printf("Page %08Lx is in state %d\n", pa, page->fState);
 }
 
 void Page::MoveToQueue(PageState newState)
 {
-	cpu_flags fl = DisableInterrupts();
+	ASSERT(fPageLock.IsLocked());
 	switch (fState) {
 		case kPageFree:
 			fFreeCount--;
-			RemoveFromList();
+			RemoveFreePage();
 			break;
 
 		case kPageTransition:
@@ -199,6 +453,11 @@ void Page::MoveToQueue(PageState newState)
 			RemoveFromList();
 			break;
 
+		case kPageInactive:
+			fInactiveCount--;
+			RemoveFromList();
+			break;
+
 		case kPageWired:
 			fWiredCount--;
 			break;
@@ -212,14 +471,25 @@ void Page::MoveToQueue(PageState newState)
 			panic("Page::MoveToQueue: bad page state 1");
 	}
 
+	PageState oldState = fState;
 	fState = newState;
+	if (oldState == kPageTransition) {
+		// Wake threads waiting for this page.  The fence orders the state
+		// change before reading the waiter count, which pairs with the
+		// atomic increment in WaitUntilNotBusy.
+		PageWaitChannel &channel = pageWaitChannels[(this - fPages) % kPageWaitChannelCount];
+		MemoryFence();
+		if (channel.fWaiterCount > 0)
+			channel.WakeAll();
+	}
 
 	switch (fState) {
 		case kPageFree:
 			ASSERT(fCache == 0);
 			fFreeCount++;
-			fFreeQueue.Enqueue(this);
+			InsertFreePage();
 			fFreePagesAvailable.Release(1, false);
+			pageEraserQueue.Enqueue(&pageEraser);
 			break;
 
 		case kPageTransition:
@@ -232,6 +502,12 @@ void Page::MoveToQueue(PageState newState)
 			fActiveQueue.Enqueue(this);
 			break;
 
+		case kPageInactive:
+			ASSERT(fCache != 0);
+			fInactiveCount++;
+			fInactiveQueue.Enqueue(this);
+			break;
+
 		case kPageWired:
 			fWiredCount++;
 			break;
@@ -245,49 +521,260 @@ void Page::MoveToQueue(PageState newState)
 		default:
 			panic("Page::MoveToQueue bad page state 2");
 	}
+}
+
+// Find the smallest free block of at least 2^order pages, starting with the
+// given zone and falling back to lower ones.  fPageLock must be held.
+// @returns The first page of the block, or 0 if there is none
+Page* Page::FindFreeBlock(int order, PageZone zone)
+{
+	for (int zoneIndex = zone; zoneIndex >= 0; zoneIndex--) {
+		for (int blockOrder = order; blockOrder <= kMaxPageOrder; blockOrder++) {
+			Page *block = static_cast<Page*>(fFreeLists[zoneIndex][blockOrder].GetTail());
+			if (block)
+				return block;
+		}
+	}
+
+	return 0;
+}
+
+// Add a page that has just become free to the free lists, merging it with its
+// buddy for as long as the buddy is a free block of the same size.
+void Page::InsertFreePage()
+{
+	int index = this - fPages;
+	int order = 0;
+	fOrder = -1;
+	while (order < kMaxPageOrder) {
+		int buddyIndex = index ^ (1 << order);
+		if (buddyIndex >= fPageCount)
+			break;
 
-	RestoreInterrupts(fl);
+		Page &buddy = fPages[buddyIndex];
+		if (buddy.fState != kPageFree || buddy.fOrder != order)
+			break;
+
+		buddy.RemoveFromList();
+		buddy.fOrder = -1;
+		index &= ~(1 << order);
+		order++;
+	}
+
+	fPages[index].fOrder = order;
+	fFreeLists[GetZone(index)][order].Enqueue(&fPages[index]);
+}
+
+// Remove this page from the free block that contains it.  The rest of the block
+// is split into smaller blocks, which are put back on the free lists.
+void Page::RemoveFreePage()
+{
+	int index = this - fPages;
+
+	// Candidates of a lower order than the block that holds this page are
+	// inside it, and only its first page has fOrder set, so the first match is
+	// that block.
+	int blockIndex = index;
+	int order = 0;
+	while (fPages[blockIndex].fOrder != order) {
+		order++;
+		ASSERT(order <= kMaxPageOrder);
+		blockIndex = index & ~((1 << order) - 1);
+	}
+
+	fPages[blockIndex].RemoveFromList();
+	fPages[blockIndex].fOrder = -1;
+	while (order > 0) {
+		order--;
+		int half = 1 << order;
+		int freeIndex;
+		if (index >= blockIndex + half) {
+			freeIndex = blockIndex;
+			blockIndex += half;
+		} else
+			freeIndex = blockIndex + half;
+
+		fPages[freeIndex].fOrder = order;
+		fFreeLists[GetZone(freeIndex)][order].Enqueue(&fPages[freeIndex]);
+	}
+}
+
+// Move all cleared pages back to the free lists, so they can be merged into
+// larger blocks.  They are still counted in fFreePagesAvailable.  fPageLock
+// must be held.
+void Page::ReleaseClearPages()
+{
+	while (fClearCount > 0) {
+		Page *page = static_cast<Page*>(fClearQueue.GetHead());
+		page->RemoveFromList();
+		fClearCount--;
+		page->fState = kPageFree;
+		fFreeCount++;
+		page->InsertFreePage();
+	}
+}
+
+PageWaitChannel::PageWaitChannel()
+	:	fWaiterCount(0)
+{
+}
+
+void PageWaitChannel::WakeAll()
+{
+	cpu_flags fl = gDispatcherLock.Lock();
+	Signal(false);
+	Unsignal();
+	gDispatcherLock.Unlock(fl);
 }
 
-int Page::PageEraser(void*)
+void PageEraser::Run()
+{
+	Page::ClearFreePages();
+}
+
+// This runs at idle priority, so it only uses processor time nothing else
+// wants.  It returns once there are no free pages left to clear; freeing a page
+// queues it again.
+void Page::ClearFreePages()
 {
 	for (;;) {
-		DisableInterrupts();
-		fFreePagesAvailable.Wait();	// Shouldn't block, just update count
+		// Reserve the page so an allocation can't find the queues empty while it
+		// is being cleared.  If none are available, allocations are using them
+		// up as fast as they are freed.
+		if (fFreePagesAvailable.Wait(0) != E_NO_ERROR)
+			break;
+
+		// Pages in the DMA zone are left alone, so they stay available for
+		// contiguous allocations.
+		cpu_flags fl = fPageLock.Lock();
+		Page *page = FindFreeBlock(0, kPageZoneHigh);
+		if (page && GetZone(page - fPages) == kPageZoneDma)
+			page = 0;
 
-		Page *page = static_cast<Page*>(fFreeQueue.GetTail());
 		if (!page) {
-			EnableInterrupts();
+			fPageLock.Unlock(fl);
 			fFreePagesAvailable.Release(1, false);
-			sleep(100000);
-			continue;
+			break;
 		}
 
 		page->MoveToQueue(kPageTransition);
-		EnableInterrupts();
+		fPageLock.Unlock(fl);
 
 		char *va = PhysicalMap::LockPhysicalPage(page->GetPhysicalAddress());
 		ClearPage(va);
 		PhysicalMap::UnlockPhysicalPage(va);
 		
-		DisableInterrupts();
+		fl = fPageLock.Lock();
 		page->MoveToQueue(kPageClear);
 		fPagesCleared++;
-		EnableInterrupts();
+		fPageLock.Unlock(fl);
 	}
+}
 
-	return 0;
+void PageOutDaemon::Run()
+{
+	Page::PageOut();
+}
+
+// Clean pages are reclaimed first, since they can be reused without any IO.
+// Dirty pages are only written back if that doesn't free enough.  If there
+// still aren't enough free pages, the rest of memory is mapped into working
+// sets.  The page daemon shrinks those when memory is low, so try again later.
+void Page::PageOut()
+{
+	fPageOutRuns++;
+	for (int pass = 0; pass < 2; pass++) {
+		int shortage = kFreePagesHighWatermark - CountFreePages();
+		if (shortage <= 0)
+			return;
+
+		// Keep enough inactive pages around to choose from.
+		if (fInactiveCount < shortage * 2)
+			DeactivatePages(shortage * 2 - fInactiveCount);
+
+		ReclaimInactivePages(shortage, pass == 1);
+	}
+
+	if (CountFreePages() < kFreePagesLowWatermark)
+		pageOutDaemon.Schedule(&pageOutQueue, kPageOutRetryInterval);
+}
+
+// Move pages from the head of the active list to the inactive list if they
+// are not mapped and haven't been referenced since the last time they were
+// looked at.  Other pages go to the back of the active list.
+int Page::DeactivatePages(int count)
+{
+	int deactivated = 0;
+	int toScan = fActiveCount;
+	while (toScan > 0 && deactivated < count) {
+		cpu_flags fl = fPageLock.Lock();
+		for (int batch = 0; batch < kPageOutScanBatch && toScan > 0
+			&& deactivated < count; batch++, toScan--) {
+			Page *page = static_cast<Page*>(fActiveQueue.GetHead());
+			if (page == 0) {
+				toScan = 0;
+				break;
+			}
+
+			fPagesScanned++;
+			if (page->fMapCount > 0 || page->fReferenced) {
+				page->fReferenced = false;
+				page->RemoveFromList();
+				fActiveQueue.Enqueue(page);
+			} else {
+				page->MoveToQueue(kPageInactive);
+				fPagesDeactivated++;
+				deactivated++;
+			}
+		}
+
+		fPageLock.Unlock(fl);
+	}
+
+	return deactivated;
+}
+
+// Try to free pages from the head of the inactive list.  Dirty pages are
+// skipped unless writeDirty is set.
+int Page::ReclaimInactivePages(int count, bool writeDirty)
+{
+	int reclaimed = 0;
+	for (int toScan = fInactiveCount; toScan > 0 && reclaimed < count; toScan--) {
+		cpu_flags fl = fPageLock.Lock();
+		Page *page = static_cast<Page*>(fInactiveQueue.GetHead());
+		if (page == 0) {
+			fPageLock.Unlock(fl);
+			break;
+		}
+
+		// Move the page to the back, so one that can't be reclaimed now isn't
+		// looked at again until the others have been.
+		page->RemoveFromList();
+		fInactiveQueue.Enqueue(page);
+		fPagesScanned++;
+		fPageLock.Unlock(fl);
+
+		// The cache checks the page again with its lock held.
+		if (PageCache::ReclaimPage(page, writeDirty)) {
+			fPagesReclaimed++;
+			reclaimed++;
+		}
+	}
+
+	return reclaimed;
 }
 
 void Page::PrintStats(int, const char**)
 {
+	int pageCount = fPageCount - fReservedCount;
 	printf("Page Statistics\n");
-	printf("  Free:        %5u (%2u%%)  %uk\n", fFreeCount, fFreeCount * 100 / fPageCount, fFreeCount * PAGE_SIZE / 1024);
-	printf("  Active:      %5u (%2u%%)  %uk\n", fActiveCount, fActiveCount * 100 / fPageCount, fActiveCount * PAGE_SIZE / 1024);
-	printf("  Wired:       %5u (%2u%%)  %uk\n", fWiredCount, fWiredCount * 100 / fPageCount, fWiredCount * PAGE_SIZE / 1024);
-	printf("  Transition:  %5u (%2u%%)  %uk\n", fTransitionCount, fTransitionCount * 100 / fPageCount, fTransitionCount * PAGE_SIZE / 1024);
-	printf("  Clear:       %5u (%2u%%)  %uk\n", fClearCount, fClearCount * 100 / fPageCount, fClearCount * PAGE_SIZE / 1024);
-	printf("  Total:       %5u        %2uk\n", fPageCount, fPageCount * PAGE_SIZE / 1024);
+	printf("  Free:        %5u (%2u%%)  %uk\n", fFreeCount, fFreeCount * 100 / pageCount, fFreeCount * (PAGE_SIZE / 1024));
+	printf("  Active:      %5u (%2u%%)  %uk\n", fActiveCount, fActiveCount * 100 / pageCount, fActiveCount * (PAGE_SIZE / 1024));
+	printf("  Inactive:    %5u (%2u%%)  %uk\n", fInactiveCount, fInactiveCount * 100 / pageCount, fInactiveCount * (PAGE_SIZE / 1024));
+	printf("  Wired:       %5u (%2u%%)  %uk\n", fWiredCount, fWiredCount * 100 / pageCount, fWiredCount * (PAGE_SIZE / 1024));
+	printf("  Transition:  %5u (%2u%%)  %uk\n", fTransitionCount, fTransitionCount * 100 / pageCount, fTransitionCount * (PAGE_SIZE / 1024));
+	printf("  Clear:       %5u (%2u%%)  %uk\n", fClearCount, fClearCount * 100 / pageCount, fClearCount * (PAGE_SIZE / 1024));
+	printf("  Total:       %5u        %2uk\n", pageCount, pageCount * (PAGE_SIZE / 1024));
 	printf("\n");
 	printf("Pages requested:          %Ld\n", fPagesRequested);
 	printf("Clear pages requested:    %Ld (%Ld%%)\n", fClearPagesRequested,
@@ -298,4 +785,37 @@ void Page::PrintStats(int, const char**)
 	printf("Clear pages used as free: %Ld/%Ld (%Ld%%)\n", fClearPagesUsedAsFree,
 		fPagesRequested - fClearPagesRequested, fClearPagesUsedAsFree * 100
 		/ (fPagesRequested - fClearPagesRequested));
+
+	// Rates are averaged since the last time this command was run.
+	bigtime_t now = SystemTime();
+	bigtime_t interval = now - lastStatsTime;
+	printf("\n");
+	printf("Watermarks:               %d low, %d high\n", kFreePagesLowWatermark,
+		kFreePagesHighWatermark);
+	printf("Page-out runs:            %Ld\n", fPageOutRuns);
+	printf("Pages scanned:            %Ld (%Ld/s)\n", fPagesScanned,
+		(fPagesScanned - lastPagesScanned) * 1000000 / interval);
+	printf("Pages deactivated:        %Ld\n", fPagesDeactivated);
+	printf("Pages reclaimed:          %Ld (%Ld/s)\n", fPagesReclaimed,
+		(fPagesReclaimed - lastPagesReclaimed) * 1000000 / interval);
+	printf("Pages written back:       %Ld\n", fPagesWrittenBack);
+	printf("Waits for busy pages:     %Ld\n", fBusyPageWaits);
+	printf("\n");
+	printf("Free blocks     ");
+	for (int order = 0; order <= kMaxPageOrder; order++)
+		printf("%5dk", (PAGE_SIZE << order) / 1024);
+
+	printf("\n");
+	static const char *kZoneNames[kPageZoneCount] = { "DMA zone:", "Normal zone:", "High zone:" };
+	for (int zone = 0; zone < kPageZoneCount; zone++) {
+		printf("  %-14s", kZoneNames[zone]);
+		for (int order = 0; order <= kMaxPageOrder; order++)
+			printf("%6d", fFreeLists[zone][order].CountItems());
+
+		printf("\n");
+	}
+
+	lastStatsTime = now;
+	lastPagesScanned = fPagesScanned;
+	lastPagesReclaimed = fPagesReclaimed;
 }
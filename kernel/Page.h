@@ -20,6 +20,19 @@
 
 #include "Lock.h"
 #include "Queue.h"
+#include "Spinlock.h"
+
+/// Ranges of physical memory, for devices that can't address all of it
+enum PageZone {
+	kPageZoneDma,		///< Below 16MB, which the ISA DMA controller can address
+	kPageZoneNormal,	///< Below 4GB, which 32-bit devices can address
+	kPageZoneHigh		///< Anywhere in memory
+};
+
+const int kPageZoneCount = 3;
+
+/// Free memory is kept in blocks of 2^order pages, up to this order (4MB)
+const int kMaxPageOrder = 10;
 
 /// Architecture dependent abstraction for a physical page frame.
 class Page : public QueueNode {
@@ -28,15 +41,34 @@ public:
 	/// it can't be paged out by other threads.
 	/// @note this doesn't acquire a blocking lock, it just sets
 	/// the pages state so other threads will leave it alone
-	static Page* LockPage(unsigned int pa);
+	static Page* LockPage(paddr_t pa);
 
 	/// Get the physical address for this page, in bytes
-	unsigned int GetPhysicalAddress() const;
+	paddr_t GetPhysicalAddress() const;
 
 	/// Allocate an unused page.  This may block if pages need to be swapped out.
 	/// @param clear If this is true, the page will be zeroed out
 	static Page* Alloc(bool clear = false);
 
+	/// Allocate a page without blocking, for speculative uses like reading ahead.
+	/// This fails if memory is running low, so it doesn't cause pages to be
+	/// paged out.  The page is returned busy and is not cleared.
+	/// @returns The page, or 0 if none could be allocated
+	static Page* TryAlloc();
+
+	/// Allocate 2^order physically contiguous pages, for buffers that devices
+	/// access with DMA.  The block is aligned to its size, so a block of 64k or
+	/// less doesn't cross a 64k boundary.  The pages are wired and not cleared.
+	/// This doesn't block.
+	/// @param zone The block is taken from this zone or a lower one
+	/// @returns Physical address of the first page, or INVALID_PAGE if there
+	///   is no free block that large
+	static paddr_t AllocContiguous(int order, PageZone zone = kPageZoneNormal);
+
+	/// Free a block allocated with AllocContiguous.  It is merged with adjacent
+	/// free blocks.
+	static void FreeContiguous(paddr_t pa, int order);
+
 	/// Move this page to the free list
 	void Free();
 
@@ -49,57 +81,94 @@ public:
 	/// @returns true if this page is busy
 	inline bool IsBusy() const;
 
+	/// Block until this page is not busy.  This returns right away if it isn't.
+	/// The page may have been freed or reused by the time this returns, so the
+	/// caller must look it up again.
+	void WaitUntilNotBusy();
+
 	/// Lock this page into place so it can't be swapped
 	void Wire();
 
 	/// Unlock this page so it can be swapped if needed
 	void Unwire();
 
-	/// Get the total number of free pages
+	/// Note that this page has been used.  If it is inactive, it is moved back
+	/// to the active list so it won't be paged out.
+	void Reference();
+
+	/// Called by the physical map when it maps a page at some virtual address.
+	/// A page can't be paged out while it is mapped anywhere.
+	/// @param pa Physical address that was mapped.  Addresses past the end of
+	///   memory are ignored.
+	static void AddMapping(paddr_t pa);
+
+	/// Called by the physical map when it unmaps a page.
+	/// @param modified true if the page was written through this mapping.  It
+	///   will be written back to its backing store before it is reused.
+	static void RemoveMapping(paddr_t pa, bool modified);
+
+	/// Get the total number of free pages, including ones that have been cleared
 	static int CountFreePages();
 
 	/// Get the total size of memory in bytes
-	static inline unsigned int GetMemSize();
+	static inline uint64 GetMemSize();
 
 	/// Called at boot time to initialize strutures
 	static void Bootstrap();
 
-	/// Start the low priority thread that erases pages in the background
+	/// Start clearing free pages in the background.  This is done by an idle
+	/// priority work item, which is queued again whenever pages are freed.
 	static void StartPageEraser();
-
 	/// Mark a specific physical address used (used during initialization to mark
 	/// pages that have been preallocated by the bootloader)
-	static void MarkUsed(unsigned int pa);
+	static void MarkUsed(paddr_t pa);
 
 private:
 	enum PageState {
 		kPageFree,
 		kPageTransition,
 		kPageActive,
+		kPageInactive,
 		kPageWired,
-		kPageClear
+		kPageClear,
+		kPageReserved	// Not memory, like the hole below 4GB.  Never changes.
 	};
 
+	/// Change the state of this page and move it to the matching queue.
+	/// fPageLock must be held.
 	void MoveToQueue(PageState);
-	static int PageEraser(void*);
+	static Page* TakeFreePage(bool clear);
+	static Page* FindFreeBlock(int order, PageZone zone);
+	void InsertFreePage();
+	void RemoveFreePage();
+	static void ReleaseClearPages();
+	static void ClearFreePages();
+	static void PageOut();
+	static int DeactivatePages(int count);
+	static int ReclaimInactivePages(int count, bool writeDirty);
 	static void PrintStats(int, const char**);
 
-	Page *fHashNext;
 	class PageCache *fCache;
 	off_t fCacheOffset;
-	Page *fCacheNext;
-	Page **fCachePrev;
+	bool fDirty;	// Was modified through a mapping that has been removed
+	bool fReferenced;	// Used since the page-out daemon last looked at it
+	volatile int fMapCount;
 	volatile PageState fState;
+	signed char fOrder;	// If this heads a free block, its order.  Otherwise -1.
 
 	static class Semaphore fFreePagesAvailable;
+	static Spinlock fPageLock;
 	static Page *fPages;
-	static Queue fFreeQueue;
+	static Queue fFreeLists[kPageZoneCount][kMaxPageOrder + 1];
 	static Queue fActiveQueue;
+	static Queue fInactiveQueue;
 	static Queue fClearQueue;
 	static int fPageCount;
+	static int fReservedCount;
 	static int fFreeCount;
 	static int fTransitionCount;
 	static int fActiveCount;
+	static int fInactiveCount;
 	static int fWiredCount;
 	static int fClearCount;
 
@@ -109,14 +178,23 @@ private:
 	static int64 fClearPagesRequested;
 	static int64 fClearPageHits;
 	static int64 fClearPagesUsedAsFree;
+	static int64 fBusyPageWaits;
 
+	// Page-out statistics
+	static int64 fPageOutRuns;
+	static int64 fPagesScanned;
+	static int64 fPagesDeactivated;
+	static int64 fPagesReclaimed;
+	static int64 fPagesWrittenBack;
 
 	friend class PageCache;
+	friend class PageEraser;
+	friend class PageOutDaemon;
 };
 
-inline unsigned int Page::GetMemSize()
+inline uint64 Page::GetMemSize()
 {
-	return fPageCount * PAGE_SIZE;
+	return static_cast<uint64>(fPageCount - fReservedCount) * PAGE_SIZE;
 }
 
 inline bool Page::IsBusy() const
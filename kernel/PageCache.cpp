@@ -21,19 +21,55 @@
 #include "Page.h"
 #include "PageCache.h"
 #include "PhysicalMap.h"
+#include "Slab.h"
+#include "Spinlock.h"
 #include "stdio.h"
 #include "string.h"
 #include "SwapSpace.h"
 #include "syscall.h"
 
-Page** PageCache::fPageHash = 0;
-int PageCache::fPageHashSize = 0;
-Mutex PageCache::fCacheLock;
+// Tags for pages in fPageTree
+const int kPageTagDirty = 0;
+const int kPageTagBusy = 1;
+const int kPageTagUnread = 2;	// Waiting for the read ahead worker
+const int kPageTagReadAhead = 3;	// Looking this up starts the next window
+
+// Sizes of read ahead windows, in pages.  The window doubles each time a
+// sequential reader reaches it.
+const int kMinReadAheadPages = 4;
+const int kMaxReadAheadPages = 64;
+
+// Holds the place of a busy page in CollectResidentPages, so a source cache
+// doesn't fill it in.
+static Page* const kBusyPageSlot = reinterpret_cast<Page*>(1);
+
+List PageCache::fCaches;
+Spinlock PageCache::fCacheListLock;
+int PageCache::fReadAheadWindows = 0;
+int PageCache::fPagesReadAhead = 0;
+static WorkQueue readAheadQueue("read ahead", kWorkPriorityNormal);
+static SlabCache pageCacheCache("page cache", sizeof(PageCache));
+
+ReadAheadWorker::ReadAheadWorker(PageCache *cache)
+	:	fCache(cache)
+{
+}
+
+void ReadAheadWorker::Run()
+{
+	fCache->ReadQueuedPages();
+}
+
+void* PageCache::operator new(size_t size)
+{
+	return pageCacheCache.AllocInstance(size);
+}
 
 PageCache::PageCache(BackingStore *backingStore, PageCache *copyCache)
 	:	fSourceCache(copyCache),
-		fResidentPages(0),
-		fRefCount(0)
+		fRefCount(0),
+		fReadAheadWorker(this),
+		fReadAheadQueued(false)
 {
 	if (copyCache)
 		copyCache->AcquireRef();
@@ -42,23 +78,38 @@ PageCache::PageCache(BackingStore *backingStore, PageCache *copyCache)
 		fBackingStore = backingStore;
 	else
 		fBackingStore = new SwapSpace;
+
+	cpu_flags fl = fCacheListLock.Lock();
+	fCaches.AddToTail(this);
+	fCacheListLock.Unlock(fl);
 }
 
 PageCache::~PageCache()
 {
 	ASSERT(fRefCount == 0);
+
+	cpu_flags fl = fCacheListLock.Lock();
+	fCaches.Remove(this);
+	fCacheListLock.Unlock(fl);
 	
-	fCacheLock.Lock();
-	while (fResidentPages) {
-		Page *page = fResidentPages;
-		RemovePage(page);
-		page->Free();
+	fLock.Lock();
+	for (;;) {
+		void *pages[16];
+		int count = fPageTree.Gather(0, pages, 16);
+		if (count == 0)
+			break;
+
+		for (int i = 0; i < count; i++) {
+			Page *page = static_cast<Page*>(pages[i]);
+			RemovePage(page);
+			page->Free();
+		}
 	}
 
 	if (fSourceCache)
 		fSourceCache->ReleaseRef();
 
-	fCacheLock.Unlock();
+	fLock.Unlock();
 
 	delete fBackingStore;
 }
@@ -66,107 +117,362 @@ PageCache::~PageCache()
 Page* PageCache::GetPage(off_t offset, bool privateCopy)
 {
 	Page *page = 0;
-	fCacheLock.Lock();
-
-	// Check to see if this page is in memory.
+	ReadAheadState *readAhead = fBackingStore->GetReadAheadState();
+	fLock.Lock();
 	for (;;) {
+		// Check to see if this page is in memory.
 		page = LookupPage(offset);
-		if (page == 0 || !page->IsBusy())
+		if (page && page->IsBusy()) {
+			// This page is busy, wait for it and try again.
+			fLock.Unlock();
+			page->WaitUntilNotBusy();
+			fLock.Lock();
+			continue;
+		}
+
+		if (page) {
+			if (readAhead)
+				UpdateReadAhead(readAhead, offset / PAGE_SIZE, false);
+
 			break;
+		}
 
-		// This page is busy, loop and try again.
-		fCacheLock.Unlock();
-		sleep(2000);
-		fCacheLock.Lock();
-	}
+		if (fBackingStore && fBackingStore->HasPage(offset)) {
+			// Check to see if the backing store has a copy.
+			page = AllocPage(offset, false);
+			if (page == 0)
+				continue;
+
+			page->SetBusy();
+			InsertPage(offset, page);
+
+			// Queue the following pages before this one is read, so the reads
+			// overlap with this thread using the page.
+			if (readAhead)
+				UpdateReadAhead(readAhead, offset / PAGE_SIZE, true);
+
+			fLock.Unlock();
+			char *va = PhysicalMap::LockPhysicalPage(page->GetPhysicalAddress());
+			status_t err = fBackingStore->Read(offset, va);
+			PhysicalMap::UnlockPhysicalPage(va);
+			fLock.Lock();
+			if (err < E_NO_ERROR) {
+				RemovePage(page);
+				page->Free();
+				page = 0;
+			} else {
+				SetNotBusy(page);
+				break;
+			}
+		}
 
-	if (page == 0 && fBackingStore && fBackingStore->HasPage(offset)) {
-		// Check to see if the backing store has a copy.
-		page = Page::Alloc();
-		page->SetBusy();
-		InsertPage(offset, page);
+		if (privateCopy) {
+			// Check to see if this is a private copy.
+			page = AllocPage(offset, false);
+			if (page == 0)
+				continue;
+
+			page->SetBusy();
+			InsertPage(offset, page);
+
+			// The copy doesn't match anything on the backing store yet.
+			page->fDirty = true;
+			fPageTree.SetTag(offset / PAGE_SIZE, kPageTagDirty);
+
+			fLock.Unlock();
+			Page *sourcePage = fSourceCache->GetPage(offset, false);
+			fLock.Lock();
+
+			if (sourcePage) {
+				// Copy this page.  Note that the source page will never be busy.
+				PhysicalMap::CopyPage(page->GetPhysicalAddress(), sourcePage->GetPhysicalAddress());
+				SetNotBusy(page);
+				break;
+			}
 
-		fCacheLock.Unlock();
-		char *va = PhysicalMap::LockPhysicalPage(page->GetPhysicalAddress());
-		status_t err = fBackingStore->Read(offset, va);
-		PhysicalMap::UnlockPhysicalPage(va);
-		fCacheLock.Lock();
-		if (err < E_NO_ERROR) {
 			RemovePage(page);
 			page->Free();
 			page = 0;
-		} else
-			page->SetNotBusy();
-	}
+		}
+
+		if (fSourceCache) {
+			// Get the page and use it as a shared (read-only) page.
+			// Insert a dummy page at this virtual address to handle
+			// collided page faults.  This will be removed and replaced
+			// with the actual page.  Other threads will wake and find
+			// the new page.
+			Page *dummy = AllocPage(offset, false);
+			if (dummy == 0)
+				continue;
+
+			dummy->SetBusy();
+			InsertPage(offset, dummy);
+			fLock.Unlock();
+			page = fSourceCache->GetPage(offset, false);
+			fLock.Lock();
+			RemovePage(dummy);
+			dummy->Free();
+			break;
+		}
+
+		// Anonymous page.  Zero it out.
+		page = AllocPage(offset, true);
+		if (page == 0)
+			continue;
 
-	if (page == 0 && privateCopy) {
-		// Check to see if this is a private copy.
-		page = Page::Alloc();
-		page->SetBusy();
 		InsertPage(offset, page);
+		SetNotBusy(page);
+		break;
+	}
 
-		fCacheLock.Unlock();
-		Page *sourcePage = fSourceCache->GetPage(offset, false);
-		fCacheLock.Lock();
+	if (page)
+		page->Reference();
 
-		if (sourcePage) {
-			// Copy this page.  Note that the source page will never be busy.
-			PhysicalMap::CopyPage(page->GetPhysicalAddress(), sourcePage->GetPhysicalAddress());
-			page->SetNotBusy();
-		} else {
-			RemovePage(page);
-			page->Free();
-			page = 0;
+	fLock.Unlock();
+	return page;
+}
+
+int PageCache::GetResidentPages(off_t offset, Page *pages[], int count)
+{
+	for (int i = 0; i < count; i++)
+		pages[i] = 0;
+
+	fLock.Lock();
+	int found = CollectResidentPages(offset / PAGE_SIZE, pages, count);
+	fLock.Unlock();
+	for (int i = 0; i < count; i++) {
+		if (pages[i] == kBusyPageSlot)
+			pages[i] = 0;
+	}
+
+	return found;
+}
+
+// Fill in the empty slots of pages from this cache, then from the source cache.
+// Pages in a copy are private and take precedence over the source.  A busy page
+// in a copy may be a private copy that is still being made, so its slot is left
+// empty rather than taking the page from the source.  The caller holds fLock.
+int PageCache::CollectResidentPages(unsigned int start, Page *pages[], int count)
+{
+	int found = 0;
+	int filled = 0;
+	unsigned int index = start;
+	unsigned int end = start + count;
+	while (index < end) {
+		void *items[8];
+		int gathered = fPageTree.Gather(index, items, 8);
+		if (gathered == 0)
+			break;
+
+		for (int i = 0; i < gathered; i++) {
+			Page *page = static_cast<Page*>(items[i]);
+			index = page->fCacheOffset / PAGE_SIZE;
+			if (index >= end)
+				break;
+
+			// A page that starts the next read ahead window is left out, so
+			// the reader faults on it.
+			if (pages[index - start] == 0 && !fPageTree.IsTagged(index, kPageTagReadAhead)) {
+				if (page->IsBusy())
+					pages[index - start] = kBusyPageSlot;
+				else {
+					pages[index - start] = page;
+					page->Reference();
+					found++;
+				}
+			}
+
+			index++;
+			filled++;
 		}
 	}
-	
-	if (page == 0 && fSourceCache) {
-		// Get the page and use it as a shared (read-only) page. 
-		// Insert a dummy page at this virtual address to handle
-		// collided page faults.  This will be removed and replaced
-		// with the actual page.  Other threads will wake and find
-		// the new page.
-		Page *dummy = Page::Alloc();
-		dummy->SetBusy();
-		InsertPage(offset, dummy);
-		fCacheLock.Unlock();
-		page = fSourceCache->GetPage(offset, false);
-		fCacheLock.Lock();
-		RemovePage(dummy);
-		dummy->Free();
+
+	if (fSourceCache && filled < count) {
+		// The lock order is always from a copy to its source.
+		fSourceCache->fLock.Lock();
+		found += fSourceCache->CollectResidentPages(start, pages, count);
+		fSourceCache->fLock.Unlock();
 	}
-	
-	if (page == 0) {
-		// Anonymous page.  Zero it out.  Insert a dummy page as above.
-		page = Page::Alloc(true);
+
+	return found;
+}
+
+// Called with fLock held for each page that is looked up in a cache that reads
+// ahead.  A miss that continues a sequential scan starts a window of pages after
+// it, and looking up the first page of that window starts the next one, so the
+// reader doesn't miss again as long as it stays sequential.
+void PageCache::UpdateReadAhead(ReadAheadState *state, unsigned int index, bool miss)
+{
+	if (miss) {
+		if (index == 0 || index == state->fLastIndex || index == state->fLastIndex + 1) {
+			StartReadAhead(state, index + 1, state->fWindowSize == 0 ? kMinReadAheadPages
+				: MIN(state->fWindowSize * 2, kMaxReadAheadPages));
+		} else
+			state->fWindowSize = 0;	// Random access
+	} else if (fPageTree.IsTagged(index, kPageTagReadAhead)) {
+		fPageTree.ClearTag(index, kPageTagReadAhead);
+		if (index == state->fWindowStart && state->fWindowSize > 0) {
+			StartReadAhead(state, index + state->fWindowSize,
+				MIN(state->fWindowSize * 2, kMaxReadAheadPages));
+		}
+	}
+
+	state->fLastIndex = index;
+}
+
+// Add busy placeholder pages for a window and queue them to be read by the
+// worker.  Called with fLock held.
+void PageCache::StartReadAhead(ReadAheadState *state, unsigned int start, int size)
+{
+	state->fWindowStart = start;
+	state->fWindowSize = size;
+	int queued = 0;
+	for (int i = 0; i < size; i++) {
+		off_t offset = static_cast<off_t>(start + i) * PAGE_SIZE;
+		if (!fBackingStore->HasPage(offset))
+			break;
+
+		if (LookupPage(offset))
+			continue;
+
+		// Only pages that are already free are used.  Paging out data that is
+		// in use to make room for data that may not be isn't worth it.
+		Page *page = Page::TryAlloc();
+		if (page == 0)
+			break;
+
 		InsertPage(offset, page);
-		page->SetNotBusy();
+		fPageTree.SetTag(start + i, kPageTagUnread);
+		queued++;
 	}
 
-	fCacheLock.Unlock();
-	return page;
+	fPageTree.SetTag(start, kPageTagReadAhead);
+	if (queued == 0)
+		return;
+
+	AtomicAdd(&fReadAheadWindows, 1);
+	AtomicAdd(&fPagesReadAhead, queued);
+	if (!fReadAheadQueued) {
+		fReadAheadQueued = true;
+		AcquireRef();
+		readAheadQueue.Enqueue(&fReadAheadWorker);
+	}
 }
 
-// This assumes that the cache lock and queue lock is already taken.
-void PageCache::StealPage(Page *page, bool modified)
+// Read pages that have been queued by StartReadAhead.  Threads that look them up
+// in the meantime wait for them like any other busy page.
+void PageCache::ReadQueuedPages()
 {
-	RemovePage(page);
-	if (modified) {
-		// Page has been modified, write back
-		fCacheLock.Unlock();
+	fLock.Lock();
+	for (;;) {
+		void *item;
+		if (fPageTree.Gather(0, &item, 1, kPageTagUnread) == 0)
+			break;
+
+		Page *page = static_cast<Page*>(item);
+		fPageTree.ClearTag(page->fCacheOffset / PAGE_SIZE, kPageTagUnread);
+		fLock.Unlock();
+		char *va = PhysicalMap::LockPhysicalPage(page->GetPhysicalAddress());
+		status_t err = fBackingStore->Read(page->fCacheOffset, va);
+		PhysicalMap::UnlockPhysicalPage(va);
+		fLock.Lock();
+		if (err < E_NO_ERROR) {
+			// A thread that needs this page will read it again and report
+			// the error.
+			RemovePage(page);
+			page->Free();
+		} else
+			SetNotBusy(page);
+	}
+
+	fReadAheadQueued = false;
+	fLock.Unlock();
+	ReleaseRef();
+}
+
+bool PageCache::ReclaimPage(Page *page, bool writeDirty)
+{
+	// Find the cache that owns this page.  If the page is still inactive, the
+	// cache hasn't been deleted, since that frees its pages, which requires the
+	// page lock.  The reference keeps the cache around after the page lock is
+	// released.  If the cache is already being deleted, its pages will be freed
+	// anyway.
+	cpu_flags fl = Page::fPageLock.Lock();
+	PageCache *cache = page->fCache;
+	if (page->fState != Page::kPageInactive || cache == 0 || !cache->TryAcquireRef()) {
+		Page::fPageLock.Unlock(fl);
+		return false;
+	}
+
+	Page::fPageLock.Unlock(fl);
+
+	// Check the page again with the cache locked, which keeps it from being
+	// looked up.
+	cache->fLock.Lock();
+	fl = Page::fPageLock.Lock();
+	bool reclaim = false;
+	if (page->fState != Page::kPageInactive || page->fCache != cache) {
+		// It has been reactivated or freed in the meantime.
+	} else if (page->fMapCount > 0 || page->fReferenced)
+		page->MoveToQueue(Page::kPageActive);
+	else if (!page->fDirty || writeDirty) {
+		page->MoveToQueue(Page::kPageTransition);
+		cache->fPageTree.SetTag(page->fCacheOffset / PAGE_SIZE, kPageTagBusy);
+		reclaim = true;
+	}
+
+	Page::fPageLock.Unlock(fl);
+	if (reclaim && page->fDirty) {
+		// The page is busy, so threads that look it up will wait rather than
+		// read stale data from the backing store.
+		cache->fLock.Unlock();
 		const char *va = PhysicalMap::LockPhysicalPage(page->GetPhysicalAddress());
-		status_t err = fBackingStore->Write(page->fCacheOffset, va);
-		if (err < 0)
-			panic("error writing back page");
-			
+		status_t err = cache->fBackingStore->Write(page->fCacheOffset, va);
 		PhysicalMap::UnlockPhysicalPage(va);
-		fCacheLock.Lock();
+		cache->fLock.Lock();
+		if (err < E_NO_ERROR) {
+			// The backing store can't be written (for example, the file
+			// system is read only).  Leave the page in the cache.
+			cache->SetNotBusy(page);
+			reclaim = false;
+		} else
+			Page::fPagesWrittenBack++;
 	}
+
+	if (reclaim)
+		cache->RemovePage(page);
+
+	cache->fLock.Unlock();
+	cache->ReleaseRef();
+	if (reclaim)
+		page->Free();
+
+	return reclaim;
+}
+
+void PageCache::MarkDirty(Page *page)
+{
+	fLock.Lock();
+	if (page->fCache == this) {
+		page->fDirty = true;
+		fPageTree.SetTag(page->fCacheOffset / PAGE_SIZE, kPageTagDirty);
+	}
+
+	fLock.Unlock();
 }
 
-void PageCache::AcquireRef()
+// Take a reference unless the count has already dropped to zero, which means
+// the cache is being deleted.
+bool PageCache::TryAcquireRef()
 {
-	AtomicAdd(&fRefCount, 1);
+	for (;;) {
+		int count = fRefCount;
+		if (count == 0)
+			return false;
+
+		if (cmpxchg32(&fRefCount, count, count + 1))
+			return true;
+	}
 }
 
 void PageCache::ReleaseRef()
@@ -183,37 +489,39 @@ off_t PageCache::Commit(off_t size)
 
 void PageCache::Lock()
 {
-	fCacheLock.Lock();
+	fLock.Lock();
 }
 
 void PageCache::Unlock()
 {
-	fCacheLock.Unlock();
+	fLock.Unlock();
 }
 
 void PageCache::Bootstrap()
 {
-	const int kHashSizes[] = {
-		563, 2063, 4079, 8423, 16387, 32843, 65543, 131267, 262127, 0
-	};
-
-	int pageCount = Page::GetMemSize() / PAGE_SIZE;
-	for (const int *sz = kHashSizes; *sz != 0; sz++) {
-		fPageHashSize = *sz;
-		if (pageCount < *sz)
-			break;
-	}
-	
-	fPageHash = new Page*[fPageHashSize];
-	memset(fPageHash, 0, sizeof(Page*) * fPageHashSize);
-	AddDebugCommand("cachestat", "Page Cache Statistics", PageCache::HashStats);
+	AddDebugCommand("cachestat", "Page Cache Statistics", PageCache::PrintStats);
 }
 
 void PageCache::Print() const
 {
-	for (Page *page = fResidentPages; page; page = page->fCacheNext)
-		printf(" phys=%08x offset=%08x\n", page->GetPhysicalAddress(),
-			static_cast<int>(page->fCacheOffset));
+	void *pages[16];
+	unsigned int next = 0;
+	for (;;) {
+		int count = fPageTree.Gather(next, pages, 16);
+		if (count == 0)
+			break;
+
+		for (int i = 0; i < count; i++) {
+			const Page *page = static_cast<const Page*>(pages[i]);
+			printf(" phys=%08Lx offset=%08x%s%s\n", page->GetPhysicalAddress(),
+				static_cast<int>(page->fCacheOffset),
+				page->fDirty ? " dirty" : "", page->IsBusy() ? " busy" : "");
+		}
+
+		next = static_cast<const Page*>(pages[count - 1])->fCacheOffset / PAGE_SIZE + 1;
+		if (next == 0)
+			break;	// Wrapped
+	}
 
 	if (fSourceCache) {
 		printf("\nCopy cache %p refcnt=%d\n", fSourceCache, fSourceCache->fRefCount);
@@ -221,85 +529,100 @@ void PageCache::Print() const
 	}
 }
 
-int PageCache::GenerateHash(off_t offset) const
-{
-	return (((reinterpret_cast<int>(this) / sizeof(PageCache)) << 7)
-		| (static_cast<int>(offset) / PAGE_SIZE)) & 0x7fffffff;
-}
-
 void PageCache::InsertPage(off_t offset, Page *page)
 {
 	page->fCache = this;
 	page->fCacheOffset = offset;
+	page->fDirty = false;
+	unsigned int index = offset / PAGE_SIZE;
+	if (fPageTree.Insert(index, page) != E_NO_ERROR)
+		panic("PageCache::InsertPage: couldn't add page to tree");
 
-	// Insert the page into the hash table.
-	Page **bucket = &fPageHash[GenerateHash(offset) % fPageHashSize];
-	page->fHashNext = *bucket;
-	*bucket = page;
-
-	// Insert the page into this caches page list.
-	page->fCacheNext = fResidentPages;
-	page->fCachePrev = &fResidentPages;
-	if (page->fCacheNext)
-		page->fCacheNext->fCachePrev = &page->fCacheNext;
-	
-	fResidentPages = page;
+	if (page->IsBusy())
+		fPageTree.SetTag(index, kPageTagBusy);
 }
 
 void PageCache::RemovePage(Page *page)
 {
 	ASSERT(page->fCache == this);
-	Page **link = &fPageHash[GenerateHash(page->fCacheOffset) % fPageHashSize];
-	while (*link != page)
-		link = &((*link)->fHashNext);
+	fPageTree.Remove(page->fCacheOffset / PAGE_SIZE);
+	page->fCache = 0;
+}
 
-	*link = (*link)->fHashNext;	
+void PageCache::SetNotBusy(Page *page)
+{
+	page->SetNotBusy();
+	fPageTree.ClearTag(page->fCacheOffset / PAGE_SIZE, kPageTagBusy);
+}
 
-	page->fCache = 0;
-	*page->fCachePrev = page->fCacheNext;
-	if (page->fCacheNext)
-		page->fCacheNext->fCachePrev = page->fCachePrev;
+// Allocate a page to hold data for an offset.  The cache lock is released while
+// allocating, since the page-out daemon may need it to free pages.  If another
+// thread has added a page at the offset in the meantime, this returns 0.
+Page* PageCache::AllocPage(off_t offset, bool clear)
+{
+	fLock.Unlock();
+	Page *page = Page::Alloc(clear);
+	fLock.Lock();
+	if (LookupPage(offset)) {
+		page->Free();
+		return 0;
+	}
+
+	return page;
 }
 
 Page* PageCache::LookupPage(off_t offset) const
 {
-	for (Page *page = fPageHash[GenerateHash(offset) % fPageHashSize]; page;
-		page = page->fHashNext) {
-		if (page->fCache == this && page->fCacheOffset == offset)
-			return page;
+	return static_cast<Page*>(fPageTree.Lookup(offset / PAGE_SIZE));
+}
+
+int PageCache::CountTaggedPages(int tag) const
+{
+	void *pages[16];
+	unsigned int next = 0;
+	int total = 0;
+	for (;;) {
+		int count = fPageTree.Gather(next, pages, 16, tag);
+		total += count;
+		if (count < 16)
+			break;
+
+		next = static_cast<const Page*>(pages[count - 1])->fCacheOffset / PAGE_SIZE + 1;
+		if (next == 0)
+			break;	// Wrapped
 	}
 
-	return 0;
+	return total;
 }
 
-void PageCache::HashStats(int, const char*[])
+void PageCache::PrintStats(int, const char*[])
 {
-	const int kMaxCount = 11;
-	int counts[kMaxCount];
-	memset(counts, 0, kMaxCount * sizeof(int));
-	int totalCached = 0;
-
-	printf("Tabulating...\n");
-	for (int bucket = 0; bucket < fPageHashSize; bucket++) {
-		int chainLength = 0;
-		for (const Page *page = fPageHash[bucket]; page; page = page->fHashNext) {
-			chainLength++;
-			totalCached++;
-		}
-
-		if (chainLength >= kMaxCount)
-			counts[kMaxCount - 1]++;
-		else
-			counts[chainLength]++;
+	int heights[kMaxRadixHeight + 1];
+	memset(heights, 0, sizeof(heights));
+	int cacheCount = 0;
+	int pageCount = 0;
+	int nodeCount = 0;
+	int dirtyCount = 0;
+	int busyCount = 0;
+	for (const ListNode *node = fCaches.GetHead(); node; node = fCaches.GetNext(node)) {
+		const PageCache *cache = static_cast<const PageCache*>(node);
+		cacheCount++;
+		pageCount += cache->fPageTree.CountItems();
+		nodeCount += cache->fPageTree.CountNodes();
+		heights[cache->fPageTree.GetHeight()]++;
+		dirtyCount += cache->CountTaggedPages(kPageTagDirty);
+		busyCount += cache->CountTaggedPages(kPageTagBusy);
 	}
 
-	printf("Cached pages: %d\n", totalCached);
-	printf("Num buckets: %d\n", fPageHashSize);
-	printf("Load Factor %d.%3d%%\n", totalCached * 100 / fPageHashSize,
-		(totalCached * 100000 / fPageHashSize) % 1000);
-	printf("Chain Lengths:\n");
-	for (int length = 0; length < kMaxCount - 1; length++)
-		printf("%d: %d\n", length, counts[length]);
+	printf("Caches: %d\n", cacheCount);
+	printf("Cached pages: %d (%d dirty, %d busy)\n", pageCount, dirtyCount, busyCount);
+	printf("Tree nodes: %d\n", nodeCount);
+	if (nodeCount > 0)
+		printf("Pages per node: %d of %d\n", pageCount / nodeCount, kRadixFanout);
+
+	printf("Tree heights:\n");
+	for (int height = 0; height <= kMaxRadixHeight; height++)
+		printf("%d: %d\n", height, heights[height]);
 
-	printf("%d+: %d\n", kMaxCount - 1, counts[kMaxCount - 1]);
+	printf("Read ahead: %d windows, %d pages\n", fReadAheadWindows, fPagesReadAhead);
 }
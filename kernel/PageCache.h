@@ -18,20 +18,40 @@
 #ifndef _PAGE_CACHE_H
 #define _PAGE_CACHE_H
 
+#include "List.h"
+#include "Lock.h"
+#include "RadixTree.h"
+#include "Spinlock.h"
 #include "types.h"
+#include "WorkQueue.h"
 
 class BackingStore;
 class Page;
+class PageCache;
+struct ReadAheadState;
+
+/// Reads the pages that a cache has queued to be read ahead
+class ReadAheadWorker : public WorkItem {
+public:
+	ReadAheadWorker(PageCache*);
+	virtual void Run();
+
+private:
+	PageCache *fCache;
+};
 
 /// A PageCache represents a collection of physical memory pages that contain
 /// a subset of data from a BackingStore object.  In our model, all of physical memory
 /// is simply a cache of data stored on some backing store.  For example, parts of a
 /// file from a disk drive.
-class PageCache {
+class PageCache : private ListNode {
 public:
 	PageCache(BackingStore *backingStore = 0, PageCache *copyOf = 0);
 	~PageCache();
 
+	/// Page caches are allocated from a slab cache
+	void* operator new(size_t);
+
 	/// Return a physical Page that contains data from a specific offset in the backing store.
 	/// If a physical page already exists in memory that contains this data, it will be returned.
 	/// However, if there is no physical page, one will be allocated (potentially taken from
@@ -46,14 +66,29 @@ public:
 	/// @returns Page containing requested data
 	Page* GetPage(off_t offset, bool privateCopy = false);
 
-	/// The virtual memory system needs to reuse a page that is in this cache.  The cache
-	/// must relenquish ownership of this page.
-	/// @param page Page to be removed from this cache.  It necessarily will be a member of this
-	///    cache.
-	/// @param dirty true if the virtual memory detects that the contents have been modified since
-	///    GetPage was called.  If it is dirty, the page cache will inform the backing store that it should
-	///    write out the new version of the data.
-	void StealPage(Page *page, bool dirty);
+	/// Find pages that are already in memory, without reading anything from the
+	/// backing store or waiting for busy pages.  This is used to map the neighbours
+	/// of a faulting page.  For a copy, pages from the source cache are returned
+	/// where this cache doesn't have its own copy.
+	/// @param offset Offset of the first page in the backing store
+	/// @param pages Filled in with the page at each offset, or 0 if it is not resident
+	/// @param count Size of the pages array
+	/// @returns Number of pages that were found
+	int GetResidentPages(off_t offset, Page *pages[], int count);
+
+	/// The page-out daemon needs to reuse an inactive page.  Remove it from the cache
+	/// that owns it and free it.  If it has been modified, the backing store is asked to
+	/// write out the new version of the data first.
+	/// @param page An inactive page.  Its state is checked again with the cache locked,
+	///    and if it has been used since it was deactivated, it is made active instead.
+	/// @param writeDirty If this is false, modified pages are left alone.
+	/// @returns true if the page was freed
+	static bool ReclaimPage(Page *page, bool writeDirty);
+
+	/// Record that a page in this cache has been written to through a mapping, so
+	/// it will be written back before it is reclaimed.  Called by the physical map
+	/// when it removes a mapping that has the modified bit set.
+	void MarkDirty(Page *page);
 
 	/// Determine if this page cache is copy on write and receives unmodified pages from
 	/// another cache.
@@ -72,7 +107,8 @@ public:
 	off_t Commit(off_t size);
 
 	/// Prevent pages in this cache from being swapped in our out by other threads
-	/// This will block of other threads are interacting with the cache.
+	/// This will block of other threads are interacting with the cache.  Other
+	/// caches are not affected.
 	void Lock();
 
 	/// Opposite of lock
@@ -85,19 +121,45 @@ public:
 	void Print() const;
 
 private:
-	inline int GenerateHash(off_t) const;
 	void InsertPage(off_t, Page*);
 	void RemovePage(Page*);
+	void SetNotBusy(Page*);
+	Page* AllocPage(off_t, bool clear);
 	Page* LookupPage(off_t) const;
-	static void HashStats(int, const char**);
+	int CollectResidentPages(unsigned int start, Page *pages[], int count);
+	void UpdateReadAhead(ReadAheadState*, unsigned int index, bool miss);
+	void StartReadAhead(ReadAheadState*, unsigned int start, int size);
+	void ReadQueuedPages();
+	int CountTaggedPages(int tag) const;
+	bool TryAcquireRef();
+	static void PrintStats(int, const char**);
 
 	BackingStore *fBackingStore;
 	PageCache *fSourceCache;
-	Page *fResidentPages;
 	volatile int fRefCount;
-	static int fPageHashSize;
-	static Page **fPageHash;
-	static class Mutex fCacheLock;
+
+	/// Resident pages, indexed by page number in the backing store.  Pages are
+	/// tagged if they are dirty or busy.
+	RadixTree fPageTree;
+
+	/// Protects the page tree and serializes lookups, so only one thread loads
+	/// a given page.
+	Mutex fLock;
+
+	/// Reads pages tagged unread in the background.  While it is queued, it
+	/// holds a reference to this cache.
+	ReadAheadWorker fReadAheadWorker;
+	bool fReadAheadQueued;
+
+	/// All page caches, for cachestat
+	static List fCaches;
+	static Spinlock fCacheListLock;
+
+	// Read ahead statistics
+	static int fReadAheadWindows;
+	static int fPagesReadAhead;
+
+	friend class ReadAheadWorker;
 };
 
 inline bool PageCache::IsCopy() const
@@ -0,0 +1,293 @@
+// 
+// Copyright 1998-2012 Jeff Bush
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// 
+
+#include "KernelDebug.h"
+#include "RadixTree.h"
+#include "string.h"
+
+const unsigned int kRadixMask = kRadixFanout - 1;
+const int kTagWords = kRadixFanout / 32;
+
+struct RadixNode {
+	void *slots[kRadixFanout];	// Child nodes, or items in the bottom level
+
+	// A bit is set if the item in the slot is tagged or, in upper levels, if
+	// any item below the slot is.
+	unsigned int tags[kRadixTagCount][kTagWords];
+	int count;	// Number of slots in use
+};
+
+static inline int SlotAt(unsigned int index, int level)
+{
+	return (index >> (level * kRadixBits)) & kRadixMask;
+}
+
+// The largest index a tree of this height can hold
+static inline unsigned int MaxIndex(int height)
+{
+	if (height * kRadixBits >= 32)
+		return 0xffffffff;
+
+	return (1u << (height * kRadixBits)) - 1;
+}
+
+static inline bool TestTag(const RadixNode *node, int tag, int slot)
+{
+	return (node->tags[tag][slot / 32] & (1u << (slot % 32))) != 0;
+}
+
+static inline void SetTagBit(RadixNode *node, int tag, int slot)
+{
+	node->tags[tag][slot / 32] |= 1u << (slot % 32);
+}
+
+static inline void ClearTagBit(RadixNode *node, int tag, int slot)
+{
+	node->tags[tag][slot / 32] &= ~(1u << (slot % 32));
+}
+
+static inline bool AnyTagged(const RadixNode *node, int tag)
+{
+	for (int word = 0; word < kTagWords; word++) {
+		if (node->tags[tag][word])
+			return true;
+	}
+
+	return false;
+}
+
+RadixTree::RadixTree()
+	:	fRoot(0),
+		fHeight(0),
+		fItemCount(0),
+		fNodeCount(0)
+{
+}
+
+RadixTree::~RadixTree()
+{
+	ASSERT(fItemCount == 0);
+}
+
+status_t RadixTree::Insert(unsigned int index, void *item)
+{
+	ASSERT(item != 0);
+	if (fRoot == 0) {
+		fRoot = NewNode();
+		if (fRoot == 0)
+			return E_NO_MEMORY;
+
+		fNodeCount++;
+		fHeight = 1;
+	}
+
+	// Add levels on top until the index fits.  The old root becomes the first
+	// child of the new one.
+	while (index > MaxIndex(fHeight)) {
+		RadixNode *node = NewNode();
+		if (node == 0)
+			return E_NO_MEMORY;
+
+		fNodeCount++;
+		node->slots[0] = fRoot;
+		node->count = 1;
+		for (int tag = 0; tag < kRadixTagCount; tag++) {
+			if (AnyTagged(fRoot, tag))
+				SetTagBit(node, tag, 0);
+		}
+
+		fRoot = node;
+		fHeight++;
+	}
+
+	RadixNode *node = fRoot;
+	for (int level = fHeight - 1; level > 0; level--) {
+		int slot = SlotAt(index, level);
+		if (node->slots[slot] == 0) {
+			RadixNode *child = NewNode();
+			if (child == 0)
+				return E_NO_MEMORY;
+
+			fNodeCount++;
+			node->slots[slot] = child;
+			node->count++;
+		}
+
+		node = static_cast<RadixNode*>(node->slots[slot]);
+	}
+
+	int slot = SlotAt(index, 0);
+	if (node->slots[slot])
+		return E_ENTRY_EXISTS;
+
+	node->slots[slot] = item;
+	node->count++;
+	fItemCount++;
+	return E_NO_ERROR;
+}
+
+void* RadixTree::Remove(unsigned int index)
+{
+	RadixNode *path[kMaxRadixHeight];
+	if (!FindPath(index, path))
+		return 0;
+
+	int slot = SlotAt(index, 0);
+	void *item = path[0]->slots[slot];
+	path[0]->slots[slot] = 0;
+	path[0]->count--;
+	fItemCount--;
+	for (int tag = 0; tag < kRadixTagCount; tag++)
+		ClearTagBit(path[0], tag, slot);
+
+	// Free nodes that are now empty, and update the tags of parents whose
+	// children no longer have tagged items.
+	for (int level = 0; level < fHeight - 1; level++) {
+		RadixNode *parent = path[level + 1];
+		int parentSlot = SlotAt(index, level + 1);
+		if (path[level]->count == 0) {
+			delete path[level];
+			fNodeCount--;
+			parent->slots[parentSlot] = 0;
+			parent->count--;
+			for (int tag = 0; tag < kRadixTagCount; tag++)
+				ClearTagBit(parent, tag, parentSlot);
+		} else {
+			for (int tag = 0; tag < kRadixTagCount; tag++) {
+				if (!AnyTagged(path[level], tag))
+					ClearTagBit(parent, tag, parentSlot);
+			}
+		}
+	}
+
+	// Remove levels from the top that only lead to the first child.
+	while (fHeight > 1 && fRoot->count == 1 && fRoot->slots[0]) {
+		RadixNode *child = static_cast<RadixNode*>(fRoot->slots[0]);
+		delete fRoot;
+		fNodeCount--;
+		fRoot = child;
+		fHeight--;
+	}
+
+	if (fRoot->count == 0) {
+		delete fRoot;
+		fNodeCount--;
+		fRoot = 0;
+		fHeight = 0;
+	}
+
+	return item;
+}
+
+void* RadixTree::Lookup(unsigned int index) const
+{
+	RadixNode *path[kMaxRadixHeight];
+	if (!FindPath(index, path))
+		return 0;
+
+	return path[0]->slots[SlotAt(index, 0)];
+}
+
+int RadixTree::Gather(unsigned int start, void *items[], int maxItems, int tag) const
+{
+	if (fRoot == 0 || start > MaxIndex(fHeight) || maxItems <= 0)
+		return 0;
+
+	return GatherNode(fRoot, fHeight - 1, start, items, maxItems, tag);
+}
+
+void RadixTree::SetTag(unsigned int index, int tag)
+{
+	RadixNode *path[kMaxRadixHeight];
+	if (!FindPath(index, path))
+		return;
+
+	for (int level = 0; level < fHeight; level++)
+		SetTagBit(path[level], tag, SlotAt(index, level));
+}
+
+void RadixTree::ClearTag(unsigned int index, int tag)
+{
+	RadixNode *path[kMaxRadixHeight];
+	if (!FindPath(index, path))
+		return;
+
+	// Parents stay tagged as long as some other child is.
+	for (int level = 0; level < fHeight; level++) {
+		ClearTagBit(path[level], tag, SlotAt(index, level));
+		if (AnyTagged(path[level], tag))
+			break;
+	}
+}
+
+bool RadixTree::IsTagged(unsigned int index, int tag) const
+{
+	RadixNode *path[kMaxRadixHeight];
+	if (!FindPath(index, path))
+		return false;
+
+	return TestTag(path[0], tag, SlotAt(index, 0));
+}
+
+RadixNode* RadixTree::NewNode()
+{
+	RadixNode *node = new RadixNode;
+	if (node)
+		memset(node, 0, sizeof(RadixNode));
+
+	return node;
+}
+
+// Fill in path with the node at each level that leads to an index, with the
+// bottom level at path[0].
+// @returns true if there is an item at the index
+bool RadixTree::FindPath(unsigned int index, RadixNode *path[]) const
+{
+	if (fRoot == 0 || index > MaxIndex(fHeight))
+		return false;
+
+	RadixNode *node = fRoot;
+	for (int level = fHeight - 1; level > 0; level--) {
+		path[level] = node;
+		node = static_cast<RadixNode*>(node->slots[SlotAt(index, level)]);
+		if (node == 0)
+			return false;
+	}
+
+	path[0] = node;
+	return node->slots[SlotAt(index, 0)] != 0;
+}
+
+int RadixTree::GatherNode(const RadixNode *node, int level, unsigned int start,
+	void *items[], int maxItems, int tag)
+{
+	int found = 0;
+	for (int slot = SlotAt(start, level); slot < kRadixFanout && found < maxItems; slot++) {
+		if (node->slots[slot] && (tag < 0 || TestTag(node, tag, slot))) {
+			if (level == 0)
+				items[found++] = node->slots[slot];
+			else {
+				found += GatherNode(static_cast<const RadixNode*>(node->slots[slot]),
+					level - 1, start, items + found, maxItems - found, tag);
+			}
+		}
+
+		// Only the first child searched starts partway through.
+		start = 0;
+	}
+
+	return found;
+}
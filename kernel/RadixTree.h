@@ -0,0 +1,105 @@
+// 
+// Copyright 1998-2012 Jeff Bush
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// 
+
+/// @file RadixTree.h
+///	Sparse array indexed by a 32 bit number
+
+#ifndef _RADIX_TREE_H
+#define _RADIX_TREE_H
+
+#include "types.h"
+
+const int kRadixBits = 6;
+const int kRadixFanout = 1 << kRadixBits;
+const int kRadixTagCount = 4;
+const int kMaxRadixHeight = (32 + kRadixBits - 1) / kRadixBits;
+
+struct RadixNode;
+
+/// A radix tree maps indices to pointers.  Each node uses kRadixBits bits of the
+/// index, and the tree only grows as tall as the largest index requires, so
+/// lookups take a handful of steps and dense ranges are stored compactly.  Each
+/// item also has kRadixTagCount tag bits.  Interior nodes record which of their
+/// children have tagged items, so tagged items can be found without visiting
+/// the rest.  This does no locking.
+class RadixTree {
+public:
+	RadixTree();
+
+	/// The tree must be empty when it is deleted
+	~RadixTree();
+
+	/// @returns
+	///   - E_NO_ERROR if the item was added
+	///   - E_ENTRY_EXISTS if there is already an item at this index
+	///   - E_NO_MEMORY if a node couldn't be allocated
+	status_t Insert(unsigned int index, void *item);
+
+	/// Remove an item and clear its tags
+	/// @returns the item that was at this index, or 0 if there wasn't one
+	void* Remove(unsigned int index);
+
+	/// @returns the item at this index, or 0 if there isn't one
+	void* Lookup(unsigned int index) const;
+
+	/// Find items in index order
+	/// @param start Only items at this index or above are returned
+	/// @param items Filled in with the items that were found
+	/// @param maxItems Size of the items array
+	/// @param tag If this is not -1, only items with this tag set are returned
+	/// @returns Number of items stored in items
+	int Gather(unsigned int start, void *items[], int maxItems, int tag = -1) const;
+
+	/// Set a tag on an item.  This does nothing if there is no item at the index.
+	void SetTag(unsigned int index, int tag);
+	void ClearTag(unsigned int index, int tag);
+	bool IsTagged(unsigned int index, int tag) const;
+
+	inline int CountItems() const;
+	inline int CountNodes() const;
+
+	/// @returns Number of levels of nodes, which is the number of steps needed
+	///   to look up an item
+	inline int GetHeight() const;
+
+private:
+	static RadixNode* NewNode();
+	bool FindPath(unsigned int index, RadixNode *path[]) const;
+	static int GatherNode(const RadixNode*, int level, unsigned int start, void *items[],
+		int maxItems, int tag);
+
+	RadixNode *fRoot;
+	int fHeight;
+	int fItemCount;
+	int fNodeCount;
+};
+
+inline int RadixTree::CountItems() const
+{
+	return fItemCount;
+}
+
+inline int RadixTree::CountNodes() const
+{
+	return fNodeCount;
+}
+
+inline int RadixTree::GetHeight() const
+{
+	return fHeight;
+}
+
+#endif
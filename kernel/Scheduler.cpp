@@ -14,83 +14,361 @@
 // limitations under the License.
 // 
 
+
 #include "cpu_asm.h"
+#include "Dispatcher.h"
+#include "KernelDebug.h"
 #include "Scheduler.h"
+#include "SchedulingClass.h"
 #include "Semaphore.h"
+#include "stdio.h"
 #include "string.h"
 #include "Thread.h"
 
-const int kQuantum = 8000;
+const bigtime_t kLoadBalanceInterval = 100000;
 
 Scheduler gScheduler;
 
+QuantumTimer::QuantumTimer()
+	:	fProcessor(0)
+{
+}
+
+void QuantumTimer::SetProcessor(Processor *processor)
+{
+	fProcessor = processor;
+}
+
+// This is called from the timer interrupt, which may occur on a different
+// processor than the one whose time slice has expired.
+InterruptStatus QuantumTimer::HandleTimeout()
+{
+	if (fProcessor == Processor::GetCurrentProcessor())
+		return kReschedule;
+
+	fProcessor->RequestReschedule();
+	return kHandledInterrupt;
+}
+
+InterruptStatus LoadBalanceTimer::HandleTimeout()
+{
+	gScheduler.fBalanceTimerPending = false;
+	return gScheduler.Balance();
+}
+
+RunQueue::RunQueue()
+	:	fReadyLevels(0),
+		fCount(0),
+		fLoad(0)
+{
+}
+
+void RunQueue::Enqueue(Thread *thread, bool atHead)
+{
+	int priority = thread->GetCurrentPriority();
+	fReadyLevels |= 1 << priority;
+	fCount++;
+	if (priority > 0)
+		fLoad++;
+
+	if (atHead)
+		fQueue[priority].AddToHead(thread);
+	else
+		fQueue[priority].Enqueue(thread);
+
+	thread->fRunQueue = this;
+}
+
+Thread* RunQueue::Dequeue()
+{
+	ASSERT(fReadyLevels != 0);
+	int priority = FindHighestSetBit(fReadyLevels);
+	Thread *thread = static_cast<Thread*>(fQueue[priority].GetHead());
+	RemoveFromLevel(thread, priority);
+	return thread;
+}
+
+void RunQueue::Remove(Thread *thread)
+{
+	ASSERT(thread->fRunQueue == this);
+	RemoveFromLevel(thread, thread->GetCurrentPriority());
+}
+
+Thread* RunQueue::Steal()
+{
+	// Check each non-empty level, from the highest priority down.
+	unsigned int levels = fReadyLevels & ~1;
+	while (levels) {
+		int priority = FindHighestSetBit(levels);
+		levels &= ~(1 << priority);
+		for (Thread *thread = static_cast<Thread*>(fQueue[priority].GetHead()); thread;
+			thread = static_cast<Thread*>(fQueue[priority].GetNext(thread))) {
+			if (thread->GetAffinity() == kAnyProcessor) {
+				RemoveFromLevel(thread, priority);
+				return thread;
+			}
+		}
+	}
+
+	return 0;
+}
+
+void RunQueue::RemoveFromLevel(Thread *thread, int priority)
+{
+	fQueue[priority].Remove(thread);
+	thread->fRunQueue = 0;
+	if (fQueue[priority].GetHead() == 0)
+		fReadyLevels &= ~(1 << priority);
+
+	fCount--;
+	if (priority > 0)
+		fLoad--;
+}
+
 Scheduler::Scheduler()
-	:	fReadyThreadCount(0),
-		fHighestReadyThread(0)
+	:	fBalancerEnabled(false),
+		fBalanceTimerPending(false),
+		fThreadsStolen(0),
+		fThreadsBalanced(0)
 {
+	for (int index = 0; index < kMaxProcessors; index++)
+		fQuantumTimer[index].SetProcessor(Processor::GetProcessor(index));
 }
 
 void Scheduler::Reschedule() 
 {
-	cpu_flags st = DisableInterrupts();
-	Thread *thread = Thread::GetRunningThread();
+	cpu_flags st = gDispatcherLock.Lock();
+	Processor *processor = Processor::GetCurrentProcessor();
+	RunQueue &runQueue = fRunQueue[processor->GetIndex()];
+	Thread *thread = processor->GetRunningThread();
 	if (thread->GetState() == kThreadRunning) {
-		if (fHighestReadyThread <= thread->GetCurrentPriority()
-			&& thread->GetQuantumUsed() < kQuantum) {
+		bigtime_t quantum = thread->GetSchedulingClass()->GetQuantum();
+		if (runQueue.GetHighestPriority() <= thread->GetCurrentPriority()
+			&& (quantum == 0 || thread->GetQuantumUsed() < quantum)) {
 			// This thread hasn't used its entire timeslice, and there
 			// isn't a higher priority thread ready to run.  Don't reschedule.
 			// Instead, continue running this thread.  Try to let the thread
 			// use its entire timeslice whenever possible for better performance.
-			RestoreInterrupts(st);
+			gDispatcherLock.Unlock(st);
 			return;
 		}
 
 		EnqueueReadyThread(thread);
 	}
 
-	CancelTimeout();	
-	if (fReadyThreadCount > 1)
-		SetTimeout(SystemTime() + kQuantum, kOneShotTimer);
+	Thread *nextThread = PickNextThread(processor->GetIndex());
+	QuantumTimer &quantumTimer = fQuantumTimer[processor->GetIndex()];
+	quantumTimer.CancelTimeout();
+	bigtime_t quantum = nextThread->GetSchedulingClass()->GetQuantum();
+	if (runQueue.GetCount() > 0 && quantum != 0)
+		quantumTimer.SetTimeout(SystemTime() + quantum, kOneShotTimer);
 
-	PickNextThread()->SwitchTo();
-	RestoreInterrupts(st);
+	// The dispatcher lock stays held during the switch.  This keeps other
+	// processors from picking up the thread being switched out before its state
+	// has been saved.  The thread that is switched to releases the lock, either
+	// here or in ThreadStartup if it is new.  The nesting depth is part of each
+	// thread's state, so it is saved and restored around the switch.
+	int lockDepth = gDispatcherLock.GetDepth();
+	nextThread->SwitchTo();
+	gDispatcherLock.SetDepth(lockDepth);
+	gDispatcherLock.Unlock(st);
 }
 
 void Scheduler::EnqueueReadyThread(Thread *thread)
 {
-	cpu_flags st = DisableInterrupts();
-	if (thread->GetSleepTime() > kQuantum * 4) {
-		// Boost this thread's priority if it has been blocked for a while
-		if (thread->GetCurrentPriority() < MIN(kMaxPriority, thread->GetBasePriority() + 3))
-			thread->SetCurrentPriority(thread->GetCurrentPriority() + 1);
-	} else {
-		// This thread has run for a while.  If it's priority was boosted,
-		// lower it back down.
-		if (thread->GetCurrentPriority() > thread->GetBasePriority())
-			thread->SetCurrentPriority(thread->GetCurrentPriority() - 1);
-	}
-	
-	if (thread->GetCurrentPriority() > fHighestReadyThread)
-		fHighestReadyThread = thread->GetCurrentPriority();
-		
-	fReadyThreadCount++;
+	cpu_flags st = gDispatcherLock.Lock();
+	SchedulingClass *schedulingClass = thread->GetSchedulingClass();
+	schedulingClass->ThreadReady(thread);
+
+	// A thread holding a mutex that a more important thread is waiting for
+	// runs at the waiter's priority until it releases it.
+	if (thread->GetCurrentPriority() < thread->GetInheritedPriority())
+		thread->SetCurrentPriority(thread->GetInheritedPriority());
+
+	// A thread that was preempted goes back on the queue of the processor
+	// it was running on.  Depending on its class, it may keep its place in line
+	// if it was preempted before its time slice expired.
+	bool wasRunning = thread->GetState() == kThreadRunning;
+	bool atHead = false;
+	int processorIndex;
+	if (wasRunning) {
+		processorIndex = Processor::GetCurrentProcessorIndex();
+		atHead = schedulingClass->IsRequeuedAtHead() && (schedulingClass->GetQuantum() == 0
+			|| thread->GetQuantumUsed() < schedulingClass->GetQuantum());
+	} else
+		processorIndex = ChooseProcessor(thread);
+
 	thread->SetState(kThreadReady);
-	fReadyQueue[thread->GetCurrentPriority()].Enqueue(thread);
-	RestoreInterrupts(st);
+	fRunQueue[processorIndex].Enqueue(thread, atHead);
+	if (fRunQueue[processorIndex].GetLoad() > 1)
+		StartBalanceTimer();
+
+	// The caller decides if the current processor should reschedule.  Another
+	// processor is interrupted if this thread should preempt what it is running.
+	Processor *processor = Processor::GetProcessor(processorIndex);
+	if (!wasRunning && processorIndex != Processor::GetCurrentProcessorIndex()
+		&& processor->GetRunningThread()
+		&& processor->GetRunningThread()->GetCurrentPriority() < thread->GetCurrentPriority())
+		processor->RequestReschedule();
+
+	gDispatcherLock.Unlock(st);
 }
 
-Thread *Scheduler::PickNextThread() 
+void Scheduler::SetPriority(Thread *thread, int priority)
 {
-	fReadyThreadCount--;
-	Thread *nextThread = static_cast<Thread*>(fReadyQueue[fHighestReadyThread].Dequeue());
-	while (fReadyQueue[fHighestReadyThread].GetHead() == 0)
-		fHighestReadyThread--;
+	cpu_flags st = gDispatcherLock.Lock();
+	RunQueue *runQueue = thread->fRunQueue;
+	if (runQueue == 0) {
+		// Running or waiting.  The new priority is used when it is next enqueued.
+		thread->SetCurrentPriority(priority);
+		gDispatcherLock.Unlock(st);
+		return;
+	}
 
-	ASSERT(nextThread);			
-	return nextThread;
+	runQueue->Remove(thread);
+	thread->SetCurrentPriority(priority);
+	runQueue->Enqueue(thread);
+	Processor *processor = Processor::GetProcessor(runQueue - fRunQueue);
+	if (processor != Processor::GetCurrentProcessor() && processor->GetRunningThread()
+		&& processor->GetRunningThread()->GetCurrentPriority() < priority)
+		processor->RequestReschedule();
+
+	gDispatcherLock.Unlock(st);
+}
+
+// This is called with interrupts disabled.  It doesn't take the dispatcher lock:
+// if another processor is changing the run queue, that processor will interrupt
+// this one if the thread it is adding should run here.
+bool Scheduler::ShouldPreempt() const
+{
+	Processor *processor = Processor::GetCurrentProcessor();
+	Thread *running = processor->GetRunningThread();
+	return running && fRunQueue[processor->GetIndex()].GetHighestPriority()
+		> running->GetCurrentPriority();
+}
+
+void Scheduler::ThreadStartup()
+{
+	gDispatcherLock.SetDepth(1);
+	gDispatcherLock.Unlock(DisableInterrupts());
+}
+
+void Scheduler::StartLoadBalancer()
+{
+	fBalancerEnabled = Processor::GetProcessorCount() > 1;
+
+	AddDebugCommand("runq", "Show per-processor run queues", PrintRunQueues);
+}
+
+Thread* Scheduler::PickNextThread(int processorIndex) 
+{
+	// If nothing but the idle thread is left, look for work that is
+	// waiting on the busiest processor.
+	RunQueue &runQueue = fRunQueue[processorIndex];
+	if (runQueue.GetLoad() == 0) {
+		RunQueue *busiest = 0;
+		for (int index = 0; index < Processor::GetProcessorCount(); index++) {
+			if (index != processorIndex && fRunQueue[index].GetLoad() > 0
+				&& (busiest == 0 || fRunQueue[index].GetLoad() > busiest->GetLoad()))
+				busiest = &fRunQueue[index];
+		}
+
+		if (busiest) {
+			Thread *thread = busiest->Steal();
+			if (thread) {
+				fThreadsStolen++;
+				return thread;
+			}
+		}
+	}
+
+	return runQueue.Dequeue();
+}
+
+// Threads stay on the processor they last ran on while it is running something
+// less important than them.  Otherwise, a processor running the lowest priority
+// thread below this one (usually an idle one) is chosen.
+int Scheduler::ChooseProcessor(Thread *thread)
+{
+	if (thread->GetAffinity() != kAnyProcessor)
+		return thread->GetAffinity();
+
+	int priority = thread->GetCurrentPriority();
+	int chosen = thread->GetLastProcessor();
+	Thread *running = Processor::GetProcessor(chosen)->GetRunningThread();
+	if (running == 0 || running->GetCurrentPriority() < priority)
+		return chosen;
+
+	int lowestPriority = priority;
+	for (int index = 0; index < Processor::GetProcessorCount(); index++) {
+		running = Processor::GetProcessor(index)->GetRunningThread();
+		if (running && running->GetCurrentPriority() < lowestPriority) {
+			lowestPriority = running->GetCurrentPriority();
+			chosen = index;
+		}
+	}
+
+	return chosen;
+}
+
+// Move a thread from the processor with the most queued work to the one with
+// the least.  This is called from the timer interrupt with the dispatcher
+// lock held.
+InterruptStatus Scheduler::Balance()
+{
+	int busiest = 0;
+	int idlest = 0;
+	for (int index = 1; index < Processor::GetProcessorCount(); index++) {
+		if (fRunQueue[index].GetLoad() > fRunQueue[busiest].GetLoad())
+			busiest = index;
+
+		if (fRunQueue[index].GetLoad() < fRunQueue[idlest].GetLoad())
+			idlest = index;
+	}
+
+	if (fRunQueue[busiest].GetLoad() > 1)
+		StartBalanceTimer();
+
+	if (fRunQueue[busiest].GetLoad() - fRunQueue[idlest].GetLoad() < 2)
+		return kHandledInterrupt;
+
+	Thread *thread = fRunQueue[busiest].Steal();
+	if (thread == 0)
+		return kHandledInterrupt;
+
+	fThreadsBalanced++;
+	fRunQueue[idlest].Enqueue(thread);
+	Processor *processor = Processor::GetProcessor(idlest);
+	if (processor->GetRunningThread()->GetCurrentPriority() >= thread->GetCurrentPriority())
+		return kHandledInterrupt;
+
+	if (processor == Processor::GetCurrentProcessor())
+		return kReschedule;
+
+	processor->RequestReschedule();
+	return kHandledInterrupt;
 }
 
-InterruptStatus Scheduler::HandleTimeout()
+// Called with the dispatcher lock held
+void Scheduler::StartBalanceTimer()
 {
-	return kReschedule;
+	if (fBalancerEnabled && !fBalanceTimerPending) {
+		fBalanceTimerPending = true;
+		fLoadBalanceTimer.SetTimeout(SystemTime() + kLoadBalanceInterval, kOneShotTimer);
+	}
+}
+
+void Scheduler::PrintRunQueues(int, const char**)
+{
+	printf("CPU Queued    Load Highest   Levels Running\n");
+	for (int index = 0; index < Processor::GetProcessorCount(); index++) {
+		const RunQueue &runQueue = gScheduler.fRunQueue[index];
+		Thread *running = Processor::GetProcessor(index)->GetRunningThread();
+		printf("%3d %6d %7d %7d %08x %s\n", index, runQueue.GetCount(),
+			runQueue.GetLoad(), runQueue.GetHighestPriority(), runQueue.GetReadyLevels(),
+			running ? running->GetName() : "");
+	}
+
+	printf("Threads stolen by idle processors: %d\n", gScheduler.fThreadsStolen);
+	printf("Threads moved by load balancer: %d\n", gScheduler.fThreadsBalanced);
 }
@@ -18,33 +18,154 @@
 #ifndef _SCHEDULER_H
 #define _SCHEDULER_H
 
+#include "cpu_asm.h"
+#include "Processor.h"
+#include "Queue.h"
 #include "Timer.h"
 #include "types.h"
 
+/// Priorities must fit in the bitmap of ready priority levels of a RunQueue
 const int kMaxPriority = 31;
 
 class Thread;
 
-/// The scheduler chooses which thread should run next
-class Scheduler : public Timer {
+/// Each processor has a timer that preempts the running thread when its time
+/// slice expires.
+class QuantumTimer : public Timer {
+public:
+	QuantumTimer();
+	void SetProcessor(Processor*);
+
+private:
+	InterruptStatus HandleTimeout();
+	Processor *fProcessor;
+};
+
+/// Moves threads from the processor with the most queued threads to the one
+/// with the fewest.  It is only armed while some queue has more than one thread
+/// waiting, so an idle system has no periodic timer interrupts.
+class LoadBalanceTimer : public Timer {
+private:
+	InterruptStatus HandleTimeout();
+};
+
+/// The threads that are ready to run on one processor, by priority.  A bit is
+/// set for each priority level that has threads, so the highest one can be
+/// found without scanning the levels.
+class RunQueue {
+public:
+	RunQueue();
+
+	/// @param atHead If true, the thread will be the next one run at its priority
+	void Enqueue(Thread*, bool atHead = false);
+
+	/// Remove the highest priority thread
+	Thread* Dequeue();
+
+	/// Remove a particular thread, which must be in this queue
+	void Remove(Thread*);
+
+	/// Remove the highest priority thread that may run on another processor.
+	/// Zero priority threads are never taken, since the processor taking the
+	/// thread would only run them if it has nothing else to do.
+	/// @returns the thread, or 0 if there aren't any that can be moved
+	Thread* Steal();
+
+	inline int GetHighestPriority() const;
+	inline int GetCount() const;
+
+	/// @returns a bitmap with bit n set if there are threads at priority n
+	inline unsigned int GetReadyLevels() const;
+
+	/// @returns the number of queued threads with a priority above zero.  This
+	///   doesn't count idle threads, so it is the amount of real work waiting.
+	inline int GetLoad() const;
+
+private:
+	void RemoveFromLevel(Thread*, int priority);
+
+	unsigned int fReadyLevels;
+	int fCount;
+	int fLoad;
+	Queue fQueue[kMaxPriority + 1];
+};
+
+/// The scheduler chooses which thread should run next.  Each processor has its
+/// own run queue.  A thread goes back to the queue of the processor it last ran on,
+/// where its working set is more likely to still be in the cache, unless that
+/// processor is busy with a more important thread and another one isn't.  A
+/// processor that runs out of work takes threads from the busiest queue, and a
+/// load balancer evens out the queues while any are backed up.  The run queues are protected
+/// by the dispatcher lock.
+class Scheduler {
 public:
 	Scheduler();
 
-	/// Pick the next thread that should be run and call SwitchTo on it.
+	/// Pick the next thread that should be run on this processor and call
+	/// SwitchTo on it.
 	void Reschedule();
 
-	/// Mark a thread ready to run and put it on the ready queue
+	/// Mark a thread ready to run and put it on a run queue.  If it should
+	/// preempt a thread running on another processor, that processor is interrupted.
 	void EnqueueReadyThread(Thread*);
 
+	/// Change the current priority of a thread.  This is used for priority
+	/// inheritance.  If the thread is ready, it is moved to the level of its run
+	/// queue for the new priority, and the processor that queue belongs to is
+	/// interrupted if the thread should now preempt what it is running.
+	void SetPriority(Thread*, int priority);
+
+	/// @returns true if a thread more important than the one running on this
+	///   processor is ready on its run queue.  The trap handler uses this to
+	///   decide whether an interrupt needs to reschedule.
+	bool ShouldPreempt() const;
+
+	/// A new thread starts running with the dispatcher lock held by the context
+	/// switch that started it.  It calls this to release the lock.  Interrupts
+	/// are still disabled when this returns.
+	void ThreadStartup();
+
+	/// Called once all processors are running to enable the load balancer.
+	void StartLoadBalancer();
+
 private:
-	Thread *PickNextThread();
-	InterruptStatus HandleTimeout();
+	Thread *PickNextThread(int processorIndex);
+	int ChooseProcessor(Thread*);
+	InterruptStatus Balance();
+	void StartBalanceTimer();
+	static void PrintRunQueues(int, const char**);
+
+	RunQueue fRunQueue[kMaxProcessors];
+	QuantumTimer fQuantumTimer[kMaxProcessors];
+	LoadBalanceTimer fLoadBalanceTimer;
+	bool fBalancerEnabled;
+	bool fBalanceTimerPending;
+	int fThreadsStolen;
+	int fThreadsBalanced;
 
-	int fReadyThreadCount;
-	int fHighestReadyThread;
-	Queue fReadyQueue[kMaxPriority + 1];
+	friend class LoadBalanceTimer;
 };
 
+inline int RunQueue::GetHighestPriority() const
+{
+	return fReadyLevels ? FindHighestSetBit(fReadyLevels) : 0;
+}
+
+inline unsigned int RunQueue::GetReadyLevels() const
+{
+	return fReadyLevels;
+}
+
+inline int RunQueue::GetCount() const
+{
+	return fCount;
+}
+
+inline int RunQueue::GetLoad() const
+{
+	return fLoad;
+}
+
 extern Scheduler gScheduler;
 
 #endif
@@ -0,0 +1,171 @@
+// 
+// Copyright 1998-2012 Jeff Bush
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// 
+
+
+#include "Scheduler.h"
+#include "SchedulingClass.h"
+#include "string.h"
+#include "Thread.h"
+
+const bigtime_t kQuantum = 8000;
+
+/// The default policy.  A thread that has been blocked for a while gets a small
+/// boost above its base priority, which decays as it runs.  Threads that do IO
+/// thus get good response time, without being able to starve threads that
+/// compute.  The current priority never drops below the base priority.
+class InteractiveClass : public SchedulingClass {
+public:
+	virtual void ThreadReady(Thread*);
+	virtual bigtime_t GetQuantum() const;
+	virtual bool IsRequeuedAtHead() const;
+	virtual bool IsRealTime() const;
+	virtual const char* GetName() const;
+};
+
+/// Fixed priority, with a time slice among threads of the same priority.
+class RoundRobinClass : public SchedulingClass {
+public:
+	virtual void ThreadReady(Thread*);
+	virtual bigtime_t GetQuantum() const;
+	virtual bool IsRequeuedAtHead() const;
+	virtual bool IsRealTime() const;
+	virtual const char* GetName() const;
+};
+
+/// Fixed priority.  A thread runs until it blocks or a higher priority thread
+/// becomes ready, and keeps its place in line if it is preempted.
+class FifoClass : public SchedulingClass {
+public:
+	virtual void ThreadReady(Thread*);
+	virtual bigtime_t GetQuantum() const;
+	virtual bool IsRequeuedAtHead() const;
+	virtual bool IsRealTime() const;
+	virtual const char* GetName() const;
+};
+
+static InteractiveClass interactiveClass;
+static RoundRobinClass roundRobinClass;
+static FifoClass fifoClass;
+
+void InteractiveClass::ThreadReady(Thread *thread)
+{
+	if (thread->GetSleepTime() > kQuantum * 4) {
+		// Boost this thread's priority if it has been blocked for a while
+		if (thread->GetCurrentPriority() < MIN(kMaxPriority, thread->GetBasePriority() + 3))
+			thread->SetCurrentPriority(thread->GetCurrentPriority() + 1);
+	} else {
+		// This thread has run for a while.  If it's priority was boosted,
+		// lower it back down.
+		if (thread->GetCurrentPriority() > thread->GetBasePriority())
+			thread->SetCurrentPriority(thread->GetCurrentPriority() - 1);
+	}
+
+	// The team may have switched from a real-time class.
+	if (thread->GetCurrentPriority() < thread->GetBasePriority())
+		thread->SetCurrentPriority(thread->GetBasePriority());
+}
+
+bigtime_t InteractiveClass::GetQuantum() const
+{
+	return kQuantum;
+}
+
+bool InteractiveClass::IsRequeuedAtHead() const
+{
+	return false;
+}
+
+bool InteractiveClass::IsRealTime() const
+{
+	return false;
+}
+
+const char* InteractiveClass::GetName() const
+{
+	return "interactive";
+}
+
+void RoundRobinClass::ThreadReady(Thread *thread)
+{
+	thread->SetCurrentPriority(thread->GetBasePriority());
+}
+
+bigtime_t RoundRobinClass::GetQuantum() const
+{
+	return kQuantum;
+}
+
+bool RoundRobinClass::IsRequeuedAtHead() const
+{
+	return false;
+}
+
+bool RoundRobinClass::IsRealTime() const
+{
+	return true;
+}
+
+const char* RoundRobinClass::GetName() const
+{
+	return "round robin";
+}
+
+void FifoClass::ThreadReady(Thread *thread)
+{
+	thread->SetCurrentPriority(thread->GetBasePriority());
+}
+
+bigtime_t FifoClass::GetQuantum() const
+{
+	return 0;
+}
+
+bool FifoClass::IsRequeuedAtHead() const
+{
+	return true;
+}
+
+bool FifoClass::IsRealTime() const
+{
+	return true;
+}
+
+const char* FifoClass::GetName() const
+{
+	return "fifo";
+}
+
+SchedulingClass* SchedulingClass::GetClass(int type)
+{
+	switch (type) {
+		case SCHED_INTERACTIVE:
+			return &interactiveClass;
+
+		case SCHED_ROUND_ROBIN:
+			return &roundRobinClass;
+
+		case SCHED_FIFO:
+			return &fifoClass;
+
+		default:
+			return 0;
+	}
+}
+
+SchedulingClass* SchedulingClass::GetDefaultClass()
+{
+	return &interactiveClass;
+}
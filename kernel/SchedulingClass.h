@@ -0,0 +1,59 @@
+// 
+// Copyright 1998-2012 Jeff Bush
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// 
+
+
+/// @file SchedulingClass.h
+#ifndef _SCHEDULING_CLASS_H
+#define _SCHEDULING_CLASS_H
+
+#include "types.h"
+
+class Thread;
+
+/// A scheduling class is the policy for a group of threads: how their priority
+/// changes as they run and block, and how long they may run before yielding to
+/// other threads of the same priority.  Each team selects a class, which is
+/// used for all of its threads.  All methods are called with the dispatcher
+/// lock held.
+class SchedulingClass {
+public:
+	/// Called when a thread becomes ready to run, before it is put on a
+	/// run queue.  This sets the current priority of the thread.
+	virtual void ThreadReady(Thread*) = 0;
+
+	/// @returns the number of microseconds a thread may run before another
+	///   ready thread of the same priority is run, or 0 if it runs until it
+	///   blocks or a higher priority thread is ready.
+	virtual bigtime_t GetQuantum() const = 0;
+
+	/// @returns true if a thread that is preempted by a higher priority thread
+	///   should run before the other threads at its priority level.
+	virtual bool IsRequeuedAtHead() const = 0;
+
+	/// @returns true if threads keep a fixed priority however long they run,
+	///   so they can keep lower priority threads from running.
+	virtual bool IsRealTime() const = 0;
+
+	virtual const char* GetName() const = 0;
+
+	/// @returns the class for a SchedulingClassType, or 0 if it is invalid.
+	static SchedulingClass* GetClass(int type);
+
+	/// @returns the class new teams use
+	static SchedulingClass* GetDefaultClass();
+};
+
+#endif
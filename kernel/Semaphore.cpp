@@ -31,13 +31,13 @@ Semaphore::Semaphore(const char name[], int initialCount)
 
 void Semaphore::Release(int releaseCount, bool reschedule)
 {
-	cpu_flags cs = DisableInterrupts();
+	cpu_flags cs = gDispatcherLock.Lock();
 	int oldCount = fCount;
 	fCount += releaseCount;
 	if (oldCount == 0)
 		Signal(reschedule);
 
-	RestoreInterrupts(cs);
+	gDispatcherLock.Unlock(cs);
 }
 
 void Semaphore::ThreadWoken()
@@ -0,0 +1,253 @@
+// 
+// Copyright 1998-2012 Jeff Bush
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// 
+
+#include "Alloc.h"
+#include "KernelDebug.h"
+#include "Slab.h"
+#include "stdio.h"
+#include "stdlib.h"
+
+const int kCacheLineSize = 32;
+
+// Empty slabs kept by each cache, so a cache whose usage goes up and down around
+// a slab boundary doesn't create and destroy a slab every time.
+const int kMaxEmptySlabs = 1;
+
+/// Header at the start of each slab page
+struct Slab : public ListNode {
+	SlabCache *fCache;
+	void *fFreeList;
+	int fInUse;
+};
+
+// Objects start on a cache line boundary after the header
+const size_t kSlabHeaderSize = (sizeof(Slab) + kCacheLineSize - 1) & ~(kCacheLineSize - 1);
+
+// Construct an object at a specific address
+inline void* operator new(size_t, void *where)
+{
+	return where;
+}
+
+SlabCache *SlabCache::fCacheList = 0;
+Spinlock SlabCache::fCacheListLock;
+
+SlabCache::SlabCache(const char name[], size_t objectSize, void (*constructor)(void*))
+	:	fName(name),
+		fNextColor(0),
+		fConstructor(constructor),
+		fEmptySlabCount(0),
+		fSlabCount(0),
+		fObjectsInUse(0),
+		fAllocCount(0)
+{
+	if (objectSize > kMaxSlabObjectSize)
+		panic("SlabCache: objects in %s are too large", name);
+
+	// The free list is threaded through free objects.  If objects are
+	// constructed, the link goes after the object so it doesn't overwrite
+	// the constructed state.
+	objectSize = (objectSize + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+	if (constructor) {
+		fLinkOffset = objectSize;
+		objectSize += sizeof(void*);
+	} else
+		fLinkOffset = 0;
+
+	// Don't let objects straddle more cache lines than needed.
+	if (objectSize >= kCacheLineSize)
+		fObjectSize = (objectSize + kCacheLineSize - 1) & ~(kCacheLineSize - 1);
+	else
+		fObjectSize = objectSize;
+
+	size_t usable = PAGE_SIZE - kSlabHeaderSize;
+	fObjectsPerSlab = usable / fObjectSize;
+	fColorCount = (usable - fObjectsPerSlab * fObjectSize) / kCacheLineSize + 1;
+
+	// Caches are usually static objects.  The list is a plain pointer so it
+	// doesn't depend on the order of static constructors.
+	cpu_flags fl = fCacheListLock.Lock();
+	fNextCache = fCacheList;
+	fCacheList = this;
+	fCacheListLock.Unlock(fl);
+}
+
+void* SlabCache::Alloc()
+{
+	cpu_flags fl = fLock.Lock();
+	for (;;) {
+		Slab *slab = static_cast<Slab*>(fPartialSlabs.GetHead());
+		if (slab == 0) {
+			slab = static_cast<Slab*>(fEmptySlabs.GetHead());
+			if (slab) {
+				fEmptySlabs.Remove(slab);
+				fPartialSlabs.AddToHead(slab);
+				fEmptySlabCount--;
+			}
+		}
+
+		if (slab) {
+			char *object = static_cast<char*>(slab->fFreeList);
+			slab->fFreeList = *reinterpret_cast<void**>(object + fLinkOffset);
+			if (++slab->fInUse == fObjectsPerSlab) {
+				fPartialSlabs.Remove(slab);
+				fFullSlabs.AddToHead(slab);
+			}
+
+			fObjectsInUse++;
+			fAllocCount++;
+			fLock.Unlock(fl);
+			return object;
+		}
+
+		// Make a new slab.  The lock is released, since running constructors
+		// may take a while and a full heap reclaims slabs from every cache.
+		fLock.Unlock(fl);
+		slab = CreateSlab();
+		if (slab == 0)
+			return 0;
+
+		fl = fLock.Lock();
+		fEmptySlabs.AddToHead(slab);
+		fEmptySlabCount++;
+		fSlabCount++;
+	}
+}
+
+void SlabCache::Free(void *object)
+{
+	Slab *slab = reinterpret_cast<Slab*>(reinterpret_cast<unsigned int>(object)
+		& ~(PAGE_SIZE - 1));
+	ASSERT(slab->fCache == this);
+
+	cpu_flags fl = fLock.Lock();
+	*reinterpret_cast<void**>(static_cast<char*>(object) + fLinkOffset) = slab->fFreeList;
+	slab->fFreeList = object;
+	if (slab->fInUse-- == fObjectsPerSlab) {
+		fFullSlabs.Remove(slab);
+		fPartialSlabs.AddToHead(slab);
+	}
+
+	if (slab->fInUse == 0) {
+		fPartialSlabs.Remove(slab);
+		fEmptySlabs.AddToHead(slab);
+		fEmptySlabCount++;
+	}
+
+	fObjectsInUse--;
+	fLock.Unlock(fl);
+	if (fEmptySlabCount > kMaxEmptySlabs)
+		Reclaim(kMaxEmptySlabs);
+}
+
+void* SlabCache::AllocInstance(size_t size)
+{
+	if (size > fObjectSize - (fConstructor ? sizeof(void*) : 0))
+		return malloc(size);
+
+	void *object = Alloc();
+	if (object == 0)
+		panic("Out of heap space");
+
+	return object;
+}
+
+void SlabCache::FreeObject(void *object)
+{
+	Slab *slab = reinterpret_cast<Slab*>(reinterpret_cast<unsigned int>(object)
+		& ~(PAGE_SIZE - 1));
+	slab->fCache->Free(object);
+}
+
+int SlabCache::ReclaimAll()
+{
+	// Caches are never destroyed, so the list can be walked without holding
+	// its lock.
+	int freed = 0;
+	for (SlabCache *cache = fCacheList; cache; cache = cache->fNextCache)
+		freed += cache->Reclaim(0);
+
+	return freed;
+}
+
+void SlabCache::Bootstrap()
+{
+	AddDebugCommand("slabinfo", "Show slab allocator caches", PrintSlabInfo);
+}
+
+Slab* SlabCache::CreateSlab()
+{
+	char *page = static_cast<char*>(AllocSlabPage());
+	if (page == 0)
+		return 0;
+
+	Slab *slab = new (page) Slab;
+	slab->fCache = this;
+	slab->fInUse = 0;
+	slab->fFreeList = 0;
+
+	// The color is only a hint, so updating it without the lock is harmless.
+	int color = fNextColor;
+	fNextColor = (color + 1) % fColorCount;
+
+	// Link the objects in address order, so they are handed out that way.
+	char *object = page + kSlabHeaderSize + color * kCacheLineSize + (fObjectsPerSlab - 1)
+		* fObjectSize;
+	for (int i = 0; i < fObjectsPerSlab; i++) {
+		if (fConstructor)
+			(*fConstructor)(object);
+
+		*reinterpret_cast<void**>(object + fLinkOffset) = slab->fFreeList;
+		slab->fFreeList = object;
+		object -= fObjectSize;
+	}
+
+	return slab;
+}
+
+// Free empty slabs until there are only keepEmpty of them
+int SlabCache::Reclaim(int keepEmpty)
+{
+	int freed = 0;
+	for (;;) {
+		cpu_flags fl = fLock.Lock();
+		if (fEmptySlabCount <= keepEmpty) {
+			fLock.Unlock(fl);
+			break;
+		}
+
+		Slab *slab = static_cast<Slab*>(fEmptySlabs.GetTail());
+		fEmptySlabs.Remove(slab);
+		fEmptySlabCount--;
+		fSlabCount--;
+		fLock.Unlock(fl);
+		FreeSlabPage(slab);
+		freed++;
+	}
+
+	return freed;
+}
+
+void SlabCache::PrintSlabInfo(int, const char**)
+{
+	printf("Name                 Size  Per Slab  Slabs  Empty    In Use      Allocs\n");
+	for (const SlabCache *cache = fCacheList; cache; cache = cache->fNextCache) {
+		printf("%20s %5d %9d %6d %6d %9d %11Ld\n", cache->fName,
+			static_cast<int>(cache->fObjectSize), cache->fObjectsPerSlab,
+			cache->fSlabCount, cache->fEmptySlabCount, cache->fObjectsInUse,
+			cache->fAllocCount);
+	}
+}
@@ -0,0 +1,108 @@
+// 
+// Copyright 1998-2012 Jeff Bush
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// 
+
+/// @file Slab.h
+///	Caches of objects of one type
+
+#ifndef _SLAB_H
+#define _SLAB_H
+
+#include "List.h"
+#include "Spinlock.h"
+#include "types.h"
+
+struct Slab;
+
+/// A SlabCache allocates objects of one size from slabs, which are heap pages
+/// that are carved into objects.  Freed objects stay constructed and are reused
+/// before new slabs are made.  Each slab starts its objects at a different
+/// cache line offset (its color), so the same object in different slabs doesn't
+/// always land in the same processor cache set.  A few empty slabs are kept, and
+/// the rest are given back to the heap.
+///
+/// Objects are normally freed with SlabCache::Free.  free() also recognizes
+/// objects from slabs and returns them to their cache, so a class can allocate
+/// instances from a cache by overriding operator new alone.  Freeing only uses
+/// spinlocks, so it may be done with interrupts disabled.  Allocating may block
+/// if the heap has to grow.
+class SlabCache {
+public:
+	/// @param name Shown by the slabinfo debugger command.  This is not copied.
+	/// @param objectSize Size of each object, up to kMaxSlabObjectSize
+	/// @param constructor If this is not null, it is called for each object when
+	///   its slab is created.  Objects must be in the constructed state when they
+	///   are freed.
+	SlabCache(const char name[], size_t objectSize, void (*constructor)(void*) = 0);
+
+	/// @returns An object, or 0 if the heap is out of space
+	void* Alloc();
+
+	/// Return an object to this cache
+	void Free(void*);
+
+	/// Allocate memory for a class specific operator new.  Instances of derived
+	/// classes that are too large for this cache come from malloc instead.
+	/// This panics if the heap is out of space, like malloc.
+	void* AllocInstance(size_t size);
+
+	/// @returns the size of objects in this cache
+	inline size_t GetObjectSize() const;
+
+	/// Give the empty slabs of every cache back to the heap.
+	/// @returns Number of pages that were freed
+	static int ReclaimAll();
+
+	/// Called by free() for pointers into slab pages
+	static void FreeObject(void*);
+
+	/// Called at boot time to initialize structures
+	static void Bootstrap();
+
+private:
+	Slab* CreateSlab();
+	int Reclaim(int keepEmpty);
+	static void PrintSlabInfo(int, const char**);
+
+	const char *fName;
+	size_t fObjectSize;
+	size_t fLinkOffset;
+	int fObjectsPerSlab;
+	int fColorCount;
+	int fNextColor;
+	void (*fConstructor)(void*);
+	Spinlock fLock;
+	List fPartialSlabs;
+	List fFullSlabs;
+	List fEmptySlabs;
+	int fEmptySlabCount;
+	int fSlabCount;
+	int fObjectsInUse;
+	int64 fAllocCount;
+	SlabCache *fNextCache;
+	static SlabCache *fCacheList;
+	static Spinlock fCacheListLock;
+};
+
+/// The largest objects that a SlabCache can hold.  Each slab is one page and holds
+/// at least eight of these.
+const size_t kMaxSlabObjectSize = PAGE_SIZE / 8;
+
+inline size_t SlabCache::GetObjectSize() const
+{
+	return fObjectSize;
+}
+
+#endif
@@ -0,0 +1,150 @@
+// 
+// Copyright 1998-2012 Jeff Bush
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// 
+
+
+/// @file Spinlock.h
+///	Busy-waiting locks for code that may not block
+
+#ifndef _SPINLOCK_H
+#define _SPINLOCK_H
+
+#include "cpu_asm.h"
+#include "KernelDebug.h"
+#include "Processor.h"
+
+/// A Spinlock protects a short critical section against other processors.
+/// Interrupts are disabled on the local processor while it is held, so it is
+/// also safe to share with interrupt handlers.  The holder must not block.
+class Spinlock {
+public:
+	inline Spinlock();
+
+	/// Disable interrupts and acquire the lock
+	/// @returns the previous interrupt state, which must be passed to Unlock
+	inline cpu_flags Lock();
+
+	/// Release the lock and restore the interrupt state returned by Lock
+	inline void Unlock(cpu_flags);
+
+	/// @returns true if any processor holds this lock.  For assertions.
+	inline bool IsLocked() const;
+
+private:
+	volatile int fLocked;
+};
+
+/// A spinlock that the processor holding it may acquire again.  This is
+/// used for the dispatcher lock, which is taken at several nesting levels
+/// (Semaphore::Release calls Dispatcher::Signal, which calls into the scheduler)
+/// and is held across context switches.
+class RecursiveSpinlock {
+public:
+	inline RecursiveSpinlock();
+	inline cpu_flags Lock();
+	inline void Unlock(cpu_flags);
+
+	/// @returns true if the calling processor holds this lock
+	inline bool IsHeld() const;
+
+	/// The nesting depth belongs to the thread that acquired the lock, not to the
+	/// processor.  The scheduler saves the depth of the outgoing thread and restores
+	/// it when that thread is resumed.
+	inline int GetDepth() const;
+	inline void SetDepth(int);
+
+private:
+	volatile int fOwner;	// Index of the owning processor + 1, or 0 if free
+	int fDepth;
+};
+
+inline Spinlock::Spinlock()
+	:	fLocked(0)
+{
+}
+
+inline cpu_flags Spinlock::Lock()
+{
+	cpu_flags fl = DisableInterrupts();
+	while (!cmpxchg32(&fLocked, 0, 1)) {
+		while (fLocked)
+			SpinPause();
+	}
+
+	return fl;
+}
+
+inline void Spinlock::Unlock(cpu_flags fl)
+{
+	ASSERT(fLocked);
+	MemoryBarrier();
+	fLocked = 0;
+	RestoreInterrupts(fl);
+}
+
+inline bool Spinlock::IsLocked() const
+{
+	return fLocked != 0;
+}
+
+inline RecursiveSpinlock::RecursiveSpinlock()
+	:	fOwner(0),
+		fDepth(0)
+{
+}
+
+inline cpu_flags RecursiveSpinlock::Lock()
+{
+	cpu_flags fl = DisableInterrupts();
+	int self = Processor::GetCurrentProcessorIndex() + 1;
+	if (fOwner != self) {
+		while (!cmpxchg32(&fOwner, 0, self)) {
+			while (fOwner)
+				SpinPause();
+		}
+	}
+
+	fDepth++;
+	return fl;
+}
+
+inline void RecursiveSpinlock::Unlock(cpu_flags fl)
+{
+	ASSERT(IsHeld());
+	ASSERT(fDepth > 0);
+	if (--fDepth == 0) {
+		MemoryBarrier();
+		fOwner = 0;
+	}
+
+	RestoreInterrupts(fl);
+}
+
+inline bool RecursiveSpinlock::IsHeld() const
+{
+	return fOwner == Processor::GetCurrentProcessorIndex() + 1;
+}
+
+inline int RecursiveSpinlock::GetDepth() const
+{
+	return fDepth;
+}
+
+inline void RecursiveSpinlock::SetDepth(int depth)
+{
+	fDepth = depth;
+}
+
+#endif
@@ -25,6 +25,8 @@
 #include "Image.h"
 #include "KernelDebug.h"
 #include "PageCache.h"
+#include "Scheduler.h"
+#include "SchedulingClass.h"
 #include "stdio.h"
 #include "string.h"
 #include "syscall.h"
@@ -71,7 +73,9 @@ SystemCallInfo systemCallTable[] = {
 	{ (CallHook) getcwd, 2 },
 	{ (CallHook) mount, 5 },
 	{ (CallHook) map_file, 6 },
-	{bad_syscall,0},{bad_syscall,0},{bad_syscall,0},{bad_syscall,0},{bad_syscall,0},
+	{ (CallHook) set_scheduling_class, 1 },
+	{ (CallHook) _get_system_time, 1 },
+	{bad_syscall,0},{bad_syscall,0},{bad_syscall,0},
 	{bad_syscall,0},{bad_syscall,0},{bad_syscall,0},{bad_syscall,0},{bad_syscall,0},
 	{bad_syscall,0},{bad_syscall,0},{bad_syscall,0},{bad_syscall,0},{bad_syscall,0},
 	{bad_syscall,0},{bad_syscall,0},{bad_syscall,0},{bad_syscall,0},{bad_syscall,0},
@@ -154,10 +158,24 @@ int _serial_print(const char string[])
 	return 0;
 }
 
+// system_time normally reads the time page.  This is only used if the time
+// stamp counter can't be read directly.
+status_t _get_system_time(bigtime_t *outTime)
+{
+	bigtime_t now = SystemTime();
+	if (!CopyUser(outTime, &now, sizeof(now)))
+		return E_BAD_ADDRESS;
+
+	return E_NO_ERROR;
+}
+
 int spawn_thread(thread_start_t entry, const char name[], void *data, int priority)
 {
-	Thread *thread = new Thread(name, Thread::GetRunningThread()->GetTeam(), entry,
-		data, priority);
+	Team *team = Thread::GetRunningThread()->GetTeam();
+	if (team->GetSchedulingClass()->IsRealTime() && priority > MAX_REAL_TIME_PRIORITY)
+		return E_NOT_ALLOWED;
+
+	Thread *thread = new Thread(name, team, entry, data, priority);
 	if (thread == 0)
 		return E_NO_MEMORY;
 
@@ -307,6 +325,20 @@ int kill_thread(int handle)
 	return E_NO_ERROR;
 }
 
+// The class applies to all threads in the calling team, including ones that
+// are created later.  Threads in the real-time classes never yield to lower
+// priorities, so they are limited to MAX_REAL_TIME_PRIORITY.  Kernel threads
+// above that, like the work queue workers, can still run.
+status_t set_scheduling_class(int type)
+{
+	SchedulingClass *schedulingClass = SchedulingClass::GetClass(type);
+	if (schedulingClass == 0)
+		return E_INVALID_OPERATION;
+
+	return Thread::GetRunningThread()->GetTeam()->SetSchedulingClass(schedulingClass,
+		schedulingClass->IsRealTime() ? MAX_REAL_TIME_PRIORITY : kMaxPriority);
+}
+
 int open(const char path[], int)
 {
 	VNode *node;
@@ -15,29 +15,35 @@
 // 
 
 #include "AddressSpace.h"
+#include "ClockSource.h"
 #include "cpu_asm.h"
 #include "KernelDebug.h"
+#include "SchedulingClass.h"
 #include "stdio.h"
 #include "Team.h"
 #include "Thread.h"
 
 List Team::fTeamList;
+Spinlock Team::fTeamLock;
 
 Team::Team(const char name[])
 	:	Resource(OBJ_TEAM, name),
-		fThreadList(0)
+		fThreadList(0),
+		fSchedulingClass(SchedulingClass::GetDefaultClass()),
+		fCachedStackCount(0)
 {
 	fAddressSpace = new AddressSpace;
-	cpu_flags fl = DisableInterrupts();
+	MapTimePage(fAddressSpace);
+	cpu_flags fl = fTeamLock.Lock();
 	fTeamList.AddToTail(this);	
-	RestoreInterrupts(fl);
+	fTeamLock.Unlock(fl);
 }
 
 Team::~Team()
 {
-	cpu_flags fl = DisableInterrupts();
+	cpu_flags fl = fTeamLock.Lock();
 	fTeamList.Remove(this);
-	RestoreInterrupts(fl);
+	fTeamLock.Unlock(fl);
 
 	delete fAddressSpace;
 }
@@ -45,45 +51,93 @@ Team::~Team()
 void Team::ThreadCreated(Thread *thread)
 {
 	AcquireRef();
-	cpu_flags fl = DisableInterrupts();
+	cpu_flags fl = fTeamLock.Lock();
+	thread->SetSchedulingClass(fSchedulingClass);
 	thread->fTeamListNext = fThreadList;
 	fThreadList = thread;
 	thread->fTeamListPrev = &fThreadList;
 	if (thread->fTeamListNext)
 		thread->fTeamListNext->fTeamListPrev = &thread->fTeamListNext;
 		
-	RestoreInterrupts(fl);
+	fTeamLock.Unlock(fl);
 }
 
 void Team::ThreadTerminated(Thread *thread)
 {
-	cpu_flags fl = DisableInterrupts();
+	cpu_flags fl = fTeamLock.Lock();
 	*thread->fTeamListPrev = thread->fTeamListNext;
 	if (thread->fTeamListNext)
 		thread->fTeamListNext->fTeamListPrev = thread->fTeamListPrev;
 
-	RestoreInterrupts(fl);
+	fTeamLock.Unlock(fl);
 	ReleaseRef();
 }
 
+Area* Team::TakeCachedStack()
+{
+	Area *area = 0;
+	cpu_flags fl = fTeamLock.Lock();
+	if (fCachedStackCount > 0)
+		area = fStackCache[--fCachedStackCount];
+
+	fTeamLock.Unlock(fl);
+	return area;
+}
+
+// The cached stacks stay in the address space, so they are deleted along with
+// it when the team goes away.
+bool Team::CacheStack(Area *area)
+{
+	bool cached = false;
+	cpu_flags fl = fTeamLock.Lock();
+	if (fCachedStackCount < kMaxCachedStacks) {
+		fStackCache[fCachedStackCount++] = area;
+		cached = true;
+	}
+
+	fTeamLock.Unlock(fl);
+	return cached;
+}
+
+status_t Team::SetSchedulingClass(SchedulingClass *schedulingClass, int maxPriority)
+{
+	cpu_flags fl = fTeamLock.Lock();
+	for (Thread *thread = fThreadList; thread; thread = thread->fTeamListNext) {
+		if (thread->GetBasePriority() > maxPriority) {
+			fTeamLock.Unlock(fl);
+			return E_NOT_ALLOWED;
+		}
+	}
+
+	fSchedulingClass = schedulingClass;
+	for (Thread *thread = fThreadList; thread; thread = thread->fTeamListNext)
+		thread->SetSchedulingClass(schedulingClass);
+
+	fTeamLock.Unlock(fl);
+	return E_NO_ERROR;
+}
+
 void Team::DoForEach(void (*EachTeamFunc)(void*, Team*), void *cookie)
 {
-	cpu_flags fl = DisableInterrupts();
+	// The lock is not held while releasing a reference, since deleting the
+	// team would acquire it again.
+	cpu_flags fl = fTeamLock.Lock();
 	Team *team = static_cast<Team*>(fTeamList.GetHead());
-	team->AcquireRef();
+	if (team)
+		team->AcquireRef();
+
+	fTeamLock.Unlock(fl);
 	while (team) {
-		RestoreInterrupts(fl);
 		EachTeamFunc(cookie, team);
-		DisableInterrupts();
+		fl = fTeamLock.Lock();
 		Team *next = static_cast<Team*>(fTeamList.GetNext(team));
 		if (next)
 			next->AcquireRef();
 
+		fTeamLock.Unlock(fl);
 		team->ReleaseRef();
 		team = next;
 	}
-	
-	RestoreInterrupts(fl);
 }
 
 void Team::Bootstrap()
@@ -98,7 +152,9 @@ void Team::Bootstrap()
 Team::Team(const char name[], AddressSpace *addressSpace)
 	:	Resource(OBJ_TEAM, name),
 		fAddressSpace(addressSpace),
-		fThreadList(0)
+		fThreadList(0),
+		fSchedulingClass(SchedulingClass::GetDefaultClass()),
+		fCachedStackCount(0)
 {
 	fTeamList.AddToTail(this);
 }
@@ -113,12 +169,13 @@ void Team::PrintThreads(int, const char*[])
 		const Team *team = static_cast<const Team*>(node);
 		teamCount++;
 		printf("Team %s\n", team->GetName());
-		printf("Name                 State    CPRI BPRI\n"); 
+		printf("Name                 State    CPRI BPRI IPRI\n"); 
 		for (Thread *thread = team->fThreadList; thread; thread = thread->fTeamListNext) {
 			threadCount++;
-			printf("%20s %8s %4d %4d\n", thread->GetName(),
+			printf("%20s %8s %4d %4d %4d\n", thread->GetName(),
 				kThreadStateName[thread->GetState()],
-				thread->GetCurrentPriority(), thread->GetBasePriority());
+				thread->GetCurrentPriority(), thread->GetBasePriority(),
+				thread->GetInheritedPriority());
 		}
 		
 		printf("\n");
@@ -21,10 +21,16 @@
 #include "HandleTable.h"
 #include "Resource.h"
 #include "List.h"
+#include "Spinlock.h"
 
 class AddressSpace;
+class Area;
+class SchedulingClass;
 class Thread;
 
+/// The number of user stacks each team keeps for new threads
+const int kMaxCachedStacks = 4;
+
 /// A team is a group of threads and an associated address space
 class Team : public Resource, public ListNode {
 public:
@@ -38,10 +44,28 @@ public:
 	/// Called when a thread terminates.  Remove from the team's list of threads.
 	void ThreadTerminated(Thread*);
 
+	/// Get a user stack that was used by a thread of this team that has exited.
+	/// Its pages are still mapped, so a new thread can start using it without
+	/// faulting them in.
+	/// @returns the area, or 0 if none are cached
+	Area* TakeCachedStack();
+
+	/// Keep the user stack of a thread that is being destroyed for a later thread.
+	/// @returns false if the cache is full, in which case the caller must delete it
+	bool CacheStack(Area*);
+
 	/// Each team has it's own private handle table.
 	inline const HandleTable *GetHandleTable() const;
 	inline HandleTable* GetHandleTable();
 
+	/// Get the scheduling policy used by threads in this team
+	inline SchedulingClass* GetSchedulingClass() const;
+
+	/// Change the scheduling policy of this team and all of its threads
+	/// @param maxPriority The highest base priority a thread of the team may have
+	/// @returns E_NOT_ALLOWED if a thread has a higher priority, or E_NO_ERROR
+	status_t SetSchedulingClass(SchedulingClass*, int maxPriority);
+
 	/// Call a function for every team in the system
 	static void DoForEach(void (*EachTeamFunc)(void*, Team*), void*);
 
@@ -56,8 +80,12 @@ private:
 
 	AddressSpace *fAddressSpace;
 	Thread *fThreadList;
+	SchedulingClass *fSchedulingClass;
+	Area *fStackCache[kMaxCachedStacks];
+	int fCachedStackCount;
 	HandleTable fHandleTable;
 	static List fTeamList;
+	static Spinlock fTeamLock;	// Protects the team list and the thread list of each team
 };
 
 inline AddressSpace* Team::GetAddressSpace() const
@@ -65,6 +93,11 @@ inline AddressSpace* Team::GetAddressSpace() const
 	return fAddressSpace;
 }
 
+inline SchedulingClass* Team::GetSchedulingClass() const
+{
+	return fSchedulingClass;
+}
+
 inline const HandleTable* Team::GetHandleTable() const
 {
 	return &fHandleTable;
@@ -17,21 +17,82 @@
 #include "AddressSpace.h"
 #include "Area.h"
 #include "cpu_asm.h"
+#include "Dispatcher.h"
 #include "KernelDebug.h"
 #include "PageCache.h"
 #include "Scheduler.h"
+#include "SchedulingClass.h"
+#include "Slab.h"
 #include "stdio.h"
 #include "string.h"
 #include "Team.h"
 #include "Thread.h"
 #include "VNode.h"
+#include "WorkQueue.h"
 
 const unsigned int kKernelStackSize = 0x3000;
 const unsigned int kUserStackSize = 0x20000;
+const int kKernelStackCacheSize = 16;
+
+/// The Grim Reaper reclaims resources owned by threads that have exited.
+/// Since this operation requires being in a thread, a thread can't really
+/// self destruct.
+class GrimReaper : public WorkItem {
+public:
+	virtual void Run();
+};
 
-Thread* Thread::fRunningThread = 0;
 Queue Thread::fReapQueue;
-Semaphore Thread::fThreadsToReap("threads to reap", 0);
+static GrimReaper grimReaper;
+static WorkQueue reaperQueue("grim reaper", kWorkPriorityHigh);
+static SlabCache threadCache("thread", sizeof(Thread));
+static SlabCache apcCache("apc", sizeof(APC));
+
+// Kernel stacks of threads that have been destroyed.  They are still wired and
+// mapped, so creating a thread doesn't need to allocate and clear pages.
+static Area *kernelStackCache[kKernelStackCacheSize];
+static int kernelStackCacheCount = 0;
+static Spinlock kernelStackCacheLock;
+
+static Area* AllocKernelStack(const char name[])
+{
+	Area *area = 0;
+	cpu_flags fl = kernelStackCacheLock.Lock();
+	if (kernelStackCacheCount > 0)
+		area = kernelStackCache[--kernelStackCacheCount];
+
+	kernelStackCacheLock.Unlock(fl);
+	if (area == 0) {
+		area = AddressSpace::GetKernelAddressSpace()->CreateArea(name,
+			kKernelStackSize, AREA_WIRED, SYSTEM_READ | SYSTEM_WRITE, new PageCache, 0,
+			INVALID_PAGE, SEARCH_FROM_TOP);
+	}
+
+	return area;
+}
+
+static void FreeKernelStack(Area *area)
+{
+	cpu_flags fl = kernelStackCacheLock.Lock();
+	if (kernelStackCacheCount < kKernelStackCacheSize) {
+		kernelStackCache[kernelStackCacheCount++] = area;
+		area = 0;
+	}
+
+	kernelStackCacheLock.Unlock(fl);
+	if (area)
+		AddressSpace::GetKernelAddressSpace()->DeleteArea(area);
+}
+
+void* Thread::operator new(size_t size)
+{
+	return threadCache.AllocInstance(size);
+}
+
+void* APC::operator new(size_t size)
+{
+	return apcCache.AllocInstance(size);
+}
 
 Thread::Thread(const char name[], Team *team, thread_start_t startAddress, void *param,
 	int priority)
@@ -39,8 +100,17 @@ Thread::Thread(const char name[], Team *team, thread_start_t startAddress, void
 		fThreadContext(team->GetAddressSpace()->GetPhysicalMap()),
 		fBasePriority(priority),
 		fCurrentPriority(priority),
+		fInheritedPriority(0),
+		fBlockedOn(0),
+		fHeldMutexes(0),
+		fRunQueue(0),
 		fFaultHandler(0),
 		fLastEvent(SystemTime()),
+		fLastProcessor(Processor::GetCurrentProcessorIndex()),
+		fAffinity(kAnyProcessor),
+		fPinCount(0),
+		fUnpinnedAffinity(kAnyProcessor),
+		fSchedulingClass(SchedulingClass::GetDefaultClass()),
 		fState(kThreadCreated),
 		fTeam(team),
 		fKernelStack(0),
@@ -49,9 +119,7 @@ Thread::Thread(const char name[], Team *team, thread_start_t startAddress, void
 	char stackName[OS_NAME_LENGTH];
 	snprintf(stackName, OS_NAME_LENGTH, "%.12s stack", name);
 
-	fKernelStack = AddressSpace::GetKernelAddressSpace()->CreateArea(stackName,
-		kKernelStackSize, AREA_WIRED, SYSTEM_READ | SYSTEM_WRITE, new PageCache, 0,
-		INVALID_PAGE, SEARCH_FROM_TOP);
+	fKernelStack = AllocKernelStack(stackName);
 	if (fKernelStack == 0) {
 		printf("team = %p\n", fTeam);
 		panic("Can't create kernel stack for thread: out of virtual space\n");
@@ -60,10 +128,16 @@ Thread::Thread(const char name[], Team *team, thread_start_t startAddress, void
 	unsigned int kernelStack = fKernelStack->GetBaseAddress() + kKernelStackSize - 4;
 	unsigned int userStack = 0;
 	if (team->GetAddressSpace() != AddressSpace::GetKernelAddressSpace()) {
-		// Create the user stack
-		fUserStack = fTeam->GetAddressSpace()->CreateArea(stackName, kUserStackSize,
-			AREA_NOT_WIRED, USER_READ | USER_WRITE | SYSTEM_READ | SYSTEM_WRITE,
-			new PageCache, 0, INVALID_PAGE, SEARCH_FROM_TOP);
+		// Reuse the stack of a thread in this team that has exited if possible,
+		// otherwise create one.  It is executable because the thread returns
+		// to an exit stub on its stack.
+		fUserStack = fTeam->TakeCachedStack();
+		if (fUserStack == 0) {
+			fUserStack = fTeam->GetAddressSpace()->CreateArea(stackName, kUserStackSize,
+				AREA_NOT_WIRED, USER_READ | USER_WRITE | USER_EXEC | SYSTEM_READ | SYSTEM_WRITE,
+				new PageCache, 0, INVALID_PAGE, SEARCH_FROM_TOP);
+		}
+
 		if (fUserStack == 0) {
 			printf("team = %p\n", fTeam);
 			panic("Can't create user stack for thread: out of virtual space\n");
@@ -90,12 +164,13 @@ void Thread::Exit()
 {
 	ASSERT(GetRunningThread() == this);
 
-	cpu_flags fl = DisableInterrupts();
+	// The dispatcher lock is held until another thread has been switched to.
+	// Otherwise, the Grim Reaper could run on another processor and free the
+	// stack this is running on.
+	gDispatcherLock.Lock();
 	SetState(kThreadDead);
 	fReapQueue.Enqueue(this);
-	fThreadsToReap.Release(1, false);
-	RestoreInterrupts(fl);
-
+	reaperQueue.Enqueue(&grimReaper);
 	gScheduler.Reschedule();
 	panic("terminated thread got scheduled");
 }
@@ -103,12 +178,15 @@ void Thread::Exit()
 void Thread::SwitchTo()
 {
 	cpu_flags cs = DisableInterrupts();
+	Processor *processor = Processor::GetCurrentProcessor();
+	Thread *runningThread = processor->GetRunningThread();
 	fState = kThreadRunning;
-	if (fRunningThread != this) {
+	if (runningThread != this) {
 		bigtime_t now = SystemTime();
-		fRunningThread->fLastEvent = now;
+		runningThread->fLastEvent = now;
 		fLastEvent = now;
-		fRunningThread = this;
+		processor->SetRunningThread(this);
+		fLastProcessor = processor->GetIndex();
 		fThreadContext.SwitchTo();
 	}
 
@@ -140,44 +218,41 @@ bigtime_t Thread::GetSleepTime() const
 
 APC* Thread::DequeueAPC()
 {
-	cpu_flags fl = DisableInterrupts();
+	cpu_flags fl = gDispatcherLock.Lock();
 	APC *apc = static_cast<APC*>(fApcQueue.Dequeue());
-	RestoreInterrupts(fl);
+	gDispatcherLock.Unlock(fl);
 
 	return apc;
 }
 
 void Thread::EnqueueAPC(APC *apc)
 {
-	cpu_flags fl = DisableInterrupts();
+	cpu_flags fl = gDispatcherLock.Lock();
 	fApcQueue.Enqueue(apc);
 #if 0
 	if (GetState() == kThreadWaiting)
 		Wake(E_INTERRUPTED);
 #endif
 
-	RestoreInterrupts(fl);
+	gDispatcherLock.Unlock(fl);
 }
 
 void Thread::Bootstrap()
 {
-	fRunningThread = new Thread("init thread");
+	Processor::SetInitialThread(new Thread("init thread"));
 	AddDebugCommand("st", "Stack trace of current thread", StackTrace);
 }
 
 void Thread::SetKernelStack(Area *area)
 {
 	fKernelStack = area;
+	fThreadContext.SetKernelStack(area->GetBaseAddress() + area->GetSize() - 4);
 }
 
 void Thread::SetTeam(Team *team)
 {
 	fTeam = team;
 	team->ThreadCreated(this);
-
-	// Threading is ready to go... start the Grim Reaper.
-	// This is kind of a weird side effect, the function should be more explicit.
-	new Thread("Grim Reaper", team, GrimReaper, this, 30);
 }
 
 // This is the constructor for bootstrap thread.  There is less state to
@@ -186,8 +261,17 @@ Thread::Thread(const char name[])
 	:	Resource(OBJ_THREAD, name),
 		fBasePriority(16),
 		fCurrentPriority(16),
+		fInheritedPriority(0),
+		fBlockedOn(0),
+		fHeldMutexes(0),
+		fRunQueue(0),
 		fFaultHandler(0),
 		fLastEvent(SystemTime()),
+		fLastProcessor(Processor::GetCurrentProcessorIndex()),
+		fAffinity(kAnyProcessor),
+		fPinCount(0),
+		fUnpinnedAffinity(kAnyProcessor),
+		fSchedulingClass(SchedulingClass::GetDefaultClass()),
 		fCurrentDir(0),
 		fState(kThreadRunning),
 		fKernelStack(0),
@@ -195,10 +279,36 @@ Thread::Thread(const char name[])
 {
 }
 
+Thread::Thread(const char name[], Team *team, Area *kernelStack, int priority)
+	:	Resource(OBJ_THREAD, name),
+		fBasePriority(priority),
+		fCurrentPriority(priority),
+		fInheritedPriority(0),
+		fBlockedOn(0),
+		fHeldMutexes(0),
+		fRunQueue(0),
+		fFaultHandler(0),
+		fLastEvent(SystemTime()),
+		fLastProcessor(Processor::GetCurrentProcessorIndex()),
+		fAffinity(kAnyProcessor),
+		fPinCount(0),
+		fUnpinnedAffinity(kAnyProcessor),
+		fSchedulingClass(SchedulingClass::GetDefaultClass()),
+		fCurrentDir(0),
+		fState(kThreadRunning),
+		fTeam(team),
+		fKernelStack(0),
+		fUserStack(0)
+{
+	SetKernelStack(kernelStack);
+	AcquireRef();
+	team->ThreadCreated(this);
+}
+
 Thread::~Thread()
 {
-	AddressSpace::GetKernelAddressSpace()->DeleteArea(fKernelStack);
-	if (fUserStack)
+	FreeKernelStack(fKernelStack);
+	if (fUserStack && !fTeam->CacheStack(fUserStack))
 		fTeam->GetAddressSpace()->DeleteArea(fUserStack);
 
 	fTeam->ThreadTerminated(this);
@@ -209,15 +319,16 @@ void Thread::StackTrace(int, const char**)
 	GetRunningThread()->fThreadContext.PrintStackTrace();
 }
 
-// The Grim Reaper thread reclaims resources for threads and teams that
-// have exited.
-int Thread::GrimReaper(void*)
+// Threads that exit while this is running are picked up by this loop, or it
+// is queued again.
+void GrimReaper::Run()
 {
 	for (;;) {
-		fThreadsToReap.Wait();
-		cpu_flags fl = DisableInterrupts();
-		Thread *victim = static_cast<Thread*>(fReapQueue.Dequeue());
-		RestoreInterrupts(fl);
+		cpu_flags fl = gDispatcherLock.Lock();
+		Thread *victim = static_cast<Thread*>(Thread::fReapQueue.Dequeue());
+		gDispatcherLock.Unlock(fl);
+		if (victim == 0)
+			break;
 
 		// The thread may not actually get deleted here if someone else has
 		// a handle to it.
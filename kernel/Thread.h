@@ -19,6 +19,7 @@
 #define _THREAD_H
 
 #include "APC.h"
+#include "Processor.h"
 #include "Resource.h"
 #include "Queue.h"
 #include "Semaphore.h"
@@ -28,8 +29,14 @@
 
 class Team;
 class Area;
+class Mutex;
+class RunQueue;
+class SchedulingClass;
 class VNode;
 
+/// Passed to SetAffinity to let a thread run on any processor
+const int kAnyProcessor = -1;
+
 enum ThreadState {
 	kThreadCreated,
 	kThreadWaiting,
@@ -44,6 +51,9 @@ class Thread : public Resource, public QueueNode {
 public:
 	Thread(const char name[], Team*, thread_start_t, void *param, int priority = 16);
 
+	/// Threads are allocated from a slab cache
+	void* operator new(size_t);
+
 	/// This function must be called from within the context of this thread.  This function
 	/// will not return.  When this is called, the current thread will stop executing and
 	/// its resources will be reclaimed by the operating system
@@ -54,7 +64,7 @@ public:
 	/// thread is resumed, it will act as if it just returned from SwitchTo.
 	void SwitchTo();
 
-	/// Get a pointer to the thread that is currently running.
+	/// Get a pointer to the thread that is currently running on this processor.
 	static inline Thread *GetRunningThread();
 
 	/// Get the state of this thread structure
@@ -80,6 +90,36 @@ public:
 	/// the functions it is performing.
 	inline int GetBasePriority() const;
 
+	/// Get the priority this thread has inherited from threads that are waiting
+	/// on mutexes it holds, or 0 if there are none.  The scheduler doesn't let
+	/// the current priority fall below this.
+	inline int GetInheritedPriority() const;
+
+	/// Get the scheduling policy for this thread.  This is the class of its team.
+	inline SchedulingClass* GetSchedulingClass() const;
+
+	/// Called by the team to change the scheduling policy.  The new policy
+	/// is used the next time the thread is scheduled.
+	inline void SetSchedulingClass(SchedulingClass*);
+
+	/// @returns the index of the processor this thread last ran on.  The scheduler
+	///   prefers to run it there again.
+	inline int GetLastProcessor() const;
+
+	/// @returns the processor this thread is bound to, or kAnyProcessor
+	inline int GetAffinity() const;
+
+	/// Bind this thread to a processor, or allow it to run anywhere if
+	/// kAnyProcessor is passed.  This takes effect the next time the
+	/// thread is enqueued.
+	inline void SetAffinity(int processorIndex);
+
+	/// Keep this thread on the processor it is running on until Unpin is
+	/// called, so it can use per-processor state across a context switch.
+	/// Calls nest.  Interrupts must be disabled, so the thread can't move first.
+	inline void Pin();
+	inline void Unpin();
+
 	/// Get the current file directory that filesystem operations in this thread
 	/// are accessing, in the form of a VNode.
 	inline VNode* GetCurrentDir() const;
@@ -139,21 +179,30 @@ public:
 private:
 	/// This is used to bootstream the first thread.
 	Thread(const char name[]);
+
+	/// This is used for the initial thread of the other processors, which is
+	/// already running on the passed stack.
+	Thread(const char name[], Team*, Area *kernelStack, int priority);
 	virtual ~Thread();
 
 	/// Print a trace of the kernel functions called by this thread.
 	static void StackTrace(int, const char**);
 
-	/// The GrimReaper thread reclaims resources owned by threads
-	/// Since this operation requires being in a thread, a thread can't really
-	/// self destruct.
-	static int GrimReaper(void*) NORETURN;
 
 	ThreadContext fThreadContext;
 	int fBasePriority;
 	int fCurrentPriority;
+	int fInheritedPriority;
+	Mutex *fBlockedOn;
+	Mutex *fHeldMutexes;
+	RunQueue *fRunQueue;
 	unsigned int fFaultHandler;
 	bigtime_t fLastEvent;
+	int fLastProcessor;
+	int fAffinity;
+	int fPinCount;
+	int fUnpinnedAffinity;
+	SchedulingClass *fSchedulingClass;
 	VNode *fCurrentDir;
 	ThreadState fState;
 	Team *fTeam;
@@ -162,16 +211,22 @@ private:
 	Thread *fTeamListNext;
 	Thread **fTeamListPrev;
 	Queue fApcQueue;
-	static Thread *fRunningThread;
 	static Queue fReapQueue;
-	static Semaphore fThreadsToReap;
 
 	friend class Team;
+	friend class Processor;
+	friend class Mutex;
+	friend class RunQueue;
+	friend class Scheduler;
+	friend class GrimReaper;
 };
 
 inline Thread* Thread::GetRunningThread()
 {
-	return fRunningThread;
+	cpu_flags fl = DisableInterrupts();
+	Thread *thread = Processor::GetCurrentProcessor()->GetRunningThread();
+	RestoreInterrupts(fl);
+	return thread;
 }
 
 inline ThreadState Thread::GetState() const
@@ -189,6 +244,45 @@ inline Team* Thread::GetTeam() const
 	return fTeam;
 }
 
+inline SchedulingClass* Thread::GetSchedulingClass() const
+{
+	return fSchedulingClass;
+}
+
+inline void Thread::SetSchedulingClass(SchedulingClass *schedulingClass)
+{
+	fSchedulingClass = schedulingClass;
+}
+
+inline int Thread::GetLastProcessor() const
+{
+	return fLastProcessor;
+}
+
+inline int Thread::GetAffinity() const
+{
+	return fAffinity;
+}
+
+inline void Thread::SetAffinity(int processorIndex)
+{
+	fAffinity = processorIndex;
+}
+
+inline void Thread::Pin()
+{
+	if (fPinCount++ == 0) {
+		fUnpinnedAffinity = fAffinity;
+		fAffinity = Processor::GetCurrentProcessorIndex();
+	}
+}
+
+inline void Thread::Unpin()
+{
+	if (--fPinCount == 0)
+		fAffinity = fUnpinnedAffinity;
+}
+
 inline VNode* Thread::GetCurrentDir() const
 {
 	return fCurrentDir;
@@ -214,6 +308,11 @@ inline int Thread::GetBasePriority() const
 	return fBasePriority;
 }
 
+inline int Thread::GetInheritedPriority() const
+{
+	return fInheritedPriority;
+}
+
 inline void Thread::SetCurrentPriority(int priority)
 {
 	fCurrentPriority = priority & 31;
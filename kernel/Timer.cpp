@@ -14,19 +14,51 @@
 // limitations under the License.
 // 
 
+#include "ClockSource.h"
 #include "cpu_asm.h"
+#include "Dispatcher.h"
+#include "HardwareTimer.h"
 #include "interrupt.h"
 #include "KernelDebug.h"
 #include "stdio.h"
 #include "Timer.h"
 
-extern void HardwareTimerBootstrap(InterruptStatus (*callback)());
-extern void SetHardwareTimer(bigtime_t relativeTimeout);
+// Each slot in the lowest level of the wheel covers about a millisecond.
+const int kWheelTickShift = 10;
 
-Queue Timer::fTimerQueue;
+// Timers that expire within this long are kept in the heap.
+const bigtime_t kHeapHorizon = 4096;
+
+Queue Timer::fWheel[kTimerWheelLevels][kTimerWheelSlots];
+uint64 Timer::fWheelOccupied[kTimerWheelLevels];
+int Timer::fWheelCount[kTimerWheelLevels];
+int64 Timer::fWheelTick = 0;
+Timer *Timer::fHeapRoot = 0;
+int Timer::fHeapCount = 0;
+bigtime_t Timer::fNextEvent = kNoTimerEvent;
+
+// @returns how many slots after start the first occupied one is, wrapping
+//   around.  At least one slot must be occupied.
+static int FindNextSlot(uint64 occupied, int start)
+{
+	uint64 rotated = occupied;
+	if (start)
+		rotated = (occupied >> start) | (occupied << (kTimerWheelSlots - start));
+
+	unsigned int low = static_cast<unsigned int>(rotated);
+	if (low)
+		return FindLowestSetBit(low);
+
+	return 32 + FindLowestSetBit(static_cast<unsigned int>(rotated >> 32));
+}
 
 Timer::Timer()
-	:	fPending(false)
+	:	fPending(false),
+		fLevel(-1),
+		fSlot(0),
+		fHeapChild(0),
+		fHeapSibling(0),
+		fHeapPrevious(0)
 {
 }
 
@@ -42,6 +74,7 @@ void Timer::SetTimeout(bigtime_t time, TimerMode mode)
 	if (fPending)
 		panic("Attempt to Set() a pending timer\n");
 	
+	bigtime_t now = SystemTime();
 	fMode = mode;
 	fPending = true;
 	if (fMode == kPeriodicTimer) {
@@ -49,35 +82,32 @@ void Timer::SetTimeout(bigtime_t time, TimerMode mode)
 		if (fInterval <= 0)
 			panic("Attempt to set periodic timer for zero or negative interval");
 	
-		fWhen = SystemTime() + fInterval;
+		fWhen = now + fInterval;
 	} else
 		fWhen = time;
 
-	cpu_flags st = DisableInterrupts();
-	const Timer *oldHead = static_cast<const Timer*>(fTimerQueue.GetHead());
-	Enqueue(this);
-
-	// If a different timer is now the head of the timer queue,
-	// reset the hardware timer.
-	if (static_cast<Timer*>(fTimerQueue.GetHead()) != oldHead)
-		ReprogramHardwareTimer();
-		
-	RestoreInterrupts(st);
+	// The wheel is brought up to date first, so the timer is placed relative
+	// to the current time.  This is cheap if no ticks have passed.
+	cpu_flags st = gDispatcherLock.Lock();
+	AdvanceWheel(now);
+	Enqueue(this, now);
+	ReprogramHardwareTimer(false);
+	gDispatcherLock.Unlock(st);
 }
 
 bool Timer::CancelTimeout()
 {
-	cpu_flags st = DisableInterrupts();
-	bool wasHead = (fTimerQueue.GetHead() == this);
-	if (fPending)
-		fTimerQueue.Remove(this);
-	
+	cpu_flags st = gDispatcherLock.Lock();
 	bool wasPending = fPending;
-	fPending = false;
-	if (wasHead)
-		ReprogramHardwareTimer();
-		
-	RestoreInterrupts(st);
+	if (fPending) {
+		bool wasHead = (fHeapRoot == this);
+		Dequeue(this);
+		fPending = false;
+		if (wasHead)
+			ReprogramHardwareTimer(true);
+	}
+
+	gDispatcherLock.Unlock(st);
 	return wasPending;
 }
 
@@ -89,19 +119,23 @@ InterruptStatus Timer::HandleTimeout()
 void Timer::Bootstrap()
 {
 	HardwareTimerBootstrap(HardwareTimerInterrupt);
-	AddDebugCommand("timers", "list pending timers", PrintTimerQueue);
+	AddDebugCommand("timers", "show pending timers", PrintTimerQueue);
 }
 
+// The dispatcher lock is held while the timeout handlers are called, so they
+// may signal dispatchers and enqueue threads.
 InterruptStatus Timer::HardwareTimerInterrupt()
 {
-	bigtime_t now = SystemTime();		
+	cpu_flags st = gDispatcherLock.Lock();
+	bigtime_t now = SystemTime();
 	bool reschedule = false;
-	while (fTimerQueue.GetHead() &&
-		now >= static_cast<Timer*>(fTimerQueue.GetHead())->fWhen) {
-		Timer *expiredTimer = static_cast<Timer*>(fTimerQueue.Dequeue());
+	AdvanceWheel(now);
+	while (fHeapRoot && now >= fHeapRoot->fWhen) {
+		Timer *expiredTimer = fHeapRoot;
+		Dequeue(expiredTimer);
 		if (expiredTimer->fMode == kPeriodicTimer) {
 			expiredTimer->fWhen += expiredTimer->fInterval;
-			Enqueue(expiredTimer);
+			Enqueue(expiredTimer, now);
 		} else
 			expiredTimer->fPending = false;
 
@@ -110,45 +144,259 @@ InterruptStatus Timer::HardwareTimerInterrupt()
 			reschedule = true;
 	}
 
-	ReprogramHardwareTimer();
+	ReprogramHardwareTimer(true);
+	gDispatcherLock.Unlock(st);
 	return reschedule ? kReschedule : kHandledInterrupt;
 }
 
-void Timer::Enqueue(Timer *newTimer)
+void Timer::Enqueue(Timer *timer, bigtime_t now)
+{
+	if (timer->fWhen < now + kHeapHorizon || (timer->fWhen >> kWheelTickShift) < fWheelTick)
+		AddToHeap(timer);
+	else
+		InsertIntoWheel(timer);
+}
+
+void Timer::Dequeue(Timer *timer)
 {
-	if (fTimerQueue.GetTail() == 0)
-		fTimerQueue.Enqueue(newTimer); // Empty list.  Add this as the only element.
-	else if (static_cast<Timer*>(fTimerQueue.GetHead())->fWhen >= newTimer->fWhen)
-		fTimerQueue.AddBefore(fTimerQueue.GetHead(), newTimer); // First Element.
+	if (timer->fLevel < 0)
+		RemoveFromHeap(timer);
 	else {
-		// Search newTimer list from end to beginning and insert this in order.
-		for (Timer *timer = static_cast<Timer*>(fTimerQueue.GetTail()); timer;
-			timer = static_cast<Timer*>(fTimerQueue.GetPrevious(timer))) {
-			if (timer->fWhen < newTimer->fWhen) {
-				fTimerQueue.AddAfter(timer, newTimer);
+		timer->RemoveFromList();
+		if (fWheel[timer->fLevel][timer->fSlot].IsEmpty())
+			fWheelOccupied[timer->fLevel] &= ~(1ULL << timer->fSlot);
+
+		fWheelCount[timer->fLevel]--;
+	}
+}
+
+// The level is chosen by how far in the future the timer expires.  Timers that
+// are beyond the range of the top level wait in its furthest slot, and are
+// cascaded back into it until they are in range.
+void Timer::InsertIntoWheel(Timer *timer)
+{
+	int64 tick = timer->fWhen >> kWheelTickShift;
+	int64 delta = tick - fWheelTick;
+	ASSERT(delta >= 0);
+	int level = 0;
+	while (level < kTimerWheelLevels - 1
+		&& delta >= (1LL << (kTimerWheelSlotBits * (level + 1))))
+		level++;
+
+	if (delta >= (1LL << (kTimerWheelSlotBits * kTimerWheelLevels)))
+		tick = fWheelTick + (1LL << (kTimerWheelSlotBits * kTimerWheelLevels)) - 1;
+
+	int slot = (tick >> (kTimerWheelSlotBits * level)) & (kTimerWheelSlots - 1);
+	timer->fLevel = level;
+	timer->fSlot = slot;
+	fWheel[level][slot].Enqueue(timer);
+	fWheelOccupied[level] |= 1ULL << slot;
+	fWheelCount[level]++;
+}
+
+// The wheel skips ahead over ticks with nothing to do, so a long idle period
+// doesn't cost anything.  A slot of an upper level is cascaded when the wheel
+// reaches the first tick it covers.
+void Timer::AdvanceWheel(bigtime_t now)
+{
+	int64 lastTick = (now + kHeapHorizon) >> kWheelTickShift;
+	while (fWheelTick <= lastTick) {
+		int64 nextTick = GetNextWheelTick();
+		if (nextTick == -1 || nextTick > lastTick) {
+			fWheelTick = lastTick + 1;
+			break;
+		}
+
+		fWheelTick = nextTick;
+		for (int level = 1; level < kTimerWheelLevels; level++) {
+			int shift = kTimerWheelSlotBits * level;
+			if (fWheelTick & ((1LL << shift) - 1))
 				break;
+
+			int slot = (fWheelTick >> shift) & (kTimerWheelSlots - 1);
+			fWheelOccupied[level] &= ~(1ULL << slot);
+			while (Timer *timer = static_cast<Timer*>(fWheel[level][slot].Dequeue())) {
+				fWheelCount[level]--;
+				InsertIntoWheel(timer);
 			}
 		}
+
+		int slot = fWheelTick & (kTimerWheelSlots - 1);
+		fWheelOccupied[0] &= ~(1ULL << slot);
+		while (Timer *timer = static_cast<Timer*>(fWheel[0][slot].Dequeue())) {
+			fWheelCount[0]--;
+			AddToHeap(timer);
+		}
+
+		fWheelTick++;
 	}
 }
 
-void Timer::ReprogramHardwareTimer()
+int64 Timer::GetNextWheelTick()
 {
-	Timer *head = static_cast<Timer*>(fTimerQueue.GetHead());
-	if (head)
-		SetHardwareTimer(head->fWhen - SystemTime());
+	int64 nextTick = -1;
+	for (int level = 0; level < kTimerWheelLevels; level++) {
+		if (fWheelCount[level] == 0)
+			continue;
+
+		// The slot for the current block of an upper level has already been
+		// cascaded, unless the wheel is at the first tick of the block.
+		int shift = kTimerWheelSlotBits * level;
+		int64 block = fWheelTick >> shift;
+		if (fWheelTick & ((1LL << shift) - 1))
+			block++;
+
+		block += FindNextSlot(fWheelOccupied[level], block & (kTimerWheelSlots - 1));
+		int64 tick = block << shift;
+		if (nextTick == -1 || tick < nextTick)
+			nextTick = tick;
+	}
+
+	return nextTick;
+}
+
+bigtime_t Timer::GetNextEvent()
+{
+	bigtime_t nextEvent = kNoTimerEvent;
+	if (fHeapRoot)
+		nextEvent = fHeapRoot->fWhen;
+
+	int64 nextTick = GetNextWheelTick();
+	if (nextTick != -1 && (nextTick << kWheelTickShift) - kHeapHorizon < nextEvent)
+		nextEvent = (nextTick << kWheelTickShift) - kHeapHorizon;
+
+	return nextEvent;
+}
+
+void Timer::AddToHeap(Timer *timer)
+{
+	timer->fLevel = -1;
+	timer->fHeapChild = 0;
+	timer->fHeapSibling = 0;
+	timer->fHeapPrevious = 0;
+	fHeapRoot = MeldHeaps(fHeapRoot, timer);
+	fHeapCount++;
+}
+
+// Both timers must be roots.  The one that expires later becomes the first
+// child of the other.
+Timer* Timer::MeldHeaps(Timer *first, Timer *second)
+{
+	if (first == 0)
+		return second;
+
+	if (second == 0)
+		return first;
+
+	if (second->fWhen < first->fWhen) {
+		Timer *temp = first;
+		first = second;
+		second = temp;
+	}
+
+	second->fHeapPrevious = first;
+	second->fHeapSibling = first->fHeapChild;
+	if (first->fHeapChild)
+		first->fHeapChild->fHeapPrevious = second;
+
+	first->fHeapChild = second;
+	return first;
+}
+
+// Combine a list of sibling heaps into one, using the standard two passes:
+// meld pairs from left to right, then meld the results from right to left.
+Timer* Timer::MergeHeapPairs(Timer *first)
+{
+	Timer *pairs = 0;	// Linked in reverse order through fHeapSibling
+	while (first) {
+		Timer *second = first->fHeapSibling;
+		Timer *next = second ? second->fHeapSibling : 0;
+		first->fHeapSibling = 0;
+		first->fHeapPrevious = 0;
+		if (second) {
+			second->fHeapSibling = 0;
+			second->fHeapPrevious = 0;
+		}
+
+		Timer *pair = MeldHeaps(first, second);
+		pair->fHeapSibling = pairs;
+		pairs = pair;
+		first = next;
+	}
+
+	Timer *root = 0;
+	while (pairs) {
+		Timer *next = pairs->fHeapSibling;
+		pairs->fHeapSibling = 0;
+		root = MeldHeaps(root, pairs);
+		pairs = next;
+	}
+
+	return root;
+}
+
+void Timer::RemoveFromHeap(Timer *timer)
+{
+	if (timer == fHeapRoot)
+		fHeapRoot = MergeHeapPairs(timer->fHeapChild);
+	else {
+		// Cut this subtree out of the heap, then meld its children back in.
+		if (timer->fHeapPrevious->fHeapChild == timer)
+			timer->fHeapPrevious->fHeapChild = timer->fHeapSibling;
+		else
+			timer->fHeapPrevious->fHeapSibling = timer->fHeapSibling;
+
+		if (timer->fHeapSibling)
+			timer->fHeapSibling->fHeapPrevious = timer->fHeapPrevious;
+
+		fHeapRoot = MeldHeaps(fHeapRoot, MergeHeapPairs(timer->fHeapChild));
+	}
+
+	timer->fHeapChild = 0;
+	timer->fHeapSibling = 0;
+	timer->fHeapPrevious = 0;
+	fHeapCount--;
+}
+
+// If each processor has its own clock event device, this programs the caller's.
+// Another processor may still have an older event pending.  When it fires, that
+// processor finds nothing has expired and programs itself for the next event.
+void Timer::ReprogramHardwareTimer(bool force)
+{
+	bigtime_t nextEvent = GetNextEvent();
+	if (nextEvent == kNoTimerEvent) {
+		if (force)
+			fNextEvent = kNoTimerEvent;
+	} else if (force || nextEvent < fNextEvent) {
+		fNextEvent = nextEvent;
+		SetHardwareTimer(nextEvent - SystemTime());
+	}
 }
 
 void Timer::PrintTimerQueue(int, const char**)
 {
-	cpu_flags st = DisableInterrupts();
+	cpu_flags st = gDispatcherLock.Lock();
 	bigtime_t now = SystemTime();
-	printf("\nCurrent time %Ld\n", now);
-	printf("  %8s %16s %16s\n", "Timer", "Wake time", "relative time");
-	for (const Timer *timer = static_cast<const Timer*>(fTimerQueue.GetHead()); timer;
-		timer = static_cast<const Timer*>(fTimerQueue.GetNext(timer))) {
-		printf("  %p %16Li %16Li\n", timer, timer->fWhen, timer->fWhen - now);
+	printf("\nCurrent time %Ld (read from %s, interrupts from %s)\n", now, GetClockSourceName(),
+		GetClockEventDeviceName());
+	if (fNextEvent != kNoTimerEvent)
+		printf("Next event in %Ld us\n", fNextEvent - now);
+
+	printf("Heap: %d timers", fHeapCount);
+	if (fHeapRoot)
+		printf(", first expires in %Ld us", fHeapRoot->fWhen - now);
+
+	printf("\n\nLevel  Slot Length  Timers  Occupied Slots\n");
+	for (int level = 0; level < kTimerWheelLevels; level++) {
+		int occupiedSlots = 0;
+		for (int slot = 0; slot < kTimerWheelSlots; slot++) {
+			if (fWheelOccupied[level] & (1ULL << slot))
+				occupiedSlots++;
+		}
+
+		printf("%5d %10Ld us %7d %15d\n", level, 1LL << (kWheelTickShift
+			+ kTimerWheelSlotBits * level), fWheelCount[level], occupiedSlots);
 	}
 
-	RestoreInterrupts(st);
+	gDispatcherLock.Unlock(st);
 }
@@ -27,9 +27,21 @@ enum TimerMode {
 	kOneShotTimer
 };
 
+const int kTimerWheelLevels = 4;
+const int kTimerWheelSlotBits = 6;
+const int kTimerWheelSlots = 1 << kTimerWheelSlotBits;
+const bigtime_t kNoTimerEvent = 0x7fffffffffffffffLL;
+
 /// Device indepent timer.  This simulates an arbritrary number of virtual hardware timers,
-/// which are multiplexed onto a single hardware timer.  The HandleTimeout function will
-/// be called when the timeout expires.  This class must be derived to use its functionality.
+/// which are multiplexed onto a single clock event device.  The device is only
+/// programmed for the soonest timeout; there is no periodic tick.
+///
+/// Pending timers are kept in a hierarchical timing wheel, where inserting and
+/// cancelling take constant time.  Each level has 64 slots, and each slot covers
+/// 64 times as long as a slot in the level below it.  As time passes, the slots
+/// of upper levels are cascaded into lower ones.  Timers that will expire in the
+/// next few milliseconds are moved from the wheel into a pairing heap, which
+/// keeps them in exact order.
 ///@todo: Shouldn't Timer be derived from InterruptHandler?  It has a lot of similar semantics
 class Timer : private QueueNode {
 public:
@@ -69,20 +81,57 @@ private:
 	/// This is called when the hardware timer expires
 	static InterruptStatus HardwareTimerInterrupt();
 
-	/// Stick the given timer into the timer queue, sorted by expiration
-	static void Enqueue(Timer*);
+	/// Put a timer into the heap if it expires soon, otherwise into the wheel
+	static void Enqueue(Timer*, bigtime_t now);
+
+	/// Remove a pending timer from the heap or the wheel
+	static void Dequeue(Timer*);
+
+	/// Put a timer into the slot of the wheel that covers its expiration
+	static void InsertIntoWheel(Timer*);
+
+	/// Move timers that will expire within the heap horizon of the passed time
+	/// out of the wheel and into the heap
+	static void AdvanceWheel(bigtime_t now);
 
-	/// Set up the hardware timer for the expiration of the first (soonest) item in the timer queue
-	static void ReprogramHardwareTimer();
+	/// @returns the next wheel tick that has timers to cascade or move to the
+	///   heap, or -1 if the wheel is empty
+	static int64 GetNextWheelTick();
 
-	/// Print all data in timer queue (parameters are ignored)
+	/// @returns the time of the next expiration or wheel tick that needs to be
+	///   handled, or kNoTimerEvent if there are no timers pending
+	static bigtime_t GetNextEvent();
+
+	/// Pairing heap operations
+	static void AddToHeap(Timer*);
+	static Timer* MeldHeaps(Timer*, Timer*);
+	static Timer* MergeHeapPairs(Timer *first);
+	static void RemoveFromHeap(Timer*);
+
+	/// Set up the hardware timer for the soonest event, if it is earlier than
+	/// the one it is already set for (or always, if force is true).
+	static void ReprogramHardwareTimer(bool force);
+
+	/// Print occupancy of the timer heap and wheel (parameters are ignored)
 	static void PrintTimerQueue(int, const char**);
 
 	bigtime_t fWhen;
 	TimerMode fMode;
 	bool fPending;
 	bigtime_t fInterval;
-	static Queue fTimerQueue;
+	int fLevel;			// Level of the wheel this is in, or -1 for the heap
+	int fSlot;
+	Timer *fHeapChild;
+	Timer *fHeapSibling;
+	Timer *fHeapPrevious;	// Parent if this is the first child, otherwise left sibling
+
+	static Queue fWheel[kTimerWheelLevels][kTimerWheelSlots];
+	static uint64 fWheelOccupied[kTimerWheelLevels];
+	static int fWheelCount[kTimerWheelLevels];
+	static int64 fWheelTick;
+	static Timer *fHeapRoot;
+	static int fHeapCount;
+	static bigtime_t fNextEvent;
 };
 
 #endif
@@ -159,3 +159,8 @@ off_t VNode::Commit(off_t size)
 	return size;
 }
 
+ReadAheadState* VNode::GetReadAheadState()
+{
+	return &fReadAhead;
+}
+
@@ -49,8 +49,10 @@ public:
 	virtual status_t Read(off_t offset, void *va);
 	virtual status_t Write(off_t offset, const void *va);
 	virtual off_t Commit(off_t size);
+	virtual ReadAheadState* GetReadAheadState();
 
 private:
+	ReadAheadState fReadAhead;
 
 	char *fMappedAddress;
 	volatile int fRefCount;
@@ -0,0 +1,216 @@
+// 
+// Copyright 1998-2012 Jeff Bush
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// 
+
+#include "cpu_asm.h"
+#include "KernelDebug.h"
+#include "Semaphore.h"
+#include "Spinlock.h"
+#include "stdio.h"
+#include "string.h"
+#include "Team.h"
+#include "Thread.h"
+#include "WorkQueue.h"
+
+/// The worker threads for one priority
+struct WorkerPool {
+	const char *fName;
+	int fThreadPriority;
+	int fWorkerCount;
+
+	/// Released once for each item that can be run
+	Semaphore *fWorkAvailable;
+
+	/// All queues of this priority.  This is filled in by static constructors,
+	/// so it must not have one itself.
+	WorkQueue *fQueues;
+
+	/// Where the next worker starts looking for an item, so queues are
+	/// served round robin.  0 means the start of the list.
+	WorkQueue *fNextQueue;
+	int fBusyWorkers;
+};
+
+// Idle work runs just above the idle threads.  The high priority pool matches
+// the priority the Grim Reaper used to run at.  Page-out has its own worker,
+// so it can't be stuck behind an item that is waiting for a free page.
+static WorkerPool pools[kWorkPriorityCount] = {
+	{"idle worker", 1, 1, 0, 0, 0, 0},
+	{"worker", 16, 2, 0, 0, 0, 0},
+	{"high priority worker", 30, 1, 0, 0, 0, 0},
+	{"page out worker", 30, 1, 0, 0, 0, 0}
+};
+
+// Protects the queues and pools.  This may be acquired with the dispatcher lock
+// held (by timer callbacks), but the dispatcher lock may not be acquired while
+// holding it.
+static Spinlock workLock;
+
+WorkItem::WorkItem()
+	:	fQueued(false)
+{
+}
+
+WorkItem::~WorkItem()
+{
+	ASSERT(!fQueued);
+}
+
+DelayedWorkItem::DelayedWorkItem()
+	:	fTarget(0)
+{
+}
+
+void DelayedWorkItem::Schedule(WorkQueue *queue, bigtime_t delay)
+{
+	CancelTimeout();
+	fTarget = queue;
+	SetTimeout(SystemTime() + delay, kOneShotTimer);
+}
+
+bool DelayedWorkItem::CancelSchedule()
+{
+	return CancelTimeout();
+}
+
+InterruptStatus DelayedWorkItem::HandleTimeout()
+{
+	fTarget->Enqueue(this);
+	return kHandledInterrupt;
+}
+
+WorkQueue::WorkQueue(const char name[], WorkPriority priority, int maxConcurrency)
+	:	fName(name),
+		fPriority(priority),
+		fMaxConcurrency(maxConcurrency),
+		fActive(0),
+		fPendingCount(0),
+		fItemsRun(0)
+{
+	cpu_flags fl = workLock.Lock();
+	fPoolNext = pools[priority].fQueues;
+	pools[priority].fQueues = this;
+	workLock.Unlock(fl);
+}
+
+void WorkQueue::Enqueue(WorkItem *item)
+{
+	cpu_flags fl = workLock.Lock();
+	if (item->fQueued) {
+		workLock.Unlock(fl);
+		return;
+	}
+
+	item->fQueued = true;
+	fPending.Enqueue(item);
+	fPendingCount++;
+	bool canRun = fActive < fMaxConcurrency;
+	workLock.Unlock(fl);
+
+	// Before the workers are started, the items just wait on the queue.
+	if (canRun && pools[fPriority].fWorkAvailable)
+		pools[fPriority].fWorkAvailable->Release(1, false);
+}
+
+// Called with the work lock held
+WorkItem* WorkQueue::Dequeue()
+{
+	WorkItem *item = static_cast<WorkItem*>(fPending.Dequeue());
+	item->fQueued = false;
+	fPendingCount--;
+	fActive++;
+	return item;
+}
+
+void WorkQueue::Bootstrap()
+{
+	Team *team = Thread::GetRunningThread()->GetTeam();
+	for (int priority = 0; priority < kWorkPriorityCount; priority++) {
+		WorkerPool &pool = pools[priority];
+		int runnable = 0;
+		cpu_flags fl = workLock.Lock();
+		for (WorkQueue *queue = pool.fQueues; queue; queue = queue->fPoolNext)
+			runnable += MIN(queue->fPendingCount, queue->fMaxConcurrency);
+
+		workLock.Unlock(fl);
+		pool.fWorkAvailable = new Semaphore(pool.fName, runnable);
+		for (int index = 0; index < pool.fWorkerCount; index++)
+			new Thread(pool.fName, team, WorkerLoop, &pool, pool.fThreadPriority);
+	}
+
+	AddDebugCommand("workq", "Show work queues", PrintQueues);
+}
+
+// Each time the semaphore is acquired, there should be an item that can run,
+// but there may not be if the worker that released it ran the item first.
+int WorkQueue::WorkerLoop(void *_pool)
+{
+	WorkerPool *pool = static_cast<WorkerPool*>(_pool);
+	for (;;) {
+		pool->fWorkAvailable->Wait();
+		cpu_flags fl = workLock.Lock();
+		WorkQueue *start = pool->fNextQueue ? pool->fNextQueue : pool->fQueues;
+		WorkQueue *queue = start;
+		do {
+			if (queue->fPendingCount > 0 && queue->fActive < queue->fMaxConcurrency)
+				break;
+
+			queue = queue->fPoolNext ? queue->fPoolNext : pool->fQueues;
+		} while (queue != start);
+
+		if (queue->fPendingCount == 0 || queue->fActive >= queue->fMaxConcurrency) {
+			workLock.Unlock(fl);
+			continue;
+		}
+
+		pool->fNextQueue = queue->fPoolNext;
+		WorkItem *item = queue->Dequeue();
+		pool->fBusyWorkers++;
+		workLock.Unlock(fl);
+
+		// The item may delete itself, so it is not touched after this.
+		item->Run();
+
+		fl = workLock.Lock();
+		pool->fBusyWorkers--;
+		queue->fActive--;
+		queue->fItemsRun++;
+		bool moreWork = queue->fPendingCount > 0;
+		workLock.Unlock(fl);
+
+		// Items that were added while the limit was reached didn't release
+		// the semaphore.
+		if (moreWork)
+			pool->fWorkAvailable->Release(1, false);
+	}
+
+	return 0;
+}
+
+void WorkQueue::PrintQueues(int, const char**)
+{
+	for (int priority = kWorkPriorityCount - 1; priority >= 0; priority--) {
+		const WorkerPool &pool = pools[priority];
+		printf("%s: %d threads at priority %d, %d busy\n", pool.fName, pool.fWorkerCount,
+			pool.fThreadPriority, pool.fBusyWorkers);
+		printf("  Name                 Pending Running Limit    Completed\n");
+		for (const WorkQueue *queue = pool.fQueues; queue; queue = queue->fPoolNext) {
+			printf("  %20s %7d %7d %5d %12Ld\n", queue->fName, queue->fPendingCount,
+				queue->fActive, queue->fMaxConcurrency, queue->fItemsRun);
+		}
+
+		printf("\n");
+	}
+}
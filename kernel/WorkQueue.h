@@ -0,0 +1,114 @@
+// 
+// Copyright 1998-2012 Jeff Bush
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// 
+
+/// @file WorkQueue.h
+///	Running background work in a shared pool of kernel threads
+
+#ifndef _WORK_QUEUE_H
+#define _WORK_QUEUE_H
+
+#include "Queue.h"
+#include "Timer.h"
+#include "types.h"
+
+/// Work queues are served by a pool of worker threads for each of these.
+enum WorkPriority {
+	/// Only runs when processors would otherwise be idle
+	kWorkPriorityIdle,
+	kWorkPriorityNormal,
+	kWorkPriorityHigh,
+
+	/// Freeing memory.  This has a worker of its own, because allocations
+	/// wait for it.  Items on these queues must not allocate memory.
+	kWorkPriorityPageOut
+};
+
+const int kWorkPriorityCount = 4;
+
+class WorkQueue;
+
+/// Something to be done by a worker thread.  Derived classes override Run.
+class WorkItem : private QueueNode {
+public:
+	WorkItem();
+	virtual ~WorkItem();
+
+	/// Called in a worker thread when this item reaches the head of its queue.
+	/// This may block, but while it does the worker can't run other items.
+	/// The item may requeue or delete itself.
+	virtual void Run() = 0;
+
+private:
+	bool fQueued;
+
+	friend class WorkQueue;
+};
+
+/// A work item that is put on a queue once a timeout has passed
+class DelayedWorkItem : public WorkItem, private Timer {
+public:
+	DelayedWorkItem();
+
+	/// Put this item on a queue after a delay.  If it is already waiting, the
+	/// delay is started over.
+	/// @param delay Time to wait, in microseconds
+	void Schedule(WorkQueue*, bigtime_t delay);
+
+	/// Stop waiting.  This doesn't affect the item if it is already queued.
+	/// @returns true if the item was waiting
+	bool CancelSchedule();
+
+private:
+	virtual InterruptStatus HandleTimeout();
+
+	WorkQueue *fTarget;
+};
+
+/// A queue of work items.  Many queues share the worker threads of a priority.
+/// Items on one queue run in the order they were added, and no more than the
+/// queue's concurrency limit of them run at the same time.
+class WorkQueue {
+public:
+	/// @param maxConcurrency The most items from this queue that may run at once.
+	///   If this is 1, items run one at a time and don't need to synchronize
+	///   with each other.
+	WorkQueue(const char name[], WorkPriority, int maxConcurrency = 1);
+
+	/// Add an item to the end of this queue.  If it is already on a queue, this
+	/// does nothing.  This may be called from interrupt handlers and timer
+	/// callbacks.
+	void Enqueue(WorkItem*);
+
+	/// Called once at boot, after the kernel team has been created, to start
+	/// the worker threads.  Items may be queued before this.
+	static void Bootstrap();
+
+private:
+	WorkItem* Dequeue();
+	static int WorkerLoop(void *pool);
+	static void PrintQueues(int, const char**);
+
+	const char *fName;
+	WorkPriority fPriority;
+	int fMaxConcurrency;
+	int fActive;
+	int fPendingCount;
+	int64 fItemsRun;
+	Queue fPending;
+	WorkQueue *fPoolNext;
+};
+
+#endif
@@ -0,0 +1,259 @@
+// 
+// Copyright 1998-2012 Jeff Bush
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// 
+
+//
+//	System time.  The time stamp counter is used if it runs at a constant rate,
+//	with a counter in the 8253 PIT as a fallback.
+//
+
+#include "AddressSpace.h"
+#include "Area.h"
+#include "ClockSource.h"
+#include "cpu_asm.h"
+#include "KernelDebug.h"
+#include "PageCache.h"
+#include "Spinlock.h"
+#include "stdio.h"
+#include "time_page.h"
+#include "Timer.h"
+
+const bigtime_t kPitClockRate = 1193180;
+
+// Number of PIT clocks the time stamp counter is measured over (about 10ms)
+const unsigned int kCalibrationClocks = 11932;
+
+// The two calibration runs must agree this closely (in parts per thousand) for
+// the time stamp counter to be trusted.
+const int64 kCalibrationTolerance = 10;
+
+// The PIT counter wraps every 55ms, so it is read more often than that to
+// keep track of the high bits.
+const bigtime_t kPitSampleInterval = 25000;
+
+const unsigned int kCpuidEdxTsc = 1 << 4;
+const unsigned int kCpuidEdxInvariantTsc = 1 << 8;	// function 0x80000007
+
+/// A free running counter that system time is computed from
+class ClockSource {
+public:
+	virtual bigtime_t GetTime() = 0;
+	virtual const char* GetName() const = 0;
+};
+
+/// Reading the time stamp counter takes a few cycles and doesn't need a lock.
+/// The conversion parameters are the same ones that are exported to user space.
+class TscClockSource : public ClockSource {
+public:
+	TscClockSource();
+	void SetFrequency(int64 ticksPerSecond);
+	inline const TimePage& GetParameters() const;
+	virtual bigtime_t GetTime();
+	virtual const char* GetName() const;
+
+private:
+	TimePage fParameters;
+};
+
+/// Channel 2 of the PIT (normally used for the speaker), counting down
+/// continuously.  It is only 16 bits wide, so it is extended in software.
+class PitClockSource : public ClockSource {
+public:
+	PitClockSource();
+	void Start(bigtime_t now);
+	virtual bigtime_t GetTime();
+	virtual const char* GetName() const;
+
+private:
+	Spinlock fLock;
+	unsigned int fLastCount;
+	int64 fClocks;
+	bigtime_t fTimeBase;
+};
+
+/// Samples the PIT often enough that it can't wrap unnoticed
+class PitSampleTimer : public Timer {
+private:
+	virtual InterruptStatus HandleTimeout();
+};
+
+static TscClockSource tscClockSource;
+static PitClockSource pitClockSource;
+static PitSampleTimer pitSampleTimer;
+static ClockSource *clockSource = &tscClockSource;
+static PageCache *timePageCache;
+static TimePage *timePage;
+
+// Until it is calibrated, the time stamp counter is assumed to run at 150MHz.
+TscClockSource::TscClockSource()
+{
+	fParameters.sequence = 0;
+	fParameters.tscValid = 1;
+	fParameters.tscBase = 0;
+	fParameters.timeBase = 0;
+	fParameters.tscMultiplier = static_cast<uint>((1000000LL << 32) / 150000000);
+}
+
+// The time is kept continuous across the change.
+void TscClockSource::SetFrequency(int64 ticksPerSecond)
+{
+	int64 tsc = rdtsc();
+	fParameters.timeBase = tsc_to_system_time(&fParameters, tsc);
+	fParameters.tscBase = tsc;
+	fParameters.tscMultiplier = static_cast<uint>((1000000LL << 32) / ticksPerSecond);
+}
+
+inline const TimePage& TscClockSource::GetParameters() const
+{
+	return fParameters;
+}
+
+bigtime_t TscClockSource::GetTime()
+{
+	return tsc_to_system_time(&fParameters, rdtsc());
+}
+
+const char* TscClockSource::GetName() const
+{
+	return "time stamp counter";
+}
+
+PitClockSource::PitClockSource()
+	:	fLastCount(0),
+		fClocks(0),
+		fTimeBase(0)
+{
+}
+
+void PitClockSource::Start(bigtime_t now)
+{
+	fTimeBase = now;
+	write_io_8((read_io_8(0x61) & ~2) | 1, 0x61);	// Gate on, speaker off
+	write_io_8(0xb4, 0x43);		// Channel 2, rate generator
+	write_io_8(0, 0x42);		// Count of 0 is 65536
+	write_io_8(0, 0x42);
+	fLastCount = 0;
+}
+
+bigtime_t PitClockSource::GetTime()
+{
+	cpu_flags fl = fLock.Lock();
+	write_io_8(0x80, 0x43);		// Latch channel 2
+	unsigned int count = read_io_8(0x42);
+	count |= read_io_8(0x42) << 8;
+	fClocks += (fLastCount - count) & 0xffff;	// Counts down
+	fLastCount = count;
+	bigtime_t now = fTimeBase + fClocks * 1000000 / kPitClockRate;
+	fLock.Unlock(fl);
+	return now;
+}
+
+const char* PitClockSource::GetName() const
+{
+	return "8253 PIT";
+}
+
+InterruptStatus PitSampleTimer::HandleTimeout()
+{
+	pitClockSource.GetTime();
+	return kHandledInterrupt;
+}
+
+// Count time stamp counter ticks while PIT channel 2 counts down.  Its output
+// goes high (and shows up in port 0x61) when it reaches zero.
+static int64 MeasureTscFrequency()
+{
+	write_io_8((read_io_8(0x61) & ~2) | 1, 0x61);	// Gate on, speaker off
+	write_io_8(0xb0, 0x43);		// Channel 2, interrupt on terminal count
+	write_io_8(kCalibrationClocks & 0xff, 0x42);
+	write_io_8(kCalibrationClocks >> 8, 0x42);
+	int64 start = rdtsc();
+	while ((read_io_8(0x61) & 0x20) == 0)
+		;
+
+	return (rdtsc() - start) * kPitClockRate / kCalibrationClocks;
+}
+
+void ClockSourceBootstrap()
+{
+	unsigned int eax, ebx, ecx, edx;
+	cpuid(1, eax, ebx, ecx, edx);
+	bool hasTsc = (edx & kCpuidEdxTsc) != 0;
+	bool invariant = false;
+	cpuid(0x80000000, eax, ebx, ecx, edx);
+	if (eax >= 0x80000007) {
+		cpuid(0x80000007, eax, ebx, ecx, edx);
+		invariant = (edx & kCpuidEdxInvariantTsc) != 0;
+	}
+
+	cpu_flags fl = DisableInterrupts();
+	int64 frequency = 0;
+	if (hasTsc) {
+		// Older processors don't report whether the counter rate is constant.
+		// Calibrate twice, and don't trust it if the rate wanders.
+		int64 first = MeasureTscFrequency();
+		int64 second = MeasureTscFrequency();
+		int64 difference = first > second ? first - second : second - first;
+		if (first > 1000000 && difference * 1000 / first <= kCalibrationTolerance)
+			frequency = (first + second) / 2;
+	}
+
+	if (frequency) {
+		tscClockSource.SetFrequency(frequency);
+		RestoreInterrupts(fl);
+		printf("Time stamp counter is %Ld.%03Ld MHz%s\n", frequency / 1000000,
+			(frequency / 1000) % 1000, invariant ? " (invariant)" : "");
+	} else {
+		pitClockSource.Start(tscClockSource.GetTime());
+		clockSource = &pitClockSource;
+		RestoreInterrupts(fl);
+		pitSampleTimer.SetTimeout(kPitSampleInterval, kPeriodicTimer);
+		printf("Time stamp counter is unusable, using %s\n", clockSource->GetName());
+	}
+}
+
+void TimePageBootstrap()
+{
+	timePageCache = new PageCache;
+	Area *area = AddressSpace::GetKernelAddressSpace()->CreateArea("time page", PAGE_SIZE,
+		AREA_WIRED, SYSTEM_READ | SYSTEM_WRITE, timePageCache, 0);
+	if (area == 0)
+		panic("Can't create time page");
+
+	// No team has mapped the page yet, so the parameters can be filled in
+	// without changing the sequence number.
+	timePage = reinterpret_cast<TimePage*>(area->GetBaseAddress());
+	timePage->tscValid = clockSource == &tscClockSource;
+	timePage->tscMultiplier = tscClockSource.GetParameters().tscMultiplier;
+	timePage->tscBase = tscClockSource.GetParameters().tscBase;
+	timePage->timeBase = tscClockSource.GetParameters().timeBase;
+}
+
+void MapTimePage(AddressSpace *addressSpace)
+{
+	if (addressSpace->CreateArea("time page", PAGE_SIZE, AREA_WIRED, USER_READ | SYSTEM_READ,
+		timePageCache, 0, TIME_PAGE_ADDRESS, EXACT_ADDRESS) == 0)
+		panic("Can't map time page");
+}
+
+const char* GetClockSourceName()
+{
+	return clockSource->GetName();
+}
+
+bigtime_t SystemTime()
+{
+	return clockSource->GetTime();
+}
@@ -0,0 +1,38 @@
+// 
+// Copyright 1998-2012 Jeff Bush
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// 
+
+/// @file ClockSource.h
+#ifndef _CLOCK_SOURCE_H
+#define _CLOCK_SOURCE_H
+
+class AddressSpace;
+
+/// Called early at boot, before anything depends on the rate of SystemTime.
+/// This calibrates the time stamp counter against the PIT and uses it for system
+/// time if it is stable.  Otherwise, a slower counter in the PIT is used.
+void ClockSourceBootstrap();
+
+/// Called once the virtual memory system is running to create the page that
+/// is mapped into each team.
+void TimePageBootstrap();
+
+/// Map the read-only time page into a new user address space at TIME_PAGE_ADDRESS
+void MapTimePage(AddressSpace*);
+
+/// @returns the name of the counter system time is read from
+const char* GetClockSourceName();
+
+#endif
@@ -15,56 +15,280 @@
 // 
 
 //
-//	Interface to 8253 Programmable Interrupt Timer
+//	Clock event devices: the 8253 Programmable Interrupt Timer and the
+//	local APIC timer.
 //
 
 #include "cpu_asm.h"
+#include "HardwareTimer.h"
 #include "InterruptHandler.h"
-#include "Timer.h"
+#include "Processor.h"
+#include "stdio.h"
+#include "string.h"
+#include "x86.h"
 
-typedef InterruptStatus (*TimerCallback)();
 const bigtime_t kPitClockRate = 1193180;
-const bigtime_t kMaxTimerInterval = (bigtime_t) 0xffff * 1000000 / kPitClockRate;
+const bigtime_t kMaxPitInterval = (bigtime_t) 0xffff * 1000000 / kPitClockRate;
 
-class TimerDispatcher : public InterruptHandler {
+// Longer intervals are broken up, which also bounds the intermediate results
+// when converting to clock ticks.
+const bigtime_t kMaxLocalTimerInterval = 1000000;
+const bigtime_t kCalibrationTime = 10000;
+
+// Local APIC timer registers, as indices into the memory mapped register array
+const int kApicTimerVectorRegister = 0x320 / 4;
+const int kApicTimerInitialCountRegister = 0x380 / 4;
+const int kApicTimerCurrentCountRegister = 0x390 / 4;
+const int kApicTimerDivideRegister = 0x3e0 / 4;
+
+const unsigned int kApicTimerMasked = 1 << 16;
+const unsigned int kApicTimerTscDeadlineMode = 2 << 17;
+const unsigned int kApicTimerDivideBy16 = 3;
+const unsigned int kTscDeadlineMsr = 0x6e0;
+
+// Feature flags returned by cpuid function 1
+const unsigned int kCpuidEdxApic = 1 << 9;
+const unsigned int kCpuidEcxTscDeadline = 1 << 24;
+
+/// A device that can interrupt at a requested time.  The timer queue is
+/// multiplexed onto one of these.
+class ClockEventDevice {
+public:
+	/// Arrange for an interrupt after the passed number of microseconds.  If the
+	/// interval is longer than the device supports, the interrupt occurs early
+	/// and the timer code programs the remainder.
+	virtual void SetNextEvent(bigtime_t relativeTimeout) = 0;
+
+	/// Set up this device on the calling processor
+	virtual void StartProcessor();
+
+	virtual const char* GetName() const = 0;
+};
+
+/// 8253 Programmable Interrupt Timer.  There is one for the whole system.
+/// It takes three slow port writes to program and has a maximum interval of
+/// about 55ms.
+class PitClockEvent : public ClockEventDevice, public InterruptHandler {
+public:
+	void Start();
+	void Stop();
+	virtual void SetNextEvent(bigtime_t relativeTimeout);
+	virtual const char* GetName() const;
+	virtual InterruptStatus HandleInterrupt();
+};
+
+/// The local APIC timer in one-shot mode.  Each processor has its own, so the
+/// interrupt occurs on the processor that programmed it.
+class LocalApicClockEvent : public ClockEventDevice {
 public:
-	TimerDispatcher(TimerCallback callback);
-	InterruptStatus HandleInterrupt();
+	bool Calibrate();
+	virtual void SetNextEvent(bigtime_t relativeTimeout);
+	virtual void StartProcessor();
+	virtual const char* GetName() const;
 
 private:
-	TimerCallback fCallback;
+	int64 fTicksPerSecond;
+	bigtime_t fMaxInterval;
 };
 
-TimerDispatcher::TimerDispatcher(TimerCallback callback)
-	:	fCallback(callback)
-{
-	ObserveInterrupt(0);
-}
+/// The local APIC timer in TSC-deadline mode.  It is programmed with a single
+/// wrmsr and has the resolution of the time stamp counter.
+class TscDeadlineClockEvent : public ClockEventDevice {
+public:
+	bool Calibrate();
+	virtual void SetNextEvent(bigtime_t relativeTimeout);
+	virtual void StartProcessor();
+	virtual const char* GetName() const;
 
-InterruptStatus TimerDispatcher::HandleInterrupt()
+private:
+	int64 fTicksPerSecond;
+};
+
+static TimerCallback timerCallback;
+static PitClockEvent pitClockEvent;
+static LocalApicClockEvent localApicClockEvent;
+static TscDeadlineClockEvent tscDeadlineClockEvent;
+static ClockEventDevice *clockEventDevice = &pitClockEvent;
+
+void ClockEventDevice::StartProcessor()
 {
-	return fCallback();
 }
 
-void HardwareTimerBootstrap(TimerCallback callback)
+void PitClockEvent::Start()
 {
-	write_io_8(0x30, 0x43);		
+	write_io_8(0x30, 0x43);
 	write_io_8(0, 0x40);
 	write_io_8(0, 0x40);
-	new TimerDispatcher(callback);
+	ObserveInterrupt(0);
 }
 
-void SetHardwareTimer(bigtime_t relativeTimeout)
+void PitClockEvent::Stop()
+{
+	IgnoreInterrupts();
+}
+
+void PitClockEvent::SetNextEvent(bigtime_t relativeTimeout)
 {
 	bigtime_t nextEventClocks;
 	if (relativeTimeout <= 0)
-		nextEventClocks = 2;			
-	else if (relativeTimeout < kMaxTimerInterval)
+		nextEventClocks = 2;
+	else if (relativeTimeout < kMaxPitInterval)
 		nextEventClocks = relativeTimeout * kPitClockRate / 1000000;
 	else
 		nextEventClocks = 0xffff;
 
-	write_io_8(0x30, 0x43);		
+	write_io_8(0x30, 0x43);
 	write_io_8(nextEventClocks & 0xff, 0x40);
 	write_io_8((nextEventClocks >> 8) & 0xff, 0x40);
 }
+
+const char* PitClockEvent::GetName() const
+{
+	return "8253 PIT";
+}
+
+InterruptStatus PitClockEvent::HandleInterrupt()
+{
+	return timerCallback();
+}
+
+// The timer counts down from its initial count for a while, timed by the system
+// clock.  Interrupts must be disabled.
+bool LocalApicClockEvent::Calibrate()
+{
+	volatile int *apic = Processor::GetLocalApicRegisters();
+	apic[kApicTimerDivideRegister] = kApicTimerDivideBy16;
+	apic[kApicTimerVectorRegister] = kApicTimerMasked | kLocalTimerInterrupt;
+	apic[kApicTimerInitialCountRegister] = 0xffffffff;
+	bigtime_t start = SystemTime();
+	bigtime_t elapsed;
+	while ((elapsed = SystemTime() - start) < kCalibrationTime)
+		SpinPause();
+
+	unsigned int ticks = 0xffffffff - static_cast<unsigned int>(apic[kApicTimerCurrentCountRegister]);
+	apic[kApicTimerInitialCountRegister] = 0;
+	fTicksPerSecond = static_cast<int64>(ticks) * 1000000 / elapsed;
+	if (fTicksPerSecond == 0)
+		return false;
+
+	fMaxInterval = MIN(kMaxLocalTimerInterval, 0xffffffffLL * 1000000 / fTicksPerSecond);
+	return true;
+}
+
+void LocalApicClockEvent::SetNextEvent(bigtime_t relativeTimeout)
+{
+	unsigned int ticks = 1;
+	if (relativeTimeout > 0) {
+		ticks = MIN(relativeTimeout, fMaxInterval) * fTicksPerSecond / 1000000;
+		if (ticks == 0)
+			ticks = 1;	// Zero would stop the timer.
+	}
+
+	Processor::GetLocalApicRegisters()[kApicTimerInitialCountRegister] = ticks;
+}
+
+void LocalApicClockEvent::StartProcessor()
+{
+	volatile int *apic = Processor::GetLocalApicRegisters();
+	apic[kApicTimerDivideRegister] = kApicTimerDivideBy16;
+	apic[kApicTimerVectorRegister] = kLocalTimerInterrupt;
+}
+
+const char* LocalApicClockEvent::GetName() const
+{
+	return "local APIC timer";
+}
+
+// Interrupts must be disabled.
+bool TscDeadlineClockEvent::Calibrate()
+{
+	bigtime_t start = SystemTime();
+	int64 startTsc = rdtsc();
+	bigtime_t elapsed;
+	while ((elapsed = SystemTime() - start) < kCalibrationTime)
+		SpinPause();
+
+	fTicksPerSecond = (rdtsc() - startTsc) * 1000000 / elapsed;
+	return fTicksPerSecond != 0;
+}
+
+// A deadline that has already passed interrupts immediately.
+void TscDeadlineClockEvent::SetNextEvent(bigtime_t relativeTimeout)
+{
+	int64 ticks = 0;
+	if (relativeTimeout > 0)
+		ticks = MIN(relativeTimeout, kMaxLocalTimerInterval) * fTicksPerSecond / 1000000;
+
+	wrmsr(kTscDeadlineMsr, rdtsc() + ticks);
+}
+
+void TscDeadlineClockEvent::StartProcessor()
+{
+	Processor::GetLocalApicRegisters()[kApicTimerVectorRegister] = kApicTimerTscDeadlineMode
+		| kLocalTimerInterrupt;
+
+	// The mode change must take effect before the deadline is written.
+	MemoryFence();
+}
+
+const char* TscDeadlineClockEvent::GetName() const
+{
+	return "local APIC timer (TSC-deadline)";
+}
+
+void HardwareTimerBootstrap(TimerCallback callback)
+{
+	timerCallback = callback;
+	pitClockEvent.Start();
+}
+
+void LocalTimerBootstrap()
+{
+	unsigned int eax, ebx, ecx, edx;
+	cpuid(1, eax, ebx, ecx, edx);
+	if ((edx & kCpuidEdxApic) == 0)
+		return;
+
+	cpu_flags fl = DisableInterrupts();
+	ClockEventDevice *device = 0;
+	if ((ecx & kCpuidEcxTscDeadline) && tscDeadlineClockEvent.Calibrate())
+		device = &tscDeadlineClockEvent;
+	else if (localApicClockEvent.Calibrate())
+		device = &localApicClockEvent;
+
+	if (device) {
+		// Only the boot processor is running, and the PIT only interrupts it, so
+		// there can be no timer interrupts in progress.
+		pitClockEvent.Stop();
+		clockEventDevice = device;
+		device->StartProcessor();
+
+		// Interrupt right away.  The timer interrupt will program the device for
+		// the first timer in the queue.
+		device->SetNextEvent(0);
+	}
+
+	RestoreInterrupts(fl);
+	printf("Timer interrupts from %s\n", clockEventDevice->GetName());
+}
+
+void StartLocalTimer()
+{
+	clockEventDevice->StartProcessor();
+}
+
+void SetHardwareTimer(bigtime_t relativeTimeout)
+{
+	clockEventDevice->SetNextEvent(relativeTimeout);
+}
+
+InterruptStatus HandleLocalTimerInterrupt()
+{
+	Processor::AcknowledgeInterrupt();
+	return timerCallback();
+}
+
+const char* GetClockEventDeviceName()
+{
+	return clockEventDevice->GetName();
+}
@@ -0,0 +1,50 @@
+// 
+// Copyright 1998-2012 Jeff Bush
+// 
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+// 
+//     http://www.apache.org/licenses/LICENSE-2.0
+// 
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+// 
+
+/// @file HardwareTimer.h
+#ifndef _HARDWARE_TIMER_H
+#define _HARDWARE_TIMER_H
+
+#include "InterruptHandler.h"
+#include "types.h"
+
+typedef InterruptStatus (*TimerCallback)();
+
+/// Called early at boot to start delivering timer interrupts to the passed
+/// callback.  Until LocalTimerBootstrap is called, they come from the 8253 PIT.
+void HardwareTimerBootstrap(TimerCallback callback);
+
+/// Called on the boot processor after the local APIC has been mapped.  This
+/// calibrates the local APIC timer and switches to it, using TSC-deadline mode
+/// if the processor supports it.  If the local APIC timer can't be used, the
+/// PIT stays in use.
+void LocalTimerBootstrap();
+
+/// Called by each application processor as it starts to set up its local timer
+void StartLocalTimer();
+
+/// Arrange for the callback to be invoked after relativeTimeout microseconds.
+/// When the local APIC timer is in use, the interrupt occurs on the calling
+/// processor.  This must be called with interrupts disabled.
+void SetHardwareTimer(bigtime_t relativeTimeout);
+
+/// Called from the trap handler when the local APIC timer expires
+InterruptStatus HandleLocalTimerInterrupt();
+
+/// @returns the name of the device timer interrupts currently come from
+const char* GetClockEventDeviceName();
+
+#endif
@@ -14,112 +14,488 @@
 // limitations under the License.
 // 
 
+#include "Alloc.h"
 #include "BootParams.h"
 #include "cpu_asm.h"
 #include "memory_layout.h"
 #include "Page.h"
 #include "PhysicalMap.h"
-#include "Queue.h"
+#include "Processor.h"
 #include "stdio.h"
 #include "string.h"
+#include "Thread.h"
+#include "WorkQueue.h"
 #include "x86.h"
 
-class LockedPage : public QueueNode {
+extern "C" {
+	extern char EnablePaeStart[];
+	extern char EnablePaeEnd[];
+};
+
+// The IO area starts with temporary mappings.  The page tables that map them
+// map themselves in their first entries, and the rest are divided between the
+// processors.
+const unsigned int kTempMapSize = 0x400000;
+const int kTempSlotsPerProcessor = (1024 - 2) / kMaxProcessors;
+
+// Temporary mappings of one processor.  Only threads that are pinned to the
+// processor use them, so a slot is remapped with a local TLB flush.
+struct TempMapSlots {
+	paddr_t pa[kTempSlotsPerProcessor];
+	int mapCount[kTempSlotsPerProcessor];
+	int nextSlot;
+	int requests;
+	int hits;
+};
+
+// Above this many pages, a TLB flush batch reloads the page directory rather
+// than invalidating each page.
+const int kMaxTlbFlushPages = 32;
+const int kMaxFreedPageTables = 16;
+const int kMaxRemovedMappings = 32;
+
+// Collects the translations that are removed while unmapping a range, so they
+// are flushed together.  Other processors are interrupted once per batch.
+// Pages stay mapped, so they can't be reclaimed, and page tables that are no
+// longer used stay allocated until after the flush, when no processor can
+// still be using them.
+class TlbFlushBatch {
+public:
+	TlbFlushBatch(unsigned int pageDirectory, bool isKernel);
+	void Add(unsigned int va);
+	void RemoveMappings(paddr_t pa, int count, bool modified);
+	void FreePageTable(paddr_t pa);
+	void Flush();
+
+private:
+	// A run of physically contiguous pages that were unmapped
+	struct RemovedMapping {
+		paddr_t pa;
+		int count;
+		bool modified;
+	};
+
+	unsigned int fPageDirectory;
+	bool fIsKernel;
+	int fPageCount;
+	unsigned int fPages[kMaxTlbFlushPages];
+	int fMappingCount;
+	RemovedMapping fMappings[kMaxRemovedMappings];
+	int fPageTableCount;
+	paddr_t fPageTables[kMaxFreedPageTables];
+};
+
+/// Times scans through memory mapped with 4k pages and with large pages, to
+/// show the cost of TLB misses.  It is started from the debugger and reports
+/// when done.
+class TlbBenchmark : public WorkItem {
 public:
-	unsigned int pa;
-	LockedPage *hashNext;
-	int mapCount;
-	LockedPage **hashPrev;
+	virtual void Run();
+
+	volatile bool fBusy;
+	int fBlockCount;	// Size of each buffer, in large pages
 };
 
 const unsigned int kPageMask = ~(PAGE_SIZE - 1);
+
+// Physical address bits of a page table entry.  With PAE, the top bit is the
+// no-execute flag.
+const uint64 kEntryAddressMask = 0x000ffffffffff000ULL;
+
+// 32-bit page tables have 1024 entries, and a page directory entry maps 4MB.
+// PAE tables have 512 entries, and a page directory entry maps 2MB.  There
+// are four PAE page directories, one for each 1GB, listed in the page
+// directory pointer table.
+const unsigned int kLegacyLargePageSize = 0x400000;
+const unsigned int kPaeLargePageSize = 0x200000;
+const int kPaeEntriesPerTable = 512;
+const unsigned int kPageDirPointerSpan = 0x40000000;
+
+// cpuid function 1 edx flags, and CR4 bits to enable them
+const unsigned int kCpuidEdxPse = 1 << 3;
+const unsigned int kCpuidEdxPae = 1 << 6;
+const unsigned int kCR4Pse = 1 << 4;
+const unsigned int kCR4Pae = 1 << 5;
+
+// cpuid function 0x80000001 edx flag and EFER bit for no-execute pages
+const unsigned int kCpuidExtendedEdxNx = 1 << 20;
+const unsigned int kMsrEfer = 0xc0000080;
+const int64 kEferNoExecute = 1 << 11;
+
 List PhysicalMap::fPhysicalMaps;
-LockedPage *PhysicalMap::fLockedPageHash[kLockedPageHashSize];
-Queue PhysicalMap::fInactiveLockedPages;
-LockedPage *PhysicalMap::fLockedPages = 0;
+Spinlock PhysicalMap::fPhysicalMapsLock;
+TempMapSlots *PhysicalMap::fTempMapSlots = 0;
+unsigned int PhysicalMap::fDirectMapSize = 0;
 PhysicalMap *PhysicalMap::fKernelPhysicalMap = 0;
-int PhysicalMap::fLockPageHits = 0;
-int PhysicalMap::fLockPageRequests = 0;
+bool PhysicalMap::fLargePages = false;
+int PhysicalMap::fLargePageCount = 0;
+bool PhysicalMap::fPae = false;
+bool PhysicalMap::fNoExecute = false;
+unsigned int PhysicalMap::fLargePageSize = kLegacyLargePageSize;
+int PhysicalMap::fPagesPerTable = 1024;
+
+const int kMaxTlbBenchmarkBlocks = 16;
+const int kTlbBenchmarkPasses = 16;
+
+// Pages are visited in this stride for random scans.  It is odd and doesn't
+// divide any block count, so every page is visited once per pass.
+const int kTlbBenchmarkStride = 7919;
+
+static TlbBenchmark tlbBenchmark;
+static WorkQueue tlbBenchmarkQueue("tlb benchmark", kWorkPriorityNormal);
 
 PhysicalMap::PhysicalMap()
 	:	fMappedPageCount(0),
 		fLock("Physical Map Lock")
 {
+	if (fPae) {
+		// User space has page directories of its own, and the one for kernel
+		// space is shared by all maps.  The processor loads the page directory
+		// pointer table from a 32-bit address, so it must be below 4GB.
+		paddr_t pageDirPointerTable = Page::AllocContiguous(0, kPageZoneNormal);
+		if (pageDirPointerTable == INVALID_PAGE)
+			panic("No memory below 4GB for a page directory pointer table");
+
+		fPageDirectory = static_cast<unsigned int>(pageDirPointerTable);
+		for (int i = 0; i < 3; i++) {
+			Page *pageDirectory = Page::Alloc(true);
+			pageDirectory->Wire();
+			fPageDirs[i] = pageDirectory->GetPhysicalAddress();
+		}
+
+		fPageDirs[3] = fKernelPhysicalMap->fPageDirs[3];
+		uint64 *pdpt = reinterpret_cast<uint64*>(LockPhysicalPage(pageDirPointerTable));
+		ClearPage(pdpt);
+		for (int i = 0; i < 4; i++)
+			pdpt[i] = fPageDirs[i] | kPagePresent;
+
+		UnlockPhysicalPage(pdpt);
+		cpu_flags fl = fPhysicalMapsLock.Lock();
+		fPhysicalMaps.AddToTail(this);
+		fPhysicalMapsLock.Unlock(fl);
+		return;
+	}
+
 	Page *pageDirectory = Page::Alloc();
 	pageDirectory->Wire();
 	fPageDirectory = pageDirectory->GetPhysicalAddress();
 
-	// Set up kernel space page directory entries.
+	// Set up kernel space page directory entries.  The list lock is held
+	// while copying so a kernel page table that is added concurrently will
+	// either be copied here or be propagated to this map by Map.
+	cpu_flags fl = fPhysicalMapsLock.Lock();
 	int *srcPageDir = reinterpret_cast<int*>(LockPhysicalPage(fKernelPhysicalMap->fPageDirectory));
 	int *destPageDir = reinterpret_cast<int*>(LockPhysicalPage(fPageDirectory));
 	memset(destPageDir, 0, 768 * 4);
 	memcpy(destPageDir + 768, srcPageDir + 768, 256 * 4);
 	UnlockPhysicalPage(srcPageDir);
 	UnlockPhysicalPage(destPageDir);
-
-	cpu_flags fl = DisableInterrupts();
 	fPhysicalMaps.AddToTail(this);
-	RestoreInterrupts(fl);
+	fPhysicalMapsLock.Unlock(fl);
 }
 
 PhysicalMap::~PhysicalMap()
 {
-	cpu_flags fl = DisableInterrupts();
+	cpu_flags fl = fPhysicalMapsLock.Lock();
 	fPhysicalMaps.Remove(this);
-	RestoreInterrupts(fl);
+	fPhysicalMapsLock.Unlock(fl);
 
 	// Since the context switching code can lazily skip changing address
 	// spaces (when switching to a kernel thread), its possible the
 	// current kernel thread is running in the address space that is about
 	// to go away.  Politely switch to the default kernel address space if
-	// is about to happen.
+	// is about to happen.  Kernel threads on other processors may be in
+	// the same situation.
+	fl = DisableInterrupts();
 	if (fPageDirectory == GetCurrentPageDir())
 		SetCurrentPageDir(fKernelPhysicalMap->fPageDirectory);
 
-	// Free up page tables (Deleting areas does not currently do this).
-	unsigned int *pageDirVA = reinterpret_cast<unsigned int*>(LockPhysicalPage(fPageDirectory));
-	for (int i = 0; i < 768; i++) {
-		unsigned int pdent = pageDirVA[i]; 
-		if (pdent & kPagePresent)
-			Page::LockPage(pdent & kPageMask)->Free();
+	RestoreInterrupts(fl);
+	Processor::DetachPageDirectory(fPageDirectory);
+
+	// Free up page tables (Deleting areas does not currently do this).  The
+	// pages that are still mapped are released first.
+	for (unsigned int va = 0; va < kKernelBase; va += fLargePageSize) {
+		uint64 pdent = GetPageDirEntry(va);
+		if ((pdent & (kPagePresent | kPageLarge)) == (kPagePresent | kPageLarge)) {
+			for (int j = 0; j < fPagesPerTable; j++)
+				Page::RemoveMapping(GetLargePageAddress(pdent) + j * PAGE_SIZE, pdent & kPageModified);
+
+			AtomicAdd(&fLargePageCount, -1);
+		} else if (pdent & kPagePresent) {
+			char *pgtbl = LockPhysicalPage(pdent & kEntryAddressMask);
+			for (int j = 0; j < fPagesPerTable; j++) {
+				uint64 ptent = ReadEntry(pgtbl, j);
+				if (ptent & kPagePresent)
+					Page::RemoveMapping(ptent & kEntryAddressMask, ptent & kPageModified);
+			}
+
+			UnlockPhysicalPage(pgtbl);
+			Page::LockPage(pdent & kEntryAddressMask)->Free();
+		}
 	}		
 
-	UnlockPhysicalPage(pageDirVA);
-	Page::LockPage(fPageDirectory)->Free();
+	if (fPae) {
+		for (int i = 0; i < 3; i++)
+			Page::LockPage(fPageDirs[i])->Free();
+
+		Page::FreeContiguous(fPageDirectory, 0);
+	} else
+		Page::LockPage(fPageDirectory)->Free();
 }
 
-void PhysicalMap::Map(unsigned int va, unsigned int pa, PageProtection protection)
+void PhysicalMap::Map(unsigned int va, paddr_t pa, PageProtection protection)
 {
 	ASSERT(va < kKernelBase || fKernelPhysicalMap == this);
 	fLock.Lock();
 
-	unsigned int *pgdir = reinterpret_cast<unsigned int*>(LockPhysicalPage(fPageDirectory));
-	unsigned int *pgtbl = 0;
-	if ((pgdir[va / PAGE_SIZE / 1024] & kPagePresent) == 0) {
-		// Allocate a new page table
-		Page *page = Page::Alloc();
+	uint64 pdent = GetPageDirEntry(va);
+	ASSERT((pdent & kPageLarge) == 0);
+	if ((pdent & kPagePresent) == 0) {
+		// Allocate a new page table.  If this is in kernel space, it is
+		// mapped into all address spaces.
+		Page *page = Page::Alloc(true);
 		page->Wire();
-		unsigned int newTablePA = page->GetPhysicalAddress();
-		pgtbl = reinterpret_cast<unsigned int*>(LockPhysicalPage(newTablePA));
-		ClearPage(pgtbl);
-		if (va >= kKernelBase) {
-			// If this is in kernel space, map the page table into all
-			// address spaces.
-			for (ListNode *node = fPhysicalMaps.GetHead(); node;
-				node = fPhysicalMaps.GetNext(node)) {
-				PhysicalMap *map = static_cast<PhysicalMap*>(node);
-				unsigned int *mpgdir = reinterpret_cast<unsigned int*>(LockPhysicalPage(map->fPageDirectory));
-				mpgdir[va / PAGE_SIZE / 1024] = newTablePA | kPagePresent |
-					kPageWritable;
-				UnlockPhysicalPage(mpgdir);
-			}
-		} else
-			pgdir[va / PAGE_SIZE / 1024] = newTablePA | kPagePresent | kPageWritable
-				| kPageUser;
-	} else
-		pgtbl = reinterpret_cast<unsigned int*>(LockPhysicalPage(pgdir[va / PAGE_SIZE / 1024] & kPageMask));
+		pdent = page->GetPhysicalAddress() | kPagePresent | kPageWritable;
+		if (va < kKernelBase)
+			pdent |= kPageUser;
 
-	unsigned int pageFlags = kPagePresent;
+		SetPageDirEntry(va, pdent);
+	}
+
+	char *pgtbl = LockPhysicalPage(pdent & kEntryAddressMask);
+	int ptindex = (va / PAGE_SIZE) % fPagesPerTable;
+
+	// The processor may set the modified bit of the old entry at any time, so
+	// it is cleared atomically.
+	uint64 oldEntry = ClearEntry(pgtbl, ptindex);
+	bool replaced = (oldEntry & kPagePresent) != 0;
+	if (!replaced)
+		fMappedPageCount++;
+
+	WriteEntry(pgtbl, ptindex, pa | GetPageFlags(va, protection));
+	Page::AddMapping(pa);
+	UnlockPhysicalPage(pgtbl);
+
+	InvalidateTLB(va);
+
+	// Other processors can only have cached the old translation if there
+	// was one.  The old page stays mapped until they have flushed it, so it
+	// can't be reclaimed while they may still write to it.
+	if (replaced) {
+		Processor::FlushRemoteTLBs(this == fKernelPhysicalMap ? INVALID_PAGE : fPageDirectory);
+		Page::RemoveMapping(oldEntry & kEntryAddressMask, oldEntry & kPageModified);
+	}
+
+	fLock.Unlock();
+}
+
+int PhysicalMap::MapUnmapped(unsigned int va, const paddr_t pa[], int count,
+	PageProtection protection)
+{
+	ASSERT(va < kKernelBase || fKernelPhysicalMap == this);
+	ASSERT(static_cast<int>((va / PAGE_SIZE) % fPagesPerTable) + count <= fPagesPerTable);
+	fLock.Lock();
+	uint64 pdent = GetPageDirEntry(va);
+	if ((pdent & kPagePresent) == 0 || (pdent & kPageLarge)) {
+		fLock.Unlock();
+		return 0;
+	}
+
+	char *pgtbl = LockPhysicalPage(pdent & kEntryAddressMask);
+	uint64 pageFlags = GetPageFlags(va, protection);
+	int ptindex = (va / PAGE_SIZE) % fPagesPerTable;
+	int mapped = 0;
+	for (int i = 0; i < count; i++) {
+		if (pa[i] == INVALID_PAGE || (ReadEntry(pgtbl, ptindex + i) & kPagePresent))
+			continue;
+
+		WriteEntry(pgtbl, ptindex + i, pa[i] | pageFlags);
+		Page::AddMapping(pa[i]);
+		mapped++;
+	}
+
+	fMappedPageCount += mapped;
+	UnlockPhysicalPage(pgtbl);
+	fLock.Unlock();
+	return mapped;
+}
+
+void PhysicalMap::MapContiguous(unsigned int va, paddr_t pa, unsigned int size,
+	PageProtection protection)
+{
+	unsigned int offset = 0;
+	while (offset < size) {
+		if (fLargePages && (va + offset) % fLargePageSize == 0
+			&& (pa + offset) % fLargePageSize == 0 && size - offset >= fLargePageSize
+			&& MapLargePage(va + offset, pa + offset, protection)) {
+			offset += fLargePageSize;
+		} else {
+			Map(va + offset, pa + offset, protection);
+			offset += PAGE_SIZE;
+		}
+	}
+}
+
+// Map one large page with a page directory entry.  Nothing needs to be flushed
+// from the TLBs, since there was no translation for this range.
+// @returns false if there is already a page table for this range
+bool PhysicalMap::MapLargePage(unsigned int va, paddr_t pa, PageProtection protection)
+{
+	ASSERT(va < kKernelBase || fKernelPhysicalMap == this);
+	fLock.Lock();
+
+	// Kernel page tables are only added with the kernel map locked, so one
+	// can't appear after this check.
+	bool mapped = (GetPageDirEntry(va) & kPagePresent) == 0;
+	if (mapped) {
+		SetPageDirEntry(va, pa | GetPageFlags(va, protection) | kPageLarge);
+		for (int i = 0; i < fPagesPerTable; i++)
+			Page::AddMapping(pa + i * PAGE_SIZE);
+
+		fMappedPageCount += fPagesPerTable;
+		AtomicAdd(&fLargePageCount, 1);
+	}
+
+	fLock.Unlock();
+	return mapped;
+}
+
+TlbFlushBatch::TlbFlushBatch(unsigned int pageDirectory, bool isKernel)
+	:	fPageDirectory(pageDirectory),
+		fIsKernel(isKernel),
+		fPageCount(0),
+		fMappingCount(0),
+		fPageTableCount(0)
+{
+}
+
+void TlbFlushBatch::Add(unsigned int va)
+{
+	if (fPageCount < kMaxTlbFlushPages)
+		fPages[fPageCount] = va;
+
+	fPageCount++;
+}
+
+void TlbFlushBatch::RemoveMappings(paddr_t pa, int count, bool modified)
+{
+	if (fMappingCount == kMaxRemovedMappings)
+		Flush();
+
+	RemovedMapping &mapping = fMappings[fMappingCount++];
+	mapping.pa = pa;
+	mapping.count = count;
+	mapping.modified = modified;
+}
+
+void TlbFlushBatch::FreePageTable(paddr_t pa)
+{
+	if (fPageTableCount == kMaxFreedPageTables)
+		Flush();
+
+	fPageTables[fPageTableCount++] = pa;
+}
+
+void TlbFlushBatch::Flush()
+{
+	if (fPageCount == 0 && fMappingCount == 0 && fPageTableCount == 0)
+		return;
+
+	// The thread stays on this processor until the others have flushed, so
+	// none of them is skipped.  A user address space only has translations
+	// here if it is the current one.  Freed page tables may be cached by
+	// the processor, so those force a reload.
+	cpu_flags fl = DisableInterrupts();
+	Thread *thread = Processor::GetCurrentProcessor()->GetRunningThread();
+	thread->Pin();
+	unsigned int currentPageDirectory = GetCurrentPageDir();
+	if (fIsKernel || fPageDirectory == currentPageDirectory) {
+		if (fPageCount > kMaxTlbFlushPages || fPageTableCount > 0)
+			SetCurrentPageDir(currentPageDirectory);
+		else {
+			for (int i = 0; i < fPageCount; i++)
+				InvalidateTLB(fPages[i]);
+		}
+	}
+
+	RestoreInterrupts(fl);
+	Processor::FlushRemoteTLBs(fIsKernel ? INVALID_PAGE : fPageDirectory);
+	fl = DisableInterrupts();
+	thread->Unpin();
+	RestoreInterrupts(fl);
+
+	for (int i = 0; i < fMappingCount; i++) {
+		for (int j = 0; j < fMappings[i].count; j++)
+			Page::RemoveMapping(fMappings[i].pa + j * PAGE_SIZE, fMappings[i].modified);
+	}
+
+	for (int i = 0; i < fPageTableCount; i++)
+		Page::LockPage(fPageTables[i])->Free();
+
+	fPageCount = 0;
+	fMappingCount = 0;
+	fPageTableCount = 0;
+}
+
+
+// Page table entries are 32 bits, or 64 bits with PAE.  The present, accessed
+// and modified bits are in the low word, so the processor only changes that
+// half, and it is the half that is updated atomically.
+uint64 PhysicalMap::ReadEntry(const void *table, int index)
+{
+	const volatile unsigned int *words = static_cast<const volatile unsigned int*>(table);
+	if (fPae)
+		return (static_cast<uint64>(words[index * 2 + 1]) << 32) | words[index * 2];
+
+	return words[index];
+}
+
+// The entry is never present with half of an old value: the high word is
+// written first when the new entry is present, and last when it isn't.
+void PhysicalMap::WriteEntry(void *table, int index, uint64 entry)
+{
+	volatile unsigned int *words = static_cast<volatile unsigned int*>(table);
+	if (!fPae)
+		words[index] = static_cast<unsigned int>(entry);
+	else if (entry & kPagePresent) {
+		words[index * 2 + 1] = static_cast<unsigned int>(entry >> 32);
+		words[index * 2] = static_cast<unsigned int>(entry);
+	} else {
+		words[index * 2] = static_cast<unsigned int>(entry);
+		words[index * 2 + 1] = static_cast<unsigned int>(entry >> 32);
+	}
+}
+
+// Clear an entry, atomically with respect to the processor setting the
+// modified bit.
+// @returns The old entry
+uint64 PhysicalMap::ClearEntry(void *table, int index)
+{
+	volatile int *words = static_cast<volatile int*>(table);
+	if (!fPae)
+		return static_cast<unsigned int>(AtomicAnd(&words[index], 0));
+
+	unsigned int low = AtomicAnd(&words[index * 2], 0);
+	uint64 high = static_cast<unsigned int>(words[index * 2 + 1]);
+	words[index * 2 + 1] = 0;
+	return (high << 32) | low;
+}
+
+void PhysicalMap::ClearAccessedBit(void *table, int index)
+{
+	volatile int *words = static_cast<volatile int*>(table);
+	AtomicAnd(&words[fPae ? index * 2 : index], ~kPageAccessed);
+}
+
+paddr_t PhysicalMap::GetLargePageAddress(uint64 pdent)
+{
+	return pdent & kEntryAddressMask & ~static_cast<uint64>(fLargePageSize - 1);
+}
+
+uint64 PhysicalMap::GetPageFlags(unsigned int va, PageProtection protection)
+{
+	uint64 pageFlags = kPagePresent;
 	if (va >= kKernelBase)
 		pageFlags |= kPageGlobal;
 
@@ -132,15 +508,71 @@ void PhysicalMap::Map(unsigned int va, unsigned int pa, PageProtection protectio
 	if (protection & kUncacheablePage)
 		pageFlags |= kPageCacheDisable;
 
-	if ((pgtbl[(va / PAGE_SIZE) % 1024] & kPagePresent) == 0)
-		fMappedPageCount++;
+	if (fNoExecute && (protection & (USER_EXEC | SYSTEM_EXEC)) == 0)
+		pageFlags |= kPageNoExecute;
 
-	pgtbl[(va / PAGE_SIZE) % 1024] = pa | pageFlags;
-	UnlockPhysicalPage(pgtbl);
+	return pageFlags;
+}
+
+// Find the page directory entry that maps va.  With PAE, each 1GB has a page
+// directory of its own.
+// @param outIndex Set to the index of the entry in the page directory
+// @returns Physical address of the page directory
+paddr_t PhysicalMap::GetPageDirPage(unsigned int va, int *outIndex) const
+{
+	if (fPae) {
+		*outIndex = (va / kPaeLargePageSize) % kPaeEntriesPerTable;
+		return fPageDirs[va / kPageDirPointerSpan];
+	}
+
+	*outIndex = va / kLegacyLargePageSize;
+	return fPageDirectory;
+}
+
+uint64 PhysicalMap::GetPageDirEntry(unsigned int va) const
+{
+	int pdindex;
+	char *pgdir = LockPhysicalPage(GetPageDirPage(va, &pdindex));
+	uint64 pdent = ReadEntry(pgdir, pdindex);
+	UnlockPhysicalPage(pgdir);
+	return pdent;
+}
+
+// Kernel space entries are set in all address spaces.
+void PhysicalMap::SetPageDirEntry(unsigned int va, uint64 pdent)
+{
+	if (va >= kKernelBase) {
+		SetKernelPageDirEntry(va, pdent);
+		return;
+	}
+
+	int pdindex;
+	char *pgdir = LockPhysicalPage(GetPageDirPage(va, &pdindex));
+	WriteEntry(pgdir, pdindex, pdent);
 	UnlockPhysicalPage(pgdir);
+}
 
-	InvalidateTLB(va);
-	fLock.Unlock();
+// Set a page directory entry in kernel space, so all address spaces share the
+// kernel page tables.  With PAE, they share the kernel page directory, so the
+// entry is only set there.  Otherwise it is set in every physical map.
+void PhysicalMap::SetKernelPageDirEntry(unsigned int va, uint64 pdent)
+{
+	cpu_flags fl = fPhysicalMapsLock.Lock();
+	if (fPae) {
+		int pdindex;
+		char *pgdir = LockPhysicalPage(fKernelPhysicalMap->GetPageDirPage(va, &pdindex));
+		WriteEntry(pgdir, pdindex, pdent);
+		UnlockPhysicalPage(pgdir);
+	} else {
+		for (ListNode *node = fPhysicalMaps.GetHead(); node; node = fPhysicalMaps.GetNext(node)) {
+			PhysicalMap *map = static_cast<PhysicalMap*>(node);
+			char *pgdir = LockPhysicalPage(map->fPageDirectory);
+			WriteEntry(pgdir, va / kLegacyLargePageSize, pdent);
+			UnlockPhysicalPage(pgdir);
+		}
+	}
+
+	fPhysicalMapsLock.Unlock(fl);
 }
 
 void PhysicalMap::Unmap(unsigned int base, unsigned int size)
@@ -148,58 +580,89 @@ void PhysicalMap::Unmap(unsigned int base, unsigned int size)
 	ASSERT(base < kKernelBase || fKernelPhysicalMap == this);
 
 	fLock.Lock();
-	unsigned int *pgdir = reinterpret_cast<unsigned int*>(LockPhysicalPage(fPageDirectory));
-	int pdindex = base / PAGE_SIZE / 1024;
-	int ptindex = (base / PAGE_SIZE) % 1024;
+	unsigned int va = base;
 	int count = size / PAGE_SIZE;
+	TlbFlushBatch batch(fPageDirectory, this == fKernelPhysicalMap);
 	while (count > 0) {
-		if ((pgdir[pdindex] & kPagePresent) == 0) {
+		unsigned int tableBase = va & ~(fLargePageSize - 1);
+		int ptindex = (va / PAGE_SIZE) % fPagesPerTable;
+		uint64 pdent = GetPageDirEntry(va);
+		if ((pdent & kPagePresent) == 0) {
 			// No page table mapped, skip.
 
-			if (ptindex + count < 1024)
+			if (ptindex + count < fPagesPerTable)
 				break;		// No more entries, done
 		
-			count -= 1024 - ptindex;
-			pdindex++;
-			ptindex = 0;
+			count -= fPagesPerTable - ptindex;
+			va = tableBase + fLargePageSize;
+			continue;
+		}
+
+		if (pdent & kPageLarge) {
+			ASSERT(ptindex == 0 && count >= fPagesPerTable);
+			SetPageDirEntry(va, 0);
+			batch.RemoveMappings(GetLargePageAddress(pdent), fPagesPerTable, pdent & kPageModified);
+
+			fMappedPageCount -= fPagesPerTable;
+			AtomicAdd(&fLargePageCount, -1);
+			batch.Add(va);
+			count -= fPagesPerTable;
+			va += fLargePageSize;
 			continue;
 		}
 
-		unsigned int *pgtbl = reinterpret_cast<unsigned int*>(LockPhysicalPage(pgdir[pdindex] & kPageMask));		
-		while (count > 0 && ptindex < 1024) {
-			if (pgtbl[ptindex] & kPagePresent) {
-				unsigned int va = (pdindex * 1024 + ptindex) * PAGE_SIZE;
-				pgtbl[ptindex] = 0;
+		char *pgtbl = LockPhysicalPage(pdent & kEntryAddressMask);		
+		bool removed = false;
+		while (count > 0 && ptindex < fPagesPerTable) {
+			if (ReadEntry(pgtbl, ptindex) & kPagePresent) {
+				uint64 oldEntry = ClearEntry(pgtbl, ptindex);
+				batch.RemoveMappings(oldEntry & kEntryAddressMask, 1, oldEntry & kPageModified);
 				fMappedPageCount--;
-				InvalidateTLB(va);
+				batch.Add(tableBase + ptindex * PAGE_SIZE);
+				removed = true;
 			}
 
 			count--;
 			ptindex++;
 		}	
-		
+
+		// Free user page tables that are now empty.  Kernel page tables are
+		// shared by all address spaces, so they are kept.
+		if (removed && tableBase < kKernelBase) {
+			bool empty = true;
+			for (int i = 0; i < fPagesPerTable && empty; i++)
+				empty = ReadEntry(pgtbl, i) == 0;
+
+			if (empty) {
+				batch.FreePageTable(pdent & kEntryAddressMask);
+				SetPageDirEntry(tableBase, 0);
+			}
+		}
+
 		UnlockPhysicalPage(pgtbl);
-		ptindex = 0;
-		pdindex++;
+		va = tableBase + fLargePageSize;
 	}
 
-	UnlockPhysicalPage(pgdir);
+	batch.Flush();
 	fLock.Unlock();
 }
 
-unsigned int PhysicalMap::GetPhysicalAddress(unsigned int va)
+paddr_t PhysicalMap::GetPhysicalAddress(unsigned int va)
 {
 	fLock.Lock();
-	unsigned int *pgdir = reinterpret_cast<unsigned int*>(LockPhysicalPage(fPageDirectory));
-	unsigned int pdent = pgdir[va / PAGE_SIZE / 1024];
-	UnlockPhysicalPage(pgdir);
+	uint64 pdent = GetPageDirEntry(va);
 	if ((pdent & kPagePresent) == 0) {
 		fLock.Unlock();
 		return INVALID_PAGE;
 	}
 
-	unsigned int *pt = reinterpret_cast<unsigned int*>(LockPhysicalPage(pgdir[va / PAGE_SIZE / 1024] & kPageMask));
-	unsigned int ptent = pt[(va / PAGE_SIZE) % 1024];
+	if (pdent & kPageLarge) {
+		fLock.Unlock();
+		return GetLargePageAddress(pdent) + (va & (fLargePageSize - 1) & kPageMask);
+	}
+
+	char *pt = LockPhysicalPage(pdent & kEntryAddressMask);
+	uint64 ptent = ReadEntry(pt, (va / PAGE_SIZE) % fPagesPerTable);
 	UnlockPhysicalPage(pt);
 
 	if ((ptent & kPagePresent) == 0) {
@@ -207,11 +670,69 @@ unsigned int PhysicalMap::GetPhysicalAddress(unsigned int va)
 		return INVALID_PAGE;
 	}
 
-	unsigned int pa = ptent & kPageMask;
+	paddr_t pa = ptent & kEntryAddressMask;
 	fLock.Unlock();
 	return pa;
 }
 
+int PhysicalMap::AgeMapping(unsigned int va, paddr_t *outPhysicalAddress)
+{
+	ASSERT(va < kKernelBase || fKernelPhysicalMap == this);
+
+	fLock.Lock();
+	uint64 pdent = GetPageDirEntry(va);
+	if ((pdent & kPagePresent) == 0) {
+		fLock.Unlock();
+		return 0;
+	}
+
+	if (pdent & kPageLarge) {
+		// Large pages map physical memory that doesn't belong to a cache, so
+		// they are never trimmed.
+		*outPhysicalAddress = GetLargePageAddress(pdent) + (va & (fLargePageSize - 1) & kPageMask);
+		fLock.Unlock();
+		return kMappingPresent | kMappingAccessed;
+	}
+
+	// The processor sets the accessed and modified bits without taking the
+	// lock, so they are changed atomically.
+	int result = 0;
+	uint64 oldEntry = 0;
+	char *pgtbl = LockPhysicalPage(pdent & kEntryAddressMask);
+	int ptindex = (va / PAGE_SIZE) % fPagesPerTable;
+	uint64 ptent = ReadEntry(pgtbl, ptindex);
+	if (ptent & kPagePresent) {
+		result = kMappingPresent;
+		*outPhysicalAddress = ptent & kEntryAddressMask;
+		if (ptent & kPageAccessed) {
+			// The TLB is not flushed.  A processor that still has this
+			// translation cached won't set the bit again until the entry is
+			// evicted, so a page that is in heavy use can occasionally look
+			// idle.  That only costs a soft fault to map it again.
+			ClearAccessedBit(pgtbl, ptindex);
+			result |= kMappingAccessed;
+		} else {
+			oldEntry = ClearEntry(pgtbl, ptindex);
+			if (oldEntry & kPageModified)
+				result |= kMappingModified;
+
+			fMappedPageCount--;
+			InvalidateTLB(va);
+		}
+	}
+
+	// The page stays mapped until other processors have flushed it, so it
+	// can't be reclaimed while they may still write to it.
+	UnlockPhysicalPage(pgtbl);
+	if ((result & (kMappingPresent | kMappingAccessed)) == kMappingPresent) {
+		Processor::FlushRemoteTLBs(this == fKernelPhysicalMap ? INVALID_PAGE : fPageDirectory);
+		Page::RemoveMapping(oldEntry & kEntryAddressMask, oldEntry & kPageModified);
+	}
+
+	fLock.Unlock();
+	return result;
+}
+
 int PhysicalMap::CountMappedPages() const
 {
 	return fMappedPageCount;
@@ -222,90 +743,207 @@ unsigned int PhysicalMap::GetPageDir() const
 	return fPageDirectory;
 }
 
-char* PhysicalMap::LockPhysicalPage(unsigned int pa)
+char* PhysicalMap::LockPhysicalPage(paddr_t pa)
 {
 	ASSERT((pa & (PAGE_SIZE - 1)) == 0);
+	if (pa < fDirectMapSize)
+		return reinterpret_cast<char*>(kDirectMapBase + static_cast<unsigned int>(pa));
+
+	cpu_flags fl = DisableInterrupts();
+	char *va = MapTempSlot(pa);
+	RestoreInterrupts(fl);
+	return va;
+}
+
+void PhysicalMap::UnlockPhysicalPage(const void *va)
+{
+	if (reinterpret_cast<unsigned int>(va) - kDirectMapBase < fDirectMapSize)
+		return;
+
+	cpu_flags fl = DisableInterrupts();
+	UnmapTempSlot(reinterpret_cast<unsigned int>(va));
+	RestoreInterrupts(fl);
+}
+
+void PhysicalMap::LockPhysicalPages(const paddr_t pa[], int count, char *outVa[])
+{
+	cpu_flags fl = DisableInterrupts();
+	for (int i = 0; i < count; i++) {
+		ASSERT((pa[i] & (PAGE_SIZE - 1)) == 0);
+		if (pa[i] < fDirectMapSize)
+			outVa[i] = reinterpret_cast<char*>(kDirectMapBase + static_cast<unsigned int>(pa[i]));
+		else
+			outVa[i] = MapTempSlot(pa[i]);
+	}
 
-	unsigned int va = INVALID_PAGE;
+	RestoreInterrupts(fl);
+}
 
+void PhysicalMap::UnlockPhysicalPages(char *const va[], int count)
+{
 	cpu_flags fl = DisableInterrupts();
+	for (int i = 0; i < count; i++) {
+		if (reinterpret_cast<unsigned int>(va[i]) - kDirectMapBase >= fDirectMapSize)
+			UnmapTempSlot(reinterpret_cast<unsigned int>(va[i]));
+	}
 
-	fLockPageRequests++;
+	RestoreInterrupts(fl);
+}
 
-	// Check to see if this is already mapped.
-	LockedPage *lockedPage;
-	for (lockedPage = fLockedPageHash[(pa / PAGE_SIZE) & kLockedPageHashSize - 1];
-		lockedPage; lockedPage = lockedPage->hashNext) {
-		if (lockedPage->pa == pa)
+// Map a page in one of the current processor's slots, reusing the slot if the
+// page is already mapped.  Interrupts must be disabled.
+char* PhysicalMap::MapTempSlot(paddr_t pa)
+{
+	int processorIndex = Processor::GetCurrentProcessorIndex();
+	TempMapSlots &slots = fTempMapSlots[processorIndex];
+	slots.requests++;
+	int slot;
+	for (slot = 0; slot < kTempSlotsPerProcessor; slot++) {
+		if (slots.pa[slot] == pa)
 			break;
 	}
 
-	if (lockedPage == 0) {
-		// This is not mapped, so find a new slot to map it in.
-		lockedPage = static_cast<LockedPage*>(fInactiveLockedPages.Dequeue());
-		if (lockedPage == 0)
-			panic("out of IO page slots");
+	int ptindex = kTempMapSize / fLargePageSize + processorIndex * kTempSlotsPerProcessor;
+	if (slot < kTempSlotsPerProcessor)
+		slots.hits++;
+	else {
+		// Slots are reused round robin, so a page that was unlocked recently
+		// is likely to still be mapped when it is locked again.
+		for (int tries = 0; ; tries++) {
+			if (tries == kTempSlotsPerProcessor)
+				panic("out of temporary mapping slots");
 
-		if (lockedPage->pa != INVALID_PAGE) {
-			*lockedPage->hashPrev = lockedPage->hashNext;
-			if (lockedPage->hashNext)
-				lockedPage->hashNext->hashPrev = lockedPage->hashPrev;		
+			slot = slots.nextSlot;
+			slots.nextSlot = (slot + 1) % kTempSlotsPerProcessor;
+			if (slots.mapCount[slot] == 0)
+				break;
 		}
-		
-		LockedPage **bucket = &fLockedPageHash[(pa / PAGE_SIZE) % kLockedPageHashSize];
-		lockedPage->hashPrev = bucket;
-		*bucket = lockedPage;
-		lockedPage->pa = pa;
-		lockedPage->mapCount++;
-		va = (lockedPage - fLockedPages) * PAGE_SIZE + kIOAreaBase;
-		reinterpret_cast<unsigned int*>(kIOAreaBase)[lockedPage - fLockedPages] = pa | kPagePresent
-			| kPageWritable;
-		InvalidateTLB(va);
-	} else {
-		fLockPageHits++;
-		va = (lockedPage - fLockedPages) * PAGE_SIZE + kIOAreaBase;
-		if (lockedPage->mapCount++ == 0)
-			lockedPage->RemoveFromList();
+
+		// The page tables are mapped at the start of the area, so the entries
+		// for all of the slots are in one array there.
+		slots.pa[slot] = pa;
+		WriteEntry(reinterpret_cast<void*>(kIOAreaBase), ptindex + slot, pa | kPagePresent
+			| kPageWritable | (fNoExecute ? kPageNoExecute : 0));
+		InvalidateTLB(kIOAreaBase + (ptindex + slot) * PAGE_SIZE);
 	}
-	
-	RestoreInterrupts(fl);	
-	return reinterpret_cast<char*>(va);
+
+	slots.mapCount[slot]++;
+	Processor::GetCurrentProcessor()->GetRunningThread()->Pin();
+	return reinterpret_cast<char*>(kIOAreaBase + (ptindex + slot) * PAGE_SIZE);
 }
 
-void PhysicalMap::UnlockPhysicalPage(const void *va)
+// Interrupts must be disabled.
+void PhysicalMap::UnmapTempSlot(unsigned int va)
 {
-	cpu_flags fl = DisableInterrupts();
-	unsigned int slot = (reinterpret_cast<unsigned int>(va) - kIOAreaBase) / PAGE_SIZE;	
-	ASSERT(slot < 1024);
-	ASSERT(fLockedPages[slot].mapCount > 0);
-	if (--fLockedPages[slot].mapCount == 0)
-		fInactiveLockedPages.Enqueue(&fLockedPages[slot]);
-	
-	RestoreInterrupts(fl);
+	int processorIndex = Processor::GetCurrentProcessorIndex();
+	int slot = (va - kIOAreaBase) / PAGE_SIZE - kTempMapSize / fLargePageSize
+		- processorIndex * kTempSlotsPerProcessor;
+	ASSERT(slot >= 0 && slot < kTempSlotsPerProcessor);
+	ASSERT(fTempMapSlots[processorIndex].mapCount[slot] > 0);
+	fTempMapSlots[processorIndex].mapCount[slot]--;
+	Processor::GetCurrentProcessor()->GetRunningThread()->Unpin();
 }
 
-void PhysicalMap::CopyPage(unsigned int destpa, unsigned int srcpa)
+void PhysicalMap::CopyPage(paddr_t destpa, paddr_t srcpa)
 {
-	const char *src = LockPhysicalPage(srcpa);
-	char *dest = LockPhysicalPage(destpa);
-	CopyPageInternal(dest, src);
-	UnlockPhysicalPage(src);
-	UnlockPhysicalPage(dest);
+	const paddr_t pa[2] = { destpa, srcpa };
+	char *va[2];
+	LockPhysicalPages(pa, 2, va);
+	CopyPageInternal(va[0], va[1]);
+	UnlockPhysicalPages(va, 2);
 }
 
-void PhysicalMap::Bootstrap()
+void PhysicalMap::SelectPagingMode()
 {
-	// Set up an area to temporarily map physical pages.
-	fLockedPages = new LockedPage[1024];
-	for (int i = 1; i < 1024; i++) {
-		fInactiveLockedPages.Enqueue(&fLockedPages[i]);
-		fLockedPages[i].pa = INVALID_PAGE;
-		fLockedPages[i].hashNext = 0;
-		fLockedPages[i].hashPrev = 0;
-		fLockedPages[i].mapCount = 0;
+	unsigned int eax, ebx, ecx, edx;
+	cpuid(1, eax, ebx, ecx, edx);
+	fLargePages = (edx & kCpuidEdxPse) != 0;
+	fPae = (edx & kCpuidEdxPae) != 0;
+	if (!fPae) {
+		if (fLargePages)
+			SetCR4(GetCR4() | kCR4Pse);
+
+		return;
+	}
+
+	cpuid(0x80000000, eax, ebx, ecx, edx);
+	if (eax >= 0x80000001) {
+		cpuid(0x80000001, eax, ebx, ecx, edx);
+		fNoExecute = (edx & kCpuidExtendedEdxNx) != 0;
+	}
+
+	// PAE page directories can always map large pages.
+	fLargePages = true;
+	fLargePageSize = kPaeLargePageSize;
+	fPagesPerTable = kPaeEntriesPerTable;
+
+	// Build PAE tables that map the same memory as the boot loader's.  The
+	// four page directories are consecutive, so they can be indexed like one
+	// page directory with twice as many entries.  Each page table becomes two,
+	// and each 4MB page becomes two 2MB pages.  Low memory is identity mapped,
+	// so the tables are written through their physical addresses.
+	const unsigned int *oldPageDir = reinterpret_cast<const unsigned int*>(GetCurrentPageDir());
+	unsigned int pageDirPointerTable = AllocBootPages(5);
+	memset(reinterpret_cast<void*>(pageDirPointerTable), 0, 5 * PAGE_SIZE);
+	uint64 *pdpt = reinterpret_cast<uint64*>(pageDirPointerTable);
+	uint64 *pageDir = reinterpret_cast<uint64*>(pageDirPointerTable + PAGE_SIZE);
+	for (int i = 0; i < 4; i++)
+		pdpt[i] = (pageDirPointerTable + (i + 1) * PAGE_SIZE) | kPagePresent;
+
+	for (int pdindex = 0; pdindex < 1024; pdindex++) {
+		unsigned int pdent = oldPageDir[pdindex];
+		if ((pdent & kPagePresent) == 0)
+			continue;
+
+		unsigned int flags = pdent & ~kPageMask;
+		if (pdent & kPageLarge) {
+			unsigned int pa = pdent & ~(kLegacyLargePageSize - 1);
+			pageDir[pdindex * 2] = pa | flags;
+			pageDir[pdindex * 2 + 1] = (pa + kPaeLargePageSize) | flags;
+			continue;
+		}
+
+		const unsigned int *oldTable = reinterpret_cast<const unsigned int*>(pdent & kPageMask);
+		unsigned int newTables = AllocBootPages(2);
+		uint64 *newTable = reinterpret_cast<uint64*>(newTables);
+		for (int i = 0; i < 1024; i++)
+			newTable[i] = oldTable[i];
+
+		pageDir[pdindex * 2] = newTables | flags;
+		pageDir[pdindex * 2 + 1] = (newTables + PAGE_SIZE) | flags;
 	}
 
-	fLockedPages[0].mapCount = 0x3fffffff;
+	// The kernel image was mapped without no-execute, so it can be turned on
+	// before switching.
+	if (fNoExecute)
+		wrmsr(kMsrEfer, rdmsr(kMsrEfer) | kEferNoExecute);
+
+	// Paging has to be turned off to change modes, so the switch runs from an
+	// identity mapped page.  The page that application processors start from
+	// isn't used until they are started.
+	memcpy(reinterpret_cast<void*>(kApTrampolineBase), EnablePaeStart, EnablePaeEnd
+		- EnablePaeStart);
+	cpu_flags fl = DisableInterrupts();
+	reinterpret_cast<void (*)(unsigned int, unsigned int)>(kApTrampolineBase)(pageDirPointerTable,
+		GetCR4() | kCR4Pae);
+	RestoreInterrupts(fl);
+}
+
+void PhysicalMap::Bootstrap()
+{
+	// Set up slots to temporarily map physical pages.
+	fTempMapSlots = new TempMapSlots[kMaxProcessors];
+	for (int processorIndex = 0; processorIndex < kMaxProcessors; processorIndex++) {
+		TempMapSlots &slots = fTempMapSlots[processorIndex];
+		for (int slot = 0; slot < kTempSlotsPerProcessor; slot++) {
+			slots.pa[slot] = INVALID_PAGE;
+			slots.mapCount[slot] = 0;
+		}
+
+		slots.nextSlot = 0;
+		slots.requests = 0;
+		slots.hits = 0;
+	}
 
 	fKernelPhysicalMap =  new PhysicalMap(GetCurrentPageDir());
 
@@ -318,32 +956,167 @@ void PhysicalMap::Bootstrap()
 		}
 	}
 
-	// Set up a place to temporarily map physical memory when needed.  This is a tricky part,
-	// because this might unwittingly allocate the page table that maps this page in low memory
-	// so care is needed when modifying.  Since this only touches the allocated
-	// page once, it is safe (although a little clunky).
+	// Set up a place to temporarily map physical memory when needed.  The page
+	// tables map themselves at the start of the IO area, where the entries for
+	// the slots are changed.  They come from the DMA zone, because that is
+	// identity mapped.
 	// Note: at this point, VA = PA in low memory.
-	unsigned int *pagedir = reinterpret_cast<unsigned int*>(GetCurrentPageDir());
-	unsigned int *pte = reinterpret_cast<unsigned int*>(Page::Alloc()->GetPhysicalAddress());
-	pagedir[kIOAreaBase / PAGE_SIZE / 1024] = (reinterpret_cast<unsigned int>(pte) & kPageMask)
-		| kPagePresent | kPageWritable | kPageGlobal;
-	pte[0] = (reinterpret_cast<unsigned int>(pte) & kPageMask) | kPagePresent | kPageWritable
-		| kPageGlobal;
-
-	// Clear out the rest of this page table for cleanliness.
-	void *va = LockPhysicalPage(reinterpret_cast<unsigned int>(pte));
-	memset(reinterpret_cast<char*>(va) + 4, 0, PAGE_SIZE - 4);
-	UnlockPhysicalPage(va);
-
-	// Clear out the rest of user space area that was used by boot
-	va = LockPhysicalPage(reinterpret_cast<unsigned int>(pagedir));
-	memset(va, 0, 768 * sizeof(int));
-	UnlockPhysicalPage(va);
+	int tempMapTableCount = kTempMapSize / fLargePageSize;
+	int tempMapOrder = 0;
+	while ((1 << tempMapOrder) < tempMapTableCount)
+		tempMapOrder++;
+
+	unsigned int tempMapTables = static_cast<unsigned int>(Page::AllocContiguous(tempMapOrder,
+		kPageZoneDma));
+	if (tempMapTables == INVALID_PAGE)
+		panic("No memory for the temporary mapping page tables");
+
+	for (int i = 0; i < tempMapTableCount; i++) {
+		unsigned int tablePa = tempMapTables + i * PAGE_SIZE;
+		ClearPage(reinterpret_cast<void*>(tablePa));
+		WriteEntry(reinterpret_cast<void*>(tempMapTables), i, tablePa | kPagePresent
+			| kPageWritable | kPageGlobal);
+		int pdindex;
+		void *pagedir = GetBootPageDir(kIOAreaBase + i * fLargePageSize, &pdindex);
+		WriteEntry(pagedir, pdindex, tablePa | kPagePresent | kPageWritable | kPageGlobal);
+	}
+
+	// Clear out the rest of user space area that was used by boot.  This
+	// removes the identity mapping, so the page directories are written
+	// through temporary mappings.
+	if (fPae) {
+		for (int i = 0; i < 3; i++) {
+			void *va = LockPhysicalPage(fKernelPhysicalMap->fPageDirs[i]);
+			ClearPage(va);
+			UnlockPhysicalPage(va);
+		}
+	} else {
+		void *va = LockPhysicalPage(GetCurrentPageDir());
+		memset(va, 0, 768 * sizeof(int));
+		UnlockPhysicalPage(va);
+	}
+
+	// Most pages can be used through the direct map afterwards, without
+	// mapping them.
+	unsigned int directMapSize = MIN(bootParams.memsize & ~(fLargePageSize - 1), kDirectMapTop
+		- kDirectMapBase + 1);
+	MapDirect(directMapSize);
+	fDirectMapSize = directMapSize;
 
 	// Flush all of the TLBs
 	SetCurrentPageDir(GetCurrentPageDir());
 
 	AddDebugCommand("pmapstat", "Statistics about physical maps", PrintStats);
+	AddDebugCommand("tlbbench", "Time memory scans through 4k and large pages",
+		TlbBenchmarkCommand);
+}
+
+// Allocate memory before the page allocator is set up.  It is taken from above
+// 1MB where the boot loader hasn't allocated anything, and added to its ranges
+// so Bootstrap marks it used.  This can't be used after Page::Bootstrap, which
+// may hand out the same memory.  The memory is not cleared.
+// @returns Physical address of the first page
+unsigned int PhysicalMap::AllocBootPages(int count)
+{
+	unsigned int size = count * PAGE_SIZE;
+	unsigned int base = 0x100000;
+	for (bool overlaps = true; overlaps; ) {
+		overlaps = false;
+		for (int i = 0; i < bootParams.rangeCount; i++) {
+			const BootParams::Range &range = bootParams.allocatedRange[i];
+			if (range.begin < base + size && range.end >= base) {
+				base = (range.end + PAGE_SIZE) & kPageMask;
+				overlaps = true;
+			}
+		}
+	}
+
+	if (base + size > bootParams.memsize)
+		panic("Not enough memory to allocate %u bytes at boot", size);
+
+	// Allocations are usually right after the previous one, so they extend its
+	// range rather than using up the ones the boot parameters have room for.
+	for (int i = 0; i < bootParams.rangeCount; i++) {
+		if (bootParams.allocatedRange[i].end + 1 == base) {
+			bootParams.allocatedRange[i].end = base + size - 1;
+			return base;
+		}
+	}
+
+	bootParams.SetAllocated(base, base + size - 1);
+	return base;
+}
+
+// Find the page directory entry for va in the current page directory, while
+// low memory is identity mapped.
+// @returns The page directory, at its physical address
+void* PhysicalMap::GetBootPageDir(unsigned int va, int *outIndex)
+{
+	unsigned int pageDir = GetCurrentPageDir();
+	if (fPae) {
+		pageDir = static_cast<unsigned int>(reinterpret_cast<const uint64*>(pageDir)[va
+			/ kPageDirPointerSpan] & kEntryAddressMask);
+		*outIndex = (va / kPaeLargePageSize) % kPaeEntriesPerTable;
+	} else
+		*outIndex = va / kLegacyLargePageSize;
+
+	return reinterpret_cast<void*>(pageDir);
+}
+
+void PhysicalMap::MapBootMemory(unsigned int va, unsigned int size)
+{
+	// The page tables are allocated first, so they are in low memory, which
+	// is still identity mapped.  They and the page directory are written
+	// through their physical addresses.
+	int tableCount = 0;
+	for (unsigned int tableVa = va & ~(fLargePageSize - 1); tableVa < va + size;
+		tableVa += fLargePageSize) {
+		int pdindex;
+		void *pagedir = GetBootPageDir(tableVa, &pdindex);
+		if ((ReadEntry(pagedir, pdindex) & kPagePresent) == 0)
+			tableCount++;
+	}
+
+	unsigned int nextTable = tableCount > 0 ? AllocBootPages(tableCount) : 0;
+	unsigned int pa = AllocBootPages(size / PAGE_SIZE);
+	for (unsigned int offset = 0; offset < size; offset += PAGE_SIZE) {
+		int pdindex;
+		void *pagedir = GetBootPageDir(va + offset, &pdindex);
+		uint64 pdent = ReadEntry(pagedir, pdindex);
+		if ((pdent & kPagePresent) == 0) {
+			ClearPage(reinterpret_cast<void*>(nextTable));
+			pdent = nextTable | kPagePresent | kPageWritable;
+			WriteEntry(pagedir, pdindex, pdent);
+			nextTable += PAGE_SIZE;
+		}
+
+		void *pgtbl = reinterpret_cast<void*>(static_cast<unsigned int>(pdent & kEntryAddressMask));
+		WriteEntry(pgtbl, ((va + offset) / PAGE_SIZE) % fPagesPerTable, (pa + offset)
+			| GetPageFlags(va + offset, SYSTEM_READ | SYSTEM_WRITE));
+	}
+}
+
+// Map low physical memory at kDirectMapBase.  The pages aren't counted as
+// mapped, since this mapping never goes away.
+void PhysicalMap::MapDirect(unsigned int size)
+{
+	for (unsigned int pa = 0; pa < size; pa += fLargePageSize) {
+		unsigned int va = kDirectMapBase + pa;
+		uint64 pageFlags = GetPageFlags(va, SYSTEM_READ | SYSTEM_WRITE);
+		if (fLargePages) {
+			SetKernelPageDirEntry(va, pa | pageFlags | kPageLarge);
+			continue;
+		}
+
+		Page *page = Page::Alloc();
+		page->Wire();
+		char *pgtbl = LockPhysicalPage(page->GetPhysicalAddress());
+		for (int i = 0; i < fPagesPerTable; i++)
+			WriteEntry(pgtbl, i, (pa + i * PAGE_SIZE) | pageFlags);
+
+		UnlockPhysicalPage(pgtbl);
+		SetKernelPageDirEntry(va, page->GetPhysicalAddress() | kPagePresent | kPageWritable);
+	}
 }
 
 PhysicalMap* PhysicalMap::GetKernelPhysicalMap()
@@ -351,29 +1124,155 @@ PhysicalMap* PhysicalMap::GetKernelPhysicalMap()
 	return fKernelPhysicalMap;
 }
 
+bool PhysicalMap::HasLargePages()
+{
+	return fLargePages;
+}
+
+unsigned int PhysicalMap::GetLargePageSize()
+{
+	return fLargePageSize;
+}
+
+bool PhysicalMap::HasPae()
+{
+	return fPae;
+}
+
+bool PhysicalMap::HasNoExecute()
+{
+	return fNoExecute;
+}
+
+// The kernel map is created at boot, while low memory is identity mapped.
 PhysicalMap::PhysicalMap(unsigned int pageDirAddress)
 	:	fPageDirectory(pageDirAddress),
 		fMappedPageCount(0),
 		fLock("Physical Map Lock")
 {
+	if (fPae) {
+		const uint64 *pdpt = reinterpret_cast<const uint64*>(pageDirAddress);
+		for (int i = 0; i < 4; i++)
+			fPageDirs[i] = pdpt[i] & kEntryAddressMask;
+	}
+
 	fPhysicalMaps.AddToTail(this);
 }
 
 void PhysicalMap::PrintStats(int, const char*[])
 {
-	printf("Locked page area:\n");
-	printf("Hits %d Requests %d (%d%%)\n", fLockPageHits, fLockPageRequests, fLockPageHits * 100 / fLockPageRequests);
-	const int kSampleSize = 12;
-	int lengths[kSampleSize];
-	memset(lengths, 0, kSampleSize * sizeof(int));
-	for (int bucket = 0; bucket < kLockedPageHashSize; bucket++) {
-		int count = 0;
-		for (LockedPage *page = fLockedPageHash[bucket]; page; page = page->hashNext)
-			count++;
+	printf("Paging: %s%s\n", fPae ? "PAE" : "32-bit", fNoExecute ? ", no-execute" : "");
+	printf("Large pages: %s, %uMB, %d mapped\n", fLargePages ? "enabled" : "not supported",
+		fLargePageSize / 0x100000, fLargePageCount);
+	printf("Direct map: %uMB\n", fDirectMapSize / 0x100000);
+	printf("Temporary mappings:\n");
+	printf("CPU In Use Hits     Requests\n");
+	for (int processorIndex = 0; processorIndex < Processor::GetProcessorCount();
+		processorIndex++) {
+		const TempMapSlots &slots = fTempMapSlots[processorIndex];
+		int inUse = 0;
+		for (int slot = 0; slot < kTempSlotsPerProcessor; slot++) {
+			if (slots.mapCount[slot] > 0)
+				inUse++;
+		}
+
+		printf("%3d %6d %8d %8d\n", processorIndex, inUse, slots.hits, slots.requests);
+	}
+}
+
+// Read one word from each page of the buffers, in order or in a scattered order.
+// @returns The average number of processor cycles per page
+static int ScanPages(char *blocks[], int blockCount, bool random)
+{
+	int pagesPerBlock = PhysicalMap::GetLargePageSize() / PAGE_SIZE;
+	int pageCount = blockCount * pagesPerBlock;
+	volatile int sum = 0;
+	int64 startTime = rdtsc();
+	for (int pass = 0; pass < kTlbBenchmarkPasses; pass++) {
+		for (int i = 0; i < pageCount; i++) {
+			int page = random ? static_cast<int>((static_cast<int64>(i) * kTlbBenchmarkStride)
+				% pageCount) : i;
+			sum += *reinterpret_cast<volatile int*>(blocks[page / pagesPerBlock]
+				+ (page % pagesPerBlock) * PAGE_SIZE);
+		}
+	}
+
+	return static_cast<int>((rdtsc() - startTime) / (pageCount * kTlbBenchmarkPasses));
+}
+
+void TlbBenchmark::Run()
+{
+	// The 4k buffers are areas of their own.  The others are physically
+	// contiguous and aligned, so they are mapped with large pages.
+	unsigned int blockSize = PhysicalMap::GetLargePageSize();
+	char *smallBlocks[kMaxTlbBenchmarkBlocks];
+	char *largeBlocks[kMaxTlbBenchmarkBlocks];
+	int blockCount = 0;
+	while (blockCount < fBlockCount) {
+		unsigned int pa;
+		smallBlocks[blockCount] = static_cast<char*>(vmalloc(blockSize));
+		largeBlocks[blockCount] = static_cast<char*>(AllocDmaBuffer(blockSize,
+			kPageZoneNormal, &pa));
+		if (smallBlocks[blockCount] == 0 || largeBlocks[blockCount] == 0) {
+			if (smallBlocks[blockCount])
+				vfree(smallBlocks[blockCount]);
+
+			if (largeBlocks[blockCount])
+				FreeDmaBuffer(largeBlocks[blockCount]);
+
+			break;
+		}
+
+		blockCount++;
+	}
+
+	if (blockCount < fBlockCount)
+		printf("tlbbench: only %d MB of contiguous memory is available\n",
+			blockCount * blockSize / 0x100000);
+
+	if (blockCount > 0) {
+		printf("tlbbench: %d MB%s, cycles per page\n", blockCount * blockSize / 0x100000,
+			PhysicalMap::HasLargePages() ? "" : " (large pages aren't supported, so both use 4k pages)");
+		printf("                4k pages  %uMB pages\n", blockSize / 0x100000);
+		printf("  sequential    %8d   %8d\n", ScanPages(smallBlocks, blockCount, false),
+			ScanPages(largeBlocks, blockCount, false));
+		printf("  random        %8d   %8d\n", ScanPages(smallBlocks, blockCount, true),
+			ScanPages(largeBlocks, blockCount, true));
+	}
+
+	for (int i = 0; i < blockCount; i++) {
+		vfree(smallBlocks[i]);
+		FreeDmaBuffer(largeBlocks[i]);
+	}
+
+	fBusy = false;
+}
+
+// This is called from the debugger, which can't create areas, so it only
+// queues the benchmark.
+void PhysicalMap::TlbBenchmarkCommand(int argc, const char *argv[])
+{
+	if (argc > 2) {
+		printf("usage: %s [megabytes]\n", argv[0]);
+		return;
+	}
+
+	int megabytes = argc > 1 ? atoi(argv[1]) : 16;
+	int blockCount = megabytes * 0x100000 / fLargePageSize;
+	if (blockCount < 1 || blockCount > kMaxTlbBenchmarkBlocks
+		|| megabytes * 0x100000 % fLargePageSize != 0) {
+		printf("size must be a multiple of %d MB, up to %d MB\n", fLargePageSize / 0x100000,
+			kMaxTlbBenchmarkBlocks * fLargePageSize / 0x100000);
+		return;
+	}
 
-		lengths[count >= kSampleSize ? kSampleSize : count]++;
+	if (tlbBenchmark.fBusy) {
+		printf("The benchmark is already running\n");
+		return;
 	}
 
-	for (int i = 0; i < kSampleSize; i++)
-		printf("%d %d\n", i, lengths[i]);
+	tlbBenchmark.fBusy = true;
+	tlbBenchmark.fBlockCount = blockCount;
+	tlbBenchmarkQueue.Enqueue(&tlbBenchmark);
+	printf("Results will be printed when the benchmark finishes\n");
 }
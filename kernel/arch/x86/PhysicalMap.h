@@ -19,41 +19,133 @@
 
 #include "List.h"
 #include "Lock.h"
+#include "Spinlock.h"
 #include "types.h"
 
-const int kLockedPageHashSize = 2048;
-
 const int kUncacheablePage = 64; // private PageProtection flag
 
+// Flags returned by PhysicalMap::AgeMapping
+const int kMappingPresent = 1;
+const int kMappingAccessed = 2;
+const int kMappingModified = 4;
+
 class PhysicalMap : private ListNode {
 public:
 	PhysicalMap();
 	virtual ~PhysicalMap();
-	void Map(unsigned int va, unsigned int pa, PageProtection);
+	void Map(unsigned int va, paddr_t pa, PageProtection);
+
+	/// Map a run of pages at consecutive virtual addresses, leaving addresses
+	/// that already have a mapping alone.  No TLB flush is needed, since no
+	/// valid translation changes.  The run must be within one page table, and
+	/// nothing is mapped if that table hasn't been allocated yet.
+	/// @param pa Physical address for each page.  Entries that are INVALID_PAGE
+	///   are skipped.
+	/// @returns Number of pages that were mapped
+	int MapUnmapped(unsigned int va, const paddr_t pa[], int count, PageProtection);
+
+	/// Map physically contiguous memory.  Parts that are aligned to the large
+	/// page size both virtually and physically, and that don't already have a
+	/// page table, are mapped with large pages if the processor supports them.
+	/// Nothing may be mapped in the range yet.
+	void MapContiguous(unsigned int va, paddr_t pa, unsigned int size, PageProtection);
+
+	/// Unmap pages.  A large page must be unmapped all at once.
 	void Unmap(unsigned int base, unsigned int size);
-	unsigned int GetPhysicalAddress(unsigned int va);
+	paddr_t GetPhysicalAddress(unsigned int va);
+
+	/// One step of the clock algorithm used to trim working sets.  If the page
+	/// mapped at va has been accessed since the last call, clear its accessed
+	/// bit.  Otherwise, unmap it.
+	/// @param outPhysicalAddress Set to the page that is mapped, if there is one
+	/// @returns kMappingPresent if a page was mapped, with kMappingAccessed if it
+	///   was kept, or kMappingModified if it was unmapped and had been written to.
+	int AgeMapping(unsigned int va, paddr_t *outPhysicalAddress);
 	int CountMappedPages() const;
+
+	/// @returns The value to load into CR3 for this map: the page directory, or
+	///   the page directory pointer table with PAE
 	unsigned int GetPageDir() const;
-	static char* LockPhysicalPage(unsigned int pa);
+
+	/// Get a kernel address for a physical page.  Pages in low memory are
+	/// always mapped and are returned directly.  Others, including all pages
+	/// above 4GB, are mapped in a slot that belongs to the current processor,
+	/// and the calling thread stays on this processor until the page is
+	/// unlocked.
+	static char* LockPhysicalPage(paddr_t pa);
 	static void UnlockPhysicalPage(const void *va);
-	static void CopyPage(unsigned int destpa, unsigned int srcpa);
+
+	/// Lock several physical pages at once, with the same rules as
+	/// LockPhysicalPage.
+	/// @param outVa Set to the kernel address of each page
+	static void LockPhysicalPages(const paddr_t pa[], int count, char *outVa[]);
+	static void UnlockPhysicalPages(char *const va[], int count);
+
+	static void CopyPage(paddr_t destpa, paddr_t srcpa);
+
+	/// Switch to PAE paging if the processor supports it, and turn on large
+	/// and no-execute pages where available.  This is called before anything
+	/// else is mapped, while low memory is still identity mapped.
+	static void SelectPagingMode();
 	static void Bootstrap();
+
+	/// Map wired memory into kernel space before the page allocator is set up.
+	/// The pages are added to the ranges the boot loader allocated, so they are
+	/// marked used by Bootstrap.  The memory is not cleared.
+	static void MapBootMemory(unsigned int va, unsigned int size);
+
 	static PhysicalMap* GetKernelPhysicalMap();
 
+	/// @returns true if large pages are used
+	static bool HasLargePages();
+
+	/// @returns The size of a large page, which is also the range one page
+	///   table maps: 4MB, or 2MB with PAE
+	static unsigned int GetLargePageSize();
+
+	/// @returns true if page tables have 64-bit entries, so memory above 4GB
+	///   can be mapped
+	static bool HasPae();
+
+	/// @returns true if pages without an execute permission can't run code
+	static bool HasNoExecute();
+
 private:
 	PhysicalMap(unsigned int pageDirAddress);
+	bool MapLargePage(unsigned int va, paddr_t pa, PageProtection);
+	paddr_t GetPageDirPage(unsigned int va, int *outIndex) const;
+	uint64 GetPageDirEntry(unsigned int va) const;
+	void SetPageDirEntry(unsigned int va, uint64 pdent);
+	static void SetKernelPageDirEntry(unsigned int va, uint64 pdent);
+	static void* GetBootPageDir(unsigned int va, int *outIndex);
+	static unsigned int AllocBootPages(int count);
+	static uint64 ReadEntry(const void *table, int index);
+	static void WriteEntry(void *table, int index, uint64 entry);
+	static uint64 ClearEntry(void *table, int index);
+	static void ClearAccessedBit(void *table, int index);
+	static paddr_t GetLargePageAddress(uint64 pdent);
+	static uint64 GetPageFlags(unsigned int va, PageProtection);
+	static void MapDirect(unsigned int size);
+	static char* MapTempSlot(paddr_t pa);
+	static void UnmapTempSlot(unsigned int va);
 	static void PrintStats(int, const char**);
+	static void TlbBenchmarkCommand(int, const char**);
 
 	unsigned int fPageDirectory;
+	paddr_t fPageDirs[4];	// With PAE, the page directory for each 1GB
 	int fMappedPageCount;
 	RecursiveLock fLock;
 	static List fPhysicalMaps;
-	static struct LockedPage *fLockedPageHash[kLockedPageHashSize];
-	static Queue fInactiveLockedPages;
-	static struct LockedPage *fLockedPages;
+	static Spinlock fPhysicalMapsLock;
+	static struct TempMapSlots *fTempMapSlots;
+	static unsigned int fDirectMapSize;
 	static PhysicalMap *fKernelPhysicalMap;
-	static int fLockPageHits;
-	static int fLockPageRequests;
+	static bool fLargePages;
+	static int fLargePageCount;
+	static bool fPae;
+	static bool fNoExecute;
+	static unsigned int fLargePageSize;
+	static int fPagesPerTable;
 };
 
 #endif
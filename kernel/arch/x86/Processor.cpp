@@ -14,48 +14,356 @@
 // limitations under the License.
 // 
 
+
 #include "AddressSpace.h"
 #include "Area.h"
-#include "Processor.h"
+#include "BootParams.h"
 #include "cpu_asm.h"
+#include "HardwareTimer.h"
+#include "interrupt.h"
+#include "KernelDebug.h"
+#include "memory_layout.h"
+#include "PageCache.h"
 #include "PhysicalMap.h"
+#include "Processor.h"
+#include "Scheduler.h"
+#include "stdio.h"
+#include "string.h"
+#include "syscall.h"
 #include "Team.h"
 #include "Thread.h"
+#include "ThreadContext.h"
+
+extern "C" {
+	extern char ApTrampolineStart[];
+	extern char ApTrampolineParameters[];
+	extern char ApTrampolineEnd[];
+};
+
+// This must match the layout of the parameter block in ap_trampoline.s
+struct TrampolineParameters {
+	unsigned int pageDirectory;
+	unsigned int cr4;
+	unsigned int noExecute;
+	unsigned int entry;
+	volatile int startedCount;
+	unsigned int stacks[kMaxProcessors - 1];
+};
+
+const unsigned int kApicPhysicalBase = 0xfee00000;
+
+// Local APIC registers, as indices into the memory mapped register array
+const int kApicIdRegister = 0x20 / 4;
+const int kApicEoiRegister = 0xb0 / 4;
+const int kApicSpuriousRegister = 0xf0 / 4;
+const int kApicIcrLowRegister = 0x300 / 4;
+const int kApicIcrHighRegister = 0x310 / 4;
+
+const unsigned int kApicSoftwareEnable = 0x100;
+const unsigned int kIcrInit = 5 << 8;
+const unsigned int kIcrStartup = 6 << 8;
+const unsigned int kIcrDeliveryPending = 1 << 12;
+const unsigned int kIcrAssert = 1 << 14;
+const unsigned int kIcrLevelTriggered = 1 << 15;
+const unsigned int kIcrAllExcludingSelf = 3 << 18;
+
+const unsigned int kApStackSize = 0x3000;
+const bigtime_t kInitDelay = 10000;
+const bigtime_t kStartupDelay = 200;
+const bigtime_t kApStartupTimeout = 100000;
+
+// Set in the started count of the trampoline once the boot processor stops
+// waiting.  Processors that start later see it and don't claim an index.
+const int kApStartupClosed = 0x40000000;
 
-const int kApicPhysicalBase = 0xfee00000;
-int* Processor::fLocalApicRegisters = 0;
-Processor* Processor::fProcessors;
+// The TSS descriptors are filled in by Processor::Bootstrap.
+static GdtEntry gdt[kFirstTssSelector / sizeof(GdtEntry) + kMaxProcessors] = {
+	{0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0},					// Null segment	0x0
+	{0xffff, 0, 0, 0xa, 1, 0, 1, 0xf, 0, 0, 1, 1, 0},			// OS Code		0x8
+	{0xffff, 0, 0, 0x2, 1, 0, 1, 0xf, 0, 0, 1, 1, 0},			// OS Data		0x10
+	{0xffff, 0, 0, 0xa, 1, 3, 1, 0xf, 0, 0, 1, 1, 0},			// User Code	0x1b
+	{0xffff, 0, 0, 0x2, 1, 3, 1, 0xf, 0, 0, 1, 1, 0},			// User Data	0x23
+};
+
+volatile int* Processor::fLocalApicRegisters = 0;
+Processor Processor::fProcessors[kMaxProcessors];
+volatile int Processor::fProcessorCount = 1;
+volatile int Processor::fProcessorsOnline = 1;
+volatile int Processor::fShootdownLock = 0;
+volatile int Processor::fShootdownAcks = 0;
+unsigned int Processor::fShootdownPageDirectory = INVALID_PAGE;
+unsigned int Processor::fShootdownNewPageDirectory = INVALID_PAGE;
 
 Processor::Processor()
+	:	fIndex(0),
+		fApicID(0),
+		fRunningThread(0),
+		fIdleThread(0),
+		fCurrentContext(0),
+		fFpuOwner(0),
+		fShootdownPending(0)
 {
-	// There is a zero priority idle thread spawned for each processor.  The thread is
-	// not specifically bound to that processor or even treated specially by
-	// scheduler code.  This guarantees that there will always be a thread that is
-	// ready to run, simplifying the scheduler.
-	new Thread("Idle Thread", Thread::GetRunningThread()->GetTeam(), IdleLoop, 0, 0);
 }
 
 void Processor::Bootstrap()
 {
-	fLocalApicRegisters = reinterpret_cast<int*>(AddressSpace::GetKernelAddressSpace()
-		->MapPhysicalMemory("Local APIC", kApicPhysicalBase, 0x1000, SYSTEM_READ
+	// Each processor has its own TSS.  It is only referenced by the processor
+	// during a switch from user to supervisor mode, in which case it is consulted
+	// to find the kernel stack pointer and selector.  It is not used for task
+	// switching, as a software based mechanism is used.
+	for (int index = 0; index < kMaxProcessors; index++) {
+		Processor &processor = fProcessors[index];
+		processor.fIndex = index;
+		memset(&processor.fTss, 0, sizeof(Tss));
+		processor.fTss.ss0 = 0x10;
+
+		unsigned int base = reinterpret_cast<unsigned int>(&processor.fTss);
+		GdtEntry &entry = gdt[kFirstTssSelector / sizeof(GdtEntry) + index];
+		entry.limit0_15 = sizeof(Tss);
+		entry.base0_15 = base & 0xffff;
+		entry.base16_23 = (base >> 16) & 0xff;
+		entry.type = 9;
+		entry.present = 1;
+		entry.defOpSize = 1;
+		entry.granularity = 1;
+		entry.base24_31 = (base >> 24) & 0xff;
+	}
+
+	LoadGdt(gdt, sizeof(gdt), kFirstTssSelector);
+	ThreadContext::Bootstrap();
+
+	// Keep the page allocator away from the page application processors
+	// will start from.
+	bootParams.SetAllocated(kApTrampolineBase, kApTrampolineBase + PAGE_SIZE);
+}
+
+void Processor::StartProcessors()
+{
+	fLocalApicRegisters = reinterpret_cast<volatile int*>(AddressSpace::GetKernelAddressSpace()
+		->MapPhysicalMemory("Local APIC", kApicPhysicalBase, PAGE_SIZE, SYSTEM_READ
 		| SYSTEM_WRITE | kUncacheablePage)->GetBaseAddress());
-	fProcessors = new Processor[1];
+	fProcessors[0].fApicID = ApicID();
+	EnableLocalApic();
+	LocalTimerBootstrap();
+
+	// There is a zero priority idle thread for each processor.  The thread is
+	// bound to that processor, but is not otherwise treated specially by
+	// scheduler code.  This guarantees that there will always be a thread that is
+	// ready to run on each processor, simplifying the scheduler.
+	fProcessors[0].fIdleThread = new Thread("Idle Thread", Thread::GetRunningThread()->GetTeam(),
+		IdleLoop, 0, 0);
+	fProcessors[0].fIdleThread->SetAffinity(0);
+
+	StartApplicationProcessors();
+	printf("%d processor%s online\n", fProcessorCount, fProcessorCount > 1 ? "s" : "");
+	gScheduler.StartLoadBalancer();
+}
+
+void Processor::SetInitialThread(Thread *thread)
+{
+	cpu_flags fl = DisableInterrupts();
+	Processor *processor = GetCurrentProcessor();
+	processor->fRunningThread = thread;
+	processor->fCurrentContext = &thread->fThreadContext;
+	thread->fLastProcessor = processor->fIndex;
+	RestoreInterrupts(fl);
+}
+
+void Processor::RequestReschedule()
+{
+	SendInterProcessorInterrupt(fApicID, kRescheduleInterrupt);
+}
+
+void Processor::FlushRemoteTLBs(unsigned int pageDirectory)
+{
+	Shootdown(pageDirectory, INVALID_PAGE);
+}
+
+void Processor::DetachPageDirectory(unsigned int pageDirectory)
+{
+	Shootdown(pageDirectory, PhysicalMap::GetKernelPhysicalMap()->GetPageDir());
 }
 
-Processor* Processor::GetCurrentProcessor()
+// Every other processor that is using pageDirectory (or all of them, if it is
+// INVALID_PAGE) flushes its TLB.  If newPageDirectory is not INVALID_PAGE,
+// those processors switch to it instead.
+void Processor::Shootdown(unsigned int pageDirectory, unsigned int newPageDirectory)
 {
-	return &fProcessors[0];
+	if (fProcessorCount == 1)
+		return;
+
+	cpu_flags fl = DisableInterrupts();
+	while (!cmpxchg32(&fShootdownLock, 0, 1)) {
+		// Another processor is flushing and may be waiting for this one, which
+		// can't take the interrupt right now.  Poll for the request.
+		HandleTLBShootdown();
+		SpinPause();
+	}
+
+	fShootdownPageDirectory = pageDirectory;
+	fShootdownNewPageDirectory = newPageDirectory;
+	fShootdownAcks = fProcessorCount - 1;
+	for (int index = 0; index < fProcessorCount; index++) {
+		if (index != GetCurrentProcessorIndex())
+			fProcessors[index].fShootdownPending = 1;
+	}
+
+	SendInterProcessorInterrupt(0, kIcrAllExcludingSelf | kTLBShootdownInterrupt);
+	while (fShootdownAcks > 0)
+		SpinPause();
+
+	MemoryBarrier();
+	fShootdownLock = 0;
+	RestoreInterrupts(fl);
+}
+
+InterruptStatus Processor::HandleInterProcessorInterrupt(int vector)
+{
+	AcknowledgeInterrupt();
+	switch (vector) {
+		case kRescheduleInterrupt:
+			return kReschedule;
+
+		case kTLBShootdownInterrupt:
+			HandleTLBShootdown();
+			break;
+	}
+
+	return kHandledInterrupt;
+}
+
+void Processor::AcknowledgeInterrupt()
+{
+	fLocalApicRegisters[kApicEoiRegister] = 0;
 }
 
 int Processor::ApicID()
 {
-	return (fLocalApicRegisters[8] >> 24) & 0xf;
+	return (fLocalApicRegisters[kApicIdRegister] >> 24) & 0xf;
+}
+
+void Processor::SendInterProcessorInterrupt(int apicID, unsigned int command)
+{
+	cpu_flags fl = DisableInterrupts();
+	while (fLocalApicRegisters[kApicIcrLowRegister] & kIcrDeliveryPending)
+		SpinPause();
+
+	fLocalApicRegisters[kApicIcrHighRegister] = apicID << 24;
+	fLocalApicRegisters[kApicIcrLowRegister] = command;
+	RestoreInterrupts(fl);
+}
+
+void Processor::EnableLocalApic()
+{
+	fLocalApicRegisters[kApicSpuriousRegister] = kApicSoftwareEnable | kSpuriousInterrupt;
+}
+
+void Processor::StartApplicationProcessors()
+{
+	// Processors start executing in real mode, so the startup code must
+	// live in low memory.  It is identity mapped so it keeps running when the
+	// processor turns on paging.
+	PhysicalMap *kernelMap = PhysicalMap::GetKernelPhysicalMap();
+	kernelMap->Map(kApTrampolineBase, kApTrampolineBase, SYSTEM_READ | SYSTEM_WRITE
+		| SYSTEM_EXEC);
+	char *trampoline = reinterpret_cast<char*>(kApTrampolineBase);
+	memcpy(trampoline, ApTrampolineStart, ApTrampolineEnd - ApTrampolineStart);
+	TrampolineParameters *params = reinterpret_cast<TrampolineParameters*>(trampoline
+		+ (ApTrampolineParameters - ApTrampolineStart));
+
+	// The number of processors isn't known until they start, so create a stack
+	// for every one that could.  The unused ones are freed afterward.
+	Area *stacks[kMaxProcessors];
+	for (int index = 1; index < kMaxProcessors; index++) {
+		stacks[index] = AddressSpace::GetKernelAddressSpace()->CreateArea("idle stack",
+			kApStackSize, AREA_WIRED, SYSTEM_READ | SYSTEM_WRITE, new PageCache, 0,
+			INVALID_PAGE, SEARCH_FROM_TOP);
+		if (stacks[index] == 0)
+			panic("Can't create processor stack: out of virtual space\n");
+
+		params->stacks[index - 1] = stacks[index]->GetBaseAddress() + kApStackSize - 4;
+	}
+
+	params->pageDirectory = kernelMap->GetPageDir();
+	params->cr4 = GetCR4();
+	params->noExecute = PhysicalMap::HasNoExecute();
+	params->entry = reinterpret_cast<unsigned int>(ApplicationProcessorEntry);
+	params->startedCount = 0;
+
+	// INIT, followed by two STARTUP IPIs, as described in the Intel MultiProcessor
+	// Specification.  The vector of a STARTUP IPI is the page number the processor
+	// begins executing at.
+	SendInterProcessorInterrupt(0, kIcrAllExcludingSelf | kIcrInit | kIcrAssert
+		| kIcrLevelTriggered);
+	sleep(kInitDelay);
+	for (int i = 0; i < 2; i++) {
+		SendInterProcessorInterrupt(0, kIcrAllExcludingSelf | kIcrStartup
+			| (kApTrampolineBase / PAGE_SIZE));
+		sleep(kStartupDelay);
+	}
+
+	sleep(kApStartupTimeout);
+
+	// Close startup, so the count of processors that have claimed an index
+	// can't change afterward.  The processors that have started are waiting
+	// in ApplicationProcessorEntry for an idle thread to be assigned to them.
+	int startedCount = AtomicOr(&params->startedCount, kApStartupClosed);
+	Team *kernelTeam = Thread::GetRunningThread()->GetTeam();
+	for (int index = 1; index <= startedCount; index++) {
+		fProcessors[index].fIdleThread = new Thread("Idle Thread", kernelTeam, stacks[index], 0);
+		fProcessors[index].fIdleThread->SetAffinity(index);
+		stacks[index] = 0;
+	}
+
+	MemoryBarrier();
+	fProcessorCount = startedCount + 1;
+	while (fProcessorsOnline < fProcessorCount)
+		SpinPause();
+
+	// No processor can claim the stacks that are left, so they are freed.  The
+	// trampoline stays mapped, because a processor that got the startup IPI
+	// late may still be running it on the way to being parked.
+	for (int index = startedCount + 1; index < kMaxProcessors; index++)
+		AddressSpace::GetKernelAddressSpace()->DeleteArea(stacks[index]);
+}
+
+void Processor::ApplicationProcessorEntry(int index)
+{
+	Processor *processor = &fProcessors[index];
+	LoadGdt(gdt, sizeof(gdt), kFirstTssSelector + index * sizeof(GdtEntry));
+	LoadInterruptTable();
+	processor->fApicID = ApicID();
+	EnableLocalApic();
+	StartLocalTimer();
+
+	while (fProcessorCount <= index)
+		SpinPause();
+
+	SetInitialThread(processor->fIdleThread);
+	AtomicAdd(&fProcessorsOnline, 1);
+	EnableInterrupts();
+	IdleLoop(0);
 }
 
+void Processor::HandleTLBShootdown()
+{
+	Processor *processor = GetCurrentProcessor();
+	if (processor->fShootdownPending) {
+		processor->fShootdownPending = 0;
+		unsigned int current = GetCurrentPageDir();
+		if (fShootdownPageDirectory == INVALID_PAGE || fShootdownPageDirectory == current) {
+			SetCurrentPageDir(fShootdownNewPageDirectory != INVALID_PAGE
+				? fShootdownNewPageDirectory : current);
+		}
+
+		AtomicAdd(&fShootdownAcks, -1);
+	}
+}
+
+// There is no periodic tick, so a processor stays halted here until a thread
+// becomes ready for it or a timer it programmed expires.
 int Processor::IdleLoop(void*)
 {
 	for (;;)
 		Halt();
 }
-
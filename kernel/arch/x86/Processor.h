@@ -14,21 +14,170 @@
 // limitations under the License.
 // 
 
+
+/// @file Processor.h
 #ifndef _PROCESSOR_H
 #define _PROCESSOR_H
 
+#include "cpu_asm.h"
+#include "InterruptHandler.h"
+#include "x86.h"
+
+class Thread;
+class ThreadContext;
+
+const int kMaxProcessors = 8;
+
+/// Selector of the TSS descriptor for processor 0.  Each processor has its own
+/// TSS, and their descriptors are consecutive in the GDT, so the task register
+/// also identifies the processor that is executing.
+const unsigned int kFirstTssSelector = 0x28;
+
+/// Processor contains the state that is private to each CPU in the system.
 class Processor {
 public:
-	static void Bootstrap();	
-	static Processor* GetCurrentProcessor();
+	/// Called early at boot (before any threads are created) to set up the
+	/// descriptor tables of the boot processor.
+	static void Bootstrap();
+
+	/// Called once the kernel team exists to create idle threads and start
+	/// the other processors in the system.
+	static void StartProcessors();
+
+	/// @returns the processor the caller is running on.  Interrupts should be
+	///   disabled, otherwise the thread may be moved to another processor
+	///   before the result is used.
+	static inline Processor* GetCurrentProcessor();
+
+	/// @returns the index of the processor the caller is running on.
+	static inline int GetCurrentProcessorIndex();
+
+	static inline Processor* GetProcessor(int index);
+	static inline int GetProcessorCount();
+
+	inline int GetIndex() const;
+
+	/// Get the thread that is running on this processor
+	inline Thread* GetRunningThread() const;
+
+	/// Set the thread that is running on this processor.  Called by the
+	/// scheduler with the dispatcher lock held.
+	inline void SetRunningThread(Thread*);
+
+	/// Get the lowest priority thread that was created for this processor
+	inline Thread* GetIdleThread() const;
+
+	/// Record a thread that represents the code that is already executing on
+	/// the calling processor (the initial thread of each processor).
+	static void SetInitialThread(Thread*);
+
+	/// Interrupt this processor so it will call into the scheduler.
+	void RequestReschedule();
+
+	/// Flush TLB entries on all processors other than the caller that are
+	/// currently using the passed page directory.  If INVALID_PAGE is passed, all
+	/// other processors will flush (this is used for kernel mappings).  This
+	/// must be called with interrupts enabled.
+	static void FlushRemoteTLBs(unsigned int pageDirectory);
+
+	/// Make any other processor that is still using the passed page directory
+	/// switch to the kernel page directory.  Kernel threads don't switch
+	/// address spaces, so a processor may be using a page directory long after the
+	/// thread that loaded it has exited.  This must be called before the page
+	/// directory is freed, with interrupts enabled.
+	static void DetachPageDirectory(unsigned int pageDirectory);
+
+	/// Called from the trap handler when an inter-processor interrupt is received.
+	/// @returns kReschedule if the scheduler should be invoked
+	static InterruptStatus HandleInterProcessorInterrupt(int vector);
+
+	/// @returns the memory mapped registers of the local APIC, or 0 if they
+	///   have not been mapped yet.  Each processor sees its own APIC at the same
+	///   address.
+	static inline volatile int* GetLocalApicRegisters();
+
+	/// Signal the end of an interrupt that was delivered by the local APIC
+	static void AcknowledgeInterrupt();
 
 private:
 	Processor();
 	static int ApicID();
+	static void SendInterProcessorInterrupt(int apicID, unsigned int command);
+	static void EnableLocalApic();
+	static void StartApplicationProcessors();
+	static void ApplicationProcessorEntry(int index) NORETURN;
+	static void Shootdown(unsigned int pageDirectory, unsigned int newPageDirectory);
+	static void HandleTLBShootdown();
 	static int IdleLoop(void*) NORETURN;
 
-	static int *fLocalApicRegisters;
-	static Processor *fProcessors;
+	int fIndex;
+	int fApicID;
+	Thread *fRunningThread;
+	Thread *fIdleThread;
+	ThreadContext *fCurrentContext;
+	ThreadContext *fFpuOwner;
+	volatile int fShootdownPending;
+	Tss fTss;
+
+	static volatile int *fLocalApicRegisters;
+	static Processor fProcessors[kMaxProcessors];
+	static volatile int fProcessorCount;
+	static volatile int fProcessorsOnline;
+	static volatile int fShootdownLock;
+	static volatile int fShootdownAcks;
+	static unsigned int fShootdownPageDirectory;
+	static unsigned int fShootdownNewPageDirectory;
+
+	friend class ThreadContext;
 };
 
+inline Processor* Processor::GetCurrentProcessor()
+{
+	return &fProcessors[GetCurrentProcessorIndex()];
+}
+
+inline int Processor::GetCurrentProcessorIndex()
+{
+	// The task register isn't set up until the GDT is loaded by Bootstrap.
+	// Code that runs before that (including static constructors) is on the boot
+	// processor.
+	unsigned int index = (GetTaskRegister() - kFirstTssSelector) / sizeof(GdtEntry);
+	return index < static_cast<unsigned int>(kMaxProcessors) ? index : 0;
+}
+
+inline Processor* Processor::GetProcessor(int index)
+{
+	return &fProcessors[index];
+}
+
+inline int Processor::GetProcessorCount()
+{
+	return fProcessorCount;
+}
+
+inline volatile int* Processor::GetLocalApicRegisters()
+{
+	return fLocalApicRegisters;
+}
+
+inline int Processor::GetIndex() const
+{
+	return fIndex;
+}
+
+inline Thread* Processor::GetRunningThread() const
+{
+	return fRunningThread;
+}
+
+inline void Processor::SetRunningThread(Thread *thread)
+{
+	fRunningThread = thread;
+}
+
+inline Thread* Processor::GetIdleThread() const
+{
+	return fIdleThread;
+}
+
 #endif
@@ -17,6 +17,8 @@
 #include <string.h>
 #include "cpu_asm.h"
 #include "PhysicalMap.h"
+#include "Processor.h"
+#include "Scheduler.h"
 #include "stdio.h"
 #include "syscall.h"
 #include "ThreadContext.h"
@@ -25,40 +27,19 @@
 	stack = (unsigned int)(stack) - 4; 				\
 	*(unsigned int*)(stack) = (unsigned int)(value);
 
-// One TSS is shared by all tasks.  It is only referenced by the processor
-// during a switch from user to supervisor mode, in which case it is consulted
-// to find the kernel stack pointer and selector.  It is not used for task switching,
-// as a software based mechanism is used.
-static Tss tss = {
-	0, 0, 0x10, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
-	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0
-};
-
-static GdtEntry gdt[] = {
-	{0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0},					// Null segment	0x0
-	{0xffff, 0, 0, 0xa, 1, 0, 1, 0xf, 0, 0, 1, 1, 0},			// OS Code		0x8
-	{0xffff, 0, 0, 0x2, 1, 0, 1, 0xf, 0, 0, 1, 1, 0},			// OS Data		0x10
-	{0xffff, 0, 0, 0xa, 1, 3, 1, 0xf, 0, 0, 1, 1, 0},			// User Code	0x1b
-	{0xffff, 0, 0, 0x2, 1, 3, 1, 0xf, 0, 0, 1, 1, 0},			// User Data	0x23
-	{sizeof(tss), reinterpret_cast<unsigned int>(&tss) & 0xffff,	// main TSS		0x28
-		(reinterpret_cast<unsigned int>(&tss) >> 16) & 0xff, 9, 0, 0, 1, 0, 0, 0, 1, 1,
-		(reinterpret_cast<unsigned int>(&tss) >> 24) & 0xff}
-};
-
-ThreadContext *ThreadContext::fCurrentTask = 0;
-ThreadContext *ThreadContext::fFpuOwner = 0;
 FpState ThreadContext::fDefaultFpState;
 
-// This is used to set up the first task.
+// This is used for threads that represent code already running on a processor
+// (the first thread of each processor).  These are kernel threads, so they use
+// the kernel page directory (which is the current one if the kernel physical map
+// hasn't been created yet).
 ThreadContext::ThreadContext()
 	:	fStackPointer(0),
-		fPageDirectory(GetCurrentPageDir()),
+		fPageDirectory(PhysicalMap::GetKernelPhysicalMap()
+			? PhysicalMap::GetKernelPhysicalMap()->GetPageDir() : GetCurrentPageDir()),
 		fKernelStackBottom(0),
 		fKernelThread(true)
 {
-	SaveFp(fDefaultFpState);
-	LoadGdt(gdt, sizeof(gdt));
-	fCurrentTask = this;
 }
 
 ThreadContext::ThreadContext(const PhysicalMap *physicalMap)
@@ -69,15 +50,6 @@ ThreadContext::ThreadContext(const PhysicalMap *physicalMap)
 {
 }
 
-ThreadContext::~ThreadContext()
-{
-	cpu_flags fl = DisableInterrupts();
-	if (fFpuOwner == this)
-		fFpuOwner = 0;
-
-	RestoreInterrupts(fl);
-}
-
 void ThreadContext::Setup(thread_start_t startAddress, void *param,
 	unsigned int userStack, unsigned int kernelStack)
 {
@@ -86,9 +58,11 @@ void ThreadContext::Setup(thread_start_t startAddress, void *param,
 	memcpy(&fFpState, &fDefaultFpState, sizeof(FpState));
 
 	if (fKernelThread) {
-		// Set up call to kernel entry point
-		PUSH(fStackPointer, thread_exit); // return address
-		PUSH(fStackPointer, startAddress); // thread start address
+		// Set up call to KernelThreadStart, passing entry point and parameter
+		PUSH(fStackPointer, param);
+		PUSH(fStackPointer, startAddress);
+		PUSH(fStackPointer, 0);
+		PUSH(fStackPointer, KernelThreadStart);
 	} else {
 		// Set up call to UserThreadStart, passing user stack, entry point, and
 		// desired parameters
@@ -99,30 +73,41 @@ void ThreadContext::Setup(thread_start_t startAddress, void *param,
 		PUSH(fStackPointer, UserThreadStart);
 	}
 
-	// State saved in SwitchTo.  Note that interrupts start off for user threads
-	// (as they call into the kernel function UserThreadStart and do some more
-	// setup before jumping to user mode).
-	PUSH(fStackPointer, fKernelThread ? (1 << 9) : 0);	// eflags
+	// State saved in SwitchTo.  Note that interrupts start off for all threads.
+	// The new thread is entered with the dispatcher lock held by the context
+	// switch, and interrupts must remain disabled until it is released.
+	PUSH(fStackPointer, 0);	// eflags
 	PUSH(fStackPointer, 0);	// ebp
 	PUSH(fStackPointer, 0);	// esi
 	PUSH(fStackPointer, 0);	// edi
 	PUSH(fStackPointer, 0);	// ebx
 }
 
+void ThreadContext::SetKernelStack(unsigned int kernelStack)
+{
+	fKernelStackBottom = kernelStack;
+}
+
 void ThreadContext::SwitchTo()
 {
-	ThreadContext *previousTask = fCurrentTask;
-	fCurrentTask = this;
-	tss.esp0 = fKernelStackBottom; // kernel stack for user threads
-	if (fFpuOwner == this)
-		ClearTrapOnFp(); // My data is still in the fpu
-	else
-		SetTrapOnFp(); 	// Another thread's data is in the fpu, trap if I need
-						// to use it.
+	Processor *processor = Processor::GetCurrentProcessor();
+	ThreadContext *previousTask = processor->fCurrentContext;
+	processor->fCurrentContext = this;
+	processor->fTss.esp0 = fKernelStackBottom; // kernel stack for user threads
+
+	// FPU state is loaded lazily, but it is saved as soon as the owning
+	// thread is switched out.  That thread may be resumed on another
+	// processor, which must be able to find its state in memory.
+	if (processor->fFpuOwner == previousTask) {
+		SaveFp(previousTask->fFpState);
+		processor->fFpuOwner = 0;
+	}
+
+	SetTrapOnFp();
 
 	// Note: the INVALID_PAGE will tell the context switching
 	// code to *not* switch address spaces.
-	ContextSwitch(&previousTask->fStackPointer, fCurrentTask->fStackPointer,
+	ContextSwitch(&previousTask->fStackPointer, fStackPointer,
 		fPageDirectory != previousTask->fPageDirectory && !fKernelThread ? fPageDirectory
 		: INVALID_PAGE);
 }
@@ -138,12 +123,23 @@ void ThreadContext::PrintStackTrace() const
 
 void ThreadContext::SwitchFp()
 {
+	Processor *processor = Processor::GetCurrentProcessor();
 	ClearTrapOnFp();
-	if (fFpuOwner)
-		SaveFp(fFpuOwner->fFpState);
+	RestoreFp(processor->fCurrentContext->fFpState);
+	processor->fFpuOwner = processor->fCurrentContext;
+}
 
-	RestoreFp(fCurrentTask->fFpState);
-	fFpuOwner = fCurrentTask;
+void ThreadContext::Bootstrap()
+{
+	SaveFp(fDefaultFpState);
+}
+
+void ThreadContext::KernelThreadStart(unsigned int startAddress, unsigned int param)
+{
+	gScheduler.ThreadStartup();
+	EnableInterrupts();
+	reinterpret_cast<thread_start_t>(startAddress)(reinterpret_cast<void*>(param));
+	thread_exit();
 }
 
 void ThreadContext::UserThreadStart(unsigned int startAddress, unsigned int userStack,
@@ -153,8 +149,9 @@ void ThreadContext::UserThreadStart(unsigned int startAddress, unsigned int user
 	// invokes the system call thread_exit().  The return address
 	// for the first function call points to this code.  This allows
 	// a user thread to simply return the entry function and self terminate
-	// cleanly.
+	// cleanly.  Interrupts stay disabled until the thread enters user mode.
 	// movl $3, %eax; int $50
+	gScheduler.ThreadStartup();
 	const unsigned char kExitStub[] = { 0xb8, 3, 0, 0, 0, 0xcd, 0x32 };
 	userStack = (userStack - sizeof(kExitStub)) & ~3;
 	memcpy(reinterpret_cast<void*>(userStack), kExitStub, sizeof(kExitStub));
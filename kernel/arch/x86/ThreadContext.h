@@ -26,16 +26,18 @@ class PhysicalMap;
 /// ThreadContext contains the architecture dependent state of a thread
 class ThreadContext {
 public:
-	ThreadContext();	// Used for first task.
+	ThreadContext();	// Used for threads that are already running.
 	ThreadContext(const PhysicalMap*);
-	~ThreadContext();
 	void Setup(thread_start_t, void *param, unsigned userStack,
 		unsigned kernelStack);
+	void SetKernelStack(unsigned kernelStack);
 	void SwitchTo();
 	void PrintStackTrace() const;
 	static void SwitchFp();
+	static void Bootstrap();
 
 private:
+	static void KernelThreadStart(unsigned startAddress, unsigned param) NORETURN;
 	static void UserThreadStart(unsigned startAddress, unsigned userStack,
 		unsigned param) NORETURN;
 
@@ -44,11 +46,6 @@ private:
 	unsigned fKernelStackBottom;
 	bool fKernelThread;
 	FpState fFpState;
-	static ThreadContext *fCurrentTask;
-
-	// Note: this assumes single processor operation.  It should
-	// move to Processor.
-	static ThreadContext *fFpuOwner;
 	static FpState fDefaultFpState;
 };
 
@@ -0,0 +1,112 @@
+# 
+# Copyright 1998-2012 Jeff Bush
+# 
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+# 
+#     http://www.apache.org/licenses/LICENSE-2.0
+# 
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+# 
+
+
+#
+# Startup code for application processors.  The boot processor copies
+# everything between ApTrampolineStart and ApTrampolineEnd to kApTrampolineBase
+# (see memory_layout.h) and fills in the parameter block before sending the
+# startup IPI.  Each processor starts executing here in real mode with
+# CS = kApTrampolineBase >> 4 and IP = 0.
+#
+# 1. Load a temporary flat GDT and switch to protected mode
+# 2. Set up CR4 and EFER the same way as on the boot processor, which selects
+#    PAE paging and no-execute pages if it uses them, then load the kernel
+#    page directory and enable paging.  The trampoline page stays identity
+#    mapped in the kernel page directory.
+# 3. Claim a unique index by atomically incrementing the started count, unless
+#    there are no stacks left or the boot processor has closed startup by
+#    setting a high bit in the count.  Processors that don't get an index are
+#    parked.
+# 4. Switch to the stack the boot processor allocated for that index and jump
+#    to Processor::ApplicationProcessorEntry(index)
+#
+
+					.set TRAMPOLINE_BASE, 0x8000		# Must match kApTrampolineBase
+					.set MAX_AP_STACKS, 7				# kMaxProcessors - 1
+
+					.text
+					.code16
+					.globl ApTrampolineStart
+					.align 8
+ApTrampolineStart:	cli
+					movw %cs, %ax
+					movw %ax, %ds
+					lgdtl ap_gdt_descriptor - ApTrampolineStart
+					movl %cr0, %eax
+					orl $1, %eax						# Protection enable
+					movl %eax, %cr0
+					ljmpl $0x8, $(ap_protected - ApTrampolineStart + TRAMPOLINE_BASE)
+
+					.code32
+ap_protected:		movw $0x10, %ax
+					movw %ax, %ds
+					movw %ax, %es
+					movw %ax, %fs
+					movw %ax, %gs
+					movw %ax, %ss
+					movl (ap_cr4 - ApTrampolineStart + TRAMPOLINE_BASE), %eax
+					movl %eax, %cr4
+					cmpl $0, (ap_no_execute - ApTrampolineStart + TRAMPOLINE_BASE)
+					je ap_load_page_dir
+					movl $0xc0000080, %ecx				# EFER
+					rdmsr
+					orl $0x800, %eax					# No-execute enable
+					wrmsr
+ap_load_page_dir:	movl (ap_page_directory - ApTrampolineStart + TRAMPOLINE_BASE), %eax
+					movl %eax, %cr3
+					movl $0x80010021, %eax				# Same as boot processor: paging, write
+					movl %eax, %cr0						# protect, numeric error, protected mode.
+														# This also enables caches.
+ap_claim_index:		movl (ap_started_count - ApTrampolineStart + TRAMPOLINE_BASE), %eax
+					cmpl $MAX_AP_STACKS, %eax			# Is there a stack for this processor?
+					jae ap_no_stack						# If not, or startup is closed, park it.
+					leal 1(%eax), %edx
+					lock
+					cmpxchgl %edx, (ap_started_count - ApTrampolineStart + TRAMPOLINE_BASE)
+					jne ap_claim_index					# Another processor changed the count
+					movl (ap_stacks - ApTrampolineStart + TRAMPOLINE_BASE)(,%eax,4), %esp
+					incl %eax							# Processor 0 is the boot processor
+					pushl %eax							# Processor index parameter
+					pushl $0							# Return address (never returns)
+					jmp *(ap_entry - ApTrampolineStart + TRAMPOLINE_BASE)
+
+ap_no_stack:		hlt
+					jmp ap_no_stack
+
+					.align 8
+ap_gdt:				.long 0, 0							# Null segment
+					.long 0x0000ffff, 0x00cf9a00		# Code 0x8
+					.long 0x0000ffff, 0x00cf9200		# Data 0x10
+ap_gdt_descriptor:	.word ap_gdt_descriptor - ap_gdt - 1
+					.long ap_gdt - ApTrampolineStart + TRAMPOLINE_BASE
+
+					# Parameter block, filled in by the boot processor.
+					# This layout must match TrampolineParameters in Processor.cpp
+					.align 4
+					.globl ApTrampolineParameters
+ApTrampolineParameters:
+ap_page_directory:	.long 0
+ap_cr4:				.long 0
+ap_no_execute:		.long 0
+ap_entry:			.long 0
+ap_started_count:	.long 0
+ap_stacks:			.space 4 * MAX_AP_STACKS
+
+					.globl ApTrampolineEnd
+ApTrampolineEnd:
+
+					.end
@@ -41,6 +41,12 @@ inline void EnableInterrupts()
 	asm("sti");
 }
 
+/// @returns true if interrupts were enabled in a state returned by DisableInterrupts
+inline bool InterruptsEnabled(const cpu_flags flags)
+{
+	return (flags & 0x200) != 0;	// IF
+}
+
 /// Invalidate Translation Lookaside Buffer for a specific virtual address
 /// This removes any cached page mappings for this address.  It must be called
 /// whenever the mapping for a virtual address is changed.
@@ -134,16 +140,64 @@ inline void SetCurrentPageDir(unsigned int addr)
 	asm("movl %0, %%cr3" : : "q" (addr));
 }
 
+/// Return control register 4, which enables processor extensions
+inline unsigned int GetCR4()
+{
+	unsigned int val;
+	asm volatile("movl %%cr4, %0" : "=r" (val));
+	return val;
+}
+
+inline void SetCR4(unsigned int val)
+{
+	asm volatile("movl %0, %%cr4" : : "r" (val));
+}
+
 inline bool cmpxchg32(volatile int *var, int oldValue, int newValue)
 {
 	int success;
 	asm volatile("lock; cmpxchg %%ecx, (%%edi); sete %%al; andl $1, %%eax"
 		: "=a" (success)
-		: "a" (oldValue), "c" (newValue), "D" (var));
+		: "a" (oldValue), "c" (newValue), "D" (var)
+		: "memory");
 
 	return success;
 }
 
+/// Hint to the processor that this is a busy-wait loop.  This avoids a memory
+/// order violation penalty when the loop exits, and lets a hyperthreaded sibling
+/// use the execution resources.
+inline void SpinPause()
+{
+	asm volatile("pause");
+}
+
+/// Prevent the compiler from moving memory accesses across this point.  x86
+/// does not reorder stores with other stores, so a compiler barrier is
+/// sufficient before releasing a lock.
+inline void MemoryBarrier()
+{
+	asm volatile("" : : : "memory");
+}
+
+/// @returns the index of the most significant bit that is set.  The value
+/// must not be zero.
+inline int FindHighestSetBit(unsigned int value)
+{
+	int index;
+	asm("bsrl %1, %0" : "=r" (index) : "rm" (value));
+	return index;
+}
+
+/// @returns the index of the least significant bit that is set.  The value
+/// must not be zero.
+inline int FindLowestSetBit(unsigned int value)
+{
+	int index;
+	asm("bsfl %1, %0" : "=r" (index) : "rm" (value));
+	return index;
+}
+
 inline int64 rdtsc()
 {
 	unsigned int high, low;
@@ -151,6 +205,35 @@ inline int64 rdtsc()
 	return (int64) high << 32 | low;
 }
 
+/// Execute the cpuid instruction for the passed function number
+inline void cpuid(unsigned int function, unsigned int &eax, unsigned int &ebx,
+	unsigned int &ecx, unsigned int &edx)
+{
+	asm volatile("cpuid" : "=a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx) : "a" (function));
+}
+
+/// Read a model specific register
+inline int64 rdmsr(unsigned int msr)
+{
+	unsigned int high, low;
+	asm volatile("rdmsr" : "=a" (low), "=d" (high) : "c" (msr));
+	return (int64) high << 32 | low;
+}
+
+/// Write a model specific register
+inline void wrmsr(unsigned int msr, int64 value)
+{
+	asm volatile("wrmsr" : : "c" (msr), "a" (static_cast<unsigned int>(value)),
+		"d" (static_cast<unsigned int>(value >> 32)));
+}
+
+/// Serialize all loads and stores.  This is needed when a store to memory
+/// mapped device registers must complete before a wrmsr.
+inline void MemoryFence()
+{
+	asm volatile("mfence" : : : "memory");
+}
+
 inline void LoadIdt(const IdtEntry base[], unsigned int limit)
 {
 	struct desc {
@@ -163,7 +246,9 @@ inline void LoadIdt(const IdtEntry base[], unsigned int limit)
 	asm("lidt (%0)" : : "r" (&d));
 }
 
-inline void LoadGdt(const GdtEntry base[], unsigned int limit)
+/// Load the global descriptor table, reload the segment registers, and load
+/// the task register with the passed TSS selector.
+inline void LoadGdt(const GdtEntry base[], unsigned int limit, unsigned int tssSelector)
 {
 	struct desc {
 		unsigned short limit;
@@ -179,9 +264,16 @@ inline void LoadGdt(const GdtEntry base[], unsigned int limit)
 		"movw %%ax, %%gs;"
 		"movw %%ax, %%fs;"
 		"movw %%ax, %%ss;"
-		"movw $0x28, %%ax;"
-		"ltr %%ax;"
-		: : "r" (&d) : "eax");
+		"ltr %w1;"
+		: : "r" (&d), "r" (tssSelector) : "eax");
+}
+
+/// Return the selector that is currently loaded in the task register
+inline unsigned int GetTaskRegister()
+{
+	unsigned int selector;
+	asm volatile("str %w0" : "=r" (selector));
+	return selector & 0xffff;
 }
 
 inline void Halt()
@@ -174,4 +174,32 @@ SetWatchpoint:		movl $0x10001, %eax
 GetDR6:				movl %dr6, %eax
 					ret
 
+
+
+#
+# Switch the boot processor to PAE paging.  The paging mode can only be changed
+# with paging turned off, so the boot processor copies everything between
+# EnablePaeStart and EnablePaeEnd to an identity mapped page and calls it
+# there with interrupts disabled.  The stack isn't touched while paging is off.
+#
+# void EnablePae(unsigned int pageDirectoryPointerTable, unsigned int cr4)
+#
+					.globl EnablePaeStart
+					.align 8
+EnablePaeStart:		movl 4(%esp), %edx			# Get page directory pointer table
+					movl 8(%esp), %ecx			# Get new CR4
+					movl %cr0, %eax
+					andl $0x7fffffff, %eax		# Turn off paging
+					movl %eax, %cr0
+					jmp 1f
+1:					movl %ecx, %cr4				# Enable PAE
+					movl %edx, %cr3
+					orl $0x80000000, %eax		# Turn paging back on
+					movl %eax, %cr0
+					jmp 2f
+2:					ret
+
+					.globl EnablePaeEnd
+EnablePaeEnd:
+
 					.end
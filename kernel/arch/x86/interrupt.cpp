@@ -16,11 +16,14 @@
 
 #include "AddressSpace.h"
 #include "cpu_asm.h"
+#include "DPC.h"
+#include "HardwareTimer.h"
 #include "KernelDebug.h"
 #include "ThreadContext.h"
 #include "interrupt.h"
 #include "InterruptHandler.h"
 #include "memory_layout.h"
+#include "Processor.h"
 #include "Scheduler.h"
 #include "stdio.h"
 #include "string.h"
@@ -39,6 +42,7 @@ extern "C" {
 	void trap34(); void trap35(); void trap36(); void trap37(); void trap38();
 	void trap39(); void trap40(); void trap41(); void trap42(); void trap43();
 	void trap44(); void trap45(); void trap46(); void trap47(); void trap50();
+	void trap51(); void trap52(); void trap53(); void trap63();
 	void bad_trap();
 	void HandleTrap(InterruptFrame);
 };
@@ -63,13 +67,12 @@ static const IdtEntry idt[kMaxInterrupt] = {
 	IDT_ENTRY(trap38), IDT_ENTRY(trap39), IDT_ENTRY(trap40), IDT_ENTRY(trap41),
 	IDT_ENTRY(trap42), IDT_ENTRY(trap43), IDT_ENTRY(trap44), IDT_ENTRY(trap45),
 	IDT_ENTRY(trap46), IDT_ENTRY(trap47), IDT_ENTRY(bad_trap), IDT_ENTRY(bad_trap),
-	IDT_ENTRY(trap50)
+	IDT_ENTRY(trap50), IDT_ENTRY(trap51), IDT_ENTRY(trap52), IDT_ENTRY(trap53),
+	IDT_ENTRY(bad_trap), IDT_ENTRY(bad_trap), IDT_ENTRY(bad_trap), IDT_ENTRY(bad_trap),
+	IDT_ENTRY(bad_trap), IDT_ENTRY(bad_trap), IDT_ENTRY(bad_trap), IDT_ENTRY(bad_trap),
+	IDT_ENTRY(trap63)
 };
 
-// Speed of the machine in MHz.  This is currently hard coded for my test machine.
-// It needs to be calculated at boot time.
-static bigtime_t timeBase = 150;
-
 void InterruptBootstrap()
 {
 	// Set up interrupt controllers.
@@ -84,10 +87,15 @@ void InterruptBootstrap()
 	write_io_8(0xfb, kMasterIcw2);	// Mask off all interrupts (except slave pic line).
 	write_io_8(0xff, kSlaveIcw2); 	// Mask off interrupts on the slave.
 
-	LoadIdt(idt, sizeof(idt));
+	LoadInterruptTable();
 	EnableInterrupts();
 }
 
+void LoadInterruptTable()
+{
+	LoadIdt(idt, sizeof(idt));
+}
+
 void EnableIrq(int irq)
 {
 	if (irq < 8)
@@ -139,7 +147,11 @@ void HandleTrap(InterruptFrame iframe)
 			AddressSpace *space = va >= kKernelBase
 				? AddressSpace::GetKernelAddressSpace()
 				: AddressSpace::GetCurrentAddressSpace();
-			if (space->HandleFault(va, iframe.errorCode & kPageFaultWrite,
+			// Running code from a page that is mapped no-execute isn't something
+			// a fault can fix.
+			if ((iframe.errorCode & (kPageFaultProtection | kPageFaultInstruction))
+				== (kPageFaultProtection | kPageFaultInstruction)
+				|| space->HandleFault(va, iframe.errorCode & kPageFaultWrite,
 				iframe.errorCode & kPageFaultUser) < 0) {
 				// Invalid page fault.  If there is a fault handler (used by CopyUser
 				// functions), jump to it.
@@ -151,7 +163,8 @@ void HandleTrap(InterruptFrame iframe)
 					printf("Thread %s in %s mode attempted to %s %s address %08x\n",
 						Thread::GetRunningThread()->GetName(), 
 						(iframe.errorCode & kPageFaultUser) ? "user" : "supervisor",
-						(iframe.errorCode & kPageFaultWrite) ? "write" : "read",
+						(iframe.errorCode & kPageFaultInstruction) ? "execute"
+						: (iframe.errorCode & kPageFaultWrite) ? "write" : "read",
 						(iframe.errorCode & kPageFaultProtection) ? "protected" : "unmapped", va);
 					iframe.Print();
 					Debugger();
@@ -182,15 +195,39 @@ void HandleTrap(InterruptFrame iframe)
 	
 			write_io_8(0x20, 0x20);	// EOI to pic 1
 			
-			if (result == kReschedule)
-				gScheduler.Reschedule();
-			else if (result == kUnhandledInterrupt) {
+			if (result == kUnhandledInterrupt) {
 				iframe.Print();
 				panic("Unhandled Interrupt");
 			}
 
+			// Only switch threads if the work the handler deferred made a more
+			// important thread ready.
+			if (DPC::RunQueued() == kReschedule || result == kReschedule
+				|| gScheduler.ShouldPreempt()) {
+				if (DPC::CanReschedule())
+					gScheduler.Reschedule();
+			}
+
 			break;
 		}
+
+		case kRescheduleInterrupt:
+		case kTLBShootdownInterrupt:
+			if (Processor::HandleInterProcessorInterrupt(iframe.vector) == kReschedule
+				&& DPC::CanReschedule())
+				gScheduler.Reschedule();
+
+			break;
+
+		case kLocalTimerInterrupt:
+			if (HandleLocalTimerInterrupt() == kReschedule && DPC::CanReschedule())
+				gScheduler.Reschedule();
+
+			break;
+
+		case kSpuriousInterrupt:
+			// The local APIC doesn't expect an EOI for these.
+			break;
 		
 		default:
 			printf("Unknown trap %d occured.\n", iframe.vector);
@@ -233,8 +270,3 @@ void InterruptFrame::Print() const
 	printf("\ntrap %08x      error code %08x\n", vector, errorCode);
 }
 
-bigtime_t SystemTime()
-{
-	return rdtsc() / timeBase;
-}
-
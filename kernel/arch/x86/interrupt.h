@@ -20,6 +20,7 @@
 #include "types.h"
 
 void InterruptBootstrap();
+void LoadInterruptTable();
 void EnableIrq(int);
 void DisableIrq(int);
 
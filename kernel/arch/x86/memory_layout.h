@@ -29,9 +29,18 @@ const unsigned int kBootStackBase = 0xc0100000;
 const unsigned int kBootStackTop = 0xc0103fff;
 const unsigned int kHeapBase = 0xc0104000;
 const unsigned int kHeapTop = 0xc01fffff;
-const unsigned int kIOAreaBase = 0xe4000000;
-const unsigned int kIOAreaTop = 0xe7ffffff;
+const unsigned int kDirectMapBase = 0xd0000000;	// Low physical memory, mapped at boot
+const unsigned int kDirectMapTop = 0xdfffffff;
+const unsigned int kPageArrayBase = 0xe0000000;	// Page descriptors, mapped at boot
+const unsigned int kPageArrayTop = 0xe7ffffff;
+const unsigned int kIOAreaBase = 0xe8000000;
+const unsigned int kIOAreaTop = 0xebffffff;
 const unsigned int kKernelTop = 0xffffffff;
+
+// Physical page that application processors start executing from.  It must be
+// below 1MB, and is identity mapped while the processors are starting.
+// ap_trampoline.s depends on this value.
+const unsigned int kApTrampolineBase = 0x8000;
 const unsigned int kAddressSpaceTop = 0xffffffff;
 
 #endif
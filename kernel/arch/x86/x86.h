@@ -78,11 +78,16 @@ enum PteFlags {
 	kPageGlobal = 256
 };
 
+// Page table entries are 64 bits with PAE, and this bit prevents instructions
+// from being fetched from the page.
+const uint64 kPageNoExecute = 0x8000000000000000ULL;
+
 enum PageFaultFlags {
 	kPageFaultProtection = 1,
 	kPageFaultWrite = 2,
 	kPageFaultUser = 4,
-	kPageFaultReserved = 8
+	kPageFaultReserved = 8,
+	kPageFaultInstruction = 16
 };
 
 enum FaultType {
@@ -107,6 +112,10 @@ enum FaultType {
 	kPICBase = 32,
 	kPICTop = 47,
 	kSystemCall = 50,
+	kRescheduleInterrupt = 51,	// Inter-processor interrupts
+	kTLBShootdownInterrupt = 52,
+	kLocalTimerInterrupt = 53,	// Local APIC timer
+	kSpuriousInterrupt = 63,	// Local APIC spurious vector (low 4 bits must be set)
 	kMaxInterrupt
 };
 
@@ -15,6 +15,8 @@
 // 
 
 #include "AddressSpace.h"
+#include "Alloc.h"
+#include "ClockSource.h"
 #include "Processor.h"
 #include "KernelDebug.h"
 #include "FileSystem.h"
@@ -22,29 +24,42 @@
 #include "Page.h"
 #include "PageCache.h"
 #include "PhysicalMap.h"
+#include "Slab.h"
 #include "syscall.h"
 #include "Team.h"
 #include "Thread.h"
 #include "Timer.h"
 #include "types.h"
+#include "WorkQueue.h"
 
 int main()
 {
 	KernelDebugBootstrap();
+	ClockSourceBootstrap();
+	Processor::Bootstrap();
 	Thread::Bootstrap();
 	InterruptBootstrap();
 	Timer::Bootstrap();
+	PhysicalMap::SelectPagingMode();
 	Page::Bootstrap();
 	PageCache::Bootstrap();
+	SlabCache::Bootstrap();
+	HeapBootstrap();
 	PhysicalMap::Bootstrap();
 	AddressSpace::Bootstrap();
+	TimePageBootstrap();
 	Team::Bootstrap();
-	Processor::Bootstrap();
+	Processor::StartProcessors();
+	WorkQueue::Bootstrap();
 	FileSystem::Bootstrap();
 	Page::StartPageEraser();
+	AddressSpace::StartPageDaemon();
 
 	exec("/boot/net_server");
 	exec("/boot/shell");
 
-	AddressSpace::PageDaemonLoop(); // This thread becomes the page daemon.
+	// Background work is done on work queues, so there is nothing left for
+	// this thread to do.
+	for (;;)
+		sleep(INFINITE_TIMEOUT);
 }
@@ -16,6 +16,7 @@
 
 #include "types.h"
 #include "syscall.h"
+#include "time_page.h"
 
 extern void __heap_init();
 extern void __stdio_init();
@@ -33,9 +34,26 @@ int64 rdtsc()
 	return (int64) high << 32 | low;
 }
 
+// The conversion parameters are read again if the kernel changed them
+// in the middle.
 bigtime_t system_time()
 {
-	return rdtsc() / 150;
+	const TimePage *page = (const TimePage*) TIME_PAGE_ADDRESS;
+	bigtime_t now;
+	int sequence;
+	do {
+		sequence = page->sequence;
+		asm volatile("" : : : "memory");
+		if (!page->tscValid) {
+			_get_system_time(&now);
+			return now;
+		}
+
+		now = tsc_to_system_time(page, rdtsc());
+		asm volatile("" : : : "memory");
+	} while ((sequence & 1) || page->sequence != sequence);
+
+	return now;
 }
 
 